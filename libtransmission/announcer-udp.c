@@ -8,7 +8,6 @@
 
 #define __LIBTRANSMISSION_ANNOUNCER_MODULE__
 
-#include <errno.h> /* errno, EAFNOSUPPORT */
 #include <string.h> /* memcpy (), memset () */
 
 #include <event2/buffer.h>
@@ -47,27 +46,13 @@ tau_sockaddr_setport (struct sockaddr * sa, tr_port port)
       ((struct sockaddr_in6 *)sa)->sin6_port = htons (port);
 }
 
-static int
+static void
 tau_sendto (tr_session * session,
             struct evutil_addrinfo * ai, tr_port port,
             const void * buf, size_t buflen)
 {
-    tr_socket_t sockfd;
-
-    if (ai->ai_addr->sa_family == AF_INET)
-        sockfd = session->udp_socket;
-    else if (ai->ai_addr->sa_family == AF_INET6)
-        sockfd = session->udp6_socket;
-    else
-        sockfd = TR_BAD_SOCKET;
-
-    if (sockfd == TR_BAD_SOCKET) {
-        errno = EAFNOSUPPORT;
-        return -1;
-    }
-
     tau_sockaddr_setport (ai->ai_addr, port);
-    return sendto (sockfd, buf, buflen, 0, ai->ai_addr, ai->ai_addrlen);
+    tr_udpSendTo (session, buf, buflen, ai->ai_addr, ai->ai_addrlen);
 }
 
 /****
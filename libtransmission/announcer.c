@@ -1053,6 +1053,7 @@ on_announce_done (const tr_announce_response  * response,
         tier->lastAnnounceSucceeded = false;
         tier->isAnnouncing = false;
         tier->manualAnnounceAllowedAt = now + tier->announceMinIntervalSec;
+        tr_torrentMarkChanged (tier->tor, TR_TORRENT_STATS);
 
         if (!response->did_connect)
         {
@@ -1253,6 +1254,7 @@ tierAnnounce (tr_announcer * announcer, tr_tier * tier)
 
     tier->isAnnouncing = true;
     tier->lastAnnounceStartTime = now;
+    tr_torrentMarkChanged (tor, TR_TORRENT_STATS);
     --announcer->slotsAvailable;
 
     announce_request_delegate (announcer, req, on_announce_done, data);
@@ -1346,6 +1348,7 @@ on_scrape_done (const tr_scrape_response * response, void * vsession)
                 tier->lastScrapeTime = now;
                 tier->lastScrapeSucceeded = false;
                 tier->lastScrapeTimedOut = response->did_timeout;
+                tr_torrentMarkChanged (tor, TR_TORRENT_STATS);
 
                 if (!response->did_connect)
                 {
@@ -1437,6 +1440,7 @@ multiscrape (tr_announcer * announcer, tr_ptrArray * tiers)
             memcpy (req->info_hash[req->info_hash_count++], hash, SHA_DIGEST_LENGTH);
             tier->isScraping = true;
             tier->lastScrapeStartTime = now;
+            tr_torrentMarkChanged (tier->tor, TR_TORRENT_STATS);
             break;
         }
 
@@ -1450,6 +1454,7 @@ multiscrape (tr_announcer * announcer, tr_ptrArray * tiers)
             memcpy (req->info_hash[req->info_hash_count++], hash, SHA_DIGEST_LENGTH);
             tier->isScraping = true;
             tier->lastScrapeStartTime = now;
+            tr_torrentMarkChanged (tier->tor, TR_TORRENT_STATS);
         }
     }
 
@@ -0,0 +1,321 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+/* Simulates tr_bandwidthAllocate ()'s upload scheduling over a tree of
+ * torrents and peers with a global speed limit, and compares it with the
+ * random 3000-byte passes that phaseOne () used to make. The peers are
+ * simulated: each has a link that takes a fixed number of bytes per period
+ * and always has more to send.
+ *
+ * It reports the tr_peerIoFlush () calls and the CPU time per period,
+ * and Jain's fairness index of the normal priority peers' bytes divided
+ * by their torrents' weights, where 1.0 is perfectly fair. If the limit
+ * is never reached, every link gets all it can take, and the index only
+ * reflects the weights.
+ *
+ * Usage: bandwidth-bench [torrentCount [peersPerTorrent [periods]]] */
+
+#include <stdio.h>
+#include <stdlib.h> /* atoi () */
+#include <string.h> /* memset () */
+
+/* compile our own copy of the scheduler, wired to the simulated peers */
+#define tr_bandwidthConstruct simBandwidthConstruct
+#define tr_bandwidthDestruct simBandwidthDestruct
+#define tr_bandwidthSetParent simBandwidthSetParent
+#define tr_bandwidthAllocate simBandwidthAllocate
+#define tr_bandwidthSetPeer simBandwidthSetPeer
+#define tr_bandwidthClamp simBandwidthClamp
+#define tr_bandwidthGetRawSpeed_Bps simBandwidthGetRawSpeed_Bps
+#define tr_bandwidthGetPieceSpeed_Bps simBandwidthGetPieceSpeed_Bps
+#define tr_bandwidthUsed simBandwidthUsed
+#define tr_peerIoFlush simPeerIoFlush
+#define tr_peerIoFlushOutgoingProtocolMsgs simPeerIoFlushOutgoingProtocolMsgs
+#define tr_peerIoSetEnabled simPeerIoSetEnabled
+#define tr_peerIoRefImpl simPeerIoRefImpl
+#define tr_peerIoUnrefImpl simPeerIoUnrefImpl
+#define tr_time_msec simTimeMsec
+
+#include "transmission.h"
+#include "bandwidth.h"
+#include "crypto-utils.h" /* tr_rand_int_weak () */
+#include "net.h"
+#include "peer-io.h"
+#include "utils.h"
+
+#include "bandwidth.c"
+
+#define PERIOD_MSEC 500
+#define GLOBAL_LIMIT_Bps (10 * 1024 * 1024)
+#define FAST_LINK (64 * 1024)
+
+struct sim_peer
+{
+  tr_peerIo io; /* must be first */
+  unsigned int weight;
+  unsigned int capacity; /* bytes the link takes per period */
+  unsigned int left;     /* ... and has left in this one */
+  uint64_t total;
+};
+
+static uint64_t now_msec;
+static uint64_t flush_calls;
+
+uint64_t
+simTimeMsec (void)
+{
+  return now_msec;
+}
+
+int
+simPeerIoFlush (tr_peerIo * io, tr_direction dir, size_t byteLimit)
+{
+  struct sim_peer * peer = (struct sim_peer *) io;
+  unsigned int n = MIN (byteLimit, peer->left);
+
+  ++flush_calls;
+
+  n = simBandwidthClamp (&io->bandwidth, dir, n);
+  peer->left -= n;
+  peer->total += n;
+  simBandwidthUsed (&io->bandwidth, dir, n, true, now_msec);
+  return n;
+}
+
+int
+simPeerIoFlushOutgoingProtocolMsgs (tr_peerIo * io UNUSED)
+{
+  return 0;
+}
+
+void
+simPeerIoSetEnabled (tr_peerIo * io UNUSED, tr_direction dir UNUSED, bool isEnabled UNUSED)
+{
+}
+
+void
+simPeerIoRefImpl (const char * file UNUSED, int line UNUSED, tr_peerIo * io)
+{
+  ++io->refCount;
+}
+
+void
+simPeerIoUnrefImpl (const char * file UNUSED, int line UNUSED, tr_peerIo * io)
+{
+  --io->refCount;
+}
+
+/***
+****  The old way
+***/
+
+static void
+oldPhaseOne (tr_ptrArray * peerArray, tr_direction dir)
+{
+  int n = tr_ptrArraySize (peerArray);
+  struct tr_peerIo ** peers = (struct tr_peerIo**) tr_ptrArrayBase (peerArray);
+
+  while (n > 0)
+    {
+      const int i = tr_rand_int_weak (n);
+      const size_t increment = 3000;
+      const int bytesUsed = simPeerIoFlush (peers[i], dir, increment);
+
+      if (bytesUsed != (int)increment)
+        {
+          tr_peerIo * pio = peers[i];
+          peers[i] = peers[n-1];
+          peers[n-1] = pio;
+          --n;
+        }
+    }
+}
+
+static void
+oldAllocate (tr_bandwidth * b, tr_direction dir, unsigned int period_msec)
+{
+  int i, peerCount;
+  tr_ptrArray tmp = TR_PTR_ARRAY_INIT;
+  tr_ptrArray low = TR_PTR_ARRAY_INIT;
+  tr_ptrArray high = TR_PTR_ARRAY_INIT;
+  tr_ptrArray normal = TR_PTR_ARRAY_INIT;
+  struct tr_peerIo ** peers;
+
+  allocateBandwidth (b, TR_PRI_LOW, dir, period_msec, &tmp);
+  peers = (struct tr_peerIo**) tr_ptrArrayBase (&tmp);
+  peerCount = tr_ptrArraySize (&tmp);
+
+  for (i=0; i<peerCount; ++i)
+    {
+      switch (peers[i]->priority)
+        {
+          case TR_PRI_HIGH:   tr_ptrArrayAppend (&high,   peers[i]); /* fall through */
+          case TR_PRI_NORMAL: tr_ptrArrayAppend (&normal, peers[i]); /* fall through */
+          default:            tr_ptrArrayAppend (&low,    peers[i]);
+        }
+    }
+
+  oldPhaseOne (&high, dir);
+  oldPhaseOne (&normal, dir);
+  oldPhaseOne (&low, dir);
+
+  tr_ptrArrayDestruct (&normal, NULL);
+  tr_ptrArrayDestruct (&high, NULL);
+  tr_ptrArrayDestruct (&low, NULL);
+  tr_ptrArrayDestruct (&tmp, NULL);
+}
+
+/***
+****
+***/
+
+static uint64_t
+nowUsec (void)
+{
+  struct timeval tv;
+
+  tr_gettimeofday (&tv);
+  return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+runSimulation (const char * name,
+               void (*allocate) (tr_bandwidth *, tr_direction, unsigned int),
+               int torrentCount, int peersPerTorrent, int periods)
+{
+  int i;
+  int j;
+  int n;
+  int count = 0;
+  uint64_t usec = 0;
+  uint64_t highBytes = 0;
+  uint64_t normalBytes = 0;
+  uint64_t lowBytes = 0;
+  double sum = 0;
+  double sumSquares = 0;
+  unsigned int seed = 1;
+  tr_address addr;
+  tr_bandwidth root;
+  tr_bandwidth * torrents = tr_new0 (tr_bandwidth, torrentCount);
+  struct sim_peer * peers = tr_new0 (struct sim_peer, torrentCount * peersPerTorrent);
+
+  now_msec = 1000000;
+  flush_calls = 0;
+  tr_address_from_string (&addr, "127.0.0.1");
+
+  memset (&root, 0, sizeof (root));
+  simBandwidthConstruct (&root, NULL, NULL);
+  tr_bandwidthSetLimited (&root, TR_UP, true);
+  tr_bandwidthSetDesiredSpeed_Bps (&root, TR_UP, GLOBAL_LIMIT_Bps);
+
+  /* one torrent in ten is high priority, one in ten is low, and every
+     third one has weight 2 */
+  for (i=0; i<torrentCount; ++i)
+    {
+      tr_bandwidth * t = &torrents[i];
+
+      simBandwidthConstruct (t, NULL, &root);
+      t->priority = i % 10 == 0 ? TR_PRI_HIGH : i % 10 == 9 ? TR_PRI_LOW : TR_PRI_NORMAL;
+      tr_bandwidthSetWeight (t, i % 3 == 1 ? 2 : 1);
+
+      for (j=0; j<peersPerTorrent; ++j)
+        {
+          struct sim_peer * peer = &peers[i * peersPerTorrent + j];
+
+          peer->io.magicNumber = PEER_IO_MAGIC_NUMBER;
+          peer->io.refCount = 1;
+          peer->io.addr = addr;
+          peer->weight = MAX (t->weight, 1u);
+
+          /* most links are fast; some are slow */
+          seed = seed * 1103515245 + 12345;
+          peer->capacity = (seed >> 16) % 4 == 0 ? 4096 + (seed >> 8) % 16384
+                                                 : FAST_LINK;
+
+          simBandwidthConstruct (&peer->io.bandwidth, NULL, t);
+          simBandwidthSetPeer (&peer->io.bandwidth, &peer->io);
+        }
+    }
+
+  n = torrentCount * peersPerTorrent;
+
+  for (i=0; i<periods; ++i)
+    {
+      uint64_t begin;
+
+      for (j=0; j<n; ++j)
+        peers[j].left = peers[j].capacity;
+
+      now_msec += PERIOD_MSEC;
+      begin = nowUsec ();
+      allocate (&root, TR_UP, PERIOD_MSEC);
+      usec += nowUsec () - begin;
+    }
+
+  /* fairness among the normal priority peers whose links could take more */
+  for (i=0; i<torrentCount; ++i)
+    for (j=0; j<peersPerTorrent; ++j)
+      {
+        const struct sim_peer * peer = &peers[i * peersPerTorrent + j];
+
+        if (torrents[i].priority == TR_PRI_HIGH)
+          highBytes += peer->total;
+        else if (torrents[i].priority == TR_PRI_LOW)
+          lowBytes += peer->total;
+        else
+          {
+            normalBytes += peer->total;
+
+            if (peer->capacity == FAST_LINK)
+              {
+                const double x = (double) peer->total / peer->weight;
+                sum += x;
+                sumSquares += x * x;
+                ++count;
+              }
+          }
+      }
+
+  /* Jain's index: (sum x)^2 / (count * sum x^2) */
+  printf ("%-8s flushes/period %8.1f   usec/period %8.1f   fairness %.3f   MiB high/normal/low %.1f/%.1f/%.1f\n",
+          name,
+          (double) flush_calls / periods,
+          (double) usec / periods,
+          sumSquares > 0 ? (sum * sum) / (count * sumSquares) : 1.0,
+          highBytes / 1048576.0, normalBytes / 1048576.0, lowBytes / 1048576.0);
+
+  for (i=0; i<n; ++i)
+    simBandwidthDestruct (&peers[i].io.bandwidth);
+  for (i=0; i<torrentCount; ++i)
+    simBandwidthDestruct (&torrents[i]);
+  simBandwidthDestruct (&root);
+  tr_free (peers);
+  tr_free (torrents);
+}
+
+int
+main (int argc, char ** argv)
+{
+  const int torrentCount = argc > 1 ? atoi (argv[1]) : 20;
+  const int peersPerTorrent = argc > 2 ? atoi (argv[2]) : 25;
+  const int periods = argc > 3 ? atoi (argv[3]) : 200;
+
+  if (torrentCount < 1 || peersPerTorrent < 1 || periods < 1)
+    {
+      fprintf (stderr, "Usage: %s [torrentCount [peersPerTorrent [periods]]]\n", argv[0]);
+      return 1;
+    }
+
+  printf ("%d torrents x %d peers, %d periods, %d KiB/s up:\n",
+          torrentCount, peersPerTorrent, periods, GLOBAL_LIMIT_Bps / 1024);
+
+  runSimulation ("random", oldAllocate, torrentCount, peersPerTorrent, periods);
+  runSimulation ("drr", simBandwidthAllocate, torrentCount, peersPerTorrent, periods);
+
+  return 0;
+}
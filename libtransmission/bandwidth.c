@@ -11,9 +11,10 @@
 
 #include "transmission.h"
 #include "bandwidth.h"
-#include "crypto-utils.h" /* tr_rand_int_weak () */
+#include "cache.h" /* tr_cacheIsBackedUp () */
 #include "log.h"
 #include "peer-io.h"
+#include "session.h"
 #include "utils.h"
 
 #define dbgmsg(...) \
@@ -86,6 +87,50 @@ bytesUsed (const uint64_t now, struct bratecontrol * r, size_t size)
 *******
 ******/
 
+enum
+{
+  /* chosen so that when using uTP we'll send a full-size frame right away
+   * and leave enough buffered data for the next frame to go out in a
+   * timely manner. */
+  MIN_QUANTUM = 3000,
+
+  /* the most that an unlimited peer of weight 1 may flush per pass */
+  MAX_QUANTUM = 65536,
+
+  TIER_COUNT = 3
+};
+
+/* The scheduler's state, kept on the root of the tree between calls
+   to tr_bandwidthAllocate () */
+struct tr_bandwidth_queues
+{
+  /* the peers in each priority tier, rebuilt each period in tree order */
+  tr_ptrArray tiers[TIER_COUNT];
+  tr_ptrArray peers;
+
+  /* where each tier's round robin left off, per direction */
+  bool hasCursor[2][TIER_COUNT];
+  unsigned int cursor[2][TIER_COUNT];
+};
+
+static void
+queuesFree (struct tr_bandwidth_queues * q)
+{
+  int i;
+
+  if (q == NULL)
+    return;
+
+  for (i=0; i<TIER_COUNT; ++i)
+    tr_ptrArrayDestruct (&q->tiers[i], NULL);
+  tr_ptrArrayDestruct (&q->peers, NULL);
+  tr_free (q);
+}
+
+/***
+****
+***/
+
 static int
 compareBandwidth (const void * va, const void * vb)
 {
@@ -119,6 +164,7 @@ tr_bandwidthDestruct (tr_bandwidth * b)
 
   tr_bandwidthSetParent (b, NULL);
   tr_ptrArrayDestruct (&b->children, NULL);
+  queuesFree (b->queues);
 
   memset (b, ~0, sizeof (tr_bandwidth));
 }
@@ -157,13 +203,16 @@ tr_bandwidthSetParent (tr_bandwidth  * b,
 ****
 ***/
 
-static void
+static int
 allocateBandwidth (tr_bandwidth  * b,
                    tr_priority_t   parent_priority,
                    tr_direction    dir,
                    unsigned int    period_msec,
                    tr_ptrArray   * peer_pool)
 {
+  int i;
+  int n;
+  struct tr_bandwidth ** children;
   const tr_priority_t priority = MAX (parent_priority, b->priority);
 
   assert (tr_isBandwidth (b));
@@ -176,58 +225,129 @@ allocateBandwidth (tr_bandwidth  * b,
       b->band[dir].bytesLeft = nextPulseSpeed * period_msec / 1000u;
     }
 
+  b->peerCount = 0;
+
   /* add this bandwidth's peer, if any, to the peer pool */
   if (b->peer != NULL)
     {
       b->peer->priority = priority;
       tr_ptrArrayAppend (peer_pool, b->peer);
+      ++b->peerCount;
     }
 
   /* traverse & repeat for the subtree */
-  if (1)
+  children = (struct tr_bandwidth**) tr_ptrArrayBase (&b->children);
+  n = tr_ptrArraySize (&b->children);
+  for (i=0; i<n; ++i)
+    b->peerCount += allocateBandwidth (children[i], priority, dir, period_msec, peer_pool);
+
+  return b->peerCount;
+}
+
+/* A peer's quantum is its share of the tightest limit above it,
+   so that one pass can spread a limited subtree's bytes among all of
+   its peers, times the nearest weight above it. */
+static size_t
+getQuantum (const tr_bandwidth * b, tr_direction dir)
+{
+  unsigned int weight = 0;
+  unsigned int share = MAX_QUANTUM;
+
+  for (; b != NULL; b = b->parent)
+    {
+      if (weight == 0)
+        weight = b->weight;
+
+      if (b->band[dir].isLimited)
+        share = MIN (share, b->band[dir].bytesLeft / MAX (b->peerCount, 1));
+
+      if (!b->band[dir].honorParentLimits)
+        break;
+    }
+
+  return (size_t) MAX (share, (unsigned int) MIN_QUANTUM) * MAX (weight, 1u);
+}
+
+static void
+reverse (tr_peerIo ** peers, int begin, int end)
+{
+  while (begin < --end)
     {
-      int i;
-      struct tr_bandwidth ** children = (struct tr_bandwidth**) tr_ptrArrayBase (&b->children);
-      const int n = tr_ptrArraySize (&b->children);
-      for (i=0; i<n; ++i)
-        allocateBandwidth (children[i], priority, dir, period_msec, peer_pool);
+      tr_peerIo * tmp = peers[begin];
+      peers[begin++] = peers[end];
+      peers[end] = tmp;
     }
 }
 
+static bool
+isSpent (const tr_bandwidth * b, tr_direction dir)
+{
+  return b->band[dir].isLimited && b->band[dir].bytesLeft == 0;
+}
+
 static void
-phaseOne (tr_ptrArray * peerArray, tr_direction dir)
+phaseOne (const tr_bandwidth * root, int tier, tr_direction dir)
 {
-  int n;
-  int peerCount = tr_ptrArraySize (peerArray);
-  struct tr_peerIo ** peers = (struct tr_peerIo**) tr_ptrArrayBase (peerArray);
+  struct tr_bandwidth_queues * q = root->queues;
+  int i;
+  int n = tr_ptrArraySize (&q->tiers[tier]);
+  struct tr_peerIo ** peers = (struct tr_peerIo**) tr_ptrArrayBase (&q->tiers[tier]);
 
   /* First phase of IO. Tries to distribute bandwidth fairly to keep faster
-   * peers from starving the others. Loop through the peers, giving each a
-   * small chunk of bandwidth. Keep looping until we run out of bandwidth
+   * peers from starving the others. Loop through the peers, giving each
+   * its quantum of bandwidth. Keep looping until we run out of bandwidth
    * and/or peers that can use it */
-  n = peerCount;
   dbgmsg ("%d peers to go round-robin for %s", n, (dir==TR_UP?"upload":"download"));
+
+  /* start after where the last period's passes left off */
+  if (q->hasCursor[dir][tier])
+    for (i=0; i<n; ++i)
+      if (peers[i]->bandwidth.uniqueKey == q->cursor[dir][tier])
+        {
+          reverse (peers, 0, i + 1);
+          reverse (peers, i + 1, n);
+          reverse (peers, 0, n);
+          break;
+        }
+
+  for (i=0; i<n; ++i)
+    peers[i]->bandwidth.band[dir].deficit = 0;
+
   while (n > 0)
     {
-      const int i = tr_rand_int_weak (n); /* pick a peer at random */
+      int keep = 0;
 
-      /* value of 3000 bytes chosen so that when using uTP we'll send a full-size
-       * frame right away and leave enough buffered data for the next frame to go
-       * out in a timely manner. */
-      const size_t increment = 3000;
+      /* once the root's budget is gone, nobody else can write either;
+       * the cursor makes the next period pick up from here */
+      for (i=0; i<n && !isSpent (root, dir); ++i)
+        {
+          tr_peerIo * io = peers[i];
+          struct tr_band * band = &io->bandwidth.band[dir];
+          int bytesUsed;
 
-      const int bytesUsed = tr_peerIoFlush (peers[i], dir, increment);
+          band->deficit += band->quantum;
+          bytesUsed = tr_peerIoFlush (io, dir, band->deficit);
+          dbgmsg ("peer #%d of %d used %d of %zu bytes in this pass", i, n, bytesUsed, band->deficit);
 
-      dbgmsg ("peer #%d of %d used %d bytes in this pass", i, n, bytesUsed);
+          if (bytesUsed > 0)
+            {
+              q->hasCursor[dir][tier] = true;
+              q->cursor[dir][tier] = io->bandwidth.uniqueKey;
+            }
 
-      if (bytesUsed != (int)increment)
-        {
-          /* peer is done writing for now; move it to the end of the list */
-          tr_peerIo * pio = peers[i];
-          peers[i] = peers[n-1];
-          peers[n-1] = pio;
-          --n;
+          if (bytesUsed <= 0 || (size_t) bytesUsed < band->deficit)
+            {
+              /* peer is done writing for now; drop it from the round */
+              band->deficit = 0;
+            }
+          else
+            {
+              band->deficit -= bytesUsed;
+              peers[keep++] = io;
+            }
         }
+
+      n = keep;
     }
 }
 
@@ -237,18 +357,23 @@ tr_bandwidthAllocate (tr_bandwidth  * b,
                       unsigned int    period_msec)
 {
   int i, peerCount;
-  tr_ptrArray tmp = TR_PTR_ARRAY_INIT;
-  tr_ptrArray low = TR_PTR_ARRAY_INIT;
-  tr_ptrArray high = TR_PTR_ARRAY_INIT;
-  tr_ptrArray normal = TR_PTR_ARRAY_INIT;
   struct tr_peerIo ** peers;
+  struct tr_bandwidth_queues * q;
+
+  if (b->queues == NULL)
+    b->queues = tr_new0 (struct tr_bandwidth_queues, 1);
+  q = b->queues;
 
   /* allocateBandwidth () is a helper function with two purposes:
    * 1. allocate bandwidth to b and its subtree
    * 2. accumulate an array of all the peerIos from b and its subtree. */
-  allocateBandwidth (b, TR_PRI_LOW, dir, period_msec, &tmp);
-  peers = (struct tr_peerIo**) tr_ptrArrayBase (&tmp);
-  peerCount = tr_ptrArraySize (&tmp);
+  tr_ptrArrayClear (&q->peers);
+  allocateBandwidth (b, TR_PRI_LOW, dir, period_msec, &q->peers);
+  peers = (struct tr_peerIo**) tr_ptrArrayBase (&q->peers);
+  peerCount = tr_ptrArraySize (&q->peers);
+
+  for (i=0; i<TIER_COUNT; ++i)
+    tr_ptrArrayClear (&q->tiers[i]);
 
   for (i=0; i<peerCount; ++i)
     {
@@ -257,21 +382,22 @@ tr_bandwidthAllocate (tr_bandwidth  * b,
 
       tr_peerIoFlushOutgoingProtocolMsgs (io);
 
+      io->bandwidth.band[dir].quantum = getQuantum (&io->bandwidth, dir);
+
       switch (io->priority)
         {
-          case TR_PRI_HIGH:   tr_ptrArrayAppend (&high,   io); /* fall through */
-          case TR_PRI_NORMAL: tr_ptrArrayAppend (&normal, io); /* fall through */
-          default:            tr_ptrArrayAppend (&low,    io);
+          case TR_PRI_HIGH:   tr_ptrArrayAppend (&q->tiers[2], io); /* fall through */
+          case TR_PRI_NORMAL: tr_ptrArrayAppend (&q->tiers[1], io); /* fall through */
+          default:            tr_ptrArrayAppend (&q->tiers[0], io);
         }
     }
 
   /* First phase of IO. Tries to distribute bandwidth fairly to keep faster
    * peers from starving the others. Loop through the peers, giving each a
-   * small chunk of bandwidth. Keep looping until we run out of bandwidth
+   * quantum of bandwidth. Keep looping until we run out of bandwidth
    * and/or peers that can use it */
-  phaseOne (&high, dir);
-  phaseOne (&normal, dir);
-  phaseOne (&low, dir);
+  for (i=TIER_COUNT-1; i>=0; --i)
+    phaseOne (b, i, dir);
 
   /* Second phase of IO. To help us scale in high bandwidth situations,
    * enable on-demand IO for peers with bandwidth left to burn.
@@ -282,12 +408,6 @@ tr_bandwidthAllocate (tr_bandwidth  * b,
 
   for (i=0; i<peerCount; ++i)
     tr_peerIoUnref (peers[i]);
-
-  /* cleanup */
-  tr_ptrArrayDestruct (&normal, NULL);
-  tr_ptrArrayDestruct (&high, NULL);
-  tr_ptrArrayDestruct (&low, NULL);
-  tr_ptrArrayDestruct (&tmp, NULL);
 }
 
 void
@@ -351,6 +471,12 @@ tr_bandwidthClamp (const tr_bandwidth  * b,
                    tr_direction          dir,
                    unsigned int          byteCount)
 {
+  /* stop reading from peers while the disk is behind on writing their blocks.
+     the next tr_bandwidthAllocate () after it catches up will turn them back on */
+  if ((dir == TR_DOWN) && (b->session != NULL) && (b->session->cache != NULL))
+    if (tr_cacheIsBackedUp (b->session->cache))
+      return 0;
+
   return bandwidthClamp (b, 0, dir, byteCount);
 }
 
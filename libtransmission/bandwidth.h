@@ -56,6 +56,10 @@ struct tr_band
   unsigned int desiredSpeed_Bps;
   struct bratecontrol raw;
   struct bratecontrol piece;
+
+  /* a peer's deficit round robin state in tr_bandwidthAllocate () */
+  size_t quantum;
+  size_t deficit;
 };
 
 /**
@@ -93,6 +97,16 @@ struct tr_band
  *   tr_bandwidthAllocate () operates on the tr_bandwidth subtree, so usually
  *   you'll only need to invoke it for the top-level tr_session bandwidth.
  *
+ * SCHEDULING
+ *
+ *   tr_bandwidthAllocate () hands out the new bandwidth with deficit round
+ *   robin: the high priority peers first, then the normal ones, then the
+ *   low ones. On each pass over a tier, every peer's deficit grows by its
+ *   quantum, which is its share of the tightest limit above it times its
+ *   weight, and the peer may flush up to its deficit. The next period's
+ *   passes start after the last peer served, so nobody is always last,
+ *   and stop as soon as the root's own limit is used up.
+ *
  *   The peer-ios all have a pointer to their associated tr_bandwidth object,
  *   and call tr_bandwidthClamp () before performing I/O to see how much
  *   bandwidth they can safely use.
@@ -105,11 +119,14 @@ typedef struct tr_bandwidth
   struct tr_band band[2];
   struct tr_bandwidth * parent;
   tr_priority_t priority;
+  unsigned int weight; /* 0 to use the parent's */
   int magicNumber;
   unsigned int uniqueKey;
   tr_session * session;
   tr_ptrArray children; /* struct tr_bandwidth */
   struct tr_peerIo * peer;
+  int peerCount; /* in the subtree, as of the last tr_bandwidthAllocate () */
+  struct tr_bandwidth_queues * queues; /* only on a tree's root */
 }
 tr_bandwidth;
 
@@ -199,6 +216,24 @@ unsigned int tr_bandwidthClamp (const tr_bandwidth  * bandwidth,
                                 tr_direction          direction,
                                 unsigned int          byteCount);
 
+/**
+ * @brief Set the bandwidth subtree's share in tr_bandwidthAllocate ().
+ * A peer with weight 2 gets twice the quantum of a peer with weight 1
+ * on each round robin pass. 0 means to use the parent's weight.
+ */
+static inline void
+tr_bandwidthSetWeight (tr_bandwidth  * bandwidth,
+                       unsigned int    weight)
+{
+  bandwidth->weight = weight;
+}
+
+static inline unsigned int
+tr_bandwidthGetWeight (const tr_bandwidth  * bandwidth)
+{
+  return bandwidth->weight;
+}
+
 /******
 *******
 ******/
@@ -6,7 +6,7 @@
  *
  */
 
-#include <stdlib.h> /* qsort () */
+#include <string.h> /* memcpy () */
 
 #include <event2/buffer.h>
 
@@ -15,7 +15,9 @@
 #include "inout.h"
 #include "log.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
+#include "platform.h" /* tr_lock, tr_cond, tr_threadNew () */
 #include "ptrarray.h"
+#include "slab.h"
 #include "torrent.h"
 #include "trevent.h"
 #include "utils.h"
@@ -34,6 +36,8 @@
 *****
 ****/
 
+struct cache_run;
+
 struct cache_block
 {
   tr_torrent * tor;
@@ -45,15 +49,101 @@ struct cache_block
   time_t time;
   tr_block_index_t block;
 
-  struct evbuffer * evbuf;
+  uint8_t * data; /* a slot from tr_cache.slab */
+
+  /* the run this block is in. only kept up-to-date on a run's first and last blocks */
+  struct cache_run * run;
+};
+
+/* the dirty blocks in one of a torrent's pieces, indexed by their offset in it */
+struct cache_piece
+{
+  struct cache_block ** blocks;
+  int count;
+};
+
+struct cache_torrent
+{
+  tr_torrent * tor;
+  struct cache_piece * pieces; /* indexed by piece */
+};
+
+/* a span of contiguous dirty blocks in one torrent. these are kept in a
+   heap so that the best one to write next is always at hand. */
+struct cache_run
+{
+  struct cache_torrent * ct;
+  tr_block_index_t first;
+  tr_block_index_t last;
+  time_t time; /* when the run last grew */
+  bool is_piece_done;
+  int heap_pos;
+};
+
+enum
+{
+  /* the write backlog may grow to the cache size, but no smaller than this */
+  MIN_BACKLOG_BYTES = 4 * 1024 * 1024,
+
+  /* allocate block buffers 1 MiB at a time */
+  SLAB_CHUNK_SLOTS = 64
+};
+
+typedef enum
+{
+  WRITE_QUEUED,
+  WRITE_ACTIVE,
+  WRITE_DONE
+}
+write_state;
+
+/* a run of blocks that's been handed off to the writer thread.
+   its blocks stay readable in the cache until the write's been reaped. */
+struct write_job
+{
+  struct write_job * next;
+
+  tr_torrent * tor;
+  int torrentId;
+  tr_block_index_t firstBlock;
+  struct cache_block ** blocks;
+  int blockCount;
+
+  struct evbuffer_iovec * iov; /* the blocks' data, for tr_ioWriteSpans () */
+  size_t buflen;
+  struct tr_io_span * spans;
+  int spanCount;
+
+  /* these are guarded by tr_cache.lock */
+  write_state state;
+  int err;
 };
 
 struct tr_cache
 {
-  tr_ptrArray blocks;
+  tr_session * session;
+  tr_slab * slab; /* the blocks' data */
+  tr_ptrArray torrents; /* struct cache_torrent, sorted by torrent id */
+  struct cache_run ** heap;
+  int heap_size;
+  int heap_alloc;
+  int block_count;
   int max_blocks;
   size_t max_bytes;
 
+  /* the writer thread only changes jobs' state and err, and the
+     reapPending and writerRunning flags; the rest of these belong
+     to the libtransmission thread but are guarded for its sake */
+  tr_lock * lock;
+  tr_cond * jobQueued; /* wakes the writer */
+  tr_cond * jobDone; /* wakes waitForWrites () and tr_cacheFree () */
+  struct write_job * jobs;
+  struct write_job * lastJob;
+  size_t backlog_bytes;
+  bool writerRunning;
+  bool closing;
+  bool reapPending;
+
   size_t disk_writes;
   size_t disk_write_bytes;
   size_t cache_writes;
@@ -61,155 +151,507 @@ struct tr_cache
 };
 
 /****
-*****
+*****  The per-torrent block index
 ****/
 
-struct run_info
+static int
+compareTorrentId (const void * va, const void * vb)
 {
-  int pos;
-  int rank;
-  time_t last_block_time;
-  bool is_multi_piece;
-  bool is_piece_done;
-  unsigned int len;
-};
+  const struct cache_torrent * a = va;
+  const struct cache_torrent * b = vb;
+
+  return a->tor->uniqueId - b->tor->uniqueId;
+}
 
+static struct cache_torrent *
+getCacheTorrent (tr_cache * cache, tr_torrent * tor, bool create)
+{
+  struct cache_torrent key;
+  struct cache_torrent * ct;
 
-/* return a count of how many contiguous blocks there are starting at this pos */
-static int
-getBlockRun (const tr_cache * cache, int pos, struct run_info * info)
+  key.tor = tor;
+  ct = tr_ptrArrayFindSorted (&cache->torrents, &key, compareTorrentId);
+
+  if ((ct == NULL) && create)
+    {
+      ct = tr_new0 (struct cache_torrent, 1);
+      ct->tor = tor;
+      ct->pieces = tr_new0 (struct cache_piece, tor->info.pieceCount);
+      tr_ptrArrayInsertSorted (&cache->torrents, ct, compareTorrentId);
+    }
+
+  return ct;
+}
+
+static void
+freeCacheTorrent (tr_cache * cache, struct cache_torrent * ct)
 {
-  int i;
-  const int n = tr_ptrArraySize (&cache->blocks);
-  const struct cache_block * const * blocks = (const struct cache_block* const *) tr_ptrArrayBase (&cache->blocks);
-  const struct cache_block * ref = blocks[pos];
-  tr_block_index_t block = ref->block;
+  tr_piece_index_t i;
 
-  for (i=pos; i<n; ++i, ++block)
+  for (i=0; i<ct->tor->info.pieceCount; ++i)
     {
-      const struct cache_block * b = blocks[i];
-      if (b->block != block)
-        break;
-      if (b->tor != ref->tor)
+      assert (ct->pieces[i].count == 0);
+      tr_free (ct->pieces[i].blocks);
+    }
+
+  tr_ptrArrayRemoveSortedPointer (&cache->torrents, ct, compareTorrentId);
+  tr_free (ct->pieces);
+  tr_free (ct);
+}
+
+static struct cache_block *
+getBlock (const struct cache_torrent * ct, tr_block_index_t block)
+{
+  const tr_torrent * tor = ct->tor;
+  const tr_piece_index_t piece = tr_torBlockPiece (tor, block);
+  const struct cache_piece * cp = &ct->pieces[piece];
+
+  if (cp->count == 0)
+    return NULL;
+
+  return cp->blocks[block - piece * tor->blockCountInPiece];
+}
+
+static void
+setBlock (struct cache_torrent * ct, tr_block_index_t block, struct cache_block * cb)
+{
+  const tr_torrent * tor = ct->tor;
+  const tr_piece_index_t piece = tr_torBlockPiece (tor, block);
+  struct cache_piece * cp = &ct->pieces[piece];
+  struct cache_block ** slot;
+
+  if (cp->blocks == NULL)
+    cp->blocks = tr_new0 (struct cache_block *, tor->blockCountInPiece);
+
+  slot = &cp->blocks[block - piece * tor->blockCountInPiece];
+  assert ((*slot == NULL) != (cb == NULL));
+  cp->count += cb != NULL ? 1 : -1;
+  *slot = cb;
+}
+
+/****
+*****  Runs, and the heap that ranks them
+****/
+
+static inline int
+runLength (const struct cache_run * run)
+{
+  return run->last + 1 - run->first;
+}
+
+static inline bool
+runIsMultiPiece (const struct cache_run * run)
+{
+  const tr_torrent * tor = run->ct->tor;
+
+  return tr_torBlockPiece (tor, run->first) != tr_torBlockPiece (tor, run->last);
+}
+
+/* true if run a should be written before run b */
+static bool
+runIsHigher (const struct cache_run * a, const struct cache_run * b)
+{
+  int a_flags, b_flags;
+  int64_t a_score, b_score;
+
+  /* Flushing stale blocks should be a top priority as the probability of them
+   * growing is very small, for blocks on piece boundaries, and nonexistant for
+   * blocks inside pieces. After those, move the multi piece runs higher. */
+  a_flags = (a->is_piece_done ? 2 : 0) | (runIsMultiPiece (a) ? 1 : 0);
+  b_flags = (b->is_piece_done ? 2 : 0) | (runIsMultiPiece (b) ? 1 : 0);
+  if (a_flags != b_flags)
+    return a_flags > b_flags;
+
+  /* Longer runs come first, plus ~2 blocks for every minute that a run has
+   * languished in the cache without growing. Since every run ages at the
+   * same rate, 32 * (length + (now - time) / 32) ranks them the same as this. */
+  a_score = (int64_t)runLength (a) * 32 - a->time;
+  b_score = (int64_t)runLength (b) * 32 - b->time;
+  return a_score > b_score;
+}
+
+static void
+heapSet (tr_cache * cache, int pos, struct cache_run * run)
+{
+  cache->heap[pos] = run;
+  run->heap_pos = pos;
+}
+
+static void
+heapSiftUp (tr_cache * cache, int pos)
+{
+  struct cache_run * run = cache->heap[pos];
+
+  while (pos > 0)
+    {
+      const int parent = (pos - 1) / 2;
+
+      if (!runIsHigher (run, cache->heap[parent]))
         break;
-      //fprintf (stderr, "pos %d tor %d block %zu time %zu\n", i, b->tor->uniqueId, (size_t)b->block, (size_t)b->time);
+
+      heapSet (cache, pos, cache->heap[parent]);
+      pos = parent;
     }
 
-  //fprintf (stderr, "run is %d long from [%d to %d)\n", (int)(i-pos), i, (int)pos);
+  heapSet (cache, pos, run);
+}
+
+static void
+heapSiftDown (tr_cache * cache, int pos)
+{
+  struct cache_run * run = cache->heap[pos];
+  const int n = cache->heap_size;
 
-  if (info != NULL)
+  for (;;)
     {
-      const struct cache_block * b = blocks[i-1];
-      info->last_block_time = b->time;
-      info->is_piece_done = tr_torrentPieceIsComplete (b->tor, b->piece);
-      info->is_multi_piece = b->piece != blocks[pos]->piece;
-      info->len = i - pos;
-      info->pos = pos;
+      int child = pos * 2 + 1;
+
+      if (child >= n)
+        break;
+      if ((child + 1 < n) && runIsHigher (cache->heap[child + 1], cache->heap[child]))
+        ++child;
+      if (!runIsHigher (cache->heap[child], run))
+        break;
+
+      heapSet (cache, pos, cache->heap[child]);
+      pos = child;
     }
 
-  return i-pos;
+  heapSet (cache, pos, run);
 }
 
-/* higher rank comes before lower rank */
-static int
-compareRuns (const void * va, const void * vb)
+static void
+heapUpdate (tr_cache * cache, struct cache_run * run)
 {
-  const struct run_info * a = va;
-  const struct run_info * b = vb;
-  return b->rank - a->rank;
+  heapSiftUp (cache, run->heap_pos);
+  heapSiftDown (cache, run->heap_pos);
 }
 
-enum
+static void
+heapInsert (tr_cache * cache, struct cache_run * run)
 {
-  MULTIFLAG   = 0x1000,
-  DONEFLAG    = 0x2000,
-  SESSIONFLAG = 0x4000
-};
+  if (cache->heap_size == cache->heap_alloc)
+    {
+      cache->heap_alloc = MAX (64, cache->heap_alloc * 2);
+      cache->heap = tr_renew (struct cache_run *, cache->heap, cache->heap_alloc);
+    }
 
-/* Calculte runs
- *   - Stale runs, runs sitting in cache for a long time or runs not growing, get priority.
- *     Returns number of runs.
- */
-static int
-calcRuns (tr_cache * cache, struct run_info * runs)
+  heapSet (cache, cache->heap_size++, run);
+  heapSiftUp (cache, run->heap_pos);
+}
+
+static void
+heapRemove (tr_cache * cache, struct cache_run * run)
 {
-  const int n = tr_ptrArraySize (&cache->blocks);
-  int i = 0, pos;
-  const time_t now = tr_time ();
+  const int pos = run->heap_pos;
+  struct cache_run * last = cache->heap[--cache->heap_size];
 
-  for (pos = 0; pos < n; pos += runs[i++].len)
+  if (last != run)
     {
-      int rank = getBlockRun (cache, pos, &runs[i]);
+      heapSet (cache, pos, last);
+      heapUpdate (cache, last);
+    }
+}
 
-      /* This adds ~2 to the relative length of a run for every minute it has
-       * languished in the cache. */
-      rank += (now - runs[i].last_block_time) / 32;
+static void
+updateRunIsPieceDone (struct cache_run * run)
+{
+  const tr_torrent * tor = run->ct->tor;
 
-      /* Flushing stale blocks should be a top priority as the probability of them
-       * growing is very small, for blocks on piece boundaries, and nonexistant for
-       * blocks inside pieces. */
-      rank |= runs[i].is_piece_done ? DONEFLAG : 0;
+  run->is_piece_done = tr_torrentPieceIsComplete (tor, tr_torBlockPiece (tor, run->last));
+}
 
-      /* Move the multi piece runs higher */
-      rank |= runs[i].is_multi_piece ? MULTIFLAG : 0;
+/* add a new block to the runs, joining it to its neighbors' runs if it can */
+static void
+addBlockToRuns (tr_cache * cache, struct cache_torrent * ct, struct cache_block * cb)
+{
+  const tr_block_index_t block = cb->block;
+  struct cache_block * prev = block > 0 ? getBlock (ct, block - 1) : NULL;
+  struct cache_block * next = block + 1 < ct->tor->blockCount ? getBlock (ct, block + 1) : NULL;
+  struct cache_run * run;
 
-      runs[i].rank = rank;
+  if ((prev != NULL) && (next != NULL))
+    {
+      /* this block bridges two runs; fold the second into the first */
+      struct cache_run * right = next->run;
+
+      run = prev->run;
+      run->last = right->last;
+      getBlock (ct, run->last)->run = run;
+      heapRemove (cache, right);
+      tr_free (right);
+    }
+  else if (prev != NULL)
+    {
+      run = prev->run;
+      run->last = block;
+    }
+  else if (next != NULL)
+    {
+      run = next->run;
+      run->first = block;
+    }
+  else
+    {
+      run = tr_new0 (struct cache_run, 1);
+      run->ct = ct;
+      run->first = run->last = block;
+      heapInsert (cache, run);
+    }
+
+  cb->run = run;
+  run->time = cb->time;
+  updateRunIsPieceDone (run);
+  heapUpdate (cache, run);
+}
 
-      //fprintf (stderr,"block run at pos %d of length %d and age %ld adjusted +%d\n",runs[i].pos,runs[i].len,now-runs[i].last_block_time,rank-runs[i].len);
+/* The block that's just been cached is the last one its piece was missing,
+ * so runs ending in that piece are about to become done. */
+static void
+markPieceDone (tr_cache * cache, struct cache_torrent * ct, tr_piece_index_t piece)
+{
+  int i;
+  const struct cache_piece * cp = &ct->pieces[piece];
+
+  for (i=0; cp->count>0 && i<ct->tor->blockCountInPiece; ++i)
+    {
+      struct cache_block * cb = cp->blocks[i];
+
+      /* only the last block of a run is sure to know which run it's in */
+      if ((cb != NULL) && ((cb->block + 1 == ct->tor->blockCount) || (getBlock (ct, cb->block + 1) == NULL))
+                       && !cb->run->is_piece_done)
+        {
+          cb->run->is_piece_done = true;
+          heapUpdate (cache, cb->run);
+        }
     }
+}
+
+/* find the run that a block is in, which may mean walking back to its first block */
+static struct cache_run *
+getBlockRun (const struct cache_torrent * ct, const struct cache_block * cb)
+{
+  tr_block_index_t block = cb->block;
+
+  while ((block > 0) && (getBlock (ct, block - 1) != NULL))
+    --block;
 
-  //fprintf (stderr, "%d block runs\n", i);
-  qsort (runs, i, sizeof (struct run_info), compareRuns);
-  return i;
+  return getBlock (ct, block)->run;
 }
 
-static int
-flushContiguous (tr_cache * cache, int pos, int n)
+/***
+****  Write-back
+***/
+
+static void
+freeJob (tr_cache * cache, struct write_job * job)
 {
   int i;
-  int err = 0;
-  uint8_t * buf = tr_new (uint8_t, n * MAX_BLOCK_SIZE);
-  uint8_t * walk = buf;
-  struct cache_block ** blocks = (struct cache_block**) tr_ptrArrayBase (&cache->blocks);
 
-  struct cache_block * b = blocks[pos];
-  tr_torrent * tor = b->tor;
-  const tr_piece_index_t piece = b->piece;
-  const uint32_t offset = b->offset;
+  for (i=0; i<job->blockCount; ++i)
+    {
+      tr_slabRelease (cache->slab, job->blocks[i]->data);
+      tr_free (job->blocks[i]);
+    }
+
+  tr_free (job->blocks);
+  tr_ioFreeSpans (job->spans, job->spanCount);
+  tr_free (job->iov);
+  tr_free (job);
+}
+
+static void onWritesDone (void * vsession);
+
+static void
+writerThreadFunc (void * vcache)
+{
+  tr_cache * cache = vcache;
 
-  for (i=pos; i<pos+n; ++i)
+  tr_lockLock (cache->lock);
+
+  for (;;)
     {
-      b = blocks[i];
-      evbuffer_copyout (b->evbuf, walk, b->length);
-      walk += b->length;
-      evbuffer_free (b->evbuf);
-      tr_free (b);
+      int err;
+      struct write_job * job;
+
+      /* take the oldest queued job, or sleep until there is one */
+      for (job=cache->jobs; job!=NULL; job=job->next)
+        if (job->state == WRITE_QUEUED)
+          break;
+
+      if (job == NULL)
+        {
+          if (cache->closing)
+            break;
+
+          tr_condWait (cache->jobQueued, cache->lock);
+          continue;
+        }
+
+      job->state = WRITE_ACTIVE;
+      tr_lockUnlock (cache->lock);
+
+      err = tr_ioWriteSpans (cache->session, job->spans, job->spanCount, job->iov, job->blockCount);
+
+      tr_lockLock (cache->lock);
+      job->err = err;
+      job->state = WRITE_DONE;
+      tr_condBroadcast (cache->jobDone);
+
+      if (!cache->reapPending)
+        {
+          cache->reapPending = true;
+          tr_runInEventThread (cache->session, onWritesDone, cache->session);
+        }
     }
-  tr_ptrArrayErase (&cache->blocks, pos, pos+n);
 
-  err = tr_ioWrite (tor, piece, offset, walk-buf, buf);
-  tr_free (buf);
+  cache->writerRunning = false;
+  tr_condBroadcast (cache->jobDone);
+  tr_lockUnlock (cache->lock);
+}
+
+static int cacheTrim (tr_cache * cache);
 
-  ++cache->disk_writes;
-  cache->disk_write_bytes += walk-buf;
-  return err;
+/* free the blocks of finished writes, then see if there's room to hand off more */
+static void
+reapWrites (tr_cache * cache)
+{
+  struct write_job * done = NULL;
+  struct write_job ** walk;
+
+  tr_lockLock (cache->lock);
+  cache->reapPending = false;
+  cache->lastJob = NULL;
+  for (walk=&cache->jobs; *walk!=NULL; )
+    {
+      struct write_job * job = *walk;
+
+      if (job->state == WRITE_DONE)
+        {
+          *walk = job->next;
+          job->next = done;
+          done = job;
+        }
+      else
+        {
+          cache->lastJob = job;
+          walk = &job->next;
+        }
+    }
+  tr_lockUnlock (cache->lock);
+
+  while (done != NULL)
+    {
+      struct write_job * job = done;
+      done = job->next;
+
+      if (job->err)
+        {
+          tr_torrent * tor = tr_torrentFindFromId (cache->session, job->torrentId);
+
+          if ((tor != NULL) && (tor->error != TR_STAT_LOCAL_ERROR))
+            tr_torrentSetLocalError (tor, "%s", tr_strerror (job->err));
+        }
+
+      cache->backlog_bytes -= job->buflen;
+      freeJob (cache, job);
+    }
+
+  cacheTrim (cache);
+}
+
+static void
+onWritesDone (void * vsession)
+{
+  tr_session * session = vsession;
+
+  if (session->cache != NULL)
+    reapWrites (session->cache);
+}
+
+/* wait for the writer to finish all the jobs for a torrent, or for every torrent if tor is NULL */
+static void
+waitForWrites (tr_cache * cache, const tr_torrent * tor)
+{
+  tr_lockLock (cache->lock);
+
+  for (;;)
+    {
+      const struct write_job * job;
+
+      for (job=cache->jobs; job!=NULL; job=job->next)
+        if ((job->state != WRITE_DONE) && ((tor == NULL) || (job->tor == tor)))
+          break;
+
+      if (job == NULL)
+        break;
+
+      tr_condWait (cache->jobDone, cache->lock);
+    }
+
+  tr_lockUnlock (cache->lock);
+
+  reapWrites (cache);
+}
+
+static size_t
+getMaxBacklog (const tr_cache * cache)
+{
+  return MAX (cache->max_bytes, MIN_BACKLOG_BYTES);
 }
 
+/* hand a run of blocks off to the writer thread */
 static int
-flushRuns (tr_cache * cache, struct run_info * runs, int n)
+flushRun (tr_cache * cache, struct cache_run * run)
 {
   int i;
   int err = 0;
-
-  for (i=0; !err && i<n; i++)
+  struct write_job * job;
+  struct cache_block * b;
+  struct cache_torrent * ct = run->ct;
+
+  job = tr_new0 (struct write_job, 1);
+  job->tor = ct->tor;
+  job->torrentId = tr_torrentId (ct->tor);
+  job->firstBlock = run->first;
+  job->blockCount = runLength (run);
+  job->blocks = tr_new (struct cache_block *, job->blockCount);
+  job->iov = tr_new (struct evbuffer_iovec, job->blockCount);
+  for (i=0; i<job->blockCount; ++i)
     {
-      int j;
+      b = job->blocks[i] = getBlock (ct, run->first + i);
+      job->iov[i].iov_base = b->data;
+      job->iov[i].iov_len = b->length;
+      job->buflen += b->length;
+      setBlock (ct, b->block, NULL);
+    }
+  cache->block_count -= job->blockCount;
 
-      err = flushContiguous (cache, runs[i].pos, runs[i].len);
+  heapRemove (cache, run);
+  tr_free (run);
 
-      for (j=i+1; j<n; j++)
-        if (runs[j].pos > runs[i].pos)
-          runs[j].pos -= runs[i].len;
+  /* create the files here, where it's safe to touch the torrent */
+  b = job->blocks[0];
+  err = tr_ioPrepareWrite (job->tor, b->piece, b->offset, job->buflen, &job->spans, &job->spanCount);
+
+  if (err)
+    {
+      freeJob (cache, job);
+    }
+  else
+    {
+      tr_lockLock (cache->lock);
+      if (cache->lastJob != NULL)
+        cache->lastJob->next = job;
+      else
+        cache->jobs = job;
+      cache->lastJob = job;
+      tr_condSignal (cache->jobQueued);
+      tr_lockUnlock (cache->lock);
+
+      cache->backlog_bytes += job->buflen;
+      ++cache->disk_writes;
+      cache->disk_write_bytes += job->buflen;
     }
 
   return err;
@@ -220,24 +662,34 @@ cacheTrim (tr_cache * cache)
 {
   int err = 0;
 
-  if (tr_ptrArraySize (&cache->blocks) > cache->max_blocks)
+  if (cache->block_count > cache->max_blocks)
     {
       /* Amount of cache that should be removed by the flush. This influences how large
        * runs can grow as well as how often flushes will happen. */
       const int cacheCutoff = 1 + cache->max_blocks / 4;
-      struct run_info * runs = tr_new (struct run_info, tr_ptrArraySize (&cache->blocks));
-      int i=0, j=0;
-
-      calcRuns (cache, runs);
-      while (j < cacheCutoff)
-        j += runs[i++].len;
-      err = flushRuns (cache, runs, i);
-      tr_free (runs);
+      int flushed = 0;
+
+      while (!err && (flushed < cacheCutoff) && (cache->heap_size > 0))
+        {
+          struct cache_run * run = cache->heap[0];
+
+          if (cache->backlog_bytes >= getMaxBacklog (cache))
+            break;
+
+          flushed += runLength (run);
+          err = flushRun (cache, run);
+        }
     }
 
   return err;
 }
 
+bool
+tr_cacheIsBackedUp (const tr_cache * cache)
+{
+  return cache->backlog_bytes >= getMaxBacklog (cache);
+}
+
 /***
 ****
 ***/
@@ -248,6 +700,13 @@ getMaxBlocks (int64_t max_bytes)
   return max_bytes / (double)MAX_BLOCK_SIZE;
 }
 
+/* keep enough of the slab around for the cache and the write backlog */
+static void
+updateSlabLimit (tr_cache * cache)
+{
+  tr_slabSetLimit (cache->slab, cache->max_blocks + getMaxBlocks (getMaxBacklog (cache)));
+}
+
 int
 tr_cacheSetLimit (tr_cache * cache, int64_t max_bytes)
 {
@@ -255,6 +714,7 @@ tr_cacheSetLimit (tr_cache * cache, int64_t max_bytes)
 
   cache->max_bytes = max_bytes;
   cache->max_blocks = getMaxBlocks (max_bytes);
+  updateSlabLimit (cache);
 
   tr_formatter_mem_B (buf, cache->max_bytes, sizeof (buf));
   tr_logAddNamedDbg (MY_NAME, "Maximum cache size set to %s (%d blocks)", buf, cache->max_blocks);
@@ -269,20 +729,47 @@ tr_cacheGetLimit (const tr_cache * cache)
 }
 
 tr_cache *
-tr_cacheNew (int64_t max_bytes)
+tr_cacheNew (tr_session * session, int64_t max_bytes)
 {
   tr_cache * cache = tr_new0 (tr_cache, 1);
-  cache->blocks = TR_PTR_ARRAY_INIT;
+  cache->session = session;
+  cache->lock = tr_lockNew ();
+  cache->jobQueued = tr_condNew ();
+  cache->jobDone = tr_condNew ();
+  cache->torrents = TR_PTR_ARRAY_INIT;
   cache->max_bytes = max_bytes;
   cache->max_blocks = getMaxBlocks (max_bytes);
+  cache->slab = tr_slabNew (MAX_BLOCK_SIZE, SLAB_CHUNK_SLOTS);
+  updateSlabLimit (cache);
+
+  /* the writer sleeps until there's a job for it, and lives as long as the cache */
+  cache->writerRunning = true;
+  tr_threadNew (writerThreadFunc, cache);
+
   return cache;
 }
 
 void
 tr_cacheFree (tr_cache * cache)
 {
-  assert (tr_ptrArrayEmpty (&cache->blocks));
-  tr_ptrArrayDestruct (&cache->blocks, NULL);
+  waitForWrites (cache, NULL);
+  assert (cache->jobs == NULL);
+
+  tr_lockLock (cache->lock);
+  cache->closing = true;
+  tr_condSignal (cache->jobQueued);
+  while (cache->writerRunning)
+    tr_condWait (cache->jobDone, cache->lock);
+  tr_lockUnlock (cache->lock);
+
+  assert (cache->block_count == 0);
+  assert (tr_ptrArrayEmpty (&cache->torrents));
+  tr_ptrArrayDestruct (&cache->torrents, NULL);
+  tr_free (cache->heap);
+  tr_slabFree (cache->slab);
+  tr_condFree (cache->jobDone);
+  tr_condFree (cache->jobQueued);
+  tr_lockFree (cache->lock);
   tr_free (cache);
 }
 
@@ -290,47 +777,66 @@ tr_cacheFree (tr_cache * cache)
 ****
 ***/
 
-static int
-cache_block_compare (const void * va, const void * vb)
+static struct cache_block *
+findDirtyBlock (tr_cache           * cache,
+                tr_torrent         * torrent,
+                tr_piece_index_t     piece,
+                uint32_t             offset)
 {
-  const struct cache_block * a = va;
-  const struct cache_block * b = vb;
-
-  /* primary key: torrent id */
-  if (a->tor->uniqueId != b->tor->uniqueId)
-    return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
+  const struct cache_torrent * ct = getCacheTorrent (cache, torrent, false);
 
-  /* secondary key: block # */
-  if (a->block != b->block)
-    return a->block < b->block ? -1 : 1;
-
-  /* they're equal */
-  return 0;
+  return ct != NULL ? getBlock (ct, _tr_block (torrent, piece, offset)) : NULL;
 }
 
+/* find a block that's dirty or still being written back.
+   Only this thread changes the job list, so it's safe to walk unlocked. */
 static struct cache_block *
 findBlock (tr_cache           * cache,
            tr_torrent         * torrent,
            tr_piece_index_t     piece,
            uint32_t             offset)
 {
-  struct cache_block key;
-  key.tor = torrent;
-  key.block = _tr_block (torrent, piece, offset);
-  return tr_ptrArrayFindSorted (&cache->blocks, &key, cache_block_compare);
+  struct cache_block * cb = findDirtyBlock (cache, torrent, piece, offset);
+
+  if ((cb == NULL) && (cache->jobs != NULL))
+    {
+      const struct write_job * job;
+      const tr_block_index_t block = _tr_block (torrent, piece, offset);
+
+      for (job=cache->jobs; job!=NULL; job=job->next)
+        if ((job->tor == torrent) && (job->firstBlock <= block) && (block < job->firstBlock + job->blockCount))
+          cb = job->blocks[block - job->firstBlock];
+    }
+
+  return cb;
+}
+
+uint8_t *
+tr_cacheAllocBlock (tr_cache * cache)
+{
+  return tr_slabAlloc (cache->slab);
+}
+
+void
+tr_cacheReleaseBlock (tr_cache * cache, uint8_t * data)
+{
+  tr_slabRelease (cache->slab, data);
 }
 
 int
-tr_cacheWriteBlock (tr_cache         * cache,
-                    tr_torrent       * torrent,
-                    tr_piece_index_t   piece,
-                    uint32_t           offset,
-                    uint32_t           length,
-                    struct evbuffer  * writeme)
+tr_cacheWriteBlockData (tr_cache         * cache,
+                        tr_torrent       * torrent,
+                        tr_piece_index_t   piece,
+                        uint32_t           offset,
+                        uint32_t           length,
+                        uint8_t          * data)
 {
-  struct cache_block * cb = findBlock (cache, torrent, piece, offset);
+  struct cache_torrent * ct = getCacheTorrent (cache, torrent, true);
+  const tr_block_index_t block = _tr_block (torrent, piece, offset);
+  struct cache_block * cb = getBlock (ct, block);
 
   assert (tr_amInEventThread (torrent->session));
+  assert (length <= MAX_BLOCK_SIZE);
 
   if (cb == NULL)
     {
@@ -339,23 +845,48 @@ tr_cacheWriteBlock (tr_cache         * cache,
       cb->piece = piece;
       cb->offset = offset;
       cb->length = length;
-      cb->block = _tr_block (torrent, piece, offset);
-      cb->evbuf = evbuffer_new ();
-      tr_ptrArrayInsertSorted (&cache->blocks, cb, cache_block_compare);
+      cb->block = block;
+      cb->data = data;
+      cb->time = tr_time ();
+      setBlock (ct, block, cb);
+      ++cache->block_count;
+      addBlockToRuns (cache, ct, cb);
+
+      /* if this finishes the piece, its runs won't be growing any more */
+      if (tr_torrentMissingBlocksInPiece (torrent, piece) == (tr_torrentBlockIsComplete (torrent, block) ? 0 : 1))
+        markPieceDone (cache, ct, piece);
+    }
+  else
+    {
+      /* swap in the new data. anyone still reading the old data holds a reference to it */
+      assert (cb->length == length);
+      tr_slabRelease (cache->slab, cb->data);
+      cb->data = data;
     }
 
   cb->time = tr_time ();
 
-  assert (cb->length == length);
-  evbuffer_drain (cb->evbuf, evbuffer_get_length (cb->evbuf));
-  evbuffer_remove_buffer (writeme, cb->evbuf, cb->length);
-
   cache->cache_writes++;
   cache->cache_write_bytes += cb->length;
 
   return cacheTrim (cache);
 }
 
+int
+tr_cacheWriteBlock (tr_cache         * cache,
+                    tr_torrent       * torrent,
+                    tr_piece_index_t   piece,
+                    uint32_t           offset,
+                    uint32_t           length,
+                    struct evbuffer  * writeme)
+{
+  uint8_t * data = tr_cacheAllocBlock (cache);
+
+  evbuffer_remove (writeme, data, length);
+
+  return tr_cacheWriteBlockData (cache, torrent, piece, offset, length, data);
+}
+
 int
 tr_cacheReadBlock (tr_cache         * cache,
                    tr_torrent       * torrent,
@@ -368,60 +899,142 @@ tr_cacheReadBlock (tr_cache         * cache,
   struct cache_block * cb = findBlock (cache, torrent, piece, offset);
 
   if (cb)
-    evbuffer_copyout (cb->evbuf, setme, len);
+    memcpy (setme, cb->data, len);
   else
     err = tr_ioRead (torrent, piece, offset, len, setme);
 
   return err;
 }
 
+static void
+releaseSharedBlock (const void * data, size_t datalen UNUSED, void * vslab)
+{
+  tr_slabRelease (vslab, (void*)data);
+}
+
 int
-tr_cachePrefetchBlock (tr_cache         * cache,
-                       tr_torrent       * torrent,
-                       tr_piece_index_t   piece,
-                       uint32_t           offset,
-                       uint32_t           len)
+tr_cacheReadBlockToBuffer (tr_cache         * cache,
+                           tr_torrent       * torrent,
+                           tr_piece_index_t   piece,
+                           uint32_t           offset,
+                           uint32_t           len,
+                           struct evbuffer  * out,
+                           bool               shared)
 {
   int err = 0;
   struct cache_block * cb = findBlock (cache, torrent, piece, offset);
 
-  if (cb == NULL)
-    err = tr_ioPrefetch (torrent, piece, offset, len);
+  /* lend the block's slot to the evbuffer, which releases it when it's done */
+  if (shared && (cb != NULL))
+    {
+      tr_slabRef (cache->slab, cb->data);
+
+      if (evbuffer_add_reference (out, cb->data, len, releaseSharedBlock, cache->slab) == 0)
+        return 0;
+
+      tr_slabRelease (cache->slab, cb->data);
+    }
+
+  if ((cb == NULL) && shared)
+    return tr_ioReadToBuffer (torrent, piece, offset, len, out);
+
+  if (cb != NULL)
+    {
+      evbuffer_add (out, cb->data, len);
+    }
+  else
+    {
+      struct evbuffer_iovec iovec[1];
+
+      evbuffer_reserve_space (out, len, iovec, 1);
+      err = tr_ioRead (torrent, piece, offset, len, iovec[0].iov_base);
+      iovec[0].iov_len = err ? 0 : len;
+      evbuffer_commit_space (out, iovec, 1);
+    }
 
   return err;
 }
 
-/***
-****
-***/
+bool
+tr_cacheHasBlock (tr_cache         * cache,
+                  tr_torrent       * torrent,
+                  tr_piece_index_t   piece,
+                  uint32_t           offset)
+{
+  return findBlock (cache, torrent, piece, offset) != NULL;
+}
 
-static int
-findBlockPos (tr_cache * cache, tr_torrent * torrent, tr_piece_index_t block)
+int
+tr_cachePrefetchBlocks (tr_cache             * cache,
+                        tr_torrent           * torrent,
+                        struct tr_io_extent  * extents,
+                        int                    extentCount)
 {
-  struct cache_block key;
-  key.tor = torrent;
-  key.block = block;
-  return tr_ptrArrayLowerBound (&cache->blocks, &key, cache_block_compare, NULL);
+  int i;
+  int n = 0;
+
+  /* the cached blocks are already in memory */
+  for (i=0; i<extentCount; ++i)
+    if (findBlock (cache, torrent, extents[i].piece, extents[i].offset) == NULL)
+      extents[n++] = extents[i];
+
+  return n > 0 ? tr_ioPrefetchExtents (torrent, extents, n) : 0;
 }
 
+/***
+****
+***/
+
 int tr_cacheFlushDone (tr_cache * cache)
 {
   int err = 0;
 
-  if (tr_ptrArraySize (&cache->blocks) > 0)
+  /* done and multi-piece runs outrank all the others, so they're at the top */
+  while (!err && (cache->heap_size > 0))
     {
-      int i, n;
-      struct run_info * runs;
+      struct cache_run * run = cache->heap[0];
 
-      runs = tr_new (struct run_info, tr_ptrArraySize (&cache->blocks));
-      i = 0;
-      n = calcRuns (cache, runs);
+      if (!run->is_piece_done && !runIsMultiPiece (run))
+        break;
 
-      while (i < n && (runs[i].is_piece_done || runs[i].is_multi_piece))
-        runs[i++].rank |= SESSIONFLAG;
+      err = flushRun (cache, run);
+    }
 
-      err = flushRuns (cache, runs, i);
-      tr_free (runs);
+  return err;
+}
+
+/* flush every run that touches blocks [first...last] */
+static int
+flushBlockRange (tr_cache             * cache,
+                 struct cache_torrent * ct,
+                 tr_block_index_t       first,
+                 tr_block_index_t       last)
+{
+  int err = 0;
+  tr_block_index_t block = first;
+
+  while (!err && (block <= last))
+    {
+      const tr_piece_index_t piece = tr_torBlockPiece (ct->tor, block);
+      const struct cache_block * cb;
+      struct cache_run * run;
+
+      /* skip over pieces with nothing in the cache */
+      if (ct->pieces[piece].count == 0)
+        {
+          block = (piece + 1) * (tr_block_index_t)ct->tor->blockCountInPiece;
+          continue;
+        }
+
+      if ((cb = getBlock (ct, block)) == NULL)
+        {
+          ++block;
+          continue;
+        }
+
+      run = getBlockRun (ct, cb);
+      block = run->last + 1;
+      err = flushRun (cache, run);
     }
 
   return err;
@@ -430,28 +1043,19 @@ int tr_cacheFlushDone (tr_cache * cache)
 int
 tr_cacheFlushFile (tr_cache * cache, tr_torrent * torrent, tr_file_index_t i)
 {
-  int pos;
   int err = 0;
   tr_block_index_t first;
   tr_block_index_t last;
+  struct cache_torrent * ct = getCacheTorrent (cache, torrent, false);
 
   tr_torGetFileBlockRange (torrent, i, &first, &last);
-  pos = findBlockPos (cache, torrent, first);
   dbgmsg ("flushing file %d from cache to disk: blocks [%zu...%zu]", (int)i, (size_t)first, (size_t)last);
 
   /* flush out all the blocks in that file */
-  while (!err && (pos < tr_ptrArraySize (&cache->blocks)))
-    {
-      const struct cache_block * b = tr_ptrArrayNth (&cache->blocks, pos);
-
-      if (b->tor != torrent)
-        break;
-      if ((b->block < first) || (b->block > last))
-        break;
-
-      err = flushContiguous (cache, pos, getBlockRun (cache, pos, NULL));
-    }
+  if (ct != NULL)
+    err = flushBlockRange (cache, ct, first, last);
 
+  waitForWrites (cache, torrent);
   return err;
 }
 
@@ -459,18 +1063,17 @@ int
 tr_cacheFlushTorrent (tr_cache * cache, tr_torrent * torrent)
 {
   int err = 0;
-  const int pos = findBlockPos (cache, torrent, 0);
+  struct cache_torrent * ct = getCacheTorrent (cache, torrent, false);
 
   /* flush out all the blocks in that torrent */
-  while (!err && (pos < tr_ptrArraySize (&cache->blocks)))
+  if (ct != NULL)
     {
-      const struct cache_block * b = tr_ptrArrayNth (&cache->blocks, pos);
-
-      if (b->tor != torrent)
-        break;
+      err = flushBlockRange (cache, ct, 0, torrent->blockCount - 1);
 
-      err = flushContiguous (cache, pos, getBlockRun (cache, pos, NULL));
+      if (!err)
+        freeCacheTorrent (cache, ct);
     }
 
+  waitForWrites (cache, torrent);
   return err;
 }
@@ -13,6 +13,7 @@
 #pragma once
 
 struct evbuffer;
+struct tr_io_extent;
 
 typedef struct tr_cache tr_cache;
 
@@ -20,7 +21,7 @@ typedef struct tr_cache tr_cache;
 ****
 ***/
 
-tr_cache * tr_cacheNew (int64_t max_bytes);
+tr_cache * tr_cacheNew (tr_session * session, int64_t max_bytes);
 
 void tr_cacheFree (tr_cache *);
 
@@ -32,6 +33,26 @@ int tr_cacheSetLimit (tr_cache * cache, int64_t max_bytes);
 
 int64_t tr_cacheGetLimit (const tr_cache *);
 
+/** @brief true if the writer is too far behind to accept more dirty blocks */
+bool tr_cacheIsBackedUp (const tr_cache *);
+
+/**
+ * Get a buffer big enough for any block, from the same slab that the cache
+ * keeps its blocks in. Pass it to tr_cacheWriteBlockData () to cache it
+ * without a copy, or give it back with tr_cacheReleaseBlock ().
+ */
+uint8_t * tr_cacheAllocBlock (tr_cache * cache);
+
+void tr_cacheReleaseBlock (tr_cache * cache, uint8_t * data);
+
+/** @brief cache a block. This takes ownership of data, from tr_cacheAllocBlock (). */
+int tr_cacheWriteBlockData (tr_cache         * cache,
+                            tr_torrent       * torrent,
+                            tr_piece_index_t   piece,
+                            uint32_t           offset,
+                            uint32_t           len,
+                            uint8_t          * data);
+
 int tr_cacheWriteBlock (tr_cache         * cache,
                         tr_torrent       * torrent,
                         tr_piece_index_t   piece,
@@ -46,16 +67,42 @@ int tr_cacheReadBlock (tr_cache         * cache,
                        uint32_t           len,
                        uint8_t          * setme);
 
-int tr_cachePrefetchBlock (tr_cache         * cache,
-                           tr_torrent       * torrent,
-                           tr_piece_index_t   piece,
-                           uint32_t           offset,
-                           uint32_t           len);
+/**
+ * Appends a block to @a out. If @a shared is true, the data may be added by
+ * reference (to a cached block or to the file on disk) rather than copied,
+ * in which case @a out's contents must not be modified in place.
+ */
+int tr_cacheReadBlockToBuffer (tr_cache         * cache,
+                               tr_torrent       * torrent,
+                               tr_piece_index_t   piece,
+                               uint32_t           offset,
+                               uint32_t           len,
+                               struct evbuffer  * out,
+                               bool               shared);
+
+/** @brief true if the block is in the cache, i.e. reading it won't touch the disk */
+bool tr_cacheHasBlock (tr_cache         * cache,
+                       tr_torrent       * torrent,
+                       tr_piece_index_t   piece,
+                       uint32_t           offset);
+
+/**
+ * Prefetches the blocks that aren't already in the cache, with as few
+ * syscalls as possible. @a extents may be reordered.
+ */
+int tr_cachePrefetchBlocks (tr_cache             * cache,
+                            tr_torrent           * torrent,
+                            struct tr_io_extent  * extents,
+                            int                    extentCount);
 
 /***
 ****
 ***/
 
+/* Blocks are written to disk by a background thread.
+   tr_cacheFlushDone () only queues them, but tr_cacheFlushTorrent ()
+   and tr_cacheFlushFile () wait until the torrent's writes are done. */
+
 int tr_cacheFlushDone (tr_cache * cache);
 
 int tr_cacheFlushTorrent (tr_cache    * cache,
@@ -0,0 +1,128 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+/* Measures the throughput of the crypto backend that this build uses,
+ * next to the built-in RC4 from crypto-utils-fallback.c, over the chunk
+ * sizes that peer-io hands them: a 4-byte message length, a small message,
+ * and whole evbuffer chains. Build with each backend to compare them.
+ *
+ * Usage: crypto-bench [megabytes] */
+
+#include <stdio.h>
+#include <stdlib.h> /* atoi () */
+#include <string.h> /* memset () */
+
+#include "transmission.h"
+#include "crypto-utils.h"
+#include "utils.h"
+
+#define TR_CRYPTO_RC4_FALLBACK
+#include "crypto-utils-fallback.c"
+
+static const size_t chunk_sizes[] = { 4, 68, 1024, 16384 };
+
+static double
+toMBps (size_t bytes, uint64_t msec)
+{
+  return msec ? (bytes / (1024.0 * 1024.0)) / (msec / 1000.0) : 0.0;
+}
+
+static uint64_t
+timeBackendRc4 (uint8_t * buf, size_t total, size_t chunk)
+{
+  size_t i;
+  uint64_t begin;
+  tr_rc4_ctx_t rc4 = tr_rc4_new ();
+
+  tr_rc4_set_key (rc4, (const uint8_t *) "0123456789abcdefghij", SHA_DIGEST_LENGTH);
+
+  begin = tr_time_msec ();
+  for (i=0; i + chunk <= total; i += chunk)
+    tr_rc4_process (rc4, buf + i, buf + i, chunk);
+
+  tr_rc4_free (rc4);
+  return tr_time_msec () - begin;
+}
+
+static uint64_t
+timeBuiltinRc4 (uint8_t * buf, size_t total, size_t chunk)
+{
+  size_t i;
+  uint64_t begin;
+  struct tr_rc4_fallback rc4;
+
+  tr_rc4_fallback_set_key (&rc4, (const uint8_t *) "0123456789abcdefghij", SHA_DIGEST_LENGTH);
+
+  begin = tr_time_msec ();
+  for (i=0; i + chunk <= total; i += chunk)
+    tr_rc4_fallback_process (&rc4, buf + i, buf + i, chunk);
+
+  return tr_time_msec () - begin;
+}
+
+static uint64_t
+timeSha1 (const uint8_t * buf, size_t total, size_t chunk)
+{
+  size_t i;
+  uint64_t begin;
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  tr_sha1_ctx_t sha = tr_sha1_init ();
+
+  begin = tr_time_msec ();
+  for (i=0; i + chunk <= total; i += chunk)
+    tr_sha1_update (sha, buf + i, chunk);
+  tr_sha1_final (sha, hash);
+
+  return tr_time_msec () - begin;
+}
+
+int
+main (int argc, char ** argv)
+{
+  size_t i;
+  uint8_t * buf;
+  uint8_t * check;
+  const int megabytes = argc > 1 ? atoi (argv[1]) : 64;
+  size_t total;
+
+  if (megabytes < 1)
+    {
+      fprintf (stderr, "Usage: %s [megabytes]\n", argv[0]);
+      return 1;
+    }
+
+  total = (size_t) megabytes * 1024 * 1024;
+  buf = tr_new0 (uint8_t, total);
+  check = tr_new0 (uint8_t, total);
+
+  /* sanity check: both RC4s should make the same keystream */
+  timeBackendRc4 (buf, total, 1024);
+  timeBuiltinRc4 (check, total, 1024);
+  if (memcmp (buf, check, total) != 0)
+    {
+      fprintf (stderr, "the backend's and the built-in RC4 disagree\n");
+      return 1;
+    }
+
+  printf ("%d MiB, in MiB/s:\n", megabytes);
+  printf ("%8s  %12s  %12s  %12s\n", "chunk", "backend rc4", "built-in rc4", "sha1");
+
+  for (i=0; i<sizeof (chunk_sizes) / sizeof (*chunk_sizes); ++i)
+    {
+      const size_t chunk = chunk_sizes[i];
+
+      printf ("%8zu  %12.1f  %12.1f  %12.1f\n", chunk,
+              toMBps (total, timeBackendRc4 (buf, total, chunk)),
+              toMBps (total, timeBuiltinRc4 (buf, total, chunk)),
+              toMBps (total, timeSha1 (buf, total, chunk)));
+    }
+
+  tr_free (check);
+  tr_free (buf);
+  return 0;
+}
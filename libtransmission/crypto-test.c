@@ -94,6 +94,55 @@ test_encrypt_decrypt (void)
   return 0;
 }
 
+static int
+test_rc4 (void)
+{
+  size_t i;
+  size_t len;
+  tr_rc4_ctx_t rc4;
+  uint8_t buf[300];
+  uint8_t whole[300];
+  static const struct
+    {
+      const char * key;
+      const char * plaintext;
+      const char * ciphertext;
+    }
+  vectors[] =
+    {
+      { "Key", "Plaintext", "\xbb\xf3\x16\xe8\xd9\x40\xaf\x0a\xd3" },
+      { "Wiki", "pedia", "\x10\x21\xbf\x04\x20" },
+      { "Secret", "Attack at dawn", "\x45\xa0\x1f\x64\x5f\xc3\x5b\x38\x35\x52\x54\x4b\x9b\xf5" }
+    };
+
+  for (i=0; i<sizeof (vectors) / sizeof (*vectors); ++i)
+    {
+      len = strlen (vectors[i].plaintext);
+      rc4 = tr_rc4_new ();
+      check (rc4 != NULL);
+      tr_rc4_set_key (rc4, (const uint8_t *) vectors[i].key, strlen (vectors[i].key));
+      tr_rc4_process (rc4, vectors[i].plaintext, buf, len);
+      check (memcmp (buf, vectors[i].ciphertext, len) == 0);
+      tr_rc4_free (rc4);
+    }
+
+  /* the keystream doesn't depend on how the input is split up */
+  memset (buf, 0, sizeof (buf));
+  rc4 = tr_rc4_new ();
+  tr_rc4_set_key (rc4, (const uint8_t *) "Key", 3);
+  tr_rc4_process (rc4, buf, whole, sizeof (whole));
+  tr_rc4_set_key (rc4, (const uint8_t *) "Key", 3);
+  for (i=0, len=1; i<sizeof (buf); i+=len, ++len)
+    {
+      len = MIN (len, sizeof (buf) - i);
+      tr_rc4_process (rc4, buf + i, buf + i, len);
+    }
+  check (memcmp (buf, whole, sizeof (buf)) == 0);
+  tr_rc4_free (rc4);
+
+  return 0;
+}
+
 static int
 test_sha1 (void)
 {
@@ -282,6 +331,7 @@ main (void)
 {
   const testFunc tests[] = { test_torrent_hash,
                              test_encrypt_decrypt,
+                             test_rc4,
                              test_sha1,
                              test_ssha1,
                              test_random,
@@ -74,3 +74,101 @@ tr_dh_secret_free (tr_dh_secret_t handle)
 }
 
 #endif /* TR_CRYPTO_DH_SECRET_FALLBACK */
+
+/***
+****
+***/
+
+#ifdef TR_CRYPTO_RC4_FALLBACK
+
+/* A portable RC4 for backends whose own is missing or slow. RC4 is serial
+   by nature (every byte's keystream depends on the swap before it), so
+   there's nothing to vectorize; instead, this keeps the state in locals,
+   uses word-sized S-box entries to avoid partial-register stalls, and
+   unrolls the loop so that the compiler can overlap the loads of
+   neighboring steps. */
+
+struct tr_rc4_fallback
+{
+  uint32_t i;
+  uint32_t j;
+  uint32_t s[256];
+};
+
+static void
+tr_rc4_fallback_set_key (struct tr_rc4_fallback * handle,
+                         const uint8_t          * key,
+                         size_t                   key_length)
+{
+  uint32_t i;
+  uint32_t j;
+  uint32_t * s = handle->s;
+
+  assert (handle != NULL);
+  assert (key != NULL);
+  assert (key_length > 0);
+
+  for (i = 0; i < 256; ++i)
+    s[i] = i;
+
+  for (i = 0, j = 0; i < 256; ++i)
+    {
+      const uint32_t t = s[i];
+      j = (j + t + key[i % key_length]) & 0xff;
+      s[i] = s[j];
+      s[j] = t;
+    }
+
+  handle->i = 0;
+  handle->j = 0;
+}
+
+#define TR_RC4_STEP(n) \
+  do \
+    { \
+      i = (i + 1) & 0xff; \
+      x = s[i]; \
+      j = (j + x) & 0xff; \
+      y = s[j]; \
+      s[i] = y; \
+      s[j] = x; \
+      out[n] = in[n] ^ (uint8_t) s[(x + y) & 0xff]; \
+    } \
+  while (0)
+
+static void
+tr_rc4_fallback_process (struct tr_rc4_fallback * handle,
+                         const void             * input,
+                         void                   * output,
+                         size_t                   length)
+{
+  uint32_t x;
+  uint32_t y;
+  uint32_t i = handle->i;
+  uint32_t j = handle->j;
+  uint32_t * s = handle->s;
+  const uint8_t * in = input;
+  uint8_t * out = output;
+
+  for (; length >= 8; length -= 8, in += 8, out += 8)
+    {
+      TR_RC4_STEP (0);
+      TR_RC4_STEP (1);
+      TR_RC4_STEP (2);
+      TR_RC4_STEP (3);
+      TR_RC4_STEP (4);
+      TR_RC4_STEP (5);
+      TR_RC4_STEP (6);
+      TR_RC4_STEP (7);
+    }
+
+  for (; length > 0; --length, ++in, ++out)
+    TR_RC4_STEP (0);
+
+  handle->i = i;
+  handle->j = j;
+}
+
+#undef TR_RC4_STEP
+
+#endif /* TR_CRYPTO_RC4_FALLBACK */
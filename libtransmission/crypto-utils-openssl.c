@@ -27,6 +27,7 @@
 #include "utils.h"
 
 #define TR_CRYPTO_DH_SECRET_FALLBACK
+#define TR_CRYPTO_RC4_FALLBACK
 #include "crypto-utils-fallback.c"
 
 /***
@@ -178,47 +179,99 @@ openssl_evp_cipher_context_free (EVP_CIPHER_CTX * handle)
 
 #endif
 
+/* OpenSSL 3 only has RC4 in its legacy provider, which usually isn't
+   loaded. When it's missing, use our own instead of failing every MSE
+   handshake. */
+static bool
+openssl_has_rc4 (void)
+{
+  static int has_rc4 = -1;
+
+  if (has_rc4 == -1)
+    {
+      EVP_CIPHER_CTX * handle = EVP_CIPHER_CTX_new ();
+
+      has_rc4 = EVP_CipherInit_ex (handle, EVP_rc4 (), NULL, NULL, NULL, -1) ? 1 : 0;
+      EVP_CIPHER_CTX_free (handle);
+
+      if (!has_rc4)
+        {
+          ERR_clear_error ();
+          tr_logAddNamedDbg (MY_NAME, "OpenSSL has no RC4; using the built-in one");
+        }
+    }
+
+  return has_rc4 != 0;
+}
+
+struct tr_rc4_openssl
+{
+  EVP_CIPHER_CTX * evp; /* NULL if using the fallback */
+  struct tr_rc4_fallback fallback;
+};
+
 tr_rc4_ctx_t
 tr_rc4_new (void)
 {
-  EVP_CIPHER_CTX * handle = EVP_CIPHER_CTX_new ();
+  struct tr_rc4_openssl * handle = tr_new0 (struct tr_rc4_openssl, 1);
 
-  if (check_result (EVP_CipherInit_ex (handle, EVP_rc4 (), NULL, NULL, NULL, -1)))
-    return handle;
+  if (openssl_has_rc4 ())
+    {
+      handle->evp = EVP_CIPHER_CTX_new ();
 
-  EVP_CIPHER_CTX_free (handle);
-  return NULL;
+      if (!check_result (EVP_CipherInit_ex (handle->evp, EVP_rc4 (), NULL, NULL, NULL, -1)))
+        {
+          EVP_CIPHER_CTX_free (handle->evp);
+          tr_free (handle);
+          return NULL;
+        }
+    }
+
+  return handle;
 }
 
 void
-tr_rc4_free (tr_rc4_ctx_t handle)
+tr_rc4_free (tr_rc4_ctx_t raw_handle)
 {
+  struct tr_rc4_openssl * handle = raw_handle;
+
   if (handle == NULL)
     return;
 
-  EVP_CIPHER_CTX_free (handle);
+  if (handle->evp != NULL)
+    EVP_CIPHER_CTX_free (handle->evp);
+  tr_free (handle);
 }
 
 void
-tr_rc4_set_key (tr_rc4_ctx_t    handle,
+tr_rc4_set_key (tr_rc4_ctx_t    raw_handle,
                 const uint8_t * key,
                 size_t          key_length)
 {
+  struct tr_rc4_openssl * handle = raw_handle;
+
   assert (handle != NULL);
   assert (key != NULL);
 
-  if (!check_result (EVP_CIPHER_CTX_set_key_length (handle, key_length)))
+  if (handle->evp == NULL)
+    {
+      tr_rc4_fallback_set_key (&handle->fallback, key, key_length);
+      return;
+    }
+
+  if (!check_result (EVP_CIPHER_CTX_set_key_length (handle->evp, key_length)))
     return;
-  check_result (EVP_CipherInit_ex (handle, NULL, NULL, key, NULL, -1));
+  check_result (EVP_CipherInit_ex (handle->evp, NULL, NULL, key, NULL, -1));
 }
 
 void
-tr_rc4_process (tr_rc4_ctx_t   handle,
+tr_rc4_process (tr_rc4_ctx_t   raw_handle,
                 const void   * input,
                 void         * output,
                 size_t         length)
 {
   int output_length;
+  struct tr_rc4_openssl * handle = raw_handle;
 
   assert (handle != NULL);
 
@@ -228,7 +281,10 @@ tr_rc4_process (tr_rc4_ctx_t   handle,
   assert (input != NULL);
   assert (output != NULL);
 
-  check_result (EVP_CipherUpdate (handle, output, &output_length, input, length));
+  if (handle->evp == NULL)
+    tr_rc4_fallback_process (&handle->fallback, input, output, length);
+  else
+    check_result (EVP_CipherUpdate (handle->evp, output, &output_length, input, length));
 }
 
 /***
@@ -143,6 +143,17 @@ tr_cryptoDecrypt (tr_crypto  * crypto,
   tr_rc4_process (crypto->dec_key, buf_in, buf_out, buf_len);
 }
 
+tr_rc4_ctx_t
+tr_cryptoDecryptTakeKey (tr_crypto * crypto)
+{
+  tr_rc4_ctx_t key = crypto->dec_key;
+
+  assert (key != NULL);
+
+  crypto->dec_key = NULL;
+  return key;
+}
+
 void
 tr_cryptoEncryptInit (tr_crypto * crypto)
 {
@@ -68,6 +68,10 @@ void           tr_cryptoDecrypt (tr_crypto *  crypto,
                                  const void * buf_in,
                                  void *       buf_out);
 
+/** @brief hand the decryption key to the caller, who must free it with
+           tr_rc4_free (). tr_cryptoDecrypt () can't be used afterwards. */
+tr_rc4_ctx_t   tr_cryptoDecryptTakeKey (tr_crypto * crypto);
+
 void           tr_cryptoEncryptInit (tr_crypto * crypto);
 
 void           tr_cryptoEncrypt (tr_crypto *  crypto,
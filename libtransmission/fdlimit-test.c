@@ -0,0 +1,220 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memset () */
+
+#include "transmission.h"
+#include "fdlimit.h"
+#include "file.h"
+#include "platform.h" /* tr_threadNew () */
+#include "session.h" /* tr_sessionLock () */
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+static tr_sys_file_t
+checkoutImpl (tr_session * session, const char * sandbox, int torrent_id, int i, bool borrow)
+{
+  char name[32];
+  char * path;
+  tr_sys_file_t fd;
+
+  tr_snprintf (name, sizeof (name), "%d-%d", torrent_id, i);
+  path = tr_buildPath (sandbox, name, NULL);
+  fd = borrow ? tr_fdFileBorrow (session, torrent_id, i, path, true, TR_PREALLOCATE_NONE, 0)
+              : tr_fdFileCheckout (session, torrent_id, i, path, true, TR_PREALLOCATE_NONE, 0);
+  tr_free (path);
+
+  return fd;
+}
+
+static tr_sys_file_t
+checkout (tr_session * session, const char * sandbox, int torrent_id, int i)
+{
+  return checkoutImpl (session, sandbox, torrent_id, i, false);
+}
+
+static int
+test_file_cache (void)
+{
+  int i;
+  int max;
+  struct tr_fd_stats stats;
+  tr_session * session = libttest_session_init (NULL);
+  char * sandbox = libtest_sandbox_create ();
+
+  tr_fdGetFileStats (session, &stats);
+  max = stats.max_open;
+  check (max > 2);
+  check_int_eq (0, stats.open_count);
+
+  /* fill the cache */
+  for (i=0; i<max; ++i)
+    check (checkout (session, sandbox, 1, i) != TR_BAD_SYS_FILE);
+  tr_fdGetFileStats (session, &stats);
+  check_int_eq (max, stats.open_count);
+  check_uint_eq (max, stats.misses);
+  check_uint_eq (0, stats.evictions);
+
+  /* looking them up again is a hit */
+  check (tr_fdFileGetCached (session, 1, 0, true) != TR_BAD_SYS_FILE);
+  check (checkout (session, sandbox, 1, 1) != TR_BAD_SYS_FILE);
+  check (tr_fdFileGetCached (session, 2, 0, false) == TR_BAD_SYS_FILE);
+  tr_fdGetFileStats (session, &stats);
+  check_uint_eq (2, stats.hits);
+
+  /* one more evicts the least recently used, which is now file 2 */
+  check (checkout (session, sandbox, 2, 0) != TR_BAD_SYS_FILE);
+  tr_fdGetFileStats (session, &stats);
+  check_int_eq (max, stats.open_count);
+  check_uint_eq (1, stats.evictions);
+  check (tr_fdFileGetCached (session, 1, 2, false) == TR_BAD_SYS_FILE);
+  check (tr_fdFileGetCached (session, 1, 0, false) != TR_BAD_SYS_FILE);
+  check (tr_fdFileGetCached (session, 1, 1, false) != TR_BAD_SYS_FILE);
+  check (tr_fdFileGetCached (session, 2, 0, false) != TR_BAD_SYS_FILE);
+
+  /* closing a torrent closes all of its files */
+  tr_sessionLock (session);
+  tr_fdTorrentClose (session, 1);
+  tr_sessionUnlock (session);
+  tr_fdGetFileStats (session, &stats);
+  check_int_eq (1, stats.open_count);
+  check (tr_fdFileGetCached (session, 1, 0, false) == TR_BAD_SYS_FILE);
+  check (tr_fdFileGetCached (session, 2, 0, false) != TR_BAD_SYS_FILE);
+
+  libttest_session_close (session);
+  libtest_sandbox_destroy (sandbox);
+  tr_free (sandbox);
+  return 0;
+}
+
+static int
+test_borrow (void)
+{
+  int i;
+  int max;
+  tr_sys_file_t fd;
+  struct tr_fd_stats stats;
+  tr_session * session = libttest_session_init (NULL);
+  char * sandbox = libtest_sandbox_create ();
+
+  tr_fdGetFileStats (session, &stats);
+  max = stats.max_open;
+
+  /* a borrowed file isn't evicted, even when it's the least recently used */
+  fd = checkoutImpl (session, sandbox, 1, 0, true);
+  check (fd != TR_BAD_SYS_FILE);
+  for (i=0; i<max; ++i)
+    check (checkout (session, sandbox, 2, i) != TR_BAD_SYS_FILE);
+  tr_fdGetFileStats (session, &stats);
+  check_uint_eq (1, stats.evictions);
+  check (tr_fdFileGetCached (session, 1, 0, true) == fd);
+  check (tr_fdFileGetCached (session, 2, 0, true) == TR_BAD_SYS_FILE);
+
+  /* closing it only hides it until it's returned */
+  tr_sessionLock (session);
+  tr_fdTorrentClose (session, 1);
+  tr_sessionUnlock (session);
+  check (tr_fdFileGetCached (session, 1, 0, true) == TR_BAD_SYS_FILE);
+  check (tr_sys_file_write_at (fd, "x", 1, 0, NULL, NULL));
+  tr_fdFileReturn (session, 1, 0, fd);
+
+  /* ...after which its slot can be used again */
+  check (checkout (session, sandbox, 2, 0) != TR_BAD_SYS_FILE);
+  tr_fdGetFileStats (session, &stats);
+  check_int_eq (max, stats.open_count);
+  check_uint_eq (1, stats.evictions);
+
+  libttest_session_close (session);
+  libtest_sandbox_destroy (sandbox);
+  tr_free (sandbox);
+  return 0;
+}
+
+struct borrow_thread_data
+{
+  tr_session * session;
+  const char * sandbox;
+  int fileCount;
+  int passes;
+  int failures;
+  volatile bool done;
+};
+
+static void
+borrowThreadFunc (void * vdata)
+{
+  int i;
+  int j;
+  struct borrow_thread_data * data = vdata;
+
+  for (i=0; i<data->passes; ++i)
+    for (j=0; j<data->fileCount; ++j)
+      {
+        const tr_sys_file_t fd = checkoutImpl (data->session, data->sandbox, 1, j, true);
+
+        if (fd == TR_BAD_SYS_FILE)
+          ++data->failures;
+        else
+          tr_fdFileReturn (data->session, 1, j, fd);
+      }
+
+  data->done = true;
+}
+
+static int
+test_checkout_from_threads (void)
+{
+  int i;
+  int j;
+  int failures = 0;
+  struct tr_fd_stats stats;
+  struct borrow_thread_data data;
+  tr_session * session = libttest_session_init (NULL);
+  char * sandbox = libtest_sandbox_create ();
+
+  tr_fdGetFileStats (session, &stats);
+
+  /* twice as many files as the cache holds, so that both threads
+     keep opening files that the other one may be opening too */
+  memset (&data, 0, sizeof (data));
+  data.session = session;
+  data.sandbox = sandbox;
+  data.fileCount = stats.max_open * 2;
+  data.passes = 20;
+  tr_threadNew (borrowThreadFunc, &data);
+
+  for (i=0; i<data.passes; ++i)
+    for (j=data.fileCount-1; j>=0; --j)
+      if (checkout (session, sandbox, 1, j) == TR_BAD_SYS_FILE)
+        ++failures;
+
+  while (!data.done)
+    tr_wait_msec (10);
+
+  check_int_eq (0, failures);
+  check_int_eq (0, data.failures);
+  tr_fdGetFileStats (session, &stats);
+  check_uint_eq ((uint64_t) data.passes * data.fileCount * 2, stats.hits + stats.misses);
+  check (stats.open_count <= stats.max_open);
+
+  libttest_session_close (session);
+  libtest_sandbox_destroy (sandbox);
+  tr_free (sandbox);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_file_cache,
+                             test_borrow,
+                             test_checkout_from_threads };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -22,6 +22,7 @@
 #include "fdlimit.h"
 #include "file.h"
 #include "log.h"
+#include "platform.h" /* tr_lock */
 #include "session.h"
 #include "torrent.h" /* tr_isTorrent () */
 
@@ -122,7 +123,22 @@ struct tr_cached_file
   tr_sys_file_t fd;
   int torrent_id;
   tr_file_index_t file_index;
-  time_t used_at;
+
+  /* tr_fdFileBorrow () calls that haven't been returned yet. A borrowed
+     file isn't evicted, and closing it is put off until it's returned. */
+  int borrows;
+  bool close_pending;
+
+  /* the slot's been reserved, and a checkout is opening the file without
+     the lock held. It holds a borrow meanwhile, so the slot stays put. */
+  bool opening;
+
+  /* the next file in this one's hash bucket, or in the free list */
+  struct tr_cached_file * hash_next;
+
+  /* the open files, most recently used first */
+  struct tr_cached_file * lru_prev;
+  struct tr_cached_file * lru_next;
 };
 
 static inline bool
@@ -146,9 +162,10 @@ cached_file_close (struct tr_cached_file * o)
  * returns 0 on success, or an errno value on failure.
  * errno values include ENOENT if the parent folder doesn't exist,
  * plus the errno values set by tr_sys_dir_create () and tr_sys_file_open ().
+ * This touches no shared state, so it's called without the fileset lock.
  */
 static int
-cached_file_open (struct tr_cached_file  * o,
+cached_file_open (tr_sys_file_t          * setme,
                   const char             * filename,
                   bool                     writable,
                   tr_preallocation_mode    allocation,
@@ -236,7 +253,7 @@ cached_file_open (struct tr_cached_file  * o,
       goto fail;
     }
 
-  o->fd = fd;
+  *setme = fd;
   return 0;
 
 fail:
@@ -259,36 +276,149 @@ struct tr_fileset
 {
   struct tr_cached_file * begin;
   const struct tr_cached_file * end;
+
+  /* the open files, hashed by torrent id and file index */
+  struct tr_cached_file ** buckets;
+  size_t bucket_mask;
+
+  struct tr_cached_file * lru_head; /* most recently used */
+  struct tr_cached_file * lru_tail; /* next to be evicted */
+  struct tr_cached_file * free_list; /* slots without an open file */
+
+  struct tr_fd_stats stats;
 };
 
+static inline size_t
+fileset_hash (const struct tr_fileset * set, int torrent_id, tr_file_index_t i)
+{
+  return (((uint32_t) torrent_id * 2654435761u) ^ i) & set->bucket_mask;
+}
+
 static void
 fileset_construct (struct tr_fileset * set, int n)
 {
-  struct tr_cached_file * o;
-  const struct tr_cached_file TR_CACHED_FILE_INIT = { false, TR_BAD_SYS_FILE, 0, 0, 0 };
+  int i;
+  size_t bucket_count = 1;
+
+  while (bucket_count < (size_t) n)
+    bucket_count <<= 1;
 
-  set->begin = tr_new (struct tr_cached_file, n);
+  memset (set, 0, sizeof (struct tr_fileset));
+  set->begin = tr_new0 (struct tr_cached_file, n);
   set->end = set->begin + n;
+  set->buckets = tr_new0 (struct tr_cached_file *, bucket_count);
+  set->bucket_mask = bucket_count - 1;
+  set->stats.max_open = n;
 
-  for (o=set->begin; o!=set->end; ++o)
-    *o = TR_CACHED_FILE_INIT;
+  for (i=n-1; i>=0; --i)
+    {
+      struct tr_cached_file * o = &set->begin[i];
+      o->fd = TR_BAD_SYS_FILE;
+      o->hash_next = set->free_list;
+      set->free_list = o;
+    }
 }
 
+/* add an open file to the hash and the front of the LRU list */
 static void
-fileset_close_all (struct tr_fileset * set)
+fileset_link (struct tr_fileset * set, struct tr_cached_file * o)
 {
-  struct tr_cached_file * o;
+  struct tr_cached_file ** bucket = &set->buckets[fileset_hash (set, o->torrent_id, o->file_index)];
+
+  o->hash_next = *bucket;
+  *bucket = o;
+
+  o->lru_prev = NULL;
+  o->lru_next = set->lru_head;
+  if (set->lru_head != NULL)
+    set->lru_head->lru_prev = o;
+  else
+    set->lru_tail = o;
+  set->lru_head = o;
+
+  ++set->stats.open_count;
+}
+
+static void
+fileset_unlink (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  struct tr_cached_file ** walk = &set->buckets[fileset_hash (set, o->torrent_id, o->file_index)];
+
+  while (*walk != o)
+    walk = &(*walk)->hash_next;
+  *walk = o->hash_next;
+  o->hash_next = NULL;
+
+  if (o->lru_prev != NULL)
+    o->lru_prev->lru_next = o->lru_next;
+  else
+    set->lru_head = o->lru_next;
+  if (o->lru_next != NULL)
+    o->lru_next->lru_prev = o->lru_prev;
+  else
+    set->lru_tail = o->lru_prev;
+  o->lru_prev = o->lru_next = NULL;
+
+  --set->stats.open_count;
+}
+
+/* mark an open file as the most recently used */
+static void
+fileset_touch (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  if (set->lru_head != o)
+    {
+      fileset_unlink (set, o);
+      fileset_link (set, o);
+    }
+}
+
+static void
+fileset_free_slot (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  if (cached_file_is_open (o))
+    cached_file_close (o);
+
+  o->hash_next = set->free_list;
+  set->free_list = o;
+}
+
+static void
+fileset_close_file (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  fileset_unlink (set, o);
+
+  /* a borrowed file stays open, out of sight, until it's returned */
+  if (o->borrows > 0)
+    o->close_pending = true;
+  else
+    fileset_free_slot (set, o);
+}
 
+static void
+fileset_close_all (struct tr_fileset * set)
+{
   if (set != NULL)
-    for (o=set->begin; o!=set->end; ++o)
-      if (cached_file_is_open (o))
-        cached_file_close (o);
+    while (set->lru_head != NULL)
+      fileset_close_file (set, set->lru_head);
 }
 
 static void
 fileset_destruct (struct tr_fileset * set)
 {
+  struct tr_cached_file * o;
+
   fileset_close_all (set);
+
+  for (o=set->begin; o!=set->end; ++o)
+    {
+      assert (o->borrows == 0);
+
+      if (o->close_pending)
+        cached_file_close (o);
+    }
+
+  tr_free (set->buckets);
   tr_free (set->begin);
   set->end = set->begin = NULL;
 }
@@ -297,49 +427,85 @@ static void
 fileset_close_torrent (struct tr_fileset * set, int torrent_id)
 {
   struct tr_cached_file * o;
+  struct tr_cached_file * next;
 
   if (set != NULL)
-    for (o=set->begin; o!=set->end; ++o)
-      if ((o->torrent_id == torrent_id) && cached_file_is_open (o))
-        cached_file_close (o);
+    for (o=set->lru_head; o!=NULL; o=next)
+      {
+        next = o->lru_next;
+
+        if (o->torrent_id == torrent_id)
+          fileset_close_file (set, o);
+      }
 }
 
 static struct tr_cached_file *
 fileset_lookup (struct tr_fileset * set, int torrent_id, tr_file_index_t i)
 {
-  struct tr_cached_file * o;
+  struct tr_cached_file * o = NULL;
 
   if (set != NULL)
+    for (o=set->buckets[fileset_hash (set, torrent_id, i)]; o!=NULL; o=o->hash_next)
+      if ((torrent_id == o->torrent_id) && (i == o->file_index))
+        break;
+
+  return o;
+}
+
+/* drop a borrow, and close the file if that was all that kept it open */
+static void
+fileset_release (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  assert (o->borrows > 0);
+
+  if ((--o->borrows == 0) && o->close_pending)
+    {
+      o->close_pending = false;
+      fileset_free_slot (set, o);
+    }
+}
+
+/* find a borrowed file, even if it's been closed since it was lent */
+static struct tr_cached_file *
+fileset_lookup_borrowed (struct tr_fileset * set, int torrent_id, tr_file_index_t i, tr_sys_file_t fd)
+{
+  struct tr_cached_file * o = fileset_lookup (set, torrent_id, i);
+
+  if ((o == NULL) || (o->fd != fd))
     for (o=set->begin; o!=set->end; ++o)
-      if ((torrent_id == o->torrent_id) && (i == o->file_index) && cached_file_is_open (o))
-        return o;
+      if (o->close_pending && (o->fd == fd))
+        break;
 
-  return NULL;
+  assert (o != set->end);
+  assert (o->borrows > 0);
+  return o;
 }
 
+/* returns a slot that's been taken off the free list,
+   or NULL if every open file is borrowed */
 static struct tr_cached_file *
 fileset_get_empty_slot (struct tr_fileset * set)
 {
-  struct tr_cached_file * cull = NULL;
+  struct tr_cached_file * o;
 
-  if (set->begin != NULL)
+  /* if all slots are full, recycle the least recently used */
+  if (set->free_list == NULL)
     {
-      struct tr_cached_file * o;
-
-      /* try to find an unused slot */
-      for (o=set->begin; o!=set->end; ++o)
-        if (!cached_file_is_open (o))
-          return o;
+      for (o=set->lru_tail; o!=NULL; o=o->lru_prev)
+        if (o->borrows == 0)
+          break;
 
-      /* all slots are full... recycle the least recently used */
-      for (cull=NULL, o=set->begin; o!=set->end; ++o)
-        if (!cull || o->used_at < cull->used_at)
-          cull = o;
+      if (o == NULL)
+        return NULL;
 
-      cached_file_close (cull);
+      fileset_close_file (set, o);
+      ++set->stats.evictions;
     }
 
-  return cull;
+  o = set->free_list;
+  set->free_list = o->hash_next;
+  o->hash_next = NULL;
+  return o;
 }
 
 /***
@@ -351,6 +517,8 @@ fileset_get_empty_slot (struct tr_fileset * set)
 struct tr_fdInfo
 {
   int peerCount;
+  tr_lock * lock; /* guards fileset */
+  tr_cond * opened; /* signaled when a reserved slot's file is done opening */
   struct tr_fileset fileset;
 };
 
@@ -366,6 +534,8 @@ ensureSessionFdInfoExists (tr_session * session)
 
       /* Create the local file cache */
       i = tr_new0 (struct tr_fdInfo, 1);
+      i->lock = tr_lockNew ();
+      i->opened = tr_condNew ();
       fileset_construct (&i->fileset, FILE_CACHE_SIZE);
       session->fdInfo = i;
 
@@ -395,6 +565,8 @@ tr_fdClose (tr_session * session)
     {
       struct tr_fdInfo * i = session->fdInfo;
       fileset_destruct (&i->fileset);
+      tr_condFree (i->opened);
+      tr_lockFree (i->lock);
       tr_free (i);
       session->fdInfo = NULL;
     }
@@ -414,32 +586,59 @@ get_fileset (tr_session * session)
   return &session->fdInfo->fileset;
 }
 
+static void
+fileset_lock (tr_session * session)
+{
+  ensureSessionFdInfoExists (session);
+  tr_lockLock (session->fdInfo->lock);
+}
+
+static void
+fileset_unlock (tr_session * session)
+{
+  tr_lockUnlock (session->fdInfo->lock);
+}
+
 void
 tr_fdFileClose (tr_session * s, const tr_torrent * tor, tr_file_index_t i)
 {
   struct tr_cached_file * o;
+  struct tr_fileset * set = get_fileset (s);
+
+  fileset_lock (s);
 
-  if ((o = fileset_lookup (get_fileset (s), tr_torrentId (tor), i)))
+  if ((o = fileset_lookup (set, tr_torrentId (tor), i)))
     {
       /* flush writable files so that their mtimes will be
        * up-to-date when this function returns to the caller... */
-      if (o->is_writable)
+      if (o->is_writable && !o->opening)
         tr_sys_file_flush (o->fd, NULL);
 
-      cached_file_close (o);
+      fileset_close_file (set, o);
     }
+
+  fileset_unlock (s);
 }
 
 tr_sys_file_t
 tr_fdFileGetCached (tr_session * s, int torrent_id, tr_file_index_t i, bool writable)
 {
-  struct tr_cached_file * o = fileset_lookup (get_fileset (s), torrent_id, i);
+  tr_sys_file_t fd = TR_BAD_SYS_FILE;
+  struct tr_fileset * set = get_fileset (s);
+  struct tr_cached_file * o;
 
-  if (!o || (writable && !o->is_writable))
-    return TR_BAD_SYS_FILE;
+  fileset_lock (s);
+
+  o = fileset_lookup (set, torrent_id, i);
+  if (o && !o->opening && (!writable || o->is_writable))
+    {
+      fileset_touch (set, o);
+      ++set->stats.hits;
+      fd = o->fd;
+    }
 
-  o->used_at = tr_time ();
-  return o->fd;
+  fileset_unlock (s);
+  return fd;
 }
 
 bool
@@ -447,11 +646,15 @@ tr_fdFileGetCachedMTime (tr_session * s, int torrent_id, tr_file_index_t i, time
 {
   bool success;
   tr_sys_path_info info;
-  struct tr_cached_file * o = fileset_lookup (get_fileset (s), torrent_id, i);
+  struct tr_cached_file * o;
 
-  if ((success = (o != NULL) && tr_sys_file_get_info (o->fd, &info, NULL)))
+  fileset_lock (s);
+
+  o = fileset_lookup (get_fileset (s), torrent_id, i);
+  if ((success = (o != NULL) && !o->opening && tr_sys_file_get_info (o->fd, &info, NULL)))
     *mtime = info.last_modified_at;
 
+  fileset_unlock (s);
   return success;
 }
 
@@ -460,10 +663,112 @@ tr_fdTorrentClose (tr_session * session, int torrent_id)
 {
   assert (tr_sessionIsLocked (session));
 
+  fileset_lock (session);
   fileset_close_torrent (get_fileset (session), torrent_id);
+  fileset_unlock (session);
 }
 
 /* returns an fd on success, or a TR_BAD_SYS_FILE on failure and sets errno */
+static tr_sys_file_t
+fileset_checkout (tr_session             * session,
+                  int                      torrent_id,
+                  tr_file_index_t          i,
+                  const char             * filename,
+                  bool                     writable,
+                  tr_preallocation_mode    allocation,
+                  uint64_t                 file_size,
+                  bool                     borrow)
+{
+  int err = 0;
+  tr_sys_file_t fd = TR_BAD_SYS_FILE;
+  struct tr_fileset * set = get_fileset (session);
+  struct tr_cached_file * o;
+
+  fileset_lock (session);
+
+  /* if another thread is opening this file, wait for it */
+  while (((o = fileset_lookup (set, torrent_id, i))) && o->opening)
+    tr_condWait (session->fdInfo->opened, session->fdInfo->lock);
+
+  if (o && writable && !o->is_writable)
+    {
+      fileset_close_file (set, o); /* close it so we can reopen in rw mode */
+      o = NULL;
+    }
+
+  if (o != NULL)
+    {
+      ++set->stats.hits;
+      fileset_touch (set, o);
+      ++o->borrows;
+    }
+  else if ((o = fileset_get_empty_slot (set)) == NULL)
+    {
+      ++set->stats.misses;
+      err = EMFILE;
+    }
+  else
+    {
+      ++set->stats.misses;
+
+      /* reserve the slot, then open the file without holding the lock,
+         so that a slow disk doesn't hold up everyone else's lookups */
+      o->is_writable = writable;
+      o->torrent_id = torrent_id;
+      o->file_index = i;
+      o->opening = true;
+      o->borrows = 1;
+      fileset_link (set, o);
+      fileset_unlock (session);
+
+      err = cached_file_open (&fd, filename, writable, allocation, file_size);
+
+      fileset_lock (session);
+      o->opening = false;
+      o->fd = fd;
+      tr_condBroadcast (session->fdInfo->opened);
+
+      if (err)
+        {
+          if (!o->close_pending)
+            fileset_unlink (set, o);
+          o->close_pending = true;
+          fileset_release (set, o);
+          o = NULL;
+        }
+      else
+        {
+          dbgmsg ("opened '%s' writable %c", filename, writable?'y':'n');
+        }
+    }
+
+  if (o != NULL)
+    {
+      dbgmsg ("checking out '%s'", filename);
+      fd = o->fd;
+
+      /* a plain checkout is a borrow that's returned at once. If the file
+         was closed while this was opening it, that's the end of it. */
+      if (!borrow)
+        {
+          if (o->close_pending)
+            {
+              fd = TR_BAD_SYS_FILE;
+              err = ECANCELED;
+            }
+
+          fileset_release (set, o);
+        }
+    }
+
+  fileset_unlock (session);
+
+  if (err)
+    errno = err;
+
+  return fd;
+}
+
 tr_sys_file_t
 tr_fdFileCheckout (tr_session             * session,
                    int                      torrent_id,
@@ -473,32 +778,40 @@ tr_fdFileCheckout (tr_session             * session,
                    tr_preallocation_mode    allocation,
                    uint64_t                 file_size)
 {
-  struct tr_fileset * set = get_fileset (session);
-  struct tr_cached_file * o = fileset_lookup (set, torrent_id, i);
+  return fileset_checkout (session, torrent_id, i, filename, writable, allocation, file_size, false);
+}
 
-  if (o && writable && !o->is_writable)
-    cached_file_close (o); /* close it so we can reopen in rw mode */
-  else if (!o)
-    o = fileset_get_empty_slot (set);
+tr_sys_file_t
+tr_fdFileBorrow (tr_session             * session,
+                 int                      torrent_id,
+                 tr_file_index_t          i,
+                 const char             * filename,
+                 bool                     writable,
+                 tr_preallocation_mode    allocation,
+                 uint64_t                 file_size)
+{
+  return fileset_checkout (session, torrent_id, i, filename, writable, allocation, file_size, true);
+}
 
-  if (!cached_file_is_open (o))
-    {
-      const int err = cached_file_open (o, filename, writable, allocation, file_size);
-      if (err)
-        {
-          errno = err;
-          return TR_BAD_SYS_FILE;
-        }
+void
+tr_fdFileReturn (tr_session       * session,
+                 int                torrent_id,
+                 tr_file_index_t    i,
+                 tr_sys_file_t      fd)
+{
+  struct tr_fileset * set = get_fileset (session);
 
-      dbgmsg ("opened '%s' writable %c", filename, writable?'y':'n');
-      o->is_writable = writable;
-    }
+  fileset_lock (session);
+  fileset_release (set, fileset_lookup_borrowed (set, torrent_id, i, fd));
+  fileset_unlock (session);
+}
 
-  dbgmsg ("checking out '%s'", filename);
-  o->torrent_id = torrent_id;
-  o->file_index = i;
-  o->used_at = tr_time ();
-  return o->fd;
+void
+tr_fdGetFileStats (tr_session * session, struct tr_fd_stats * setme)
+{
+  fileset_lock (session);
+  *setme = get_fileset (session)->stats;
+  fileset_unlock (session);
 }
 
 /***
@@ -30,6 +30,11 @@
  * continually opening and closing the same files when downloading
  * piece data.
  *
+ * The pool is locked, so it may be used from any thread. But another
+ * thread's checkout may close a returned fd as soon as this returns,
+ * so code running outside the libtransmission thread should use
+ * tr_fdFileBorrow () instead.
+ *
  * - if do_write is true, subfolders in torrentFile are created if necessary.
  * - if do_write is true, the target file is created if necessary.
  *
@@ -46,6 +51,24 @@ tr_sys_file_t  tr_fdFileCheckout (tr_session             * session,
                                   tr_preallocation_mode    preallocation_mode,
                                   uint64_t                 preallocation_file_size);
 
+/**
+ * Like tr_fdFileCheckout (), but the file is kept open until it's handed
+ * back with tr_fdFileReturn (), even if it's evicted or closed meanwhile.
+ * This is how threads other than the libtransmission thread use the pool.
+ */
+tr_sys_file_t  tr_fdFileBorrow (tr_session             * session,
+                                int                      torrent_id,
+                                tr_file_index_t          file_num,
+                                const char             * filename,
+                                bool                     do_write,
+                                tr_preallocation_mode    preallocation_mode,
+                                uint64_t                 preallocation_file_size);
+
+void           tr_fdFileReturn (tr_session             * session,
+                                int                      torrent_id,
+                                tr_file_index_t          file_num,
+                                tr_sys_file_t            fd);
+
 tr_sys_file_t tr_fdFileGetCached (tr_session             * session,
                                   int                      torrent_id,
                                   tr_file_index_t          file_num,
@@ -75,6 +98,17 @@ void tr_fdFileClose (tr_session        * session,
  */
 void tr_fdTorrentClose (tr_session * session, int torrentId);
 
+struct tr_fd_stats
+{
+  uint64_t hits;       /* lookups that found the file already open */
+  uint64_t misses;     /* checkouts that had to open the file */
+  uint64_t evictions;  /* files closed to make room for another */
+  int open_count;      /* how many files are open now */
+  int max_open;        /* how many files can be open at once */
+};
+
+void tr_fdGetFileStats (tr_session * session, struct tr_fd_stats * setme);
+
 
 /***********************************************************************
  * Sockets
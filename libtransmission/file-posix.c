@@ -34,6 +34,7 @@
 #include <sys/mman.h> /* mmap (), munmap () */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h> /* preadv (), pwritev () */
 #include <unistd.h> /* lseek (), write (), ftruncate (), pread (), pwrite (), pathconf (), etc */
 
 #ifdef HAVE_XFS_XFS_H
@@ -69,6 +70,12 @@
 #if defined (__UCLIBC__) && !TR_UCLIBC_CHECK_VERSION (0, 9, 28)
  #undef HAVE_PREAD
  #undef HAVE_PWRITE
+ #undef HAVE_PREADV
+ #undef HAVE_PWRITEV
+#endif
+
+#ifndef IOV_MAX
+ #define IOV_MAX 16
 #endif
 
 #ifdef __APPLE__
@@ -634,6 +641,73 @@ tr_sys_file_read_at (tr_sys_file_t    handle,
   return ret;
 }
 
+bool
+tr_sys_file_read_vec_at (tr_sys_file_t        handle,
+                         const tr_sys_iovec * vec,
+                         int                  vec_count,
+                         uint64_t             offset,
+                         uint64_t           * bytes_read,
+                         tr_error          ** error)
+{
+  bool ret = true;
+  uint64_t total = 0;
+
+  assert (handle != TR_BAD_SYS_FILE);
+  assert (vec != NULL || vec_count == 0);
+  /* seek requires signed offset, so it should be in mod range */
+  assert (offset < UINT64_MAX / 2);
+
+  while (ret && vec_count > 0)
+    {
+      uint64_t wanted = 0;
+      uint64_t my_bytes_read;
+
+#ifdef HAVE_PREADV
+
+      int i;
+      ssize_t n;
+      struct iovec iov[IOV_MAX];
+      const int count = MIN (vec_count, IOV_MAX);
+
+      for (i=0; i<count; ++i)
+        {
+          iov[i].iov_base = vec[i].base;
+          iov[i].iov_len = vec[i].len;
+          wanted += vec[i].len;
+        }
+
+      n = preadv (handle, iov, count, offset);
+      ret = n != -1;
+      my_bytes_read = ret ? (uint64_t) n : 0;
+
+      if (!ret)
+        set_system_error (error, errno);
+
+#else
+
+      const int count = 1;
+
+      wanted = vec[0].len;
+      ret = tr_sys_file_read_at (handle, vec[0].base, wanted, offset, &my_bytes_read, error);
+
+#endif
+
+      total += my_bytes_read;
+      offset += my_bytes_read;
+      vec += count;
+      vec_count -= count;
+
+      /* stop at end-of-file */
+      if (my_bytes_read < wanted)
+        break;
+    }
+
+  if (ret && bytes_read != NULL)
+    *bytes_read = total;
+
+  return ret;
+}
+
 bool
 tr_sys_file_write (tr_sys_file_t    handle,
                    const void     * buffer,
@@ -710,6 +784,73 @@ tr_sys_file_write_at (tr_sys_file_t    handle,
   return ret;
 }
 
+bool
+tr_sys_file_write_vec_at (tr_sys_file_t        handle,
+                          const tr_sys_iovec * vec,
+                          int                  vec_count,
+                          uint64_t             offset,
+                          uint64_t           * bytes_written,
+                          tr_error          ** error)
+{
+  bool ret = true;
+  uint64_t total = 0;
+
+  assert (handle != TR_BAD_SYS_FILE);
+  assert (vec != NULL || vec_count == 0);
+  /* seek requires signed offset, so it should be in mod range */
+  assert (offset < UINT64_MAX / 2);
+
+  while (ret && vec_count > 0)
+    {
+      uint64_t wanted = 0;
+      uint64_t my_bytes_written;
+
+#ifdef HAVE_PWRITEV
+
+      int i;
+      ssize_t n;
+      struct iovec iov[IOV_MAX];
+      const int count = MIN (vec_count, IOV_MAX);
+
+      for (i=0; i<count; ++i)
+        {
+          iov[i].iov_base = vec[i].base;
+          iov[i].iov_len = vec[i].len;
+          wanted += vec[i].len;
+        }
+
+      n = pwritev (handle, iov, count, offset);
+      ret = n != -1;
+      my_bytes_written = ret ? (uint64_t) n : 0;
+
+      if (!ret)
+        set_system_error (error, errno);
+
+#else
+
+      const int count = 1;
+
+      wanted = vec[0].len;
+      ret = tr_sys_file_write_at (handle, vec[0].base, wanted, offset, &my_bytes_written, error);
+
+#endif
+
+      total += my_bytes_written;
+      offset += my_bytes_written;
+      vec += count;
+      vec_count -= count;
+
+      /* like pwritev (), report a short write rather than retrying it */
+      if (my_bytes_written < wanted)
+        break;
+    }
+
+  if (ret && bytes_written != NULL)
+    *bytes_written = total;
+
+  return ret;
+}
+
 bool
 tr_sys_file_flush (tr_sys_file_t    handle,
                    tr_error      ** error)
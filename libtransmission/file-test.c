@@ -1053,6 +1053,7 @@ test_file_read_write_seek (void)
   tr_sys_file_t fd;
   uint64_t n;
   char buf[100];
+  tr_sys_iovec vec[2];
 
   path1 = tr_buildPath (test_dir, "a", NULL);
 
@@ -1126,6 +1127,25 @@ test_file_read_write_seek (void)
 
   check_int_eq (0, memcmp (buf, "st-ok", 5));
 
+  vec[0].base = (void *) "AB";
+  vec[0].len = 2;
+  vec[1].base = (void *) "CD";
+  vec[1].len = 2;
+  check (tr_sys_file_write_vec_at (fd, vec, 2, 1, &n, &err));
+  check (err == NULL);
+  check_uint_eq (4, n);
+
+  vec[0].base = buf;
+  vec[0].len = 3;
+  vec[1].base = buf + 50;
+  vec[1].len = 10;
+  check (tr_sys_file_read_vec_at (fd, vec, 2, 0, &n, &err));
+  check (err == NULL);
+  check_uint_eq (7, n);
+
+  check_int_eq (0, memcmp (buf, "tAB", 3));
+  check_int_eq (0, memcmp (buf + 50, "CDok", 4));
+
   tr_sys_file_close (fd, NULL);
 
   tr_sys_path_remove (path1, NULL);
@@ -935,6 +935,44 @@ tr_sys_file_read_at (tr_sys_file_t    handle,
   return ret;
 }
 
+bool
+tr_sys_file_read_vec_at (tr_sys_file_t        handle,
+                         const tr_sys_iovec * vec,
+                         int                  vec_count,
+                         uint64_t             offset,
+                         uint64_t           * bytes_read,
+                         tr_error          ** error)
+{
+  int i;
+  bool ret = true;
+  uint64_t total = 0;
+
+  assert (handle != TR_BAD_SYS_FILE);
+  assert (vec != NULL || vec_count == 0);
+
+  /* there's no ReadFileScatter () for unaligned, buffered i/o */
+  for (i=0; ret && i<vec_count; ++i)
+    {
+      uint64_t my_bytes_read;
+
+      ret = tr_sys_file_read_at (handle, vec[i].base, vec[i].len, offset, &my_bytes_read, error);
+
+      if (ret)
+        {
+          total += my_bytes_read;
+          offset += my_bytes_read;
+
+          if (my_bytes_read < vec[i].len)
+            break;
+        }
+    }
+
+  if (ret && bytes_read != NULL)
+    *bytes_read = total;
+
+  return ret;
+}
+
 bool
 tr_sys_file_write (tr_sys_file_t    handle,
                    const void     * buffer,
@@ -1008,6 +1046,44 @@ tr_sys_file_write_at (tr_sys_file_t    handle,
   return ret;
 }
 
+bool
+tr_sys_file_write_vec_at (tr_sys_file_t        handle,
+                          const tr_sys_iovec * vec,
+                          int                  vec_count,
+                          uint64_t             offset,
+                          uint64_t           * bytes_written,
+                          tr_error          ** error)
+{
+  int i;
+  bool ret = true;
+  uint64_t total = 0;
+
+  assert (handle != TR_BAD_SYS_FILE);
+  assert (vec != NULL || vec_count == 0);
+
+  /* there's no WriteFileGather () for unaligned, buffered i/o */
+  for (i=0; ret && i<vec_count; ++i)
+    {
+      uint64_t my_bytes_written;
+
+      ret = tr_sys_file_write_at (handle, vec[i].base, vec[i].len, offset, &my_bytes_written, error);
+
+      if (ret)
+        {
+          total += my_bytes_written;
+          offset += my_bytes_written;
+
+          if (my_bytes_written < vec[i].len)
+            break;
+        }
+    }
+
+  if (ret && bytes_written != NULL)
+    *bytes_written = total;
+
+  return ret;
+}
+
 bool
 tr_sys_file_flush (tr_sys_file_t    handle,
                    tr_error      ** error)
@@ -110,6 +110,14 @@ typedef struct tr_sys_path_info
 }
 tr_sys_path_info;
 
+/** @brief A buffer for vectored reads and writes, like POSIX `struct iovec`. */
+typedef struct tr_sys_iovec
+{
+  void   * base;
+  size_t   len;
+}
+tr_sys_iovec;
+
 /**
  * @name Platform-specific wrapper functions
  *
@@ -394,6 +402,28 @@ bool            tr_sys_file_read_at         (tr_sys_file_t        handle,
                                              uint64_t           * bytes_read,
                                              struct tr_error   ** error);
 
+/**
+ * @brief Like `preadv ()`, except that the position is undefined afterwards.
+ *        Not thread-safe.
+ *
+ * @param[in]  handle     Valid file descriptor.
+ * @param[in]  vec        Buffers to store read data to, in order.
+ * @param[in]  vec_count  Number of buffers in `vec`.
+ * @param[in]  offset     File offset in bytes to start reading from.
+ * @param[out] bytes_read Number of bytes actually read. Optional, pass `NULL`
+ *                        if you are not interested.
+ * @param[out] error      Pointer to error object. Optional, pass `NULL` if you
+ *                        are not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool            tr_sys_file_read_vec_at     (tr_sys_file_t        handle,
+                                             const tr_sys_iovec * vec,
+                                             int                  vec_count,
+                                             uint64_t             offset,
+                                             uint64_t           * bytes_read,
+                                             struct tr_error   ** error);
+
 /**
  * @brief Portability wrapper for `write ()`.
  *
@@ -435,6 +465,28 @@ bool            tr_sys_file_write_at        (tr_sys_file_t        handle,
                                              uint64_t           * bytes_written,
                                              struct tr_error   ** error);
 
+/**
+ * @brief Like `pwritev ()`, except that the position is undefined afterwards.
+ *        Not thread-safe.
+ *
+ * @param[in]  handle        Valid file descriptor.
+ * @param[in]  vec           Buffers to get data being written from, in order.
+ * @param[in]  vec_count     Number of buffers in `vec`.
+ * @param[in]  offset        File offset in bytes to start writing from.
+ * @param[out] bytes_written Number of bytes actually written. Optional, pass
+ *                           `NULL` if you are not interested.
+ * @param[out] error         Pointer to error object. Optional, pass `NULL` if
+ *                           you are not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool            tr_sys_file_write_vec_at    (tr_sys_file_t        handle,
+                                             const tr_sys_iovec * vec,
+                                             int                  vec_count,
+                                             uint64_t             offset,
+                                             uint64_t           * bytes_written,
+                                             struct tr_error   ** error);
+
 /**
  * @brief Portability wrapper for `fsync ()`.
  *
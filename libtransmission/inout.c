@@ -11,6 +11,12 @@
 #include <stdlib.h> /* bsearch () */
 #include <string.h> /* memcmp () */
 
+#ifndef _WIN32
+ #include <unistd.h> /* dup (), close () */
+#endif
+
+#include <event2/buffer.h>
+
 #include "transmission.h"
 #include "cache.h" /* tr_cacheReadBlock () */
 #include "crypto-utils.h"
@@ -18,6 +24,7 @@
 #include "fdlimit.h"
 #include "file.h"
 #include "inout.h"
+#include "io-queue.h"
 #include "log.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "stats.h" /* tr_statsFileCreated () */
@@ -32,36 +39,30 @@ enum
 {
   TR_IO_READ,
   TR_IO_PREFETCH,
+  TR_IO_SEND, /* buf is an evbuffer to append a file segment to */
   /* Any operations that require write access must follow TR_IO_WRITE. */
-  TR_IO_WRITE
+  TR_IO_WRITE,
+  TR_IO_OPEN /* buf is a span_list to append the file's span to */
 };
 
-/* returns 0 on success, or an errno on failure */
+struct span_list
+{
+  struct tr_io_span * spans;
+  int count;
+};
+
+/* finds the file's fd, opening (and maybe creating) the file if needed.
+   returns 0 on success, or an errno on failure */
 static int
-readOrWriteBytes (tr_session       * session,
-                  tr_torrent       * tor,
-                  int                ioMode,
-                  tr_file_index_t    fileIndex,
-                  uint64_t           fileOffset,
-                  void             * buf,
-                  size_t             buflen)
+getFile (tr_session       * session,
+         tr_torrent       * tor,
+         tr_file_index_t    fileIndex,
+         bool               doWrite,
+         tr_sys_file_t    * setme)
 {
   tr_sys_file_t fd;
   int err = 0;
-  const bool doWrite = ioMode >= TR_IO_WRITE;
-  const tr_info * const info = &tor->info;
-  const tr_file * const file = &info->files[fileIndex];
-
-  assert (fileIndex < info->fileCount);
-  assert (!file->length || (fileOffset < file->length));
-  assert (fileOffset + buflen <= file->length);
-
-  if (!file->length)
-    return 0;
-
-  /***
-  ****  Find the fd
-  ***/
+  const tr_file * const file = &tor->info.files[fileIndex];
 
   fd = tr_fdFileGetCached (session, tr_torrentId (tor), fileIndex, doWrite);
   if (fd == TR_BAD_SYS_FILE)
@@ -112,6 +113,35 @@ readOrWriteBytes (tr_session       * session,
       tr_free (subpath);
     }
 
+  *setme = fd;
+  return err;
+}
+
+/* returns 0 on success, or an errno on failure */
+static int
+readOrWriteBytes (tr_session       * session,
+                  tr_torrent       * tor,
+                  int                ioMode,
+                  tr_file_index_t    fileIndex,
+                  uint64_t           fileOffset,
+                  void             * buf,
+                  size_t             buflen)
+{
+  tr_sys_file_t fd;
+  int err;
+  const bool doWrite = ioMode >= TR_IO_WRITE;
+  const tr_info * const info = &tor->info;
+  const tr_file * const file = &info->files[fileIndex];
+
+  assert (fileIndex < info->fileCount);
+  assert (!file->length || (fileOffset < file->length));
+  assert (fileOffset + buflen <= file->length);
+
+  if (!file->length)
+    return 0;
+
+  err = getFile (session, tor, fileIndex, doWrite, &fd);
+
   /***
   ****  Use the fd
   ***/
@@ -120,27 +150,69 @@ readOrWriteBytes (tr_session       * session,
     {
       tr_error * error = NULL;
 
-      if (ioMode == TR_IO_READ)
+      if (ioMode == TR_IO_WRITE)
         {
-          if (!tr_sys_file_read_at (fd, buf, buflen, fileOffset, NULL, &error))
+          if (!tr_sys_file_write_at (fd, buf, buflen, fileOffset, NULL, &error))
             {
               err = error->code;
-              tr_logAddTorErr (tor, "read failed for \"%s\": %s", file->name, error->message);
+              tr_logAddTorErr (tor, "write failed for \"%s\": %s", file->name, error->message);
               tr_error_free (error);
             }
         }
-      else if (ioMode == TR_IO_WRITE)
+#ifdef TR_HAVE_FILE_SEGMENTS
+      else if (ioMode == TR_IO_SEND)
         {
-          if (!tr_sys_file_write_at (fd, buf, buflen, fileOffset, NULL, &error))
+          /* the fd cache may close fd at any time, so the segment gets its own */
+          const int segfd = dup (fd);
+          struct evbuffer_file_segment * seg = NULL;
+
+          if (segfd != -1)
+            seg = evbuffer_file_segment_new (segfd, fileOffset, buflen,
+                                             EVBUF_FS_CLOSE_ON_FREE | EVBUF_FS_DISABLE_LOCKING);
+
+          if (seg == NULL)
             {
-              err = error->code;
-              tr_logAddTorErr (tor, "write failed for \"%s\": %s", file->name, error->message);
-              tr_error_free (error);
+              err = errno;
+              if (segfd != -1)
+                close (segfd);
+            }
+          else
+            {
+              if (evbuffer_add_file_segment (buf, seg, 0, buflen) != 0)
+                err = EIO;
+              evbuffer_file_segment_free (seg); /* the evbuffer holds a reference */
             }
+
+          if (err)
+            tr_logAddTorErr (tor, "send failed for \"%s\": %s", file->name, tr_strerror (err));
         }
-      else if (ioMode == TR_IO_PREFETCH)
+#endif
+      else if (ioMode == TR_IO_OPEN)
         {
-          tr_sys_file_prefetch (fd, fileOffset, buflen, NULL);
+          /* the file exists now, so find where it is for the writer */
+          char * subpath;
+          const char * base;
+          struct span_list * list = buf;
+
+          if (!tr_torrentFindFile2 (tor, fileIndex, &base, &subpath, NULL))
+            {
+              err = ENOENT;
+            }
+          else
+            {
+              struct tr_io_span * span;
+
+              list->spans = tr_renew (struct tr_io_span, list->spans, list->count + 1);
+              span = &list->spans[list->count++];
+              span->torrent_id = tr_torrentId (tor);
+              span->file_index = fileIndex;
+              span->filename = tr_buildPath (base, subpath, NULL);
+              span->allocation = file->dnd ? TR_PREALLOCATE_NONE : session->preallocationMode;
+              span->file_size = file->length;
+              span->offset = fileOffset;
+              span->length = buflen;
+              tr_free (subpath);
+            }
         }
       else
         {
@@ -219,12 +291,13 @@ readOrWritePiece (tr_torrent       * tor,
       const uint64_t bytesThisPass = MIN (buflen, file->length - fileOffset);
 
       err = readOrWriteBytes (tor->session, tor, ioMode, fileIndex, fileOffset, buf, bytesThisPass);
-      buf += bytesThisPass;
+      if ((ioMode != TR_IO_SEND) && (ioMode != TR_IO_OPEN))
+        buf += bytesThisPass;
       buflen -= bytesThisPass;
       fileIndex++;
       fileOffset = 0;
 
-      if ((err != 0) && (ioMode == TR_IO_WRITE) && (tor->error != TR_STAT_LOCAL_ERROR))
+      if ((err != 0) && (ioMode >= TR_IO_WRITE) && (tor->error != TR_STAT_LOCAL_ERROR))
         {
           char * path = tr_buildPath (tor->downloadDir, file->name, NULL);
           tr_torrentSetLocalError (tor, "%s (%s)", tr_strerror (err), path);
@@ -235,6 +308,377 @@ readOrWritePiece (tr_torrent       * tor,
   return err;
 }
 
+/***
+****  Batched reads
+***/
+
+enum
+{
+  /* most batches are a handful of blocks; don't malloc for those */
+  STACK_SEGMENTS = 8
+};
+
+/* the part of an extent that falls in one file */
+struct io_segment
+{
+  tr_file_index_t   fileIndex;
+  uint64_t          fileOffset;
+  uint32_t          length;
+  uint8_t         * buf;
+};
+
+static int
+compareSegments (const void * va, const void * vb)
+{
+  const struct io_segment * a = va;
+  const struct io_segment * b = vb;
+
+  if (a->fileIndex != b->fileIndex)
+    return a->fileIndex < b->fileIndex ? -1 : 1;
+
+  if (a->fileOffset != b->fileOffset)
+    return a->fileOffset < b->fileOffset ? -1 : 1;
+
+  return 0;
+}
+
+/* reads or prefetches one file range made of segs[0..n-1] */
+static int
+readOrPrefetchSegments (tr_torrent                * tor,
+                        int                         ioMode,
+                        const struct io_segment   * segs,
+                        int                         n,
+                        tr_sys_iovec              * vec)
+{
+  int i;
+  int err;
+  tr_sys_file_t fd;
+  const tr_file * file = &tor->info.files[segs[0].fileIndex];
+  const uint64_t begin = segs[0].fileOffset;
+  uint64_t end = begin;
+
+  for (i=0; i<n; ++i)
+    end = MAX (end, segs[i].fileOffset + segs[i].length);
+
+  err = getFile (tor->session, tor, segs[0].fileIndex, false, &fd);
+
+  if (!err && (ioMode == TR_IO_READ))
+    {
+      tr_error * error = NULL;
+
+      for (i=0; i<n; ++i)
+        {
+          vec[i].base = segs[i].buf;
+          vec[i].len = segs[i].length;
+        }
+
+      if (!tr_sys_file_read_vec_at (fd, vec, n, begin, NULL, &error))
+        {
+          err = error->code;
+          tr_logAddTorErr (tor, "read failed for \"%s\": %s", file->name, error->message);
+          tr_error_free (error);
+        }
+    }
+  else if (!err && (ioMode == TR_IO_PREFETCH))
+    {
+      tr_sys_file_prefetch (fd, begin, end - begin, NULL);
+    }
+
+  return err;
+}
+
+/* splits the extents up at file boundaries, growing segs as needed.
+   returns the number of segments, or -1 if an extent is invalid */
+static int
+getSegments (const tr_torrent           * tor,
+             const struct tr_io_extent  * extents,
+             int                          extentCount,
+             struct io_segment         ** segs,
+             int                        * alloc,
+             struct io_segment          * stackSegs)
+{
+  int i;
+  int n = 0;
+  const tr_info * info = &tor->info;
+
+  for (i=0; i<extentCount; ++i)
+    {
+      const struct tr_io_extent * e = &extents[i];
+      uint8_t * buf = e->buf;
+      uint32_t buflen = e->length;
+      tr_file_index_t fileIndex;
+      uint64_t fileOffset;
+
+      if (e->piece >= info->pieceCount)
+        return -1;
+
+      tr_ioFindFileLocation (tor, e->piece, e->offset, &fileIndex, &fileOffset);
+
+      while (buflen)
+        {
+          const tr_file * file = &info->files[fileIndex];
+          const uint32_t bytesThisPass = MIN (buflen, file->length - fileOffset);
+
+          if (bytesThisPass > 0)
+            {
+              if (n == *alloc)
+                {
+                  struct io_segment * tmp = tr_new (struct io_segment, *alloc * 2);
+                  memcpy (tmp, *segs, sizeof (struct io_segment) * n);
+                  if (*segs != stackSegs)
+                    tr_free (*segs);
+                  *segs = tmp;
+                  *alloc *= 2;
+                }
+
+              (*segs)[n].fileIndex = fileIndex;
+              (*segs)[n].fileOffset = fileOffset;
+              (*segs)[n].length = bytesThisPass;
+              (*segs)[n].buf = buf;
+              ++n;
+            }
+
+          if (buf != NULL)
+            buf += bytesThisPass;
+          buflen -= bytesThisPass;
+          fileIndex++;
+          fileOffset = 0;
+        }
+    }
+
+  return n;
+}
+
+/* returns 0 on success, or an errno on failure */
+static int
+readOrPrefetchExtents (tr_torrent                 * tor,
+                       int                          ioMode,
+                       const struct tr_io_extent  * extents,
+                       int                          extentCount)
+{
+  int i;
+  int j;
+  int n;
+  int err = 0;
+  struct io_segment stackSegs[STACK_SEGMENTS];
+  tr_sys_iovec stackVec[STACK_SEGMENTS];
+  struct io_segment * segs = stackSegs;
+  tr_sys_iovec * vec = stackVec;
+  int alloc = STACK_SEGMENTS;
+
+  assert (ioMode == TR_IO_READ || ioMode == TR_IO_PREFETCH);
+
+  n = getSegments (tor, extents, extentCount, &segs, &alloc, stackSegs);
+  if (n < 0)
+    {
+      n = 0;
+      err = EINVAL;
+    }
+
+  if (n > 1)
+    qsort (segs, n, sizeof (struct io_segment), compareSegments);
+
+  if (n > STACK_SEGMENTS)
+    vec = tr_new (tr_sys_iovec, n);
+
+  /* one syscall for each run of segments that pick up where the last left off.
+     prefetches don't care about buffers, so they merge overlapping ranges too */
+  for (i=0; !err && i<n; i=j)
+    {
+      uint64_t end = segs[i].fileOffset + segs[i].length;
+
+      for (j=i+1; j<n; ++j)
+        {
+          if (segs[j].fileIndex != segs[i].fileIndex)
+            break;
+          if (ioMode == TR_IO_READ ? segs[j].fileOffset != end : segs[j].fileOffset > end)
+            break;
+          end = MAX (end, segs[j].fileOffset + segs[j].length);
+        }
+
+      err = readOrPrefetchSegments (tor, ioMode, segs + i, j - i, vec);
+    }
+
+  if (vec != stackVec)
+    tr_free (vec);
+  if (segs != stackSegs)
+    tr_free (segs);
+
+  return err;
+}
+
+int
+tr_ioReadExtents (tr_torrent                 * tor,
+                  const struct tr_io_extent  * extents,
+                  int                          extentCount)
+{
+  return readOrPrefetchExtents (tor, TR_IO_READ, extents, extentCount);
+}
+
+int
+tr_ioPrefetchExtents (tr_torrent                 * tor,
+                      const struct tr_io_extent  * extents,
+                      int                          extentCount)
+{
+  return readOrPrefetchExtents (tor, TR_IO_PREFETCH, extents, extentCount);
+}
+
+/***
+****  Asynchronous reads
+***/
+
+#ifndef _WIN32
+
+struct async_read
+{
+  int               pending; /* segments still in flight */
+  int               err;
+  tr_io_done_func   func;
+  void            * user_data;
+};
+
+struct async_segment
+{
+  struct async_read  * ar;
+  int                  fd;
+  uint32_t             length;
+};
+
+static void
+onSegmentRead (void * vseg, int err, size_t bytes)
+{
+  struct async_segment * seg = vseg;
+  struct async_read * ar = seg->ar;
+
+  /* a complete piece's files are never short, but check anyway */
+  if (!err && (bytes < seg->length))
+    err = EIO;
+
+  if (err && !ar->err)
+    {
+      ar->err = err;
+      tr_logAddError ("async read failed: %s", tr_strerror (err));
+    }
+
+  close (seg->fd);
+  tr_free (seg);
+
+  if (--ar->pending == 0)
+    {
+      ar->func (ar->user_data, ar->err);
+      tr_free (ar);
+    }
+}
+
+int
+tr_ioReadAsync (tr_torrent          * tor,
+                struct tr_io_queue  * queue,
+                tr_piece_index_t      pieceIndex,
+                uint32_t              begin,
+                uint32_t              len,
+                uint8_t             * buf,
+                tr_io_done_func       func,
+                void                * user_data)
+{
+  int i;
+  int n;
+  int err = 0;
+  int * fds;
+  struct async_read * ar;
+  struct io_segment stackSegs[STACK_SEGMENTS];
+  struct io_segment * segs = stackSegs;
+  int alloc = STACK_SEGMENTS;
+  const struct tr_io_extent extent = { pieceIndex, begin, len, buf };
+
+  if (queue == NULL)
+    return ENOSYS;
+
+  n = getSegments (tor, &extent, 1, &segs, &alloc, stackSegs);
+  if (n <= 0)
+    return EINVAL;
+
+  /* open all the files first, so that nothing is in flight if one fails.
+     the fd cache may close its fds at any time, so the reads get their own */
+  fds = tr_new (int, n);
+  for (i=0; !err && i<n; ++i)
+    {
+      tr_sys_file_t fd;
+
+      if (!(err = getFile (tor->session, tor, segs[i].fileIndex, false, &fd)))
+        if ((fds[i] = dup (fd)) == -1)
+          err = errno;
+    }
+
+  if (err)
+    {
+      for (i=i-2; i>=0; --i)
+        close (fds[i]);
+    }
+  else
+    {
+      ar = tr_new0 (struct async_read, 1);
+      ar->pending = n;
+      ar->func = func;
+      ar->user_data = user_data;
+
+      for (i=0; i<n; ++i)
+        {
+          int qerr = ar->err;
+          struct async_segment * seg = tr_new (struct async_segment, 1);
+
+          seg->ar = ar;
+          seg->fd = fds[i];
+          seg->length = segs[i].length;
+
+          if (!qerr)
+            qerr = tr_ioQueueRead (queue, seg->fd, segs[i].buf, segs[i].length,
+                                   segs[i].fileOffset, onSegmentRead, seg);
+
+          if (qerr)
+            {
+              close (seg->fd);
+              tr_free (seg);
+              --ar->pending;
+              ar->err = qerr;
+            }
+        }
+
+      /* if nothing got queued, the callback will never come */
+      if (ar->pending == 0)
+        {
+          err = ar->err;
+          tr_free (ar);
+        }
+    }
+
+  tr_free (fds);
+  if (segs != stackSegs)
+    tr_free (segs);
+
+  return err;
+}
+
+#else /* _WIN32 */
+
+int
+tr_ioReadAsync (tr_torrent          * tor UNUSED,
+                struct tr_io_queue  * queue UNUSED,
+                tr_piece_index_t      pieceIndex UNUSED,
+                uint32_t              begin UNUSED,
+                uint32_t              len UNUSED,
+                uint8_t             * buf UNUSED,
+                tr_io_done_func       func UNUSED,
+                void                * user_data UNUSED)
+{
+  return ENOSYS;
+}
+
+#endif /* _WIN32 */
+
+/***
+****
+***/
+
 int
 tr_ioRead (tr_torrent       * tor,
            tr_piece_index_t   pieceIndex,
@@ -242,7 +686,31 @@ tr_ioRead (tr_torrent       * tor,
            uint32_t           len,
            uint8_t          * buf)
 {
-  return readOrWritePiece (tor, TR_IO_READ, pieceIndex, begin, buf, len);
+  const struct tr_io_extent extent = { pieceIndex, begin, len, buf };
+
+  return tr_ioReadExtents (tor, &extent, 1);
+}
+
+int
+tr_ioReadToBuffer (tr_torrent       * tor,
+                   tr_piece_index_t   pieceIndex,
+                   uint32_t           begin,
+                   uint32_t           len,
+                   struct evbuffer  * out)
+{
+#ifdef TR_HAVE_FILE_SEGMENTS
+  return readOrWritePiece (tor, TR_IO_SEND, pieceIndex, begin, (uint8_t*)out, len);
+#else
+  int err;
+  struct evbuffer_iovec iovec[1];
+
+  evbuffer_reserve_space (out, len, iovec, 1);
+  err = tr_ioRead (tor, pieceIndex, begin, len, iovec[0].iov_base);
+  iovec[0].iov_len = err ? 0 : len;
+  evbuffer_commit_space (out, iovec, 1);
+
+  return err;
+#endif
 }
 
 int
@@ -251,7 +719,9 @@ tr_ioPrefetch (tr_torrent       * tor,
                uint32_t           begin,
                uint32_t           len)
 {
-  return readOrWritePiece (tor, TR_IO_PREFETCH, pieceIndex, begin, NULL, len);
+  const struct tr_io_extent extent = { pieceIndex, begin, len, NULL };
+
+  return tr_ioPrefetchExtents (tor, &extent, 1);
 }
 
 int
@@ -264,6 +734,115 @@ tr_ioWrite (tr_torrent       * tor,
   return readOrWritePiece (tor, TR_IO_WRITE, pieceIndex, begin, (uint8_t*)buf, len);
 }
 
+int
+tr_ioPrepareWrite (tr_torrent          * tor,
+                   tr_piece_index_t      pieceIndex,
+                   uint32_t              begin,
+                   uint32_t              len,
+                   struct tr_io_span  ** setme,
+                   int                 * setmeCount)
+{
+  int err;
+  struct span_list list = { NULL, 0 };
+
+  err = readOrWritePiece (tor, TR_IO_OPEN, pieceIndex, begin, (uint8_t*)&list, len);
+
+  if (err)
+    {
+      tr_ioFreeSpans (list.spans, list.count);
+      list.spans = NULL;
+      list.count = 0;
+    }
+
+  *setme = list.spans;
+  *setmeCount = list.count;
+  return err;
+}
+
+int
+tr_ioWriteSpans (tr_session                  * session,
+                 const struct tr_io_span     * spans,
+                 int                           spanCount,
+                 const struct evbuffer_iovec * iov,
+                 int                           iovCount)
+{
+  int i;
+  int err = 0;
+  size_t iovUsed = 0; /* how much of iov[0] has been written */
+  tr_sys_iovec * vec = tr_new (tr_sys_iovec, iovCount + spanCount);
+
+  for (i=0; !err && i<spanCount; ++i)
+    {
+      tr_sys_file_t fd;
+      tr_error * error = NULL;
+      const struct tr_io_span * span = &spans[i];
+      uint64_t left = span->length;
+      int n = 0;
+
+      /* gather this span's slices of the buffers; a buffer may straddle two files */
+      while (left > 0)
+        {
+          const size_t len = MIN (iov->iov_len - iovUsed, left);
+
+          assert (iovCount > 0);
+
+          vec[n].base = (uint8_t*)iov->iov_base + iovUsed;
+          vec[n].len = len;
+          ++n;
+
+          left -= len;
+          iovUsed += len;
+
+          if (iovUsed == iov->iov_len)
+            {
+              ++iov;
+              --iovCount;
+              iovUsed = 0;
+            }
+        }
+
+      fd = tr_fdFileBorrow (session, span->torrent_id, span->file_index, span->filename,
+                            true, span->allocation, span->file_size);
+
+      if (fd == TR_BAD_SYS_FILE)
+        {
+          tr_error_set_literal (&error, errno, tr_strerror (errno));
+        }
+      else
+        {
+          uint64_t written;
+
+          /* write straight out of the buffers with a single syscall */
+          if (tr_sys_file_write_vec_at (fd, vec, n, span->offset, &written, &error) && (written < span->length))
+            tr_error_set_literal (&error, EIO, tr_strerror (EIO));
+
+          tr_fdFileReturn (session, span->torrent_id, span->file_index, fd);
+        }
+
+      if (error != NULL)
+        {
+          err = error->code;
+          tr_logAddError ("write failed for \"%s\": %s", span->filename, error->message);
+          tr_error_free (error);
+        }
+    }
+
+  tr_free (vec);
+  return err;
+}
+
+void
+tr_ioFreeSpans (struct tr_io_span * spans,
+                int                 spanCount)
+{
+  int i;
+
+  for (i=0; i<spanCount; ++i)
+    tr_free (spans[i].filename);
+
+  tr_free (spans);
+}
+
 /****
 *****
 ****/
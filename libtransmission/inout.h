@@ -12,8 +12,18 @@
 
 #pragma once
 
+#include <event2/event.h> /* LIBEVENT_VERSION_NUMBER */
+
+struct evbuffer;
+struct evbuffer_iovec;
+struct tr_io_queue;
 struct tr_torrent;
 
+/* libevent 2.1 can hand file ranges straight to sendfile () */
+#if LIBEVENT_VERSION_NUMBER >= 0x02010000 && !defined (_WIN32)
+ #define TR_HAVE_FILE_SEGMENTS
+#endif
+
 /**
  * @addtogroup file_io File IO
  * @{
@@ -29,11 +39,72 @@ int tr_ioRead (struct tr_torrent   * tor,
                uint32_t              len,
                uint8_t             * setme);
 
+/**
+ * Appends the block specified by the piece index, offset, and length to @a out.
+ * Where supported this adds a reference to the file range instead of reading it,
+ * so @a out's contents must not be modified in place (e.g. encrypted).
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioReadToBuffer (struct tr_torrent   * tor,
+                       tr_piece_index_t      pieceIndex,
+                       uint32_t              offset,
+                       uint32_t              len,
+                       struct evbuffer     * out);
+
 int tr_ioPrefetch (tr_torrent       * tor,
                    tr_piece_index_t   pieceIndex,
                    uint32_t           begin,
                    uint32_t           len);
 
+/**
+ * A block of a torrent for batched i/o.
+ */
+struct tr_io_extent
+{
+  tr_piece_index_t   piece;
+  uint32_t           offset;
+  uint32_t           length;
+  uint8_t          * buf; /* where to read the block to. unused by prefetches */
+};
+
+/**
+ * Reads several blocks at once. The extents are sorted by file position,
+ * and ones that are next to each other on disk are read with a single
+ * vectored read.
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioReadExtents (struct tr_torrent          * tor,
+                      const struct tr_io_extent  * extents,
+                      int                          extentCount);
+
+/**
+ * Like tr_ioReadExtents (), but only hints to the OS that the blocks
+ * will be read soon. Adjacent and overlapping extents are merged.
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioPrefetchExtents (struct tr_torrent          * tor,
+                          const struct tr_io_extent  * extents,
+                          int                          extentCount);
+
+typedef void (*tr_io_done_func) (void * user_data, int err);
+
+/**
+ * Starts reading the block specified by the piece index, offset, and
+ * length into @a buf without blocking. When the read finishes, @a func is
+ * called from the libtransmission thread with 0 or an errno value.
+ * The torrent may be freed before then, but @a buf must stay valid.
+ * @return 0 if the read was started, or an errno value if it wasn't
+ *         (e.g. @a queue is NULL), in which case @a func won't be called.
+ */
+int tr_ioReadAsync (struct tr_torrent   * tor,
+                    struct tr_io_queue  * queue,
+                    tr_piece_index_t      pieceIndex,
+                    uint32_t              offset,
+                    uint32_t              len,
+                    uint8_t             * buf,
+                    tr_io_done_func       func,
+                    void                * user_data);
+
 /**
  * Writes the block specified by the piece index, offset, and length.
  * @return 0 on success, or an errno value on failure.
@@ -44,6 +115,50 @@ int tr_ioWrite (struct tr_torrent  * tor,
                 uint32_t             len,
                 const uint8_t      * writeme);
 
+/**
+ * A range of one file, for writes that are finished off of the
+ * libtransmission thread.
+ */
+struct tr_io_span
+{
+  int                     torrent_id;
+  tr_file_index_t         file_index;
+  char                  * filename;
+  tr_preallocation_mode   allocation; /* in case the file must be reopened */
+  uint64_t                file_size;
+  uint64_t                offset;
+  uint32_t                length;
+};
+
+/**
+ * Creates the files that the specified piece index, offset, and length
+ * fall in and returns the spans that they cover, for tr_ioWriteSpans ().
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioPrepareWrite (struct tr_torrent   * tor,
+                       tr_piece_index_t      pieceIndex,
+                       uint32_t              offset,
+                       uint32_t              len,
+                       struct tr_io_span  ** setme,
+                       int                 * setmeCount);
+
+/**
+ * Writes the buffers in iov, one after the other, across spans from
+ * tr_ioPrepareWrite (). They must add up to the spans' total length.
+ * Each span is written with a single vectored write.
+ * Since it borrows its files from the fd cache, this is safe to call
+ * from any thread.
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioWriteSpans (tr_session                  * session,
+                     const struct tr_io_span     * spans,
+                     int                           spanCount,
+                     const struct evbuffer_iovec * iov,
+                     int                           iovCount);
+
+void tr_ioFreeSpans (struct tr_io_span * spans,
+                     int                 spanCount);
+
 /**
  * @brief Test to see if the piece matches its metainfo's SHA1 checksum.
  */
@@ -0,0 +1,122 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memcmp () */
+
+#include <event2/event.h>
+
+#include "transmission.h"
+#include "file.h"
+#include "io-queue.h"
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+struct read_result
+{
+  int done;
+  int err;
+  size_t bytes;
+};
+
+static void
+onRead (void * vresult, int err, size_t bytes)
+{
+  struct read_result * result = vresult;
+
+  ++result->done;
+  result->err = err;
+  result->bytes = bytes;
+}
+
+static void
+waitForReads (struct event_base * base, const tr_io_queue * q)
+{
+  int i;
+  const struct timeval tenth_sec = { 0, 100000 };
+
+  for (i=0; i<50 && tr_ioQueueGetPending (q) > 0; ++i)
+    {
+      event_base_loopexit (base, &tenth_sec);
+      event_base_dispatch (base);
+    }
+}
+
+static int
+test_read (void)
+{
+  int i;
+  char * sandbox;
+  char * path;
+  tr_sys_file_t fd;
+  tr_io_queue * q;
+  char bufs[3][8];
+  struct read_result results[3];
+  struct event_base * base = event_base_new ();
+
+  /* this build or kernel may not support it */
+  q = tr_ioQueueNew (base);
+  if (q == NULL)
+    {
+      event_base_free (base);
+      return 0;
+    }
+
+  sandbox = libtest_sandbox_create ();
+  path = tr_buildPath (sandbox, "a.txt", NULL);
+  libtest_create_file_with_string_contents (path, "hello, world");
+  fd = tr_sys_file_open (path, TR_SYS_FILE_READ, 0, NULL);
+  check (fd != TR_BAD_SYS_FILE);
+
+  memset (results, 0, sizeof (results));
+  check_int_eq (0, tr_ioQueueRead (q, fd, bufs[0], 5, 0, onRead, &results[0]));
+  check_int_eq (0, tr_ioQueueRead (q, fd, bufs[1], 5, 7, onRead, &results[1]));
+  check_int_eq (0, tr_ioQueueRead (q, fd, bufs[2], 8, 10, onRead, &results[2])); /* short read */
+
+  /* nothing is reported until the event loop runs */
+  for (i=0; i<3; ++i)
+    check_int_eq (0, results[i].done);
+
+  waitForReads (base, q);
+  check_int_eq (0, tr_ioQueueGetPending (q));
+
+  for (i=0; i<3; ++i)
+    {
+      check_int_eq (1, results[i].done);
+      check_int_eq (0, results[i].err);
+    }
+  check_uint_eq (5, results[0].bytes);
+  check_uint_eq (5, results[1].bytes);
+  check_uint_eq (2, results[2].bytes);
+  check (memcmp (bufs[0], "hello", 5) == 0);
+  check (memcmp (bufs[1], "world", 5) == 0);
+  check (memcmp (bufs[2], "ld", 2) == 0);
+
+  /* freeing the queue finishes any reads that are in flight */
+  memset (results, 0, sizeof (results));
+  check_int_eq (0, tr_ioQueueRead (q, fd, bufs[0], 5, 0, onRead, &results[0]));
+  tr_ioQueueFree (q);
+  check_int_eq (1, results[0].done);
+  check_uint_eq (5, results[0].bytes);
+
+  tr_sys_file_close (fd, NULL);
+  tr_sys_path_remove (path, NULL);
+  tr_free (path);
+  libtest_sandbox_destroy (sandbox);
+  tr_free (sandbox);
+  event_base_free (base);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_read };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
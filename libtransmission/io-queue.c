@@ -0,0 +1,378 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <errno.h>
+
+#ifdef WITH_IO_URING
+ #include <string.h> /* memset () */
+ #include <linux/io_uring.h>
+ #include <sys/eventfd.h>
+ #include <sys/mman.h>
+ #include <sys/syscall.h>
+ #include <sys/uio.h> /* struct iovec */
+ #include <unistd.h>
+
+ #include <event2/event.h>
+#endif
+
+#include "transmission.h"
+#include "io-queue.h"
+#include "log.h"
+#include "utils.h"
+
+#ifdef WITH_IO_URING
+
+#define MY_NAME "io_uring"
+
+enum
+{
+  /* how many reads can be submitted at once */
+  QUEUE_DEPTH = 256
+};
+
+struct io_request
+{
+  struct iovec iov;
+  tr_io_queue_func func;
+  void * user_data;
+};
+
+struct tr_io_queue
+{
+  int ring_fd;
+  int event_fd;
+  struct event * event;
+
+  /* the submission ring */
+  void * sq_ring;
+  size_t sq_ring_size;
+  unsigned * sq_head;
+  unsigned * sq_tail;
+  unsigned * sq_mask;
+  unsigned * sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe * sqes;
+
+  /* the completion ring. this may share a mapping with the submission ring */
+  void * cq_ring;
+  size_t cq_ring_size;
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned * cq_mask;
+  unsigned cq_entries;
+  struct io_uring_cqe * cqes;
+
+  int unsubmitted; /* in the submission ring, but not yet taken by the kernel */
+  int pending;     /* submitted, but not yet reaped */
+};
+
+/***
+****
+***/
+
+static int
+ioUringSetup (unsigned entries, struct io_uring_params * params)
+{
+  return syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int
+ioUringEnter (int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+  return syscall (__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int
+ioUringRegister (int fd, unsigned opcode, const void * arg, unsigned nr_args)
+{
+  return syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* hand any queued submissions to the kernel, and maybe wait for a completion */
+static int
+submit (tr_io_queue * q, unsigned minComplete)
+{
+  int n;
+  const unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+  do
+    n = ioUringEnter (q->ring_fd, q->unsubmitted, minComplete, flags);
+  while ((n == -1) && (errno == EINTR));
+
+  if (n == -1)
+    return errno;
+
+  q->unsubmitted -= n;
+  return 0;
+}
+
+static void
+reapCompletions (tr_io_queue * q)
+{
+  unsigned head = *q->cq_head;
+
+  for (;;)
+    {
+      struct io_request * req;
+      const struct io_uring_cqe * cqe;
+      int res;
+
+      if (head == __atomic_load_n (q->cq_tail, __ATOMIC_ACQUIRE))
+        break;
+
+      cqe = &q->cqes[head & *q->cq_mask];
+      req = (struct io_request *) (uintptr_t) cqe->user_data;
+      res = cqe->res;
+
+      /* give the slot back before the callback, which may queue more reads */
+      __atomic_store_n (q->cq_head, ++head, __ATOMIC_RELEASE);
+      --q->pending;
+
+      if (res < 0)
+        req->func (req->user_data, -res, 0);
+      else
+        req->func (req->user_data, 0, res);
+
+      tr_free (req);
+      head = *q->cq_head;
+    }
+}
+
+static void
+onCompletions (evutil_socket_t fd, short what UNUSED, void * vq)
+{
+  uint64_t count;
+  tr_io_queue * q = vq;
+
+  /* clear the eventfd's counter */
+  if (read (fd, &count, sizeof (count)) == -1)
+    {
+      /* EAGAIN: a previous pass already got them */
+    }
+
+  if (q->unsubmitted > 0)
+    submit (q, 0);
+
+  reapCompletions (q);
+}
+
+static void
+unmapRings (tr_io_queue * q)
+{
+  if (q->sqes != NULL && q->sqes != MAP_FAILED)
+    munmap (q->sqes, q->sq_entries * sizeof (struct io_uring_sqe));
+  if (q->cq_ring != NULL && q->cq_ring != MAP_FAILED && q->cq_ring != q->sq_ring)
+    munmap (q->cq_ring, q->cq_ring_size);
+  if (q->sq_ring != NULL && q->sq_ring != MAP_FAILED)
+    munmap (q->sq_ring, q->sq_ring_size);
+}
+
+static bool
+mapRings (tr_io_queue * q, const struct io_uring_params * p)
+{
+  uint8_t * sq;
+  uint8_t * cq;
+
+  q->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof (unsigned);
+  q->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof (struct io_uring_cqe);
+
+  if (p->features & IORING_FEAT_SINGLE_MMAP)
+    q->sq_ring_size = q->cq_ring_size = MAX (q->sq_ring_size, q->cq_ring_size);
+
+  q->sq_ring = mmap (NULL, q->sq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQ_RING);
+  if (q->sq_ring == MAP_FAILED)
+    return false;
+
+  if (p->features & IORING_FEAT_SINGLE_MMAP)
+    q->cq_ring = q->sq_ring;
+  else
+    q->cq_ring = mmap (NULL, q->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_CQ_RING);
+  if (q->cq_ring == MAP_FAILED)
+    return false;
+
+  q->sqes = mmap (NULL, p->sq_entries * sizeof (struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQES);
+  if (q->sqes == MAP_FAILED)
+    return false;
+
+  sq = q->sq_ring;
+  q->sq_head = (unsigned *) (sq + p->sq_off.head);
+  q->sq_tail = (unsigned *) (sq + p->sq_off.tail);
+  q->sq_mask = (unsigned *) (sq + p->sq_off.ring_mask);
+  q->sq_array = (unsigned *) (sq + p->sq_off.array);
+  q->sq_entries = p->sq_entries;
+
+  cq = q->cq_ring;
+  q->cq_head = (unsigned *) (cq + p->cq_off.head);
+  q->cq_tail = (unsigned *) (cq + p->cq_off.tail);
+  q->cq_mask = (unsigned *) (cq + p->cq_off.ring_mask);
+  q->cqes = (struct io_uring_cqe *) (cq + p->cq_off.cqes);
+  q->cq_entries = p->cq_entries;
+
+  return true;
+}
+
+tr_io_queue *
+tr_ioQueueNew (struct event_base * base)
+{
+  tr_io_queue * q;
+  struct io_uring_params params;
+
+  if (tr_env_key_exists ("TR_DISABLE_IO_URING"))
+    return NULL;
+
+  q = tr_new0 (tr_io_queue, 1);
+  q->event_fd = -1;
+
+  memset (&params, 0, sizeof (params));
+  q->ring_fd = ioUringSetup (QUEUE_DEPTH, &params);
+
+  if ((q->ring_fd == -1)
+      || !mapRings (q, &params)
+      || ((q->event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+      || (ioUringRegister (q->ring_fd, IORING_REGISTER_EVENTFD, &q->event_fd, 1) == -1))
+    {
+      tr_logAddNamedInfo (MY_NAME, "Not using asynchronous disk reads: %s", tr_strerror (errno));
+      unmapRings (q);
+      if (q->event_fd != -1)
+        close (q->event_fd);
+      if (q->ring_fd != -1)
+        close (q->ring_fd);
+      tr_free (q);
+      return NULL;
+    }
+
+  q->event = event_new (base, q->event_fd, EV_READ | EV_PERSIST, onCompletions, q);
+  event_add (q->event, NULL);
+
+  tr_logAddNamedDbg (MY_NAME, "Using asynchronous disk reads (queue depth %u)", q->sq_entries);
+  return q;
+}
+
+void
+tr_ioQueueFree (tr_io_queue * q)
+{
+  int err = 0;
+
+  if (q == NULL)
+    return;
+
+  /* the callbacks own their buffers, so let every read finish */
+  while ((q->pending > 0) && !(err = submit (q, 1)))
+    reapCompletions (q);
+
+  if (q->pending > 0)
+    tr_logAddNamedError (MY_NAME, "Leaving %d reads unfinished: %s", q->pending, tr_strerror (err));
+
+  event_free (q->event);
+  unmapRings (q);
+  close (q->event_fd);
+  close (q->ring_fd);
+  tr_free (q);
+}
+
+int
+tr_ioQueueRead (tr_io_queue       * q,
+                tr_sys_file_t       fd,
+                void              * buf,
+                size_t              len,
+                uint64_t            offset,
+                tr_io_queue_func    func,
+                void              * user_data)
+{
+  int err;
+  unsigned tail;
+  unsigned index;
+  struct io_uring_sqe * sqe;
+  struct io_request * req;
+
+  /* don't let completions outnumber the completion ring */
+  if (q->pending >= (int) MIN (q->sq_entries, q->cq_entries))
+    return EAGAIN;
+
+  req = tr_new (struct io_request, 1);
+  req->iov.iov_base = buf;
+  req->iov.iov_len = len;
+  req->func = func;
+  req->user_data = user_data;
+
+  /* IORING_OP_READV rather than IORING_OP_READ, which needs Linux 5.6 */
+  tail = *q->sq_tail;
+  index = tail & *q->sq_mask;
+  sqe = &q->sqes[index];
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->off = offset;
+  sqe->addr = (uintptr_t) &req->iov;
+  sqe->len = 1;
+  sqe->user_data = (uintptr_t) req;
+  q->sq_array[index] = index;
+  __atomic_store_n (q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  ++q->unsubmitted;
+  ++q->pending;
+
+  /* the kernel takes entries in order, so if any are left over, this one
+     is too. onCompletions () only retries when some other read finishes,
+     which may never happen, so take it back and let the caller read it
+     some other way. the kernel doesn't look at the ring between calls,
+     so it's safe to rewind the tail */
+  err = submit (q, 0);
+  if (q->unsubmitted > 0)
+    {
+      __atomic_store_n (q->sq_tail, tail, __ATOMIC_RELEASE);
+      --q->unsubmitted;
+      --q->pending;
+      tr_free (req);
+      return err ? err : EAGAIN;
+    }
+
+  return 0;
+}
+
+int
+tr_ioQueueGetPending (const tr_io_queue * q)
+{
+  return q->pending;
+}
+
+#else /* WITH_IO_URING */
+
+tr_io_queue *
+tr_ioQueueNew (struct event_base * base UNUSED)
+{
+  return NULL;
+}
+
+void
+tr_ioQueueFree (tr_io_queue * q UNUSED)
+{
+}
+
+int
+tr_ioQueueRead (tr_io_queue       * q UNUSED,
+                tr_sys_file_t       fd UNUSED,
+                void              * buf UNUSED,
+                size_t              len UNUSED,
+                uint64_t            offset UNUSED,
+                tr_io_queue_func    func UNUSED,
+                void              * user_data UNUSED)
+{
+  return ENOSYS;
+}
+
+int
+tr_ioQueueGetPending (const tr_io_queue * q UNUSED)
+{
+  return 0;
+}
+
+#endif /* WITH_IO_URING */
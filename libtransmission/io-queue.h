@@ -0,0 +1,65 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#pragma once
+
+#include "file.h" /* tr_sys_file_t */
+
+struct event_base;
+
+/**
+ * An asynchronous disk read queue.
+ *
+ * Reads are handed to the kernel (via io_uring on Linux) and their
+ * callbacks are invoked from the event loop when they finish, so that
+ * a slow disk doesn't stall the libtransmission thread.
+ *
+ * Where that's not available, tr_ioQueueNew () returns NULL and callers
+ * should fall back to the blocking tr_sys_file_* () functions.
+ */
+
+typedef struct tr_io_queue tr_io_queue;
+
+/**
+ * @param err 0 on success, or an errno value on failure
+ * @param bytes how many bytes were read. This is short at end-of-file.
+ */
+typedef void (*tr_io_queue_func) (void * user_data, int err, size_t bytes);
+
+/**
+ * @return a new queue, or NULL if asynchronous i/o isn't supported
+ *         by this build or by the running kernel, or if it has been
+ *         turned off by the TR_DISABLE_IO_URING environment variable
+ */
+tr_io_queue * tr_ioQueueNew (struct event_base * base);
+
+/** @brief free the queue, waiting for (and running the callbacks of) any reads in flight */
+void tr_ioQueueFree (tr_io_queue * q);
+
+/**
+ * @brief queue a read of @a len bytes at @a offset in @a fd into @a buf.
+ *
+ * @a fd and @a buf must stay valid until @a func is called.
+ * @return 0 if the read was queued, or an errno value if it wasn't,
+ *         such as EAGAIN if the queue or the kernel is too busy to take it.
+ *         @a func won't be called then.
+ */
+int tr_ioQueueRead (tr_io_queue       * q,
+                    tr_sys_file_t       fd,
+                    void              * buf,
+                    size_t              len,
+                    uint64_t            offset,
+                    tr_io_queue_func    func,
+                    void              * user_data);
+
+/** @brief how many reads are in flight */
+int tr_ioQueueGetPending (const tr_io_queue * q);
@@ -10,6 +10,8 @@
 
 #include <locale.h> /* setlocale() */
 
+#include <event2/buffer.h>
+
 #define __LIBTRANSMISSION_VARIANT_MODULE__
 #include "transmission.h"
 #include "utils.h" /* tr_free */
@@ -222,6 +224,55 @@ test_unescape (void)
     return 0;
 }
 
+static int
+test_writer (void)
+{
+    size_t len;
+    char * str;
+    int64_t i;
+    tr_variant top;
+    tr_variant val;
+    tr_variant * list;
+    struct evbuffer * buf = evbuffer_new ();
+    tr_json_writer * w = tr_jsonWriterNew (buf);
+
+    tr_variantInitList (&val, 2);
+    tr_variantListAddInt (&val, 1);
+    tr_variantListAddStr (&val, "two");
+
+    tr_jsonWriterDictBegin (w);
+    tr_jsonWriterKey (w, TR_KEY_id);
+    tr_jsonWriterInt (w, 42);
+    tr_jsonWriterKey (w, TR_KEY_name);
+    tr_jsonWriterStr (w, "a \"quoted\"\nname");
+    tr_jsonWriterKey (w, TR_KEY_torrents);
+    tr_jsonWriterListBegin (w);
+    tr_jsonWriterVariant (w, &val);
+    tr_jsonWriterListBegin (w);
+    tr_jsonWriterEnd (w);
+    tr_jsonWriterInt (w, -1);
+    tr_jsonWriterEnd (w);
+    tr_jsonWriterEnd (w);
+    tr_jsonWriterFree (w);
+    tr_variantFree (&val);
+
+    len = evbuffer_get_length (buf);
+    str = tr_strndup (evbuffer_pullup (buf, -1), len);
+    check_streq ("{\"id\":42,\"name\":\"a \\\"quoted\\\"\\nname\",\"torrents\":[[1,\"two\"],[],-1]}", str);
+
+    /* and it round-trips */
+    check_int_eq (0, tr_variantFromJson (&top, str, len));
+    check (tr_variantDictFindInt (&top, TR_KEY_id, &i));
+    check_int_eq (42, i);
+    check (tr_variantDictFindList (&top, TR_KEY_torrents, &list));
+    check_int_eq (3, tr_variantListSize (list));
+
+    tr_variantFree (&top);
+    tr_free (str);
+    evbuffer_free (buf);
+    return 0;
+}
+
 int
 main (void)
 {
@@ -238,7 +289,8 @@ main (void)
                              test1,
                              test2,
                              test3,
-                             test_unescape };
+                             test_unescape,
+                             test_writer };
 
   /* run the tests in a locale with a decimal point of '.' */
   setlocale (LC_NUMERIC, "C");
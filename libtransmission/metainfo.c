@@ -67,13 +67,27 @@ getTorrentFilename (const tr_session * session, const tr_info * inf)
 ****
 ***/
 
+/* `component' needn't be nul-terminated, since it may point into the .torrent */
 static bool
-path_component_is_suspicious (const char * component)
+path_component_is_suspicious (const char * component, size_t len)
 {
-  return (component == NULL)
-      || (strpbrk (component, PATH_DELIMITER_CHARS) != NULL)
-      || (strcmp (component, ".") == 0)
-      || (strcmp (component, "..") == 0);
+  size_t i;
+  const char * nul;
+
+  if (component == NULL)
+    return true;
+
+  if (len == TR_BAD_SIZE)
+    len = strlen (component);
+  else if ((nul = memchr (component, '\0', len)))
+    len = nul - component;
+
+  for (i=0; i<len; ++i)
+    if (char_is_path_separator (component[i]))
+      return true;
+
+  return (len == 1 && component[0] == '.')
+      || (len == 2 && component[0] == '.' && component[1] == '.');
 }
 
 static bool
@@ -85,7 +99,7 @@ getfile (char ** setme, const char * root, tr_variant * path, struct evbuffer *
   *setme = NULL;
 
   /* root's already been checked by caller */
-  assert (!path_component_is_suspicious (root));
+  assert (!path_component_is_suspicious (root, TR_BAD_SIZE));
 
   if (tr_variantIsList (path))
     {
@@ -103,7 +117,7 @@ getfile (char ** setme, const char * root, tr_variant * path, struct evbuffer *
           const char * str;
 
           if (!tr_variantGetStr (tr_variantListChild (path, i), &str, &len) ||
-              path_component_is_suspicious (str))
+              path_component_is_suspicious (str, len))
             {
               success = false;
               break;
@@ -144,7 +158,7 @@ parseFiles (tr_info * inf, tr_variant * files, const tr_variant * length)
       struct evbuffer * buf;
       const char * result;
 
-      if (path_component_is_suspicious (inf->name))
+      if (path_component_is_suspicious (inf->name, TR_BAD_SIZE))
         return "path";
 
       buf = evbuffer_new ();
@@ -194,7 +208,7 @@ parseFiles (tr_info * inf, tr_variant * files, const tr_variant * length)
     }
   else if (tr_variantGetInt (length, &len)) /* single-file mode */
     {
-      if (path_component_is_suspicious (inf->name))
+      if (path_component_is_suspicious (inf->name, TR_BAD_SIZE))
         return "path";
 
       inf->isFolder         = false;
@@ -347,13 +361,13 @@ getannounce (tr_info * inf, tr_variant * meta)
  * trailing slash for multifile torrents if omitted by the end user.
  */
 static char*
-fix_webseed_url (const tr_info * inf, const char * url_in)
+fix_webseed_url (const tr_info * inf, const char * url_in, size_t url_in_len)
 {
   size_t len;
   char * url;
   char * ret = NULL;
 
-  url = tr_strdup (url_in);
+  url = tr_strndup (url_in, url_in_len);
   tr_strstrip (url);
   len = strlen (url);
 
@@ -374,6 +388,7 @@ geturllist (tr_info * inf, tr_variant * meta)
 {
   tr_variant * urls;
   const char * url;
+  size_t len;
 
   if (tr_variantDictFindList (meta, TR_KEY_url_list, &urls))
     {
@@ -385,18 +400,18 @@ geturllist (tr_info * inf, tr_variant * meta)
 
       for (i=0; i<n; i++)
         {
-          if (tr_variantGetStr (tr_variantListChild (urls, i), &url, NULL))
+          if (tr_variantGetStr (tr_variantListChild (urls, i), &url, &len))
             {
-              char * fixed_url = fix_webseed_url (inf, url);
+              char * fixed_url = fix_webseed_url (inf, url, len);
 
               if (fixed_url != NULL)
                 inf->webseeds[inf->webseedCount++] = fixed_url;
             }
         }
     }
-  else if (tr_variantDictFindStr (meta, TR_KEY_url_list, &url, NULL)) /* handle single items in webseeds */
+  else if (tr_variantDictFindStr (meta, TR_KEY_url_list, &url, &len)) /* handle single items in webseeds */
     {
-      char * fixed_url = fix_webseed_url (inf, url);
+      char * fixed_url = fix_webseed_url (inf, url, len);
 
       if (fixed_url != NULL)
         {
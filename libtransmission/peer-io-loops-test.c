@@ -0,0 +1,292 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memcmp (), memset () */
+#include <time.h> /* time () */
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+#include "transmission.h"
+#include "crypto-utils.h"
+#include "fdlimit.h"
+#include "net.h"
+#include "peer-io-loops.h"
+#include "session.h"
+#include "trevent.h"
+#include "utils.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+#define WRITE_SIZE 100000
+#define DECRYPT_SIZE 3000
+
+struct loops_test_data
+{
+  tr_session * session;
+  tr_socket_t socket;
+  tr_io_conn * conn;
+  volatile short events;
+  volatile bool done;
+  int result;
+  struct evbuffer * buf;
+  tr_rc4_ctx_t dec_key;
+};
+
+static void
+onConnEvent (void * vdata, short what)
+{
+  struct loops_test_data * data = vdata;
+
+  data->events |= what;
+}
+
+static void
+newConnFunc (void * vdata)
+{
+  struct loops_test_data * data = vdata;
+
+  data->conn = tr_ioConnNew (data->session->ioLoops, data->socket, onConnEvent, data);
+  tr_ioConnWatch (data->conn, EV_READ, true);
+  data->done = true;
+}
+
+static void
+watchReadFunc (void * vdata)
+{
+  struct loops_test_data * data = vdata;
+
+  data->events = 0;
+  tr_ioConnWatch (data->conn, EV_READ, true);
+  data->done = true;
+}
+
+static void
+readFunc (void * vdata)
+{
+  struct loops_test_data * data = vdata;
+
+  data->result = tr_ioConnRead (data->conn, data->buf, 1024);
+  data->done = true;
+}
+
+static void
+writeFunc (void * vdata)
+{
+  struct loops_test_data * data = vdata;
+
+  data->result = tr_ioConnWrite (data->conn, data->buf, WRITE_SIZE);
+  data->done = true;
+}
+
+static void
+setDecryptKeyFunc (void * vdata)
+{
+  struct loops_test_data * data = vdata;
+
+  tr_ioConnSetDecryptKey (data->conn, data->dec_key);
+  data->done = true;
+}
+
+static void
+freeConnFunc (void * vdata)
+{
+  struct loops_test_data * data = vdata;
+
+  tr_ioConnFree (data->conn);
+  data->done = true;
+}
+
+static void
+runAndWait (struct loops_test_data * data, void (*func) (void *))
+{
+  data->done = false;
+  tr_runInEventThread (data->session, func, data);
+  while (!data->done)
+    tr_wait_msec (10);
+}
+
+static bool
+waitForEvents (struct loops_test_data * data, short what)
+{
+  const time_t deadline = time (NULL) + 5;
+
+  while (!(data->events & what) && time (NULL) <= deadline)
+    tr_wait_msec (10);
+
+  return (data->events & what) != 0;
+}
+
+/* make a connected pair of sockets. the one in data->socket is counted
+   by fdlimit, like a peer's, since the loops close it with tr_netClose () */
+static tr_socket_t
+makeSocketPair (struct loops_test_data * data)
+{
+  tr_socket_t listener;
+  tr_socket_t peer;
+  struct sockaddr_in sin;
+  socklen_t len = sizeof (sin);
+
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  listener = socket (AF_INET, SOCK_STREAM, 0);
+  if (listener == TR_BAD_SOCKET
+      || bind (listener, (struct sockaddr*)&sin, sizeof (sin)) == -1
+      || listen (listener, 1) == -1
+      || getsockname (listener, (struct sockaddr*)&sin, &len) == -1)
+    return TR_BAD_SOCKET;
+
+  data->socket = tr_fdSocketCreate (data->session, AF_INET, SOCK_STREAM);
+  if (data->socket == TR_BAD_SOCKET
+      || connect (data->socket, (struct sockaddr*)&sin, sizeof (sin)) == -1)
+    return TR_BAD_SOCKET;
+
+  peer = accept (listener, NULL, NULL);
+  tr_netCloseSocket (listener);
+  evutil_make_socket_nonblocking (data->socket);
+  return peer;
+}
+
+static int
+test_conn (void)
+{
+  int i;
+  size_t len;
+  tr_socket_t peer;
+  tr_variant settings;
+  char * buf = tr_new (char, WRITE_SIZE);
+  char * got = tr_new0 (char, WRITE_SIZE);
+  struct loops_test_data data;
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddInt (&settings, TR_KEY_peer_io_threads, 2);
+  memset (&data, 0, sizeof (data));
+  data.session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+  check (data.session->ioLoops != NULL);
+  check_int_eq (2, data.session->peerIoThreads);
+
+  peer = makeSocketPair (&data);
+  check (peer != TR_BAD_SOCKET);
+  data.buf = evbuffer_new ();
+  runAndWait (&data, newConnFunc);
+
+  /* nothing to read yet */
+  runAndWait (&data, readFunc);
+  check_int_eq (-1, data.result);
+
+  /* reading */
+  check_int_eq (5, send (peer, "hello", 5, 0));
+  check (waitForEvents (&data, EV_READ));
+  runAndWait (&data, readFunc);
+  check_int_eq (5, data.result);
+  check_uint_eq (5, evbuffer_get_length (data.buf));
+  check (memcmp (evbuffer_pullup (data.buf, -1), "hello", 5) == 0);
+  evbuffer_drain (data.buf, 5);
+
+  /* writing */
+  for (i=0; i<WRITE_SIZE; ++i)
+    buf[i] = (char)(i % 251);
+  evbuffer_add (data.buf, buf, WRITE_SIZE);
+  runAndWait (&data, writeFunc);
+  check_int_eq (WRITE_SIZE, data.result);
+  check_uint_eq (0, evbuffer_get_length (data.buf));
+  for (len=0; len<WRITE_SIZE; )
+    {
+      const int n = recv (peer, got + len, WRITE_SIZE - len, 0);
+      check (n > 0);
+      len += n;
+    }
+  check (memcmp (buf, got, WRITE_SIZE) == 0);
+
+  /* EOF */
+  runAndWait (&data, watchReadFunc);
+  tr_netCloseSocket (peer);
+  check (waitForEvents (&data, EV_READ));
+  runAndWait (&data, readFunc);
+  check_int_eq (0, data.result);
+
+  runAndWait (&data, freeConnFunc);
+  libttest_session_close (data.session);
+  evbuffer_free (data.buf);
+  tr_free (got);
+  tr_free (buf);
+  return 0;
+}
+
+/* send part of an RC4 stream before the loop gets the key and part after,
+   and check that all of it comes out of tr_ioConnRead () decrypted */
+static int
+test_decrypt (void)
+{
+  int i;
+  tr_socket_t peer;
+  tr_variant settings;
+  tr_rc4_ctx_t enc_key;
+  uint8_t key[SHA_DIGEST_LENGTH];
+  uint8_t plain[DECRYPT_SIZE];
+  uint8_t cipher[DECRYPT_SIZE];
+  struct loops_test_data data;
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddInt (&settings, TR_KEY_peer_io_threads, 1);
+  memset (&data, 0, sizeof (data));
+  data.session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+  check (data.session->ioLoops != NULL);
+
+  peer = makeSocketPair (&data);
+  check (peer != TR_BAD_SOCKET);
+  data.buf = evbuffer_new ();
+  runAndWait (&data, newConnFunc);
+
+  for (i=0; i<SHA_DIGEST_LENGTH; ++i)
+    key[i] = (uint8_t)i;
+  enc_key = tr_rc4_new ();
+  tr_rc4_set_key (enc_key, key, sizeof (key));
+  data.dec_key = tr_rc4_new ();
+  tr_rc4_set_key (data.dec_key, key, sizeof (key));
+  for (i=0; i<DECRYPT_SIZE; ++i)
+    plain[i] = (uint8_t)(i % 251);
+  tr_rc4_process (enc_key, plain, cipher, DECRYPT_SIZE);
+
+  /* the first part is waiting in the loop's buffer when the key arrives */
+  check_int_eq (1000, send (peer, (const char*)cipher, 1000, 0));
+  check (waitForEvents (&data, EV_READ));
+  runAndWait (&data, setDecryptKeyFunc);
+  check_int_eq (DECRYPT_SIZE - 1000, send (peer, (const char*)cipher + 1000, DECRYPT_SIZE - 1000, 0));
+
+  while (evbuffer_get_length (data.buf) < DECRYPT_SIZE)
+    {
+      runAndWait (&data, watchReadFunc);
+      check (waitForEvents (&data, EV_READ));
+      runAndWait (&data, readFunc);
+      check (data.result > 0);
+    }
+  check_uint_eq (DECRYPT_SIZE, evbuffer_get_length (data.buf));
+  check (memcmp (evbuffer_pullup (data.buf, -1), plain, DECRYPT_SIZE) == 0);
+
+  runAndWait (&data, freeConnFunc);
+  libttest_session_close (data.session);
+  tr_netCloseSocket (peer);
+  tr_rc4_free (enc_key);
+  evbuffer_free (data.buf);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_conn,
+                             test_decrypt };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
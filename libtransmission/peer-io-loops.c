@@ -0,0 +1,819 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "transmission.h"
+#include "crypto-utils.h" /* tr_rc4_process () */
+#include "log.h"
+#include "net.h"
+#include "peer-io-loops.h"
+#include "platform.h" /* tr_lock, tr_thread */
+#include "session.h"
+#include "trevent.h" /* tr_runInEventThread () */
+#include "utils.h"
+
+#ifdef _WIN32
+ #define WAKE_FAMILY AF_INET
+ #define ERR_WOULD_BLOCK WSAEWOULDBLOCK
+#else
+ #define WAKE_FAMILY AF_UNIX
+ #define ERR_WOULD_BLOCK EAGAIN
+#endif
+
+enum
+{
+  /* how far a loop reads ahead of, or writes behind, the libtransmission thread.
+     this matches the most that peer-io keeps in a peer's input buffer. */
+  CONN_BUFFER_SIZE = 256 * 1024,
+
+  /* how many of an evbuffer's chains to decrypt per evbuffer_peek () */
+  DECRYPT_IOVEC_COUNT = 16
+};
+
+/* commands from the libtransmission thread to a loop */
+enum
+{
+  CMD_ADD         = (1 << 0),
+  CMD_RESUME_READ = (1 << 1),
+  CMD_WRITE       = (1 << 2),
+  CMD_REMOVE      = (1 << 3)
+};
+
+struct tr_io_loop;
+
+struct tr_io_conn
+{
+  struct tr_io_loop * loop;
+  tr_socket_t socket;
+  tr_io_conn_func func;
+  void * user_data;
+
+  /* the rest is guarded by the loop's lock unless noted otherwise */
+
+  struct evbuffer * rx;  /* read by the loop, but not taken by tr_ioConnRead () yet */
+  struct evbuffer * tx;  /* given by tr_ioConnWrite (), but not taken by the loop yet */
+  size_t queued;         /* tx plus the bytes the loop is writing */
+  int read_err;          /* -1 at EOF, or a socket error */
+  int write_err;
+  bool read_paused;      /* the loop stopped reading because rx was full */
+  bool write_armed;      /* the loop has something to write */
+  short watch;           /* the events the libtransmission thread is waiting for */
+  bool freed;            /* tr_ioConnFree () has been called */
+  bool removed;          /* ...and the loop has let go of it */
+  tr_rc4_ctx_t dec_key;  /* set once; only the loop uses it after that */
+
+  int cmds;
+  bool in_cmds;
+  struct tr_io_conn * next_cmd;
+
+  bool in_ready;
+  struct tr_io_conn * next_ready;
+
+  /* only used by the loop's thread */
+  struct event * ev_read;
+  struct event * ev_write;
+  struct evbuffer * sending;
+};
+
+struct tr_io_loop
+{
+  tr_io_loops * loops;
+  tr_lock * lock;
+  struct event_base * base;
+  evutil_socket_t wake_fds[2];
+  struct event * wake_event;
+  struct evbuffer * scratch;  /* only used by the loop's thread */
+  int conn_count;             /* only used by the libtransmission thread */
+
+  /* guarded by lock */
+  tr_io_conn * cmds;
+  tr_io_conn * ready;
+  bool notify_pending;
+  bool quit;
+  bool done;
+};
+
+struct tr_io_loops
+{
+  tr_session * session;
+  struct event * ready_event;
+  int count;
+  struct tr_io_loop * loops;
+};
+
+#define dbgmsg(...) \
+  do \
+    { \
+      if (tr_logGetDeepEnabled ()) \
+        tr_logAddDeep (__FILE__, __LINE__, "peer-io-loops", __VA_ARGS__); \
+    } \
+  while (0)
+
+static bool
+isWouldBlock (int err)
+{
+  return err == ERR_WOULD_BLOCK || err == EAGAIN || err == EINTR;
+}
+
+/***
+****  Handing connections back and forth.
+****  These are called with the loop's lock held.
+***/
+
+/* the caller must wake the loop if this returns true */
+static bool
+postCommand (tr_io_conn * conn, int cmd)
+{
+  struct tr_io_loop * loop = conn->loop;
+  const bool wake = loop->cmds == NULL;
+
+  conn->cmds |= cmd;
+
+  if (!conn->in_cmds)
+    {
+      conn->in_cmds = true;
+      conn->next_cmd = loop->cmds;
+      loop->cmds = conn;
+    }
+
+  return wake;
+}
+
+static void
+wakeLoop (struct tr_io_loop * loop)
+{
+  const char ch = 'w';
+
+  send (loop->wake_fds[1], &ch, 1, 0);
+}
+
+/* the caller must notify the libtransmission thread if this returns true */
+static bool
+postReady (tr_io_conn * conn)
+{
+  struct tr_io_loop * loop = conn->loop;
+  bool notify = false;
+
+  if (!conn->in_ready)
+    {
+      conn->in_ready = true;
+      conn->next_ready = loop->ready;
+      loop->ready = conn;
+    }
+
+  if (!loop->notify_pending)
+    {
+      loop->notify_pending = true;
+      notify = true;
+    }
+
+  return notify;
+}
+
+/* decrypt the buffer in place, one batch of chains at a time */
+static void
+decryptBuffer (tr_rc4_ctx_t key, struct evbuffer * buf)
+{
+  struct evbuffer_ptr pos;
+  struct evbuffer_iovec iovecs[DECRYPT_IOVEC_COUNT];
+  size_t size = evbuffer_get_length (buf);
+
+  evbuffer_ptr_set (buf, &pos, 0, EVBUFFER_PTR_SET);
+
+  while (size > 0)
+    {
+      int i;
+      size_t batch = 0;
+      const int n = MIN (evbuffer_peek (buf, size, &pos, iovecs, DECRYPT_IOVEC_COUNT),
+                         DECRYPT_IOVEC_COUNT);
+
+      if (n <= 0)
+        break;
+
+      for (i=0; i<n && size > 0; ++i)
+        {
+          const size_t len = MIN (iovecs[i].iov_len, size);
+          tr_rc4_process (key, iovecs[i].iov_base, iovecs[i].iov_base, len);
+          size -= len;
+          batch += len;
+        }
+
+      if (size > 0 && evbuffer_ptr_set (buf, &pos, batch, EVBUFFER_PTR_ADD))
+        break;
+    }
+
+  assert (size == 0);
+}
+
+static bool
+isReadable (const tr_io_conn * conn)
+{
+  return conn->read_err != 0 || evbuffer_get_length (conn->rx) > 0;
+}
+
+static bool
+isWritable (const tr_io_conn * conn)
+{
+  return conn->write_err != 0 || conn->queued < CONN_BUFFER_SIZE;
+}
+
+/***
+****  The loops' side
+***/
+
+static void onReadyFromLoop (void * vsession);
+
+static void
+notifySession (struct tr_io_loop * loop)
+{
+  tr_runInEventThread (loop->loops->session, onReadyFromLoop, loop->loops->session);
+}
+
+static void
+onWritable (evutil_socket_t fd, short what UNUSED, void * vconn)
+{
+  int n;
+  int err;
+  bool notify = false;
+  tr_io_conn * conn = vconn;
+  struct tr_io_loop * loop = conn->loop;
+
+  tr_lockLock (loop->lock);
+  evbuffer_add_buffer (conn->sending, conn->tx);
+  tr_lockUnlock (loop->lock);
+
+  EVUTIL_SET_SOCKET_ERROR (0);
+  n = evbuffer_write (conn->sending, fd);
+  err = EVUTIL_SOCKET_ERROR ();
+
+  tr_lockLock (loop->lock);
+
+  if (n > 0)
+    conn->queued -= n;
+  else if (n < 0 && !isWouldBlock (err))
+    conn->write_err = err;
+
+  if (!conn->write_err && (evbuffer_get_length (conn->sending) > 0 || evbuffer_get_length (conn->tx) > 0))
+    event_add (conn->ev_write, NULL);
+  else
+    conn->write_armed = false;
+
+  if ((conn->watch & EV_WRITE) && isWritable (conn))
+    notify = postReady (conn);
+
+  tr_lockUnlock (loop->lock);
+
+  if (notify)
+    notifySession (loop);
+}
+
+static void
+onReadable (evutil_socket_t fd, short what UNUSED, void * vconn)
+{
+  int n;
+  int err;
+  size_t len;
+  bool notify = false;
+  tr_rc4_ctx_t dec_key;
+  tr_io_conn * conn = vconn;
+  struct tr_io_loop * loop = conn->loop;
+
+  tr_lockLock (loop->lock);
+  len = evbuffer_get_length (conn->rx);
+  dec_key = conn->dec_key;
+  tr_lockUnlock (loop->lock);
+
+  if (len >= CONN_BUFFER_SIZE)
+    return;
+
+  EVUTIL_SET_SOCKET_ERROR (0);
+  n = evbuffer_read (loop->scratch, fd, CONN_BUFFER_SIZE - len);
+  err = EVUTIL_SOCKET_ERROR ();
+
+  if (n > 0 && dec_key != NULL)
+    decryptBuffer (dec_key, loop->scratch);
+
+  tr_lockLock (loop->lock);
+
+  if (n > 0)
+    {
+      /* the key was handed over while we were reading */
+      if (dec_key == NULL && conn->dec_key != NULL)
+        decryptBuffer (conn->dec_key, loop->scratch);
+
+      evbuffer_add_buffer (conn->rx, loop->scratch);
+    }
+  else if (n == 0)
+    conn->read_err = -1;
+  else if (!isWouldBlock (err))
+    conn->read_err = err;
+
+  if (conn->read_err)
+    {
+      event_del (conn->ev_read);
+    }
+  else if (evbuffer_get_length (conn->rx) >= CONN_BUFFER_SIZE)
+    {
+      event_del (conn->ev_read);
+      conn->read_paused = true;
+    }
+
+  if ((conn->watch & EV_READ) && isReadable (conn))
+    notify = postReady (conn);
+
+  tr_lockUnlock (loop->lock);
+
+  if (notify)
+    notifySession (loop);
+}
+
+static void
+runCommands (struct tr_io_loop * loop, tr_io_conn * conn, int cmds)
+{
+  if (cmds & CMD_REMOVE)
+    {
+      bool notify;
+
+      if (conn->ev_read != NULL)
+        event_free (conn->ev_read);
+      if (conn->ev_write != NULL)
+        event_free (conn->ev_write);
+      if (conn->sending != NULL)
+        evbuffer_free (conn->sending);
+
+      /* the libtransmission thread frees it from here */
+      tr_lockLock (loop->lock);
+      conn->removed = true;
+      notify = postReady (conn);
+      tr_lockUnlock (loop->lock);
+
+      if (notify)
+        notifySession (loop);
+      return;
+    }
+
+  if (cmds & CMD_ADD)
+    {
+      conn->ev_read = event_new (loop->base, conn->socket, EV_READ | EV_PERSIST, onReadable, conn);
+      conn->ev_write = event_new (loop->base, conn->socket, EV_WRITE, onWritable, conn);
+      conn->sending = evbuffer_new ();
+      event_add (conn->ev_read, NULL);
+    }
+
+  if (cmds & CMD_RESUME_READ)
+    event_add (conn->ev_read, NULL);
+
+  /* try right away instead of waiting for the socket to poll as writable */
+  if (cmds & CMD_WRITE)
+    onWritable (conn->socket, EV_WRITE, conn);
+}
+
+static void
+onWake (evutil_socket_t fd, short what UNUSED, void * vloop)
+{
+  bool quit;
+  char buf[64];
+  tr_io_conn * conn;
+  struct tr_io_loop * loop = vloop;
+
+  while (recv (fd, buf, sizeof (buf), 0) > 0)
+    ;
+
+  tr_lockLock (loop->lock);
+  conn = loop->cmds;
+  loop->cmds = NULL;
+  quit = loop->quit;
+  tr_lockUnlock (loop->lock);
+
+  while (conn != NULL)
+    {
+      int cmds;
+      tr_io_conn * next;
+
+      tr_lockLock (loop->lock);
+      next = conn->next_cmd;
+      cmds = conn->cmds;
+      conn->cmds = 0;
+      conn->in_cmds = false;
+      tr_lockUnlock (loop->lock);
+
+      runCommands (loop, conn, cmds);
+      conn = next;
+    }
+
+  if (quit)
+    event_base_loopbreak (loop->base);
+}
+
+static void
+loopThreadFunc (void * vloop)
+{
+  struct tr_io_loop * loop = vloop;
+
+  event_base_dispatch (loop->base);
+
+  dbgmsg ("loop %p is done", (void*)loop);
+  tr_lockLock (loop->lock);
+  loop->done = true;
+  tr_lockUnlock (loop->lock);
+}
+
+/***
+****  The libtransmission thread's side
+***/
+
+static bool
+isLoopDone (struct tr_io_loop * loop)
+{
+  bool done;
+
+  tr_lockLock (loop->lock);
+  done = loop->done;
+  tr_lockUnlock (loop->lock);
+
+  return done;
+}
+
+static void
+destroyConn (tr_io_loops * loops, tr_io_conn * conn)
+{
+  tr_netClose (loops->session, conn->socket);
+  if (conn->dec_key != NULL)
+    tr_rc4_free (conn->dec_key);
+  evbuffer_free (conn->rx);
+  evbuffer_free (conn->tx);
+  tr_free (conn);
+}
+
+static void
+processReady (tr_io_loops * loops)
+{
+  int i;
+
+  for (i=0; i<loops->count; ++i)
+    {
+      tr_io_conn * conn;
+      struct tr_io_loop * loop = &loops->loops[i];
+
+      tr_lockLock (loop->lock);
+      conn = loop->ready;
+      loop->ready = NULL;
+      loop->notify_pending = false;
+      tr_lockUnlock (loop->lock);
+
+      while (conn != NULL)
+        {
+          short what = 0;
+          bool removed;
+          tr_io_conn * next;
+
+          tr_lockLock (loop->lock);
+          next = conn->next_ready;
+          conn->in_ready = false;
+          removed = conn->removed;
+          if (!removed && !conn->freed)
+            {
+              if ((conn->watch & EV_READ) && isReadable (conn))
+                what |= EV_READ;
+              if ((conn->watch & EV_WRITE) && isWritable (conn))
+                what |= EV_WRITE;
+              conn->watch &= ~what;
+            }
+          tr_lockUnlock (loop->lock);
+
+          if (removed)
+            destroyConn (loops, conn);
+          else if (what != 0)
+            conn->func (conn->user_data, what);
+
+          conn = next;
+        }
+    }
+}
+
+static void
+onReadyFromLoop (void * vsession)
+{
+  tr_session * session = vsession;
+
+  /* the loops may have been freed since this was queued */
+  if (session->ioLoops != NULL)
+    processReady (session->ioLoops);
+}
+
+static void
+onReadyEvent (evutil_socket_t fd UNUSED, short what UNUSED, void * vloops)
+{
+  processReady (vloops);
+}
+
+tr_io_loops *
+tr_ioLoopsNew (tr_session * session, int count)
+{
+  int i;
+  tr_io_loops * loops;
+
+  assert (tr_amInEventThread (session));
+  assert (count > 0);
+
+  loops = tr_new0 (tr_io_loops, 1);
+  loops->session = session;
+  loops->ready_event = event_new (session->event_base, -1, 0, onReadyEvent, loops);
+  loops->loops = tr_new0 (struct tr_io_loop, count);
+
+  for (i=0; i<count; ++i)
+    {
+      struct tr_io_loop * loop = &loops->loops[i];
+
+      if (evutil_socketpair (WAKE_FAMILY, SOCK_STREAM, 0, loop->wake_fds) == -1)
+        {
+          char err_buf[512];
+          tr_logAddError ("Couldn't create peer i/o loop: %s",
+                          tr_net_strerror (err_buf, sizeof (err_buf), sockerrno));
+          break;
+        }
+
+      evutil_make_socket_nonblocking (loop->wake_fds[0]);
+      evutil_make_socket_nonblocking (loop->wake_fds[1]);
+      loop->loops = loops;
+      loop->lock = tr_lockNew ();
+      loop->base = event_base_new ();
+      loop->scratch = evbuffer_new ();
+      loop->wake_event = event_new (loop->base, loop->wake_fds[0], EV_READ | EV_PERSIST, onWake, loop);
+      event_add (loop->wake_event, NULL);
+      loops->count = i + 1;
+    }
+
+  if (loops->count < count)
+    {
+      /* none of the threads were started */
+      for (i=0; i<loops->count; ++i)
+        loops->loops[i].done = true;
+
+      tr_ioLoopsFree (loops);
+      return NULL;
+    }
+
+  for (i=0; i<count; ++i)
+    tr_threadNew (loopThreadFunc, &loops->loops[i]);
+
+  tr_logAddDebug ("Started %d peer i/o loops", count);
+  return loops;
+}
+
+void
+tr_ioLoopsFree (tr_io_loops * loops)
+{
+  int i;
+
+  if (loops == NULL)
+    return;
+
+  assert (tr_amInEventThread (loops->session));
+
+  /* any connections freed before now get removed before the loops quit */
+  for (i=0; i<loops->count; ++i)
+    {
+      struct tr_io_loop * loop = &loops->loops[i];
+
+      tr_lockLock (loop->lock);
+      loop->quit = true;
+      tr_lockUnlock (loop->lock);
+      wakeLoop (loop);
+    }
+
+  for (i=0; i<loops->count; ++i)
+    while (!isLoopDone (&loops->loops[i]))
+      tr_wait_msec (10);
+
+  processReady (loops);
+
+  for (i=0; i<loops->count; ++i)
+    {
+      struct tr_io_loop * loop = &loops->loops[i];
+
+      assert (loop->conn_count == 0);
+
+      event_free (loop->wake_event);
+      event_base_free (loop->base);
+      evbuffer_free (loop->scratch);
+      evutil_closesocket (loop->wake_fds[0]);
+      evutil_closesocket (loop->wake_fds[1]);
+      tr_lockFree (loop->lock);
+    }
+
+  event_free (loops->ready_event);
+  tr_free (loops->loops);
+  tr_free (loops);
+}
+
+/***
+****
+***/
+
+tr_io_conn *
+tr_ioConnNew (tr_io_loops     * loops,
+              tr_socket_t       socket,
+              tr_io_conn_func   func,
+              void            * user_data)
+{
+  int i;
+  bool wake;
+  tr_io_conn * conn;
+  struct tr_io_loop * loop = &loops->loops[0];
+
+  assert (tr_amInEventThread (loops->session));
+  assert (socket != TR_BAD_SOCKET);
+  assert (func != NULL);
+
+  for (i=1; i<loops->count; ++i)
+    if (loop->conn_count > loops->loops[i].conn_count)
+      loop = &loops->loops[i];
+
+  conn = tr_new0 (tr_io_conn, 1);
+  conn->loop = loop;
+  conn->socket = socket;
+  conn->func = func;
+  conn->user_data = user_data;
+  conn->rx = evbuffer_new ();
+  conn->tx = evbuffer_new ();
+  ++loop->conn_count;
+
+  tr_lockLock (loop->lock);
+  wake = postCommand (conn, CMD_ADD);
+  tr_lockUnlock (loop->lock);
+
+  if (wake)
+    wakeLoop (loop);
+
+  return conn;
+}
+
+void
+tr_ioConnFree (tr_io_conn * conn)
+{
+  bool wake;
+  struct tr_io_loop * loop = conn->loop;
+
+  assert (tr_amInEventThread (loop->loops->session));
+  assert (!conn->freed);
+
+  tr_lockLock (loop->lock);
+  conn->freed = true;
+  conn->watch = 0;
+  wake = postCommand (conn, CMD_REMOVE);
+  tr_lockUnlock (loop->lock);
+
+  --loop->conn_count;
+
+  if (wake)
+    wakeLoop (loop);
+}
+
+void
+tr_ioConnSetDecryptKey (tr_io_conn * conn, tr_rc4_ctx_t dec_key)
+{
+  struct tr_io_loop * loop = conn->loop;
+
+  assert (tr_amInEventThread (loop->loops->session));
+  assert (!conn->freed);
+  assert (dec_key != NULL);
+
+  /* the loop adds to rx under the lock, so nothing slips in between
+     decrypting what's there and the loop taking over */
+  tr_lockLock (loop->lock);
+  assert (conn->dec_key == NULL);
+  decryptBuffer (dec_key, conn->rx);
+  conn->dec_key = dec_key;
+  tr_lockUnlock (loop->lock);
+}
+
+void
+tr_ioConnWatch (tr_io_conn * conn, short what, bool enable)
+{
+  bool activate = false;
+  struct tr_io_loop * loop = conn->loop;
+
+  assert (!conn->freed);
+
+  tr_lockLock (loop->lock);
+
+  if (!enable)
+    {
+      conn->watch &= ~what;
+    }
+  else
+    {
+      conn->watch |= what;
+
+      /* if it's ready already, say so on the next pass through the event loop */
+      if (((what & EV_READ) && isReadable (conn)) || ((what & EV_WRITE) && isWritable (conn)))
+        {
+          postReady (conn);
+          activate = true;
+        }
+    }
+
+  tr_lockUnlock (loop->lock);
+
+  if (activate)
+    event_active (loop->loops->ready_event, EV_TIMEOUT, 1);
+}
+
+int
+tr_ioConnRead (tr_io_conn * conn, struct evbuffer * buf, size_t howmuch)
+{
+  int n;
+  int err = 0;
+  bool wake = false;
+  struct tr_io_loop * loop = conn->loop;
+
+  tr_lockLock (loop->lock);
+
+  if (evbuffer_get_length (conn->rx) > 0)
+    {
+      n = evbuffer_remove_buffer (conn->rx, buf, howmuch);
+
+      if (conn->read_paused && evbuffer_get_length (conn->rx) < CONN_BUFFER_SIZE / 2)
+        {
+          conn->read_paused = false;
+          wake = postCommand (conn, CMD_RESUME_READ);
+        }
+    }
+  else if (conn->read_err == -1)
+    {
+      n = 0;
+    }
+  else
+    {
+      n = -1;
+      err = conn->read_err ? conn->read_err : ERR_WOULD_BLOCK;
+    }
+
+  tr_lockUnlock (loop->lock);
+
+  if (wake)
+    wakeLoop (loop);
+
+  if (n < 0)
+    EVUTIL_SET_SOCKET_ERROR (err);
+
+  return n;
+}
+
+int
+tr_ioConnWrite (tr_io_conn * conn, struct evbuffer * buf, size_t howmuch)
+{
+  int n;
+  int err = 0;
+  bool wake = false;
+  struct tr_io_loop * loop = conn->loop;
+
+  tr_lockLock (loop->lock);
+
+  if (conn->write_err)
+    {
+      n = -1;
+      err = conn->write_err;
+    }
+  else if (conn->queued >= CONN_BUFFER_SIZE)
+    {
+      n = -1;
+      err = ERR_WOULD_BLOCK;
+    }
+  else
+    {
+      n = evbuffer_remove_buffer (buf, conn->tx, MIN (howmuch, CONN_BUFFER_SIZE - conn->queued));
+      if (n > 0)
+        {
+          conn->queued += n;
+
+          if (!conn->write_armed)
+            {
+              conn->write_armed = true;
+              wake = postCommand (conn, CMD_WRITE);
+            }
+        }
+    }
+
+  tr_lockUnlock (loop->lock);
+
+  if (wake)
+    wakeLoop (loop);
+
+  if (n < 0)
+    EVUTIL_SET_SOCKET_ERROR (err);
+
+  return n;
+}
@@ -0,0 +1,96 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#pragma once
+
+#include "crypto-utils.h" /* tr_rc4_ctx_t */
+#include "net.h" /* tr_socket_t */
+
+struct evbuffer;
+
+/**
+ * Network worker loops that do the socket reads and writes
+ * of TCP peer connections on threads of their own.
+ *
+ * Each loop is a thread with its own event_base, and each connection
+ * belongs to one loop. The loop reads from the socket into a buffer until
+ * that's full, and writes out whatever has been handed to it, so to the
+ * libtransmission thread these buffers look like extra-large socket buffers:
+ * tr_ioConnRead () and tr_ioConnWrite () never block and never make a syscall.
+ * Once a connection's encryption is settled, its loop can decrypt what it
+ * reads as well. Everything else, such as bandwidth, encryption, and parsing,
+ * stays on the libtransmission thread.
+ *
+ * Unless noted otherwise, these functions must be called from the
+ * libtransmission thread, which is also where the callbacks are invoked.
+ */
+
+typedef struct tr_io_loops tr_io_loops;
+typedef struct tr_io_conn tr_io_conn;
+
+/**
+ * @param what the events (EV_READ and/or EV_WRITE) that are ready.
+ *             As with non-persistent libevent events, each watch is
+ *             cleared once it's fired.
+ */
+typedef void (*tr_io_conn_func) (void * user_data, short what);
+
+tr_io_loops * tr_ioLoopsNew     (tr_session  * session,
+                                 int           count);
+
+/** @brief stop the loops. All their connections must have been freed. */
+void          tr_ioLoopsFree    (tr_io_loops * loops);
+
+/** @brief hand a connected, non-blocking socket to the least busy loop */
+tr_io_conn *  tr_ioConnNew      (tr_io_loops     * loops,
+                                 tr_socket_t       socket,
+                                 tr_io_conn_func   func,
+                                 void            * user_data);
+
+/** @brief stop watching the connection. Its socket is closed with
+           tr_netClose () once its loop has let go of it. */
+void          tr_ioConnFree     (tr_io_conn  * conn);
+
+/**
+ * @brief have the loop RC4-decrypt everything it reads from now on.
+ *
+ * What the loop has read but tr_ioConnRead () hasn't taken yet is decrypted
+ * right away, so everything tr_ioConnRead () moves afterwards is plaintext.
+ * The connection takes ownership of @a dec_key.
+ */
+void          tr_ioConnSetDecryptKey (tr_io_conn   * conn,
+                                      tr_rc4_ctx_t   dec_key);
+
+/** @brief start or stop watching for EV_READ and/or EV_WRITE */
+void          tr_ioConnWatch    (tr_io_conn  * conn,
+                                 short         what,
+                                 bool          enable);
+
+/**
+ * @brief move up to @a howmuch bytes that the loop has read into @a buf.
+ * @return like evbuffer_read (): the number of bytes moved, 0 at EOF,
+ *         or -1 with the socket error set, which is EAGAIN if nothing
+ *         has been read yet.
+ */
+int           tr_ioConnRead     (tr_io_conn      * conn,
+                                 struct evbuffer * buf,
+                                 size_t            howmuch);
+
+/**
+ * @brief move up to @a howmuch bytes from @a buf to the loop for writing.
+ * @return like evbuffer_write_atmost (): the number of bytes moved, or -1
+ *         with the socket error set, which is EAGAIN if the loop's buffer
+ *         is full.
+ */
+int           tr_ioConnWrite    (tr_io_conn      * conn,
+                                 struct evbuffer * buf,
+                                 size_t            howmuch);
@@ -0,0 +1,194 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memcmp () */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "crypto.h"
+#include "fdlimit.h"
+#include "net.h"
+#include "peer-io.h"
+#include "session.h"
+#include "trevent.h"
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+#define PAYLOAD_LEN 5000
+#define DRAIN_LEN 3000
+
+struct peer_io_test_data
+{
+  tr_session * session;
+  tr_peerIo * io;
+  volatile bool done;
+};
+
+static void
+newIoFunc (void * vdata)
+{
+  tr_address addr;
+  struct peer_io_test_data * data = vdata;
+  const tr_socket_t socket = tr_fdSocketCreate (data->session, AF_INET, SOCK_STREAM);
+
+  tr_address_from_string (&addr, "127.0.0.1");
+  data->io = tr_peerIoNewIncoming (data->session, NULL, &addr, 6881, socket, NULL);
+  data->done = true;
+}
+
+static void
+unrefIoFunc (void * vdata)
+{
+  struct peer_io_test_data * data = vdata;
+
+  tr_peerIoUnref (data->io);
+  data->done = true;
+}
+
+static void
+runAndWait (struct peer_io_test_data * data, void (*func) (void *))
+{
+  data->done = false;
+  tr_runInEventThread (data->session, func, data);
+  while (!data->done)
+    tr_wait_msec (10);
+}
+
+/* a stream of messages, as a peer would send them */
+static struct evbuffer *
+makeStream (void)
+{
+  int i;
+  struct evbuffer * out = evbuffer_new ();
+
+  for (i=0; i<3; ++i)
+    {
+      int j;
+      uint8_t payload[PAYLOAD_LEN];
+
+      for (j=0; j<PAYLOAD_LEN; ++j)
+        payload[j] = (uint8_t)(i + j);
+
+      evbuffer_add_uint32 (out, PAYLOAD_LEN + 1);
+      evbuffer_add_uint8 (out, (uint8_t)i);
+      evbuffer_add (out, payload, PAYLOAD_LEN);
+    }
+
+  return out;
+}
+
+/* encrypt part of the plaintext stream and hand it to the io,
+   as if it had just been read from the socket */
+static void
+arrive (tr_peerIo * io, tr_crypto * sender, struct evbuffer * plain, size_t len)
+{
+  uint8_t * buf = tr_new (uint8_t, len);
+
+  evbuffer_remove (plain, buf, len);
+  tr_cryptoEncrypt (sender, len, buf, buf);
+  evbuffer_add (tr_peerIoGetReadBuffer (io), buf, len);
+  tr_free (buf);
+}
+
+static int
+readStream (bool decryptAhead)
+{
+  int i;
+  int len;
+  uint8_t id;
+  uint32_t msglen;
+  tr_crypto sender;
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  uint8_t payload[PAYLOAD_LEN];
+  struct evbuffer * inbuf;
+  struct evbuffer * plain = makeStream ();
+  struct evbuffer * piece = evbuffer_new ();
+  struct peer_io_test_data data;
+
+  memset (&data, 0, sizeof (data));
+  data.session = libttest_session_init (NULL);
+  runAndWait (&data, newIoFunc);
+  check (data.io != NULL);
+  inbuf = tr_peerIoGetReadBuffer (data.io);
+
+  /* set up RC4 between the io and a fake peer */
+  for (i=0; i<SHA_DIGEST_LENGTH; ++i)
+    hash[i] = (uint8_t)i;
+  tr_peerIoSetTorrentHash (data.io, hash);
+  tr_cryptoConstruct (&sender, hash, false);
+  check (tr_cryptoComputeSecret (&sender, tr_cryptoGetMyPublicKey (tr_peerIoGetCrypto (data.io), &len)));
+  check (tr_cryptoComputeSecret (tr_peerIoGetCrypto (data.io), tr_cryptoGetMyPublicKey (&sender, &len)));
+  tr_cryptoEncryptInit (&sender);
+  tr_cryptoDecryptInit (tr_peerIoGetCrypto (data.io));
+  tr_peerIoSetEncryption (data.io, PEER_ENCRYPTION_RC4);
+  tr_peerIoSetDecryptAhead (data.io, decryptAhead);
+
+  /* the first message, arriving in two parts */
+  arrive (data.io, &sender, plain, 3);
+  arrive (data.io, &sender, plain, 1000);
+  tr_peerIoReadUint32 (data.io, inbuf, &msglen);
+  check_uint_eq (PAYLOAD_LEN + 1, msglen);
+  tr_peerIoReadUint8 (data.io, inbuf, &id);
+  check_int_eq (0, id);
+  arrive (data.io, &sender, plain, evbuffer_get_length (plain));
+  tr_peerIoReadBytes (data.io, inbuf, payload, PAYLOAD_LEN);
+  for (i=0; i<PAYLOAD_LEN; ++i)
+    check_int_eq ((uint8_t)i, payload[i]);
+
+  /* the second, skipped over */
+  tr_peerIoReadUint32 (data.io, inbuf, &msglen);
+  check_uint_eq (PAYLOAD_LEN + 1, msglen);
+  tr_peerIoReadUint8 (data.io, inbuf, &id);
+  check_int_eq (1, id);
+  tr_peerIoDrain (data.io, inbuf, DRAIN_LEN);
+  tr_peerIoDrain (data.io, inbuf, PAYLOAD_LEN - DRAIN_LEN);
+
+  /* the third, read into a buffer like piece data is */
+  tr_peerIoReadUint32 (data.io, inbuf, &msglen);
+  check_uint_eq (PAYLOAD_LEN + 1, msglen);
+  tr_peerIoReadUint8 (data.io, inbuf, &id);
+  check_int_eq (2, id);
+  tr_peerIoReadBytesToBuf (data.io, inbuf, piece, PAYLOAD_LEN);
+  check_uint_eq (PAYLOAD_LEN, evbuffer_get_length (piece));
+  evbuffer_remove (piece, payload, PAYLOAD_LEN);
+  for (i=0; i<PAYLOAD_LEN; ++i)
+    check_int_eq ((uint8_t)(i + 2), payload[i]);
+
+  check_uint_eq (0, evbuffer_get_length (inbuf));
+  check_uint_eq (0, data.io->inbufDecrypted);
+
+  tr_cryptoDestruct (&sender);
+  runAndWait (&data, unrefIoFunc);
+  libttest_session_close (data.session);
+  evbuffer_free (piece);
+  evbuffer_free (plain);
+  return 0;
+}
+
+static int
+test_decrypt_by_field (void)
+{
+  return readStream (false);
+}
+
+static int
+test_decrypt_ahead (void)
+{
+  return readStream (true);
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_decrypt_by_field,
+                             test_decrypt_ahead };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
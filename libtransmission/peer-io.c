@@ -23,6 +23,7 @@
 #include "net.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "peer-io.h"
+#include "peer-io-loops.h"
 #include "trevent.h" /* tr_runInEventThread () */
 #include "tr-utp.h"
 #include "utils.h"
@@ -43,6 +44,9 @@
 
 #define UTP_READ_BUFFER_SIZE (256 * 1024)
 
+/* how many of an evbuffer's chains to en/decrypt per evbuffer_peek () */
+#define CRYPTO_IOVEC_COUNT 16
+
 static size_t
 guessPacketOverhead (size_t d)
 {
@@ -244,8 +248,36 @@ canReadWrapper (tr_peerIo * io)
     tr_peerIoUnref (io);
 }
 
+/* TCP sockets are read and written either here or by a peer i/o loop */
+
+static int
+io_read (tr_peerIo * io, size_t howmuch)
+{
+    if (io->conn != NULL)
+    {
+        const int n = tr_ioConnRead (io->conn, io->inbuf, howmuch);
+
+        /* the loop has decrypted these already */
+        if (n > 0 && io->decryptOnLoop)
+            io->inbufDecrypted += n;
+
+        return n;
+    }
+
+    return evbuffer_read (io->inbuf, io->socket, (int)howmuch);
+}
+
+static int
+io_write (tr_peerIo * io, size_t howmuch)
+{
+    if (io->conn != NULL)
+        return tr_ioConnWrite (io->conn, io->outbuf, howmuch);
+
+    return evbuffer_write_atmost (io->outbuf, io->socket, howmuch);
+}
+
 static void
-event_read_cb (evutil_socket_t fd, short event UNUSED, void * vio)
+event_read_cb (evutil_socket_t fd UNUSED, short event UNUSED, void * vio)
 {
     int res;
     int e;
@@ -275,7 +307,7 @@ event_read_cb (evutil_socket_t fd, short event UNUSED, void * vio)
     }
 
     EVUTIL_SET_SOCKET_ERROR (0);
-    res = evbuffer_read (io->inbuf, fd, (int)howmuch);
+    res = io_read (io, howmuch);
     e = EVUTIL_SOCKET_ERROR ();
 
     if (res > 0)
@@ -309,14 +341,14 @@ event_read_cb (evutil_socket_t fd, short event UNUSED, void * vio)
 }
 
 static int
-tr_evbuffer_write (tr_peerIo * io, int fd, size_t howmuch)
+tr_evbuffer_write (tr_peerIo * io, size_t howmuch)
 {
     int e;
     int n;
     char errstr[256];
 
     EVUTIL_SET_SOCKET_ERROR (0);
-    n = evbuffer_write_atmost (io->outbuf, fd, howmuch);
+    n = io_write (io, howmuch);
     e = EVUTIL_SOCKET_ERROR ();
     dbgmsg (io, "wrote %d to peer (%s)", n, (n==-1?tr_net_strerror (errstr,sizeof (errstr),e):""));
 
@@ -324,7 +356,7 @@ tr_evbuffer_write (tr_peerIo * io, int fd, size_t howmuch)
 }
 
 static void
-event_write_cb (evutil_socket_t fd, short event UNUSED, void * vio)
+event_write_cb (evutil_socket_t fd UNUSED, short event UNUSED, void * vio)
 {
     int res = 0;
     int e;
@@ -352,7 +384,7 @@ event_write_cb (evutil_socket_t fd, short event UNUSED, void * vio)
     }
 
     EVUTIL_SET_SOCKET_ERROR (0);
-    res = tr_evbuffer_write (io, fd, howmuch);
+    res = tr_evbuffer_write (io, howmuch);
     e = EVUTIL_SOCKET_ERROR ();
 
     if (res == -1) {
@@ -387,6 +419,40 @@ event_write_cb (evutil_socket_t fd, short event UNUSED, void * vio)
         io->gotError (io, what, io->userData);
 }
 
+static void
+conn_event_cb (void * vio, short what)
+{
+    tr_peerIo * io = vio;
+    struct tr_io_conn * conn = io->conn;
+
+    tr_peerIoRef (io);
+
+    if (what & EV_READ)
+        event_read_cb (io->socket, EV_READ, io);
+
+    /* unless the read callback closed or reconnected the socket */
+    if ((what & EV_WRITE) && io->conn == conn)
+        event_write_cb (io->socket, EV_WRITE, io);
+
+    tr_peerIoUnref (io);
+}
+
+static void
+io_watch_socket (tr_peerIo * io)
+{
+    tr_session * session = io->session;
+
+    if (session->ioLoops != NULL && io->socket != TR_BAD_SOCKET)
+    {
+        io->conn = tr_ioConnNew (session->ioLoops, io->socket, conn_event_cb, io);
+    }
+    else
+    {
+        io->event_read = event_new (session->event_base, io->socket, EV_READ, event_read_cb, io);
+        io->event_write = event_new (session->event_base, io->socket, EV_WRITE, event_write_cb, io);
+    }
+}
+
 /**
 ***
 **/
@@ -628,10 +694,7 @@ tr_peerIoNew (tr_session       * session,
     dbgmsg (io, "socket is %"TR_PRI_SOCK", utp_socket is %p", socket, (void*)utp_socket);
 
     if (io->socket != TR_BAD_SOCKET) {
-        io->event_read = event_new (session->event_base,
-                                    io->socket, EV_READ, event_read_cb, io);
-        io->event_write = event_new (session->event_base,
-                                     io->socket, EV_WRITE, event_write_cb, io);
+        io_watch_socket (io);
     }
 #ifdef WITH_UTP
     else {
@@ -707,7 +770,7 @@ event_enable (tr_peerIo * io, short event)
     assert (io->session != NULL);
     assert (io->session->events != NULL);
 
-    if (io->socket != TR_BAD_SOCKET)
+    if (io->socket != TR_BAD_SOCKET && io->conn == NULL)
     {
         assert (event_initialized (io->event_read));
         assert (event_initialized (io->event_write));
@@ -716,7 +779,9 @@ event_enable (tr_peerIo * io, short event)
     if ((event & EV_READ) && ! (io->pendingEvents & EV_READ))
     {
         dbgmsg (io, "enabling ready-to-read polling");
-        if (io->socket != TR_BAD_SOCKET)
+        if (io->conn != NULL)
+            tr_ioConnWatch (io->conn, EV_READ, true);
+        else if (io->socket != TR_BAD_SOCKET)
             event_add (io->event_read, NULL);
         io->pendingEvents |= EV_READ;
     }
@@ -724,7 +789,9 @@ event_enable (tr_peerIo * io, short event)
     if ((event & EV_WRITE) && ! (io->pendingEvents & EV_WRITE))
     {
         dbgmsg (io, "enabling ready-to-write polling");
-        if (io->socket != TR_BAD_SOCKET)
+        if (io->conn != NULL)
+            tr_ioConnWatch (io->conn, EV_WRITE, true);
+        else if (io->socket != TR_BAD_SOCKET)
             event_add (io->event_write, NULL);
         io->pendingEvents |= EV_WRITE;
     }
@@ -737,7 +804,7 @@ event_disable (struct tr_peerIo * io, short event)
     assert (io->session != NULL);
     assert (io->session->events != NULL);
 
-    if (io->socket != TR_BAD_SOCKET)
+    if (io->socket != TR_BAD_SOCKET && io->conn == NULL)
     {
         assert (event_initialized (io->event_read));
         assert (event_initialized (io->event_write));
@@ -746,7 +813,9 @@ event_disable (struct tr_peerIo * io, short event)
     if ((event & EV_READ) && (io->pendingEvents & EV_READ))
     {
         dbgmsg (io, "disabling ready-to-read polling");
-        if (io->socket != TR_BAD_SOCKET)
+        if (io->conn != NULL)
+            tr_ioConnWatch (io->conn, EV_READ, false);
+        else if (io->socket != TR_BAD_SOCKET)
             event_del (io->event_read);
         io->pendingEvents &= ~EV_READ;
     }
@@ -754,7 +823,9 @@ event_disable (struct tr_peerIo * io, short event)
     if ((event & EV_WRITE) && (io->pendingEvents & EV_WRITE))
     {
         dbgmsg (io, "disabling ready-to-write polling");
-        if (io->socket != TR_BAD_SOCKET)
+        if (io->conn != NULL)
+            tr_ioConnWatch (io->conn, EV_WRITE, false);
+        else if (io->socket != TR_BAD_SOCKET)
             event_del (io->event_write);
         io->pendingEvents &= ~EV_WRITE;
     }
@@ -784,6 +855,13 @@ tr_peerIoSetEnabled (tr_peerIo    * io,
 static void
 io_close_socket (tr_peerIo * io)
 {
+    if (io->conn != NULL) {
+        /* this closes the socket once the loop is done with it */
+        tr_ioConnFree (io->conn);
+        io->conn = NULL;
+        io->socket = TR_BAD_SOCKET;
+    }
+
     if (io->socket != TR_BAD_SOCKET) {
         tr_netClose (io->session, io->socket);
         io->socket = TR_BAD_SOCKET;
@@ -924,6 +1002,7 @@ tr_peerIoReconnect (tr_peerIo * io)
 
     assert (tr_isPeerIo (io));
     assert (!tr_peerIoIsIncoming (io));
+    assert (!io->decryptOnLoop);
 
     session = tr_peerIoGetSession (io);
 
@@ -933,8 +1012,7 @@ tr_peerIoReconnect (tr_peerIo * io)
     io_close_socket (io);
 
     io->socket = tr_netOpenPeerSocket (session, &io->addr, io->port, io->isSeed);
-    io->event_read = event_new (session->event_base, io->socket, EV_READ, event_read_cb, io);
-    io->event_write = event_new (session->event_base, io->socket, EV_WRITE, event_write_cb, io);
+    io_watch_socket (io);
 
     if (io->socket != TR_BAD_SOCKET)
     {
@@ -1033,6 +1111,9 @@ tr_peerIoSetEncryption (tr_peerIo * io, tr_encryption_type encryption_type)
     assert (encryption_type == PEER_ENCRYPTION_NONE
          || encryption_type == PEER_ENCRYPTION_RC4);
 
+    /* bytes that were already decrypted can't be un-decrypted */
+    assert (io->inbufDecrypted == 0 || encryption_type == io->encryption_type);
+
     io->encryption_type = encryption_type;
 }
 
@@ -1048,21 +1129,34 @@ processBuffer (tr_crypto        * crypto,
                void            (* callback) (tr_crypto *, size_t, const void *, void *))
 {
     struct evbuffer_ptr pos;
-    struct evbuffer_iovec iovec;
+    struct evbuffer_iovec iovecs[CRYPTO_IOVEC_COUNT];
+
+    if (size == 0)
+        return;
 
     evbuffer_ptr_set (buffer, &pos, offset, EVBUFFER_PTR_SET);
 
-    do
+    while (size > 0)
     {
-        if (evbuffer_peek (buffer, size, &pos, &iovec, 1) <= 0)
+        int i;
+        size_t batch = 0;
+        const int n = MIN (evbuffer_peek (buffer, size, &pos, iovecs, CRYPTO_IOVEC_COUNT),
+                           CRYPTO_IOVEC_COUNT);
+
+        if (n <= 0)
             break;
 
-        callback (crypto, iovec.iov_len, iovec.iov_base, iovec.iov_base);
+        for (i=0; i<n && size > 0; ++i)
+        {
+            const size_t len = MIN (iovecs[i].iov_len, size);
+            callback (crypto, len, iovecs[i].iov_base, iovecs[i].iov_base);
+            size -= len;
+            batch += len;
+        }
 
-        assert (size >= iovec.iov_len);
-        size -= iovec.iov_len;
+        if (size > 0 && evbuffer_ptr_set (buffer, &pos, batch, EVBUFFER_PTR_ADD))
+            break;
     }
-    while (!evbuffer_ptr_set (buffer, &pos, iovec.iov_len, EVBUFFER_PTR_ADD));
 
     assert (size == 0);
 }
@@ -1157,6 +1251,55 @@ maybeDecryptBuffer (tr_peerIo       * io,
         processBuffer (&io->crypto, buf, offset, size, &tr_cryptoDecrypt);
 }
 
+/* If decrypting ahead, decrypt whatever has arrived in the read buffer
+   since the last time, and account for the byteCount bytes that are
+   about to be taken from it. Returns false if the caller has to decrypt
+   the bytes itself. */
+static bool
+decryptAhead (tr_peerIo * io, struct evbuffer * inbuf, size_t byteCount)
+{
+    size_t len;
+
+    if (!io->decryptAhead || inbuf != io->inbuf || io->encryption_type != PEER_ENCRYPTION_RC4)
+        return false;
+
+    len = evbuffer_get_length (inbuf);
+    if (io->inbufDecrypted < len)
+    {
+        assert (!io->decryptOnLoop);
+        maybeDecryptBuffer (io, inbuf, io->inbufDecrypted, len - io->inbufDecrypted);
+        io->inbufDecrypted = len;
+    }
+
+    assert (io->inbufDecrypted >= byteCount);
+    io->inbufDecrypted -= byteCount;
+    return true;
+}
+
+void
+tr_peerIoSetDecryptAhead (tr_peerIo * io, bool enabled)
+{
+    assert (tr_isPeerIo (io));
+    assert (enabled || io->inbufDecrypted == 0);
+    assert (enabled || !io->decryptOnLoop);
+
+    io->decryptAhead = enabled;
+
+    /* the keys are settled, so the i/o loop can decrypt the rest of the
+       stream as it reads it. whatever has reached inbuf already is
+       decrypted here first, since it comes before what the loop has */
+    if (enabled && io->conn != NULL && io->encryption_type == PEER_ENCRYPTION_RC4 && !io->decryptOnLoop)
+    {
+        const size_t len = evbuffer_get_length (io->inbuf);
+
+        maybeDecryptBuffer (io, io->inbuf, io->inbufDecrypted, len - io->inbufDecrypted);
+        io->inbufDecrypted = len;
+
+        tr_ioConnSetDecryptKey (io->conn, tr_cryptoDecryptTakeKey (&io->crypto));
+        io->decryptOnLoop = true;
+    }
+}
+
 void
 tr_peerIoReadBytesToBuf (tr_peerIo * io, struct evbuffer * inbuf, struct evbuffer * outbuf, size_t byteCount)
 {
@@ -1166,6 +1309,12 @@ tr_peerIoReadBytesToBuf (tr_peerIo * io, struct evbuffer * inbuf, struct evbuffe
     assert (tr_isPeerIo (io));
     assert (evbuffer_get_length (inbuf) >= byteCount);
 
+    if (decryptAhead (io, inbuf, byteCount))
+    {
+        evbuffer_remove_buffer (inbuf, outbuf, byteCount);
+        return;
+    }
+
     /* append it to outbuf */
     tmp = evbuffer_new ();
     evbuffer_remove_buffer (inbuf, tmp, byteCount);
@@ -1188,6 +1337,11 @@ tr_peerIoReadBytes (tr_peerIo * io, struct evbuffer * inbuf, void * bytes, size_
             break;
 
         case PEER_ENCRYPTION_RC4:
+            if (decryptAhead (io, inbuf, byteCount))
+            {
+                evbuffer_remove (inbuf, bytes, byteCount);
+                break;
+            }
             evbuffer_remove (inbuf, bytes, byteCount);
             tr_cryptoDecrypt (&io->crypto, byteCount, bytes, bytes);
             break;
@@ -1224,6 +1378,12 @@ tr_peerIoDrain (tr_peerIo       * io,
     char buf[4096];
     const size_t buflen = sizeof (buf);
 
+    if (decryptAhead (io, inbuf, byteCount))
+    {
+        evbuffer_drain (inbuf, byteCount);
+        return;
+    }
+
     while (byteCount > 0)
     {
         const size_t thisPass = MIN (byteCount, buflen);
@@ -1257,7 +1417,7 @@ tr_peerIoTryRead (tr_peerIo * io, size_t howmuch)
             char err_buf[512];
 
             EVUTIL_SET_SOCKET_ERROR (0);
-            res = evbuffer_read (io->inbuf, io->socket, (int)howmuch);
+            res = io_read (io, howmuch);
             e = EVUTIL_SOCKET_ERROR ();
 
             dbgmsg (io, "read %d from peer (%s)", res,
@@ -1303,7 +1463,7 @@ tr_peerIoTryWrite (tr_peerIo * io, size_t howmuch)
             int e;
 
             EVUTIL_SET_SOCKET_ERROR (0);
-            n = tr_evbuffer_write (io, io->socket, howmuch);
+            n = tr_evbuffer_write (io, howmuch);
             e = EVUTIL_SOCKET_ERROR ();
 
             if (n > 0)
@@ -83,6 +83,11 @@ typedef struct tr_peerIo
     tr_encryption_type    encryption_type;
     bool                  isSeed;
 
+    /* see tr_peerIoSetDecryptAhead () */
+    bool                  decryptAhead;
+    bool                  decryptOnLoop;
+    size_t                inbufDecrypted;
+
     tr_port               port;
     tr_socket_t           socket;
     struct UTPSocket    * utp_socket;
@@ -110,6 +115,10 @@ typedef struct tr_peerIo
 
     struct event        * event_read;
     struct event        * event_write;
+
+    /* if the session has peer i/o loops, this is used instead of
+       event_read and event_write to do a TCP socket's i/o */
+    struct tr_io_conn   * conn;
 }
 tr_peerIo;
 
@@ -284,6 +293,20 @@ static inline tr_crypto * tr_peerIoGetCrypto (tr_peerIo * io)
 
 void tr_peerIoSetEncryption (tr_peerIo * io, tr_encryption_type encryption_type);
 
+/**
+ * @brief decrypt all of the read buffer at once, instead of field by field.
+ *
+ * When this is on, the first read from the read buffer decrypts everything
+ * that's in it, and later reads only decrypt what has arrived since.
+ * It must only be turned on once the encryption type won't change again,
+ * and the read buffer must then only be consumed with the tr_peerIoRead*
+ * and tr_peerIoDrain () functions.
+ *
+ * If the socket is served by a peer i/o loop, the loop takes over the
+ * decryption and can't give it back, so this can't be turned off again.
+ */
+void tr_peerIoSetDecryptAhead (tr_peerIo * io, bool enabled);
+
 static inline bool
 tr_peerIoIsEncrypted (const tr_peerIo * io)
 {
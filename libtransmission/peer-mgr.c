@@ -30,6 +30,7 @@
 #include "peer-io.h"
 #include "peer-mgr.h"
 #include "peer-msgs.h"
+#include "picker.h"
 #include "ptrarray.h"
 #include "session.h"
 #include "stats.h" /* tr_statsAddUploaded, tr_statsAddDownloaded */
@@ -163,22 +164,33 @@ struct block_request
   tr_block_index_t block;
   tr_peer * peer;
   time_t sentAt;
+
+  /* links, as indices into request_table::entries.
+     hashNext doubles as the free list's link */
+  int hashNext;
+  int older;
+  int newer;
+};
+
+/* the pending block requests, hashed by block and chained oldest-to-newest */
+struct request_table
+{
+  struct block_request * entries;
+  int                  * buckets;
+  int                    bucketCount; /* a power of two */
+  int                    alloc;
+  int                    count;
+  int                    freeList;
+  int                    oldest;
+  int                    newest;
 };
 
 struct weighted_piece
 {
-  tr_piece_index_t index;
   int16_t salt;
   int16_t requestCount;
 };
 
-enum piece_sort_state
-{
-  PIECES_UNSORTED,
-  PIECES_SORTED_BY_INDEX,
-  PIECES_SORTED_BY_WEIGHT
-};
-
 /** @brief Opaque, per-torrent data structure for peer connection information */
 typedef struct tr_swarm
 {
@@ -198,13 +210,14 @@ typedef struct tr_swarm
   bool                       isRunning;
   bool                       needsCompletenessCheck;
 
-  struct block_request     * requests;
-  int                        requestCount;
-  int                        requestAlloc;
+  struct request_table       requests;
 
+  /* per-piece request counts and salts, indexed by piece */
   struct weighted_piece    * pieces;
-  int                        pieceCount;
-  enum piece_sort_state      pieceSortState;
+
+  /* the pieces we want to request, ordered by pieceWeight () */
+  tr_picker                  picker;
+  bool                       pieceWeightsAreStale;
 
   /* An array of pieceCount items stating how many peers have each piece.
      This is used to help us for downloading pieces "rarest first."
@@ -508,8 +521,10 @@ swarmFree (void * vs)
 
   replicationFree (s);
 
-  tr_free (s->requests);
+  tr_free (s->requests.entries);
+  tr_free (s->requests.buckets);
   tr_free (s->pieces);
+  tr_pickerDestruct (&s->picker);
   tr_free (s);
 }
 
@@ -546,6 +561,10 @@ swarmNew (tr_peerMgr * manager, tr_torrent * tor)
   s->peers = TR_PTR_ARRAY_INIT;
   s->webseeds = TR_PTR_ARRAY_INIT;
   s->outgoingHandshakes = TR_PTR_ARRAY_INIT;
+  s->picker = TR_PICKER_INIT;
+  s->requests.freeList = -1;
+  s->requests.oldest = -1;
+  s->requests.newest = -1;
 
   rebuildWebseedArray (s, tor);
 
@@ -711,13 +730,14 @@ tr_peerMgrSetUtpFailed (tr_torrent *tor, const tr_address *addr, bool failed)
 ***
 *** There are two data structures associated with managing block requests:
 ***
-*** 1. tr_swarm::requests, an array of "struct block_request" which keeps
+*** 1. tr_swarm::requests, a table of "struct block_request" which keeps
 ***    track of which blocks have been requested, and when, and by which peers.
-***    This is list is used for (a) cancelling requests that have been pending
-***    for too long and (b) avoiding duplicate requests before endgame.
+***    It's hashed by block for (a) avoiding duplicate requests before endgame,
+***    and chained in the order the requests were sent for (b) cancelling
+***    requests that have been pending for too long.
 ***
-*** 2. tr_swarm::pieces, an array of "struct weighted_piece" which lists the
-***    pieces that we want to request. It's used to decide which blocks to
+*** 2. tr_swarm::picker, a tr_picker which lists the pieces that we want
+***    to request, ordered by weight. It's used to decide which blocks to
 ***    return next when tr_peerMgrGetBlockRequests () is called.
 **/
 
@@ -725,54 +745,88 @@ tr_peerMgrSetUtpFailed (tr_torrent *tor, const tr_address *addr, bool failed)
 *** struct block_request
 **/
 
-static int
-compareReqByBlock (const void * va, const void * vb)
+static inline int
+requestHash (const struct request_table * t, tr_block_index_t block)
 {
-  const struct block_request * a = va;
-  const struct block_request * b = vb;
+  uint32_t h = block;
 
-  /* primary key: block */
-  if (a->block < b->block) return -1;
-  if (a->block > b->block) return 1;
+  h ^= h >> 16;
+  h *= 0x45d9f3bu;
+  h ^= h >> 16;
 
-  /* secondary key: peer */
-  if (a->peer < b->peer) return -1;
-  if (a->peer > b->peer) return 1;
+  return h & (t->bucketCount - 1);
+}
 
-  return 0;
+static void
+requestTableRehash (struct request_table * t, int bucketCount)
+{
+  int i;
+
+  tr_free (t->buckets);
+  t->bucketCount = bucketCount;
+  t->buckets = tr_new (int, bucketCount);
+  for (i=0; i<bucketCount; ++i)
+    t->buckets[i] = -1;
+
+  for (i=t->oldest; i!=-1; i=t->entries[i].newer)
+    {
+      const int bucket = requestHash (t, t->entries[i].block);
+      t->entries[i].hashNext = t->buckets[bucket];
+      t->buckets[bucket] = i;
+    }
 }
 
 static void
 requestListAdd (tr_swarm * s, tr_block_index_t block, tr_peer * peer)
 {
-  struct block_request key;
+  int i;
+  int bucket;
+  struct block_request * b;
+  struct request_table * t = &s->requests;
 
   /* ensure enough room is available... */
-  if (s->requestCount + 1 >= s->requestAlloc)
+  if (t->freeList == -1)
     {
-      const int CHUNK_SIZE = 128;
-      s->requestAlloc += CHUNK_SIZE;
-      s->requests = tr_renew (struct block_request,
-                              s->requests, s->requestAlloc);
+      const int oldAlloc = t->alloc;
+
+      t->alloc = MAX (128, oldAlloc * 2);
+      t->entries = tr_renew (struct block_request, t->entries, t->alloc);
+
+      for (i=t->alloc-1; i>=oldAlloc; --i)
+        {
+          t->entries[i].hashNext = t->freeList;
+          t->freeList = i;
+        }
     }
 
+  /* keep the load factor at or below 1 */
+  if (t->count + 1 > t->bucketCount)
+    requestTableRehash (t, MAX (128, t->bucketCount * 2));
+
+  i = t->freeList;
+  b = &t->entries[i];
+  t->freeList = b->hashNext;
+
   /* populate the record we're inserting */
-  key.block = block;
-  key.peer = peer;
-  key.sentAt = tr_time ();
+  b->block = block;
+  b->peer = peer;
+  b->sentAt = tr_time ();
+
+  /* add it to its hash bucket... */
+  bucket = requestHash (t, block);
+  b->hashNext = t->buckets[bucket];
+  t->buckets[bucket] = i;
+
+  /* ...and to the newest end of the list, which keeps it sorted by sentAt */
+  b->older = t->newest;
+  b->newer = -1;
+  if (t->newest != -1)
+    t->entries[t->newest].newer = i;
+  else
+    t->oldest = i;
+  t->newest = i;
 
-  /* insert the request to our array... */
-  {
-    bool exact;
-    const int pos = tr_lowerBound (&key, s->requests, s->requestCount,
-                                   sizeof (struct block_request),
-                                   compareReqByBlock, &exact);
-    assert (!exact);
-    memmove (s->requests + pos + 1,
-             s->requests + pos,
-             sizeof (struct block_request) * (s->requestCount++ - pos));
-    s->requests[pos] = key;
-  }
+  ++t->count;
 
   if (peer != NULL)
     {
@@ -782,19 +836,23 @@ requestListAdd (tr_swarm * s, tr_block_index_t block, tr_peer * peer)
 
   /*fprintf (stderr, "added request of block %lu from peer %s... "
                      "there are now %d block\n",
-                     (unsigned long)block, tr_atomAddrStr (peer->atom), s->requestCount);*/
+                     (unsigned long)block, tr_atomAddrStr (peer->atom), t->count);*/
 }
 
 static struct block_request *
 requestListLookup (tr_swarm * s, tr_block_index_t block, const tr_peer * peer)
 {
-  struct block_request key;
-  key.block = block;
-  key.peer = (tr_peer*) peer;
+  int i;
+  struct request_table * t = &s->requests;
+
+  if (t->count == 0)
+    return NULL;
+
+  for (i=t->buckets[requestHash (t, block)]; i!=-1; i=t->entries[i].hashNext)
+    if ((t->entries[i].block == block) && (t->entries[i].peer == peer))
+      return &t->entries[i];
 
-  return bsearch (&key, s->requests, s->requestCount,
-                  sizeof (struct block_request),
-                  compareReqByBlock);
+  return NULL;
 }
 
 /**
@@ -805,24 +863,15 @@ static void
 getBlockRequestPeers (tr_swarm * s, tr_block_index_t block,
                       tr_ptrArray * peerArr)
 {
-  bool exact;
-  int i, pos;
-  struct block_request key;
-
-  key.block = block;
-  key.peer = NULL;
-  pos = tr_lowerBound (&key, s->requests, s->requestCount,
-                       sizeof (struct block_request),
-                       compareReqByBlock, &exact);
+  int i;
+  struct request_table * t = &s->requests;
 
-  assert (!exact); /* shouldn't have a request with .peer == NULL */
+  if (t->count == 0)
+    return;
 
-  for (i=pos; i<s->requestCount; ++i)
-    {
-      if (s->requests[i].block != block)
-        break;
-      tr_ptrArrayAppend (peerArr, s->requests[i].peer);
-    }
+  for (i=t->buckets[requestHash (t, block)]; i!=-1; i=t->entries[i].hashNext)
+    if (t->entries[i].block == block)
+      tr_ptrArrayAppend (peerArr, t->entries[i].peer);
 }
 
 static void
@@ -833,26 +882,49 @@ decrementPendingReqCount (const struct block_request * b)
       --b->peer->pendingReqsToPeer;
 }
 
+/* unlink a request from the table without touching the peer's pending count */
+static void
+requestTableRemove (struct request_table * t, struct block_request * b)
+{
+  int * walk;
+  const int i = b - t->entries;
+
+  assert (0 <= i && i < t->alloc);
+
+  /* remove it from its hash bucket... */
+  for (walk=&t->buckets[requestHash (t, b->block)]; *walk!=i; walk=&t->entries[*walk].hashNext)
+    assert (*walk != -1);
+  *walk = b->hashNext;
+
+  /* ...and from the sentAt list */
+  if (b->older != -1)
+    t->entries[b->older].newer = b->newer;
+  else
+    t->oldest = b->newer;
+  if (b->newer != -1)
+    t->entries[b->newer].older = b->older;
+  else
+    t->newest = b->older;
+
+  b->hashNext = t->freeList;
+  t->freeList = i;
+  --t->count;
+}
+
 static void
 requestListRemove (tr_swarm * s, tr_block_index_t block, const tr_peer * peer)
 {
-  const struct block_request * b = requestListLookup (s, block, peer);
+  struct block_request * b = requestListLookup (s, block, peer);
 
   if (b != NULL)
     {
-      const int pos = b - s->requests;
-      assert (pos < s->requestCount);
-
       decrementPendingReqCount (b);
 
-      tr_removeElementFromArray (s->requests,
-                                 pos,
-                                 sizeof (struct block_request),
-                                 s->requestCount--);
+      requestTableRemove (&s->requests, b);
 
       /*fprintf (stderr, "removing request of block %lu from peer %s... "
                          "there are now %d block requests left\n",
-                         (unsigned long)block, tr_atomAddrStr (peer->atom), t->requestCount);*/
+                         (unsigned long)block, tr_atomAddrStr (peer->atom), s->requests.count);*/
     }
 }
 
@@ -880,14 +952,14 @@ testForEndgame (const tr_swarm * s)
 {
   /* we consider ourselves to be in endgame if the number of bytes
      we've got requested is >= the number of bytes left to download */
-  return ((uint64_t) s->requestCount * s->tor->blockSize)
+  return ((uint64_t) s->requests.count * s->tor->blockSize)
                >= tr_torrentGetLeftUntilDone (s->tor);
 }
 
 static void
 updateEndgame (tr_swarm * s)
 {
-  assert (s->requestCount >= 0);
+  assert (s->requests.count >= 0);
 
   if (!testForEndgame (s))
     {
@@ -912,7 +984,7 @@ updateEndgame (tr_swarm * s)
       numDownloading += countActiveWebseeds (s);
 
       /* average number of pending requests per downloading peer */
-      s->endgame = s->requestCount / MAX (numDownloading, 1);
+      s->endgame = s->requests.count / MAX (numDownloading, 1);
     }
 }
 
@@ -926,91 +998,107 @@ updateEndgame (tr_swarm * s)
 static inline void
 invalidatePieceSorting (tr_swarm * s)
 {
-  s->pieceSortState = PIECES_UNSORTED;
+  s->pieceWeightsAreStale = true;
 }
 
-static const tr_torrent * weightTorrent;
+/* A piece's weight is packed into a picker key s.t. lower keys sort first:
+ * bits 34..49 hold the piece's request weight,
+ * bits 32..33 hold its inverted priority,
+ * bits 16..31 hold its replication count, and
+ * bits  0..15 hold its salt. */
+enum
+{
+  WEIGHT_SHIFT = 34,
+  PRIORITY_SHIFT = 32,
+  REPLICATION_SHIFT = 16
+};
 
-static const uint16_t * weightReplication;
+#define REPLICATION_MASK ((uint64_t)0xFFFF << REPLICATION_SHIFT)
 
 static void
-setComparePieceByWeightTorrent (tr_swarm * s)
+ensureReplicationExists (tr_swarm * s)
 {
   if (!replicationExists (s))
-    replicationNew (s);
-
-  weightTorrent = s->tor;
-  weightReplication = s->pieceReplication;
+    {
+      replicationNew (s);
+      invalidatePieceSorting (s);
+    }
 }
 
 /* we try to create a "weight" s.t. high-priority pieces come before others,
  * and that partially-complete pieces come before empty ones. */
-static int
-comparePieceByWeight (const void * va, const void * vb)
+static uint64_t
+pieceWeight (const tr_swarm * s, tr_piece_index_t index)
 {
-  const struct weighted_piece * a = va;
-  const struct weighted_piece * b = vb;
-  int ia, ib, missing, pending;
-  const tr_torrent * tor = weightTorrent;
-  const uint16_t * rep = weightReplication;
+  uint64_t key;
+  int weight;
+  const tr_torrent * tor = s->tor;
+  const struct weighted_piece * p = &s->pieces[index];
+  const int missing = tr_torrentMissingBlocksInPiece (tor, index);
+  const int pending = p->requestCount;
 
   /* primary key: weight */
-  missing = tr_torrentMissingBlocksInPiece (tor, a->index);
-  pending = a->requestCount;
-  ia = missing > pending ? missing - pending : (tor->blockCountInPiece + pending);
-  missing = tr_torrentMissingBlocksInPiece (tor, b->index);
-  pending = b->requestCount;
-  ib = missing > pending ? missing - pending : (tor->blockCountInPiece + pending);
-  if (ia < ib) return -1;
-  if (ia > ib) return 1;
+  weight = missing > pending ? missing - pending : (int)(tor->blockCountInPiece + pending);
+  key = (uint64_t) MIN (weight, 0xFFFF) << WEIGHT_SHIFT;
 
   /* secondary key: higher priorities go first */
-  ia = tor->info.pieces[a->index].priority;
-  ib = tor->info.pieces[b->index].priority;
-  if (ia > ib) return -1;
-  if (ia < ib) return 1;
+  key |= (uint64_t)(TR_PRI_HIGH - tor->info.pieces[index].priority) << PRIORITY_SHIFT;
 
   /* tertiary key: rarest first. */
-  ia = rep[a->index];
-  ib = rep[b->index];
-  if (ia < ib) return -1;
-  if (ia > ib) return 1;
+  key |= (uint64_t) s->pieceReplication[index] << REPLICATION_SHIFT;
 
   /* quaternary key: random */
-  if (a->salt < b->salt) return -1;
-  if (a->salt > b->salt) return 1;
+  key |= (uint16_t) p->salt;
 
-  /* okay, they're equal */
-  return 0;
+  return key;
 }
 
-static int
-comparePieceByIndex (const void * va, const void * vb)
+static void
+pieceListResortPiece (tr_swarm * s, tr_piece_index_t index)
 {
-  const struct weighted_piece * a = va;
-  const struct weighted_piece * b = vb;
-  if (a->index < b->index) return -1;
-  if (a->index > b->index) return 1;
-  return 0;
+  if (!replicationExists (s))
+    invalidatePieceSorting (s);
+  else if (!s->pieceWeightsAreStale && tr_pickerHas (&s->picker, index))
+    tr_pickerSet (&s->picker, index, pieceWeight (s, index));
 }
 
 static void
-pieceListSort (tr_swarm * s, enum piece_sort_state state)
+pieceListResortAll (tr_swarm * s)
 {
-  assert (state==PIECES_SORTED_BY_INDEX
-       || state==PIECES_SORTED_BY_WEIGHT);
+  tr_piece_index_t i;
+  tr_piece_index_t * pieces;
+  tr_piece_index_t n = 0;
 
-  if (state == PIECES_SORTED_BY_WEIGHT)
-    {
-      setComparePieceByWeightTorrent (s);
-      qsort (s->pieces, s->pieceCount, sizeof (struct weighted_piece), comparePieceByWeight);
-    }
-  else
+  ensureReplicationExists (s);
+
+  /* collect them first, since re-keying moves them around in the picker */
+  pieces = tr_new (tr_piece_index_t, tr_pickerSize (&s->picker));
+  for (i=tr_pickerFirst (&s->picker); i!=TR_PICKER_NONE; i=tr_pickerNext (&s->picker, i))
+    pieces[n++] = i;
+
+  for (i=0; i<n; ++i)
+    tr_pickerSet (&s->picker, pieces[i], pieceWeight (s, pieces[i]));
+
+  s->pieceWeightsAreStale = false;
+  tr_free (pieces);
+}
+
+/* Every piece's replication count has changed by the same amount, so the
+ * pieces' order is unchanged. Patch their keys without moving them. */
+static void
+pieceListUpdateAllReplication (tr_swarm * s)
+{
+  tr_piece_index_t i;
+
+  if (s->pieceWeightsAreStale)
+    return;
+
+  for (i=tr_pickerFirst (&s->picker); i!=TR_PICKER_NONE; i=tr_pickerNext (&s->picker, i))
     {
-      qsort (s->pieces, s->pieceCount, sizeof (struct weighted_piece), comparePieceByIndex);
+      uint64_t key = tr_pickerGetKey (&s->picker, i) & ~REPLICATION_MASK;
+      key |= (uint64_t) s->pieceReplication[i] << REPLICATION_SHIFT;
+      tr_pickerSetInPlace (&s->picker, i, key);
     }
-
-  s->pieceSortState = state;
 }
 
 /**
@@ -1022,18 +1110,17 @@ pieceListSort (tr_swarm * s, enum piece_sort_state state)
 #define assertReplicationCountIsExact(t)
 #else
 static void
-assertWeightedPiecesAreSorted (Torrent * t)
+assertWeightedPiecesAreSorted (tr_swarm * s)
 {
-    if (!t->endgame)
+    if (!s->endgame && !s->pieceWeightsAreStale)
     {
-        int i;
-        setComparePieceByWeightTorrent (t);
-        for (i=0; i<t->pieceCount-1; ++i)
-            assert (comparePieceByWeight (&t->pieces[i], &t->pieces[i+1]) <= 0);
+        tr_piece_index_t i;
+        for (i=tr_pickerFirst (&s->picker); i!=TR_PICKER_NONE; i=tr_pickerNext (&s->picker, i))
+            assert (tr_pickerGetKey (&s->picker, i) == pieceWeight (s, i));
     }
 }
 static void
-assertReplicationCountIsExact (Torrent * t)
+assertReplicationCountIsExact (tr_swarm * t)
 {
     /* This assert might fail due to errors of implementations in other
      * clients. It happens when receiving duplicate bitfields/HaveAll/HaveNone
@@ -1062,161 +1149,62 @@ assertReplicationCountIsExact (Torrent * t)
 }
 #endif
 
-static struct weighted_piece *
-pieceListLookup (tr_swarm * s, tr_piece_index_t index)
-{
-  int i;
-
-  for (i=0; i<s->pieceCount; ++i)
-    if (s->pieces[i].index == index)
-      return &s->pieces[i];
-
-  return NULL;
-}
-
 static void
 pieceListRebuild (tr_swarm * s)
 {
   if (!tr_torrentIsSeed (s->tor))
     {
       tr_piece_index_t i;
-      tr_piece_index_t * pool;
-      tr_piece_index_t poolCount = 0;
       const tr_torrent * tor = s->tor;
       const tr_info * inf = tr_torrentInfo (tor);
-      struct weighted_piece * pieces;
-      int pieceCount;
 
-      /* build the new list */
-      pool = tr_new (tr_piece_index_t, inf->pieceCount);
-      for (i=0; i<inf->pieceCount; ++i)
-        if (!inf->pieces[i].dnd)
-          if (!tr_torrentPieceIsComplete (tor, i))
-            pool[poolCount++] = i;
-      pieceCount = poolCount;
-      pieces = tr_new0 (struct weighted_piece, pieceCount);
-      for (i=0; i<poolCount; ++i)
+      /* the piece count changes when a magnet link gets its metainfo */
+      if (tr_pickerPieceCount (&s->picker) != inf->pieceCount)
         {
-          struct weighted_piece * piece = pieces + i;
-          piece->index = pool[i];
-          piece->requestCount = 0;
-          piece->salt = tr_rand_int_weak (4096);
+          tr_pickerDestruct (&s->picker);
+          tr_pickerConstruct (&s->picker, inf->pieceCount);
+          tr_free (s->pieces);
+          s->pieces = tr_new0 (struct weighted_piece, inf->pieceCount);
+          for (i=0; i<inf->pieceCount; ++i)
+            s->pieces[i].salt = tr_rand_int_weak (4096);
         }
 
-      /* if we already had a list of pieces, merge it into
-       * the new list so we don't lose its requestCounts */
-      if (s->pieces != NULL)
+      /* pieces already in the picker keep their requestCounts */
+      for (i=0; i<inf->pieceCount; ++i)
         {
-          struct weighted_piece * o = s->pieces;
-          struct weighted_piece * oend = o + s->pieceCount;
-          struct weighted_piece * n = pieces;
-          struct weighted_piece * nend = n + pieceCount;
-
-          pieceListSort (s, PIECES_SORTED_BY_INDEX);
-
-          while (o!=oend && n!=nend)
+          if (!inf->pieces[i].dnd && !tr_torrentPieceIsComplete (tor, i))
             {
-              if (o->index < n->index)
-                ++o;
-              else if (o->index > n->index)
-                ++n;
-              else
-                *n++ = *o++;
+              if (!tr_pickerHas (&s->picker, i))
+                {
+                  s->pieces[i].requestCount = 0;
+                  tr_pickerSet (&s->picker, i, 0);
+                }
+            }
+          else
+            {
+              tr_pickerRemove (&s->picker, i);
             }
-
-          tr_free (s->pieces);
         }
 
-      s->pieces = pieces;
-      s->pieceCount = pieceCount;
-
-      pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
-
-      /* cleanup */
-      tr_free (pool);
+      pieceListResortAll (s);
     }
 }
 
 static void
 pieceListRemovePiece (tr_swarm * s, tr_piece_index_t piece)
 {
-  struct weighted_piece * p;
-
-  if ((p = pieceListLookup (s, piece)))
-    {
-      const int pos = p - s->pieces;
-
-      tr_removeElementFromArray (s->pieces,
-                                 pos,
-                                 sizeof (struct weighted_piece),
-                                 s->pieceCount--);
-
-      if (s->pieceCount == 0)
-        {
-          tr_free (s->pieces);
-          s->pieces = NULL;
-        }
-    }
-}
-
-static void
-pieceListResortPiece (tr_swarm * s, struct weighted_piece * p)
-{
-  int pos;
-  bool isSorted = true;
-
-  if (p == NULL)
-    return;
-
-  /* is the torrent already sorted? */
-  pos = p - s->pieces;
-  setComparePieceByWeightTorrent (s);
-  if (isSorted && (pos > 0) && (comparePieceByWeight (p-1, p) > 0))
-    isSorted = false;
-  if (isSorted && (pos < s->pieceCount - 1) && (comparePieceByWeight (p, p+1) > 0))
-    isSorted = false;
-
-  if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
-    {
-      pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
-      isSorted = true;
-    }
-
-  /* if it's not sorted, move it around */
-  if (!isSorted)
-    {
-      bool exact;
-      const struct weighted_piece tmp = *p;
-
-      tr_removeElementFromArray (s->pieces,
-                                 pos,
-                                 sizeof (struct weighted_piece),
-                                 s->pieceCount--);
-
-      pos = tr_lowerBound (&tmp, s->pieces, s->pieceCount,
-                           sizeof (struct weighted_piece),
-                           comparePieceByWeight, &exact);
-
-      memmove (&s->pieces[pos + 1],
-               &s->pieces[pos],
-               sizeof (struct weighted_piece) * (s->pieceCount++ - pos));
-
-      s->pieces[pos] = tmp;
-    }
-
-  assertWeightedPiecesAreSorted (s);
+  tr_pickerRemove (&s->picker, piece);
 }
 
 static void
 pieceListRemoveRequest (tr_swarm * s, tr_block_index_t block)
 {
-  struct weighted_piece * p;
   const tr_piece_index_t index = tr_torBlockPiece (s->tor, block);
 
-  if (((p = pieceListLookup (s, index))) && (p->requestCount > 0))
+  if (tr_pickerHas (&s->picker, index) && (s->pieces[index].requestCount > 0))
     {
-      --p->requestCount;
-      pieceListResortPiece (s, p);
+      --s->pieces[index].requestCount;
+      pieceListResortPiece (s, index);
     }
 }
 
@@ -1240,9 +1228,7 @@ tr_incrReplicationOfPiece (tr_swarm * s, const size_t index)
   /* One more replication of this piece is present in the swarm */
   ++s->pieceReplication[index];
 
-  /* we only resort the piece if the list is already sorted */
-  if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
-    pieceListResortPiece (s, pieceListLookup (s, index));
+  pieceListResortPiece (s, index);
 }
 
 /**
@@ -1258,11 +1244,13 @@ tr_incrReplicationFromBitfield (tr_swarm * s, const tr_bitfield * b)
   assert (replicationExists (s));
 
   for (i=0; i<n; ++i)
-    if (tr_bitfieldHas (b, i))
-      ++rep[i];
-
-  if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
-    invalidatePieceSorting (s);
+    {
+      if (tr_bitfieldHas (b, i))
+        {
+          ++rep[i];
+          pieceListResortPiece (s, i);
+        }
+    }
 }
 
 /**
@@ -1279,6 +1267,8 @@ tr_incrReplication (tr_swarm * s)
 
   for (i=0; i<n; ++i)
     ++s->pieceReplication[i];
+
+  pieceListUpdateAllReplication (s);
 }
 
 /**
@@ -1297,15 +1287,19 @@ tr_decrReplicationFromBitfield (tr_swarm * s, const tr_bitfield * b)
     {
       for (i=0; i<n; ++i)
         --s->pieceReplication[i];
+
+      pieceListUpdateAllReplication (s);
     }
   else if (!tr_bitfieldHasNone (b))
     {
       for (i=0; i<n; ++i)
-        if (tr_bitfieldHas (b, i))
-          --s->pieceReplication[i];
-
-      if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
-        invalidatePieceSorting (s);
+        {
+          if (tr_bitfieldHas (b, i))
+            {
+              --s->pieceReplication[i];
+              pieceListResortPiece (s, i);
+            }
+        }
     }
 }
 
@@ -1332,7 +1326,9 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
   int i;
   int got;
   tr_swarm * s;
-  struct weighted_piece * pieces;
+  tr_piece_index_t index;
+  tr_piece_index_t * touched;
+  int touchedCount = 0;
   const tr_bitfield * const have = &peer->have;
 
   /* sanity clause */
@@ -1344,30 +1340,37 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
   s = tor->swarm;
 
   /* prep the pieces list */
-  if (s->pieces == NULL)
+  if (tr_pickerSize (&s->picker) == 0)
     pieceListRebuild (s);
 
-  if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
-    pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
+  if (s->pieceWeightsAreStale || !replicationExists (s))
+    pieceListResortAll (s);
 
   assertReplicationCountIsExact (s);
   assertWeightedPiecesAreSorted (s);
 
   updateEndgame (s);
-  pieces = s->pieces;
-  for (i=0; i<s->pieceCount && got<numwant; ++i)
+
+  /* re-keying a piece moves it in the picker, so remember
+     which ones we've changed and resort them when we're done */
+  touched = tr_new (tr_piece_index_t, numwant);
+
+  for (index=tr_pickerFirst (&s->picker);
+       index!=TR_PICKER_NONE && got<numwant;
+       index=tr_pickerNext (&s->picker, index))
     {
-      struct weighted_piece * p = pieces + i;
+      struct weighted_piece * p = &s->pieces[index];
 
       /* if the peer has this piece that we want... */
-      if (tr_bitfieldHas (have, p->index))
+      if (tr_bitfieldHas (have, index))
         {
           tr_block_index_t b;
           tr_block_index_t first;
           tr_block_index_t last;
+          const int oldRequestCount = p->requestCount;
           tr_ptrArray peerArr = TR_PTR_ARRAY_INIT;
 
-          tr_torGetPieceBlockRange (tor, p->index, &first, &last);
+          tr_torGetPieceBlockRange (tor, index, &first, &last);
 
           for (b=first; b<=last && (got<numwant || (get_intervals && setme[2*got-1] == b-1)); ++b)
             {
@@ -1427,41 +1430,21 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
               ++p->requestCount;
             }
 
+          /* each piece we touch begins a new request or interval, so
+             there can't be more touched pieces than numwant */
+          if (p->requestCount != oldRequestCount)
+            touched[touchedCount++] = index;
+
           tr_ptrArrayDestruct (&peerArr, NULL);
         }
     }
 
-  /* In most cases we've just changed the weights of a small number of pieces.
-   * So rather than qsort ()ing the entire array, it's faster to apply an
-   * adaptive insertion sort algorithm. */
-  if (got > 0)
-    {
-      /* not enough requests || last piece modified */
-      if (i == s->pieceCount)
-        --i;
+  for (i=0; i<touchedCount; ++i)
+    pieceListResortPiece (s, touched[i]);
 
-      setComparePieceByWeightTorrent (s);
-      while (--i >= 0)
-        {
-          bool exact;
-
-          /* relative position! */
-          const int newpos = tr_lowerBound (&s->pieces[i], &s->pieces[i + 1],
-                                            s->pieceCount - (i + 1),
-                                            sizeof (struct weighted_piece),
-                                            comparePieceByWeight, &exact);
-          if (newpos > 0)
-            {
-              const struct weighted_piece piece = s->pieces[i];
-              memmove (&s->pieces[i],
-                       &s->pieces[i + 1],
-                       sizeof (struct weighted_piece) * (newpos));
-              s->pieces[i + newpos] = piece;
-            }
-        }
-    }
+  tr_free (touched);
 
-  assertWeightedPiecesAreSorted (t);
+  assertWeightedPiecesAreSorted (s);
   *numgot = got;
 }
 
@@ -1488,43 +1471,41 @@ refillUpkeep (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
     now = tr_time ();
     too_old = now - REQUEST_TTL_SECS;
 
-    /* alloc the temporary "cancel" buffer */
-    tor = NULL;
-    while ((tor = tr_torrentNext (mgr->session, tor)))
-        cancel_buflen = MAX (cancel_buflen, tor->swarm->requestCount);
-    if (cancel_buflen > 0)
-        cancel = tr_new (struct block_request, cancel_buflen);
-
     /* prune requests that are too old */
     tor = NULL;
     while ((tor = tr_torrentNext (mgr->session, tor)))
     {
         tr_swarm * s = tor->swarm;
-        const int n = s->requestCount;
-        if (n > 0)
+        struct request_table * t = &s->requests;
+
+        if (t->count > 0)
         {
-            int keepCount = 0;
+            int i;
             int cancelCount = 0;
             const struct block_request * it;
             const struct block_request * end;
 
-            for (it=s->requests, end=it+n; it!=end; ++it)
+            if (cancel_buflen < t->count)
             {
-                tr_peerMsgs * msgs = PEER_MSGS(it->peer);
+                cancel_buflen = t->count;
+                cancel = tr_renew (struct block_request, cancel, cancel_buflen);
+            }
+
+            /* the list is sorted by sentAt, so we can stop at the first young one */
+            for (i=t->oldest; i!=-1 && t->entries[i].sentAt<=too_old; )
+            {
+                struct block_request * b = &t->entries[i];
+                tr_peerMsgs * msgs = PEER_MSGS(b->peer);
 
-                if ((msgs !=NULL) && (it->sentAt <= too_old) && !tr_peerMsgsIsReadingBlock (msgs, it->block))
-                    cancel[cancelCount++] = *it;
-                else
+                i = b->newer;
+
+                if ((msgs != NULL) && !tr_peerMsgsIsReadingBlock (msgs, b->block))
                 {
-                    if (it != &s->requests[keepCount])
-                        s->requests[keepCount] = *it;
-                    keepCount++;
+                    cancel[cancelCount++] = *b;
+                    requestTableRemove (t, b);
                 }
             }
 
-            /* prune out the ones we aren't keeping */
-            s->requestCount = keepCount;
-
             /* send cancel messages for all the "cancel" ones */
             for (it=cancel, end=it+cancelCount; it!=end; ++it)
             {
@@ -1627,11 +1608,12 @@ static void
 peerDeclinedAllRequests (tr_swarm * s, const tr_peer * peer)
 {
   int i, n;
-  tr_block_index_t * blocks = tr_new (tr_block_index_t, s->requestCount);
+  const struct request_table * t = &s->requests;
+  tr_block_index_t * blocks = tr_new (tr_block_index_t, t->count);
 
-  for (i=n=0; i<s->requestCount; ++i)
-    if (peer == s->requests[i].peer)
-      blocks[n++] = s->requests[i].block;
+  for (i=t->oldest, n=0; i!=-1; i=t->entries[i].newer)
+    if (peer == t->entries[i].peer)
+      blocks[n++] = t->entries[i].block;
 
   for (i=0; i<n; ++i)
     removeRequestFromTables (s, blocks[i], peer);
@@ -1805,7 +1787,7 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vs)
           const tr_block_index_t block = _tr_block (tor, p, e->offset);
           cancelAllRequestsForBlock (s, block, peer);
           tr_historyAdd (&peer->blocksSentToClient, tr_time(), 1);
-          pieceListResortPiece (s, pieceListLookup (s, p));
+          pieceListResortPiece (s, p);
           tr_torrentGotBlock (tor, block);
           break;
         }
@@ -1932,6 +1914,7 @@ createBitTorrentPeer (tr_torrent       * tor,
 
   assert (swarm->stats.peerCount == tr_ptrArraySize (&swarm->peers));
   assert (swarm->stats.peerFromCount[atom->fromFirst] <= swarm->stats.peerCount);
+  tr_torrentMarkChanged (tor, TR_TORRENT_STATS);
 
   msgs = PEER_MSGS (peer);
   tr_peerMsgsUpdateActive (msgs, TR_UP);
@@ -2416,7 +2399,7 @@ tr_peerMgrStartTorrent (tr_torrent * tor)
 
   s->isRunning = true;
   s->maxPeers = tor->maxConnectedPeers;
-  s->pieceSortState = PIECES_UNSORTED;
+  invalidatePieceSorting (s);
 
   rechokePulse (0, 0, s->manager);
 }
@@ -3318,6 +3301,7 @@ removePeer (tr_swarm * s, tr_peer * peer)
 
   assert (s->stats.peerCount == tr_ptrArraySize (&s->peers));
   assert (s->stats.peerFromCount[atom->fromFirst] >= 0);
+  tr_torrentMarkChanged (s->tor, TR_TORRENT_STATS);
 
   tr_peerFree (peer);
 }
@@ -19,6 +19,7 @@
 #include "transmission.h"
 #include "cache.h"
 #include "completion.h"
+#include "inout.h" /* struct tr_io_extent */
 #include "file.h"
 #include "log.h"
 #include "peer-io.h"
@@ -151,7 +152,18 @@ struct tr_incoming
   uint8_t                id;
   uint32_t               length; /* includes the +1 for id length */
   struct peer_request    blockReq; /* metadata for incoming blocks */
-  struct evbuffer      * block; /* piece data for incoming blocks */
+  uint8_t              * block; /* piece data for incoming blocks, from tr_cacheAllocBlock () */
+  uint32_t               blockLength; /* how much of block has arrived */
+};
+
+/* a block that's being read from disk to upload to the peer */
+struct upload_read
+{
+  struct tr_peerMsgs   * msgs; /* NULL if the peer went away before the read finished */
+  tr_session           * session;
+  struct peer_request    req;
+  uint8_t              * block; /* from tr_cacheAllocBlock () */
+  struct upload_read   * next;
 };
 
 /**
@@ -246,6 +258,10 @@ struct tr_peerMsgs
 
   struct tr_incoming    incoming;
 
+  /* blocks being read asynchronously for the peer */
+  struct upload_read  * uploadReads;
+  int                   uploadReadCount;
+
   /* if the peer supports the Extension Protocol in BEP 10 and
      supplied a reqq argument, it's stored here. Otherwise, the
      value is zero and should be ignored. */
@@ -1262,7 +1278,7 @@ parseLtep (tr_peerMsgs * msgs, uint32_t msglen, struct evbuffer * inbuf)
     else
     {
         dbgmsg (msgs, "skipping unknown ltep message (%d)", (int)ltep_msgid);
-        evbuffer_drain (inbuf, msglen);
+        tr_peerIoDrain (msgs->io, inbuf, msglen);
     }
 }
 
@@ -1327,6 +1343,8 @@ static void
 prefetchPieces (tr_peerMsgs *msgs)
 {
   int i;
+  int n = 0;
+  struct tr_io_extent extents[PREFETCH_SIZE];
 
   if (!getSession (msgs)->isPrefetchEnabled)
     return;
@@ -1336,10 +1354,18 @@ prefetchPieces (tr_peerMsgs *msgs)
       const struct peer_request * req = msgs->peerAskedFor + i;
       if (requestIsValid (msgs, req))
         {
-          tr_cachePrefetchBlock (getSession (msgs)->cache, msgs->torrent, req->index, req->offset, req->length);
+          extents[n].piece = req->index;
+          extents[n].offset = req->offset;
+          extents[n].length = req->length;
+          extents[n].buf = NULL;
+          ++n;
           ++msgs->prefetchCount;
         }
     }
+
+  /* hand them all to the disk at once so that neighbouring blocks get merged */
+  if (n > 0)
+    tr_cachePrefetchBlocks (getSession (msgs)->cache, msgs->torrent, extents, n);
 }
 
 static void
@@ -1418,7 +1444,7 @@ messageLengthIsCorrect (const tr_peerMsgs * msg, uint8_t id, uint32_t len)
 }
 
 static int clientGotBlock (tr_peerMsgs *               msgs,
-                           struct evbuffer *           block,
+                           uint8_t *                   block,
                            const struct peer_request * req);
 
 static int
@@ -1448,29 +1474,34 @@ readBtPiece (tr_peerMsgs      * msgs,
         int err;
         size_t n;
         size_t nLeft;
-        struct evbuffer * block_buffer;
+        uint8_t * block;
 
+        /* read straight into a buffer that the cache can keep */
         if (msgs->incoming.block == NULL)
-            msgs->incoming.block = evbuffer_new ();
-        block_buffer = msgs->incoming.block;
+        {
+            msgs->incoming.block = tr_cacheAllocBlock (getSession (msgs)->cache);
+            msgs->incoming.blockLength = 0;
+        }
 
         /* read in another chunk of data */
-        nLeft = req->length - evbuffer_get_length (block_buffer);
+        nLeft = req->length - msgs->incoming.blockLength;
         n = MIN (nLeft, inlen);
 
-        tr_peerIoReadBytesToBuf (msgs->io, inbuf, block_buffer, n);
+        tr_peerIoReadBytes (msgs->io, inbuf, msgs->incoming.block + msgs->incoming.blockLength, n);
+        msgs->incoming.blockLength += n;
 
         fireClientGotPieceData (msgs, n);
         *setme_piece_bytes_read += n;
         dbgmsg (msgs, "got %zu bytes for block %u:%u->%u ... %d remain",
                n, req->index, req->offset, req->length,
-             (int)(req->length - evbuffer_get_length (block_buffer)));
-        if (evbuffer_get_length (block_buffer) < req->length)
+             (int)(req->length - msgs->incoming.blockLength));
+        if (msgs->incoming.blockLength < req->length)
             return READ_LATER;
 
         /* pass the block along... */
-        err = clientGotBlock (msgs, block_buffer, req);
-        evbuffer_drain (block_buffer, evbuffer_get_length (block_buffer));
+        block = msgs->incoming.block;
+        msgs->incoming.block = NULL;
+        err = clientGotBlock (msgs, block, req);
 
         /* cleanup */
         req->length = 0;
@@ -1693,14 +1724,16 @@ assert (tr_bitfieldHasAll (&msgs->peer.have));
     return READ_NOW;
 }
 
-/* returns 0 on success, or an errno on failure */
+/* returns 0 on success, or an errno on failure.
+   this takes ownership of data, which is from tr_cacheAllocBlock (). */
 static int
 clientGotBlock (tr_peerMsgs                * msgs,
-                struct evbuffer            * data,
+                uint8_t                    * data,
                 const struct peer_request  * req)
 {
     int err;
     tr_torrent * tor = msgs->torrent;
+    tr_cache * cache = getSession (msgs)->cache;
     const tr_block_index_t block = _tr_block (tor, req->index, req->offset);
 
     assert (msgs);
@@ -1709,12 +1742,14 @@ clientGotBlock (tr_peerMsgs                * msgs,
     if (!requestIsValid (msgs, req)) {
         dbgmsg (msgs, "dropping invalid block %u:%u->%u",
                 req->index, req->offset, req->length);
+        tr_cacheReleaseBlock (cache, data);
         return EBADMSG;
     }
 
     if (req->length != tr_torBlockCountBytes (msgs->torrent, block)) {
         dbgmsg (msgs, "wrong block size -- expected %u, got %d",
                 tr_torBlockCountBytes (msgs->torrent, block), req->length);
+        tr_cacheReleaseBlock (cache, data);
         return EMSGSIZE;
     }
 
@@ -1722,10 +1757,12 @@ clientGotBlock (tr_peerMsgs                * msgs,
 
     if (!tr_peerMgrDidPeerRequest (msgs->torrent, &msgs->peer, block)) {
         dbgmsg (msgs, "we didn't ask for this message...");
+        tr_cacheReleaseBlock (cache, data);
         return 0;
     }
     if (tr_torrentPieceIsComplete (msgs->torrent, req->index)) {
         dbgmsg (msgs, "we did ask for this message, but the piece is already complete...");
+        tr_cacheReleaseBlock (cache, data);
         return 0;
     }
 
@@ -1733,7 +1770,7 @@ clientGotBlock (tr_peerMsgs                * msgs,
     ***  Save the block
     **/
 
-    if ((err = tr_cacheWriteBlock (getSession (msgs)->cache, tor, req->index, req->offset, req->length, data)))
+    if ((err = tr_cacheWriteBlockData (cache, tor, req->index, req->offset, req->length, data)))
         return err;
 
     tr_bitfieldAdd (&msgs->peer.blame, req->index);
@@ -1916,6 +1953,95 @@ updateBlockRequests (tr_peerMsgs * msgs)
     }
 }
 
+static void
+onUploadRead (void * vread, int err)
+{
+    struct upload_read * ur = vread;
+    tr_peerMsgs * msgs = ur->msgs;
+
+    if (msgs != NULL)
+    {
+        struct upload_read ** walk;
+        const struct peer_request * req = &ur->req;
+
+        for (walk=&msgs->uploadReads; *walk!=ur; walk=&(*walk)->next)
+            ;
+        *walk = ur->next;
+        --msgs->uploadReadCount;
+
+        if (err)
+        {
+            if (tr_peerIoSupportsFEXT (msgs->io))
+                protocolSendReject (msgs, req);
+        }
+        else
+        {
+            struct evbuffer * out = evbuffer_new ();
+
+            evbuffer_expand (out, 4 + 1 + 4 + 4 + req->length);
+            evbuffer_add_uint32 (out, sizeof (uint8_t) + 2 * sizeof (uint32_t) + req->length);
+            evbuffer_add_uint8 (out, BT_PIECE);
+            evbuffer_add_uint32 (out, req->index);
+            evbuffer_add_uint32 (out, req->offset);
+            evbuffer_add (out, ur->block, req->length);
+
+            dbgmsg (msgs, "sending block %u:%u->%u", req->index, req->offset, req->length);
+            tr_peerIoWriteBuf (msgs->io, out, true);
+            msgs->clientSentAnythingAt = tr_time ();
+            tr_historyAdd (&msgs->peer.blocksSentToPeer, tr_time (), 1);
+
+            evbuffer_free (out);
+        }
+    }
+
+    tr_cacheReleaseBlock (ur->session->cache, ur->block);
+    tr_free (ur);
+}
+
+/* Start reading a block from disk in the background if that would
+   otherwise block the event loop. Returns false if the caller should
+   send the block the usual way. */
+static bool
+startUploadRead (tr_peerMsgs * msgs, const struct peer_request * req)
+{
+    struct upload_read * ur;
+    tr_session * session = getSession (msgs);
+
+    if (session->ioQueue == NULL)
+        return false;
+
+#ifdef TR_HAVE_FILE_SEGMENTS
+    /* unencrypted peers get the file on disk by reference, with no read */
+    if (!tr_peerIoIsEncrypted (msgs->io))
+        return false;
+#endif
+
+    /* cached blocks are already in memory, and pieces that
+       need checking are checked by the usual path */
+    if (tr_cacheHasBlock (session->cache, msgs->torrent, req->index, req->offset)
+        || tr_torrentPieceNeedsCheck (msgs->torrent, req->index))
+        return false;
+
+    ur = tr_new0 (struct upload_read, 1);
+    ur->msgs = msgs;
+    ur->session = session;
+    ur->req = *req;
+    ur->block = tr_cacheAllocBlock (session->cache);
+
+    if (tr_ioReadAsync (msgs->torrent, session->ioQueue, req->index, req->offset, req->length,
+                        ur->block, onUploadRead, ur) != 0)
+    {
+        tr_cacheReleaseBlock (session->cache, ur->block);
+        tr_free (ur);
+        return false;
+    }
+
+    ur->next = msgs->uploadReads;
+    msgs->uploadReads = ur;
+    ++msgs->uploadReadCount;
+    return true;
+}
+
 static size_t
 fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
 {
@@ -2016,31 +2142,48 @@ fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
     ***  Data Blocks
     **/
 
-    if ((tr_peerIoGetWriteBufferSpace (msgs->io, now) >= msgs->torrent->blockSize)
+    /* the blocks being read from disk will need buffer space too */
+    if ((tr_peerIoGetWriteBufferSpace (msgs->io, now) >= msgs->torrent->blockSize * (1 + msgs->uploadReadCount))
         && popNextRequest (msgs, &req))
     {
+        const bool canSend = requestIsValid (msgs, &req)
+                          && tr_torrentPieceIsComplete (msgs->torrent, req.index);
+
         --msgs->prefetchCount;
 
-        if (requestIsValid (msgs, &req)
-            && tr_torrentPieceIsComplete (msgs->torrent, req.index))
+        if (canSend && startUploadRead (msgs, &req))
+        {
+            /* the block is sent when the read finishes. count it as
+               progress so that the caller keeps filling the pipeline */
+            bytesWritten += req.length;
+        }
+        else if (canSend)
         {
             int err;
             const uint32_t msglen = 4 + 1 + 4 + 4 + req.length;
             struct evbuffer * out;
-            struct evbuffer_iovec iovec[1];
+
+            /* unencrypted peers can share the cached block or the file
+               on disk, since nothing will rewrite the bytes in place.
+               not if an i/o loop does the writing, though: the loop's
+               thread would release the block, and the cache's slab
+               may only be used from this one */
+            const bool shared = !tr_peerIoIsEncrypted (msgs->io) && msgs->io->conn == NULL;
 
             out = evbuffer_new ();
-            evbuffer_expand (out, msglen);
+            if (!shared)
+                evbuffer_expand (out, msglen);
+#ifdef EVBUFFER_FLAG_DRAINS_TO_FD
+            else if (msgs->io->utp_socket == NULL)
+                evbuffer_set_flags (out, EVBUFFER_FLAG_DRAINS_TO_FD); /* let file segments use sendfile () */
+#endif
 
             evbuffer_add_uint32 (out, sizeof (uint8_t) + 2 * sizeof (uint32_t) + req.length);
             evbuffer_add_uint8 (out, BT_PIECE);
             evbuffer_add_uint32 (out, req.index);
             evbuffer_add_uint32 (out, req.offset);
 
-            evbuffer_reserve_space (out, req.length, iovec, 1);
-            err = tr_cacheReadBlock (getSession (msgs)->cache, msgs->torrent, req.index, req.offset, req.length, iovec[0].iov_base);
-            iovec[0].iov_len = req.length;
-            evbuffer_commit_space (out, iovec, 1);
+            err = tr_cacheReadBlockToBuffer (getSession (msgs)->cache, msgs->torrent, req.index, req.offset, req.length, out, shared);
 
             /* check the piece if it needs checking... */
             if (!err && tr_torrentPieceNeedsCheck (msgs->torrent, req.index))
@@ -2509,7 +2652,15 @@ peermsgs_destruct (tr_peer * peer)
     event_free (msgs->pexTimer);
 
   if (msgs->incoming.block != NULL)
-    evbuffer_free (msgs->incoming.block);
+    tr_cacheReleaseBlock (getSession (msgs)->cache, msgs->incoming.block);
+
+  /* the reads in flight clean up after themselves when they finish */
+  while (msgs->uploadReads != NULL)
+    {
+      struct upload_read * ur = msgs->uploadReads;
+      msgs->uploadReads = ur->next;
+      ur->msgs = NULL;
+    }
 
   if (msgs->io)
     {
@@ -2675,6 +2826,8 @@ tr_peerMsgsNew (struct tr_torrent    * torrent,
         protocolSendPort (m, tr_dhtPort (torrent->session));
     }
 
+  /* the handshake is done, so the encryption won't change anymore */
+  tr_peerIoSetDecryptAhead (m->io, true);
   tr_peerIoSetIOFuncs (m->io, canRead, didWrite, gotError, m);
   updateDesiredRequestCount (m);
 
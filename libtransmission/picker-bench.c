@@ -0,0 +1,146 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+/* Compares tr_picker against the sorted weighted_piece array that
+ * tr_peerMgrGetNextRequests () used to maintain with tr_lowerBound ()
+ * and memmove ().
+ *
+ * Usage: picker-bench [pieceCount [updateCount]] */
+
+#include <stdio.h>
+#include <stdlib.h> /* atoi () */
+#include <string.h> /* memmove () */
+
+#include "transmission.h"
+#include "crypto-utils.h" /* tr_rand_int_weak () */
+#include "picker.h"
+#include "utils.h"
+
+struct sorted_piece
+{
+  uint64_t key;
+  tr_piece_index_t index;
+};
+
+static int
+compareSortedPieces (const void * va, const void * vb)
+{
+  const struct sorted_piece * a = va;
+  const struct sorted_piece * b = vb;
+
+  if (a->key != b->key)
+    return a->key < b->key ? -1 : 1;
+  if (a->index != b->index)
+    return a->index < b->index ? -1 : 1;
+  return 0;
+}
+
+/* the old way: find the piece, cut it out, and memmove it back in */
+static void
+arraySet (struct sorted_piece * pieces, int n, tr_piece_index_t index, uint64_t key)
+{
+  int i;
+  bool exact;
+  struct sorted_piece tmp;
+
+  for (i=0; i<n; ++i)
+    if (pieces[i].index == index)
+      break;
+
+  tmp = pieces[i];
+  tmp.key = key;
+  tr_removeElementFromArray (pieces, i, sizeof (struct sorted_piece), n--);
+  i = tr_lowerBound (&tmp, pieces, n, sizeof (struct sorted_piece), compareSortedPieces, &exact);
+  memmove (pieces + i + 1, pieces + i, sizeof (struct sorted_piece) * (n - i));
+  pieces[i] = tmp;
+}
+
+int
+main (int argc, char ** argv)
+{
+  int i;
+  uint64_t begin;
+  uint64_t arrayMsec;
+  uint64_t pickerMsec;
+  uint64_t sortMsec;
+  tr_picker picker;
+  struct sorted_piece * pieces;
+  tr_piece_index_t * updates;
+  uint64_t * keys;
+  const int pieceCount = argc > 1 ? atoi (argv[1]) : 100000;
+  const int updateCount = argc > 2 ? atoi (argv[2]) : 200000;
+
+  if (pieceCount < 1 || updateCount < 1)
+    {
+      fprintf (stderr, "Usage: %s [pieceCount [updateCount]]\n", argv[0]);
+      return 1;
+    }
+
+  /* generate the same workload for both */
+  keys = tr_new (uint64_t, updateCount);
+  updates = tr_new (tr_piece_index_t, updateCount);
+  for (i=0; i<updateCount; ++i)
+    {
+      updates[i] = tr_rand_int_weak (pieceCount);
+      keys[i] = tr_rand_int_weak (1 << 20);
+    }
+
+  /* initial build */
+  begin = tr_time_msec ();
+  pieces = tr_new (struct sorted_piece, pieceCount);
+  for (i=0; i<pieceCount; ++i)
+    {
+      pieces[i].index = i;
+      pieces[i].key = tr_rand_int_weak (1 << 20);
+    }
+  qsort (pieces, pieceCount, sizeof (struct sorted_piece), compareSortedPieces);
+  sortMsec = tr_time_msec () - begin;
+
+  begin = tr_time_msec ();
+  tr_pickerConstruct (&picker, pieceCount);
+  for (i=0; i<pieceCount; ++i)
+    tr_pickerSet (&picker, pieces[i].index, pieces[i].key);
+  pickerMsec = tr_time_msec () - begin;
+
+  printf ("%d pieces, initial build:  array (qsort) %5"PRIu64" msec  picker %5"PRIu64" msec\n",
+          pieceCount, sortMsec, pickerMsec);
+
+  /* re-key random pieces, as have/request/cancel events do */
+  begin = tr_time_msec ();
+  for (i=0; i<updateCount; ++i)
+    arraySet (pieces, pieceCount, updates[i], keys[i]);
+  arrayMsec = tr_time_msec () - begin;
+
+  begin = tr_time_msec ();
+  for (i=0; i<updateCount; ++i)
+    tr_pickerSet (&picker, updates[i], keys[i]);
+  pickerMsec = tr_time_msec () - begin;
+
+  printf ("%d updates:               array %13"PRIu64" msec  picker %5"PRIu64" msec\n",
+          updateCount, arrayMsec, pickerMsec);
+
+  /* sanity check: both should agree on the order */
+  {
+    tr_piece_index_t p = tr_pickerFirst (&picker);
+
+    for (i=0; i<pieceCount; ++i, p=tr_pickerNext (&picker, p))
+      {
+        if (p != pieces[i].index)
+          {
+            fprintf (stderr, "order mismatch at position %d\n", i);
+            return 1;
+          }
+      }
+  }
+
+  tr_pickerDestruct (&picker);
+  tr_free (pieces);
+  tr_free (updates);
+  tr_free (keys);
+  return 0;
+}
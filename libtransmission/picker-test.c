@@ -0,0 +1,142 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include "transmission.h"
+#include "crypto-utils.h" /* tr_rand_int_weak () */
+#include "picker.h"
+#include "utils.h" /* tr_new0 () */
+
+#include "libtransmission-test.h"
+
+/* walk the picker and confirm it's ordered by (key, index)
+   and that it holds exactly the pieces we think it does */
+static bool
+pickerIsSorted (const tr_picker * p, const bool * in_set, const uint64_t * keys, tr_piece_index_t n)
+{
+  tr_piece_index_t i;
+  tr_piece_index_t prev = TR_PICKER_NONE;
+  tr_piece_index_t count = 0;
+  tr_piece_index_t expected = 0;
+
+  for (i=0; i<n; ++i)
+    {
+      if (in_set[i] != tr_pickerHas (p, i))
+        return false;
+      if (in_set[i])
+        ++expected;
+    }
+
+  for (i=tr_pickerFirst (p); i!=TR_PICKER_NONE; i=tr_pickerNext (p, i))
+    {
+      if (!in_set[i] || tr_pickerGetKey (p, i) != keys[i])
+        return false;
+
+      if (prev != TR_PICKER_NONE)
+        if ((keys[prev] > keys[i]) || (keys[prev] == keys[i] && prev > i))
+          return false;
+
+      prev = i;
+      ++count;
+    }
+
+  return count == expected && count == tr_pickerSize (p);
+}
+
+static int
+test_picker_basic (void)
+{
+  tr_picker p;
+
+  tr_pickerConstruct (&p, 5);
+  check_uint_eq (0, tr_pickerSize (&p));
+  check_uint_eq (TR_PICKER_NONE, tr_pickerFirst (&p));
+  check (!tr_pickerHas (&p, 0));
+
+  tr_pickerSet (&p, 3, 10);
+  tr_pickerSet (&p, 1, 20);
+  tr_pickerSet (&p, 4, 10);
+  tr_pickerSet (&p, 0, 5);
+  check_uint_eq (4, tr_pickerSize (&p));
+  check (!tr_pickerHas (&p, 2));
+
+  /* ties are broken by piece index */
+  check_uint_eq (0, tr_pickerFirst (&p));
+  check_uint_eq (3, tr_pickerNext (&p, 0));
+  check_uint_eq (4, tr_pickerNext (&p, 3));
+  check_uint_eq (1, tr_pickerNext (&p, 4));
+  check_uint_eq (TR_PICKER_NONE, tr_pickerNext (&p, 1));
+
+  /* re-keying moves the piece */
+  tr_pickerSet (&p, 1, 1);
+  check_uint_eq (4, tr_pickerSize (&p));
+  check_uint_eq (1, tr_pickerFirst (&p));
+  check_uint_eq (0, tr_pickerNext (&p, 1));
+
+  tr_pickerRemove (&p, 0);
+  tr_pickerRemove (&p, 2);
+  check_uint_eq (3, tr_pickerSize (&p));
+  check (!tr_pickerHas (&p, 0));
+  check_uint_eq (3, tr_pickerNext (&p, 1));
+
+  tr_pickerClear (&p);
+  check_uint_eq (0, tr_pickerSize (&p));
+  check_uint_eq (5, tr_pickerPieceCount (&p));
+  check_uint_eq (TR_PICKER_NONE, tr_pickerFirst (&p));
+
+  tr_pickerDestruct (&p);
+  return 0;
+}
+
+static int
+test_picker_random (void)
+{
+  int i;
+  tr_picker p;
+  const tr_piece_index_t n = 2000;
+  bool * in_set = tr_new0 (bool, n);
+  uint64_t * keys = tr_new0 (uint64_t, n);
+
+  tr_pickerConstruct (&p, n);
+
+  for (i=0; i<20000; ++i)
+    {
+      const tr_piece_index_t piece = tr_rand_int_weak (n);
+
+      if (tr_rand_int_weak (4) == 0)
+        {
+          tr_pickerRemove (&p, piece);
+          in_set[piece] = false;
+        }
+      else
+        {
+          /* use a small key range so that there are plenty of ties */
+          keys[piece] = tr_rand_int_weak (64);
+          tr_pickerSet (&p, piece, keys[piece]);
+          in_set[piece] = true;
+        }
+
+      if (i % 1000 == 0)
+        check (pickerIsSorted (&p, in_set, keys, n));
+    }
+
+  check (pickerIsSorted (&p, in_set, keys, n));
+
+  tr_pickerDestruct (&p);
+  tr_free (keys);
+  tr_free (in_set);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_picker_basic,
+                             test_picker_random };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -0,0 +1,282 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <assert.h>
+
+#include "transmission.h"
+#include "picker.h"
+#include "utils.h"
+
+struct tr_picker_node
+{
+  uint64_t key;
+  tr_piece_index_t parent;
+  tr_piece_index_t left;
+  tr_piece_index_t right;
+  bool inSet;
+};
+
+const tr_picker TR_PICKER_INIT = { NULL, 0, 0, TR_PICKER_NONE };
+
+/* The treap's heap priorities only need to look random with respect to the
+ * keys, so hash the piece index instead of spending memory on storing them. */
+static inline uint32_t
+heapPriority (tr_piece_index_t i)
+{
+  uint32_t h = i * 2654435761u;
+  h ^= h >> 15;
+  return h * 2246822519u;
+}
+
+static inline bool
+nodeIsBefore (const tr_picker * p, tr_piece_index_t a, tr_piece_index_t b)
+{
+  const uint64_t ka = p->nodes[a].key;
+  const uint64_t kb = p->nodes[b].key;
+
+  return ka < kb || (ka == kb && a < b);
+}
+
+static inline bool
+heapIsBefore (tr_piece_index_t a, tr_piece_index_t b)
+{
+  const uint32_t ha = heapPriority (a);
+  const uint32_t hb = heapPriority (b);
+
+  return ha > hb || (ha == hb && a < b);
+}
+
+/* point whatever pointed at `from' to `to' instead */
+static void
+replaceChild (tr_picker * p, tr_piece_index_t parent, tr_piece_index_t from, tr_piece_index_t to)
+{
+  if (parent == TR_PICKER_NONE)
+    p->root = to;
+  else if (p->nodes[parent].left == from)
+    p->nodes[parent].left = to;
+  else
+    p->nodes[parent].right = to;
+
+  if (to != TR_PICKER_NONE)
+    p->nodes[to].parent = parent;
+}
+
+/* move n's left child up into n's place */
+static void
+rotateRight (tr_picker * p, tr_piece_index_t n)
+{
+  struct tr_picker_node * nodes = p->nodes;
+  const tr_piece_index_t l = nodes[n].left;
+  const tr_piece_index_t lr = nodes[l].right;
+
+  replaceChild (p, nodes[n].parent, n, l);
+
+  nodes[n].left = lr;
+  if (lr != TR_PICKER_NONE)
+    nodes[lr].parent = n;
+
+  nodes[l].right = n;
+  nodes[n].parent = l;
+}
+
+/* move n's right child up into n's place */
+static void
+rotateLeft (tr_picker * p, tr_piece_index_t n)
+{
+  struct tr_picker_node * nodes = p->nodes;
+  const tr_piece_index_t r = nodes[n].right;
+  const tr_piece_index_t rl = nodes[r].left;
+
+  replaceChild (p, nodes[n].parent, n, r);
+
+  nodes[n].right = rl;
+  if (rl != TR_PICKER_NONE)
+    nodes[rl].parent = n;
+
+  nodes[r].left = n;
+  nodes[n].parent = r;
+}
+
+static void
+treapInsert (tr_picker * p, tr_piece_index_t n)
+{
+  struct tr_picker_node * nodes = p->nodes;
+  tr_piece_index_t parent = TR_PICKER_NONE;
+  tr_piece_index_t walk = p->root;
+
+  /* find the leaf to hang it from */
+  while (walk != TR_PICKER_NONE)
+    {
+      parent = walk;
+      walk = nodeIsBefore (p, n, walk) ? nodes[walk].left : nodes[walk].right;
+    }
+
+  nodes[n].parent = parent;
+  nodes[n].left = TR_PICKER_NONE;
+  nodes[n].right = TR_PICKER_NONE;
+
+  if (parent == TR_PICKER_NONE)
+    p->root = n;
+  else if (nodeIsBefore (p, n, parent))
+    nodes[parent].left = n;
+  else
+    nodes[parent].right = n;
+
+  /* restore the heap property */
+  while (nodes[n].parent != TR_PICKER_NONE && heapIsBefore (n, nodes[n].parent))
+    {
+      parent = nodes[n].parent;
+
+      if (nodes[parent].left == n)
+        rotateRight (p, parent);
+      else
+        rotateLeft (p, parent);
+    }
+}
+
+static void
+treapRemove (tr_picker * p, tr_piece_index_t n)
+{
+  struct tr_picker_node * nodes = p->nodes;
+
+  /* rotate it down until it has at most one child */
+  while (nodes[n].left != TR_PICKER_NONE && nodes[n].right != TR_PICKER_NONE)
+    {
+      if (heapIsBefore (nodes[n].left, nodes[n].right))
+        rotateRight (p, n);
+      else
+        rotateLeft (p, n);
+    }
+
+  replaceChild (p, nodes[n].parent, n,
+                nodes[n].left != TR_PICKER_NONE ? nodes[n].left : nodes[n].right);
+
+  nodes[n].parent = TR_PICKER_NONE;
+  nodes[n].left = TR_PICKER_NONE;
+  nodes[n].right = TR_PICKER_NONE;
+}
+
+static inline tr_piece_index_t
+leftmost (const tr_picker * p, tr_piece_index_t n)
+{
+  if (n != TR_PICKER_NONE)
+    while (p->nodes[n].left != TR_PICKER_NONE)
+      n = p->nodes[n].left;
+
+  return n;
+}
+
+/***
+****
+***/
+
+void
+tr_pickerConstruct (tr_picker * p, tr_piece_index_t pieceCount)
+{
+  *p = TR_PICKER_INIT;
+  p->pieceCount = pieceCount;
+}
+
+void
+tr_pickerDestruct (tr_picker * p)
+{
+  tr_free (p->nodes);
+  *p = TR_PICKER_INIT;
+}
+
+void
+tr_pickerClear (tr_picker * p)
+{
+  const tr_piece_index_t pieceCount = p->pieceCount;
+
+  tr_pickerDestruct (p);
+  tr_pickerConstruct (p, pieceCount);
+}
+
+bool
+tr_pickerHas (const tr_picker * p, tr_piece_index_t piece)
+{
+  return p->nodes != NULL
+      && piece < p->pieceCount
+      && p->nodes[piece].inSet;
+}
+
+uint64_t
+tr_pickerGetKey (const tr_picker * p, tr_piece_index_t piece)
+{
+  assert (tr_pickerHas (p, piece));
+
+  return p->nodes[piece].key;
+}
+
+void
+tr_pickerSet (tr_picker * p, tr_piece_index_t piece, uint64_t key)
+{
+  assert (piece < p->pieceCount);
+
+  if (p->nodes == NULL)
+    p->nodes = tr_new0 (struct tr_picker_node, p->pieceCount);
+
+  if (p->nodes[piece].inSet)
+    {
+      if (p->nodes[piece].key == key)
+        return;
+
+      treapRemove (p, piece);
+    }
+  else
+    {
+      p->nodes[piece].inSet = true;
+      ++p->size;
+    }
+
+  p->nodes[piece].key = key;
+  treapInsert (p, piece);
+}
+
+void
+tr_pickerSetInPlace (tr_picker * p, tr_piece_index_t piece, uint64_t key)
+{
+  assert (tr_pickerHas (p, piece));
+
+  p->nodes[piece].key = key;
+}
+
+void
+tr_pickerRemove (tr_picker * p, tr_piece_index_t piece)
+{
+  if (tr_pickerHas (p, piece))
+    {
+      treapRemove (p, piece);
+      p->nodes[piece].inSet = false;
+      --p->size;
+    }
+}
+
+tr_piece_index_t
+tr_pickerFirst (const tr_picker * p)
+{
+  return leftmost (p, p->root);
+}
+
+tr_piece_index_t
+tr_pickerNext (const tr_picker * p, tr_piece_index_t n)
+{
+  const struct tr_picker_node * nodes = p->nodes;
+
+  assert (tr_pickerHas (p, n));
+
+  if (nodes[n].right != TR_PICKER_NONE)
+    return leftmost (p, nodes[n].right);
+
+  /* climb until we come up from a left child */
+  while (nodes[n].parent != TR_PICKER_NONE && nodes[nodes[n].parent].right == n)
+    n = nodes[n].parent;
+
+  return nodes[n].parent;
+}
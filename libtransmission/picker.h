@@ -0,0 +1,88 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#pragma once
+
+/**
+ * @addtogroup peers Peers
+ * @{
+ */
+
+/**
+ * An ordered set of piece indices, each with a 64-bit sort key.
+ *
+ * The pieces are kept in a treap ordered by (key, index), so adding,
+ * removing, or re-keying a piece costs O(log n) instead of the memmove ()
+ * and qsort () needed to keep a sorted array in order. Walking the set
+ * in order is amortized O(1) per step, and membership tests are O(1).
+ */
+
+#define TR_PICKER_NONE ((tr_piece_index_t)~0)
+
+struct tr_picker_node;
+
+typedef struct tr_picker
+{
+  /* these are PRIVATE IMPLEMENTATION details included for composition only.
+   * Don't access these directly! */
+
+  struct tr_picker_node * nodes;
+  tr_piece_index_t        pieceCount;
+  tr_piece_index_t        size;
+  tr_piece_index_t        root;
+}
+tr_picker;
+
+extern const tr_picker TR_PICKER_INIT;
+
+void             tr_pickerConstruct (tr_picker * picker, tr_piece_index_t pieceCount);
+
+void             tr_pickerDestruct  (tr_picker * picker);
+
+/** @brief add a piece, or move it if it's already in the set */
+void             tr_pickerSet       (tr_picker * picker, tr_piece_index_t piece, uint64_t key);
+
+/**
+ * @brief change a piece's key without moving it.
+ *
+ * This is only useful when the set's order is unaffected by the change,
+ * such as when every key in the set is shifted by the same amount.
+ */
+void             tr_pickerSetInPlace (tr_picker * picker, tr_piece_index_t piece, uint64_t key);
+
+void             tr_pickerRemove    (tr_picker * picker, tr_piece_index_t piece);
+
+void             tr_pickerClear     (tr_picker * picker);
+
+bool             tr_pickerHas       (const tr_picker * picker, tr_piece_index_t piece);
+
+uint64_t         tr_pickerGetKey    (const tr_picker * picker, tr_piece_index_t piece);
+
+/** @return the piece with the lowest key, or TR_PICKER_NONE if the set is empty */
+tr_piece_index_t tr_pickerFirst     (const tr_picker * picker);
+
+/** @return the piece after the given one, or TR_PICKER_NONE if it's the last */
+tr_piece_index_t tr_pickerNext      (const tr_picker * picker, tr_piece_index_t piece);
+
+static inline tr_piece_index_t
+tr_pickerSize (const tr_picker * picker)
+{
+  return picker->size;
+}
+
+static inline tr_piece_index_t
+tr_pickerPieceCount (const tr_picker * picker)
+{
+  return picker->pieceCount;
+}
+
+/* @} */
@@ -75,5 +75,28 @@ void tr_lockUnlock (tr_lock *);
 /** @brief return nonzero if the specified lock is locked */
 bool tr_lockHave (const tr_lock *);
 
+/***
+****
+***/
+
+typedef struct tr_cond tr_cond;
+
+/** @brief Create a new condition variable */
+tr_cond * tr_condNew (void);
+
+/** @brief Destroy a condition variable */
+void tr_condFree (tr_cond *);
+
+/** @brief Unlock `lock', which must be held exactly once, until `cond' is
+    signaled; then lock it again. Like any condition wait, this may wake
+    spuriously, so callers should wait in a loop that checks their state. */
+void tr_condWait (tr_cond *, tr_lock * lock);
+
+/** @brief Wake one of the threads waiting on a condition variable */
+void tr_condSignal (tr_cond *);
+
+/** @brief Wake all of the threads waiting on a condition variable */
+void tr_condBroadcast (tr_cond *);
+
 /* @} */
 
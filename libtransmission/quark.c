@@ -11,6 +11,7 @@
 #include <string.h> /* memcmp() */
 
 #include "transmission.h"
+#include "platform.h" /* tr_lock */
 #include "ptrarray.h"
 #include "quark.h"
 #include "utils.h" /* tr_memdup(), tr_strndup() */
@@ -109,8 +110,10 @@ static const struct tr_key_struct my_static[] =
   { "errorString", 11 },
   { "eta", 3 },
   { "etaIdle", 7 },
+  { "evictions", 9 },
   { "failure reason", 14 },
   { "fields", 6 },
+  { "file-cache-stats", 16 },
   { "fileStats", 9 },
   { "filename", 8 },
   { "files", 5 },
@@ -136,6 +139,7 @@ static const struct tr_key_struct my_static[] =
   { "have", 4 },
   { "haveUnchecked", 13 },
   { "haveValid", 9 },
+  { "hits", 4 },
   { "honorsSessionLimits", 19 },
   { "host", 4 },
   { "id", 2 },
@@ -191,6 +195,7 @@ static const struct tr_key_struct my_static[] =
   { "manualAnnounceTime", 18 },
   { "max-peers", 9 },
   { "maxConnectedPeers", 17 },
+  { "maxOpenFiles", 12 },
   { "memory-bytes", 12 },
   { "memory-units", 12 },
   { "message-level", 13 },
@@ -200,6 +205,7 @@ static const struct tr_key_struct my_static[] =
   { "method", 6 },
   { "min interval", 12 },
   { "min_request_interval", 20 },
+  { "misses", 6 },
   { "move", 4 },
   { "msg_type", 8 },
   { "mtimes", 6 },
@@ -210,6 +216,7 @@ static const struct tr_key_struct my_static[] =
   { "nodes", 5 },
   { "nodes6", 6 },
   { "open-dialog-dir", 15 },
+  { "openFiles", 9 },
   { "p", 1 },
   { "path", 4 },
   { "path.utf-8", 10 },
@@ -217,6 +224,7 @@ static const struct tr_key_struct my_static[] =
   { "pausedTorrentCount", 18 },
   { "peer-congestion-algorithm", 25 },
   { "peer-id-ttl-hours", 17 },
+  { "peer-io-threads", 15 },
   { "peer-limit", 10 },
   { "peer-limit-global", 17 },
   { "peer-limit-per-torrent", 22 },
@@ -285,6 +293,8 @@ static const struct tr_key_struct my_static[] =
   { "rename-partial-files", 20 },
   { "reqq", 4 },
   { "result", 6 },
+  { "resume-database-enabled", 23 },
+  { "revision", 8 },
   { "rpc-authentication-required", 27 },
   { "rpc-bind-address", 16 },
   { "rpc-enabled", 11 },
@@ -324,6 +334,7 @@ static const struct tr_key_struct my_static[] =
   { "show-statusbar", 14 },
   { "show-toolbar", 12 },
   { "show-tracker-scrapes", 20 },
+  { "since", 5 },
   { "size-bytes", 10 },
   { "size-units", 10 },
   { "sizeWhenDone", 12 },
@@ -392,6 +403,8 @@ static const struct tr_key_struct my_static[] =
   { "ut_recommend", 12 },
   { "utp-enabled", 11 },
   { "v", 1 },
+  { "verify-io-limit-mb", 18 },
+  { "verify-threads", 14 },
   { "version", 7 },
   { "wanted", 6 },
   { "warning message", 15 },
@@ -418,6 +431,25 @@ compareKeys (const void * va, const void * vb)
 
 static tr_ptrArray my_runtime = TR_PTR_ARRAY_INIT_STATIC;
 
+/* guards my_runtime, since benc and json can be parsed on worker threads */
+static tr_lock * runtime_lock = NULL;
+
+void
+tr_quark_init_lock (void)
+{
+  if (runtime_lock == NULL)
+    runtime_lock = tr_lockNew ();
+}
+
+/* without a session, only one thread uses quarks, so creating it here is safe */
+static tr_lock *
+getRuntimeLock (void)
+{
+  tr_quark_init_lock ();
+
+  return runtime_lock;
+}
+
 bool
 tr_quark_lookup (const void * str, size_t len, tr_quark * setme)
 {
@@ -440,11 +472,16 @@ tr_quark_lookup (const void * str, size_t len, tr_quark * setme)
     }
 
   /* was it added during runtime? */
-  if (!success && !tr_ptrArrayEmpty(&my_runtime))
+  if (!success)
     {
       size_t i;
-      struct tr_key_struct ** runtime = (struct tr_key_struct **) tr_ptrArrayBase (&my_runtime);
-      const size_t n_runtime = tr_ptrArraySize (&my_runtime);
+      struct tr_key_struct ** runtime;
+      size_t n_runtime;
+
+      tr_lockLock (getRuntimeLock ());
+
+      runtime = (struct tr_key_struct **) tr_ptrArrayBase (&my_runtime);
+      n_runtime = tr_ptrArraySize (&my_runtime);
       for (i=0; i<n_runtime; ++i)
         {
           if (compareKeys (&tmp, runtime[i]) == 0)
@@ -454,6 +491,8 @@ tr_quark_lookup (const void * str, size_t len, tr_quark * setme)
               break;
             }
         }
+
+      tr_lockUnlock (getRuntimeLock ());
     }
 
   return success;
@@ -483,7 +522,13 @@ tr_quark_new (const void * str, size_t len)
     len = strlen (str);
 
   if (!tr_quark_lookup (str, len, &ret))
-    ret = append_new_quark (str, len);
+    {
+      /* look again while holding the lock, in case another thread just added it */
+      tr_lockLock (getRuntimeLock ());
+      if (!tr_quark_lookup (str, len, &ret))
+        ret = append_new_quark (str, len);
+      tr_lockUnlock (getRuntimeLock ());
+    }
 
   return ret;
 }
@@ -496,7 +541,11 @@ tr_quark_get_string (tr_quark q, size_t * len)
   if (q < TR_N_KEYS)
     tmp = &my_static[q];
   else
-    tmp = tr_ptrArrayNth (&my_runtime, q-TR_N_KEYS);
+    {
+      tr_lockLock (getRuntimeLock ());
+      tmp = tr_ptrArrayNth (&my_runtime, q-TR_N_KEYS);
+      tr_lockUnlock (getRuntimeLock ());
+    }
 
   if (len != NULL)
     *len = tmp->len;
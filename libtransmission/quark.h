@@ -110,8 +110,10 @@ enum
   TR_KEY_errorString,
   TR_KEY_eta,
   TR_KEY_etaIdle,
+  TR_KEY_evictions, /* rpc */
   TR_KEY_failure_reason,
   TR_KEY_fields,
+  TR_KEY_file_cache_stats, /* rpc */
   TR_KEY_fileStats,
   TR_KEY_filename,
   TR_KEY_files,
@@ -137,6 +139,7 @@ enum
   TR_KEY_have,
   TR_KEY_haveUnchecked,
   TR_KEY_haveValid,
+  TR_KEY_hits, /* rpc */
   TR_KEY_honorsSessionLimits,
   TR_KEY_host,
   TR_KEY_id,
@@ -192,6 +195,7 @@ enum
   TR_KEY_manualAnnounceTime,
   TR_KEY_max_peers,
   TR_KEY_maxConnectedPeers,
+  TR_KEY_maxOpenFiles, /* rpc */
   TR_KEY_memory_bytes,
   TR_KEY_memory_units,
   TR_KEY_message_level,
@@ -201,6 +205,7 @@ enum
   TR_KEY_method,
   TR_KEY_min_interval,
   TR_KEY_min_request_interval,
+  TR_KEY_misses, /* rpc */
   TR_KEY_move,
   TR_KEY_msg_type,
   TR_KEY_mtimes,
@@ -211,6 +216,7 @@ enum
   TR_KEY_nodes,
   TR_KEY_nodes6,
   TR_KEY_open_dialog_dir,
+  TR_KEY_openFiles, /* rpc */
   TR_KEY_p,
   TR_KEY_path,
   TR_KEY_path_utf_8,
@@ -218,6 +224,7 @@ enum
   TR_KEY_pausedTorrentCount,
   TR_KEY_peer_congestion_algorithm,
   TR_KEY_peer_id_ttl_hours,
+  TR_KEY_peer_io_threads,
   TR_KEY_peer_limit,
   TR_KEY_peer_limit_global,
   TR_KEY_peer_limit_per_torrent,
@@ -286,6 +293,8 @@ enum
   TR_KEY_rename_partial_files,
   TR_KEY_reqq,
   TR_KEY_result,
+  TR_KEY_resume_database_enabled, /* session-get, settings */
+  TR_KEY_revision, /* rpc */
   TR_KEY_rpc_authentication_required,
   TR_KEY_rpc_bind_address,
   TR_KEY_rpc_enabled,
@@ -325,6 +334,7 @@ enum
   TR_KEY_show_statusbar,
   TR_KEY_show_toolbar,
   TR_KEY_show_tracker_scrapes,
+  TR_KEY_since, /* rpc */
   TR_KEY_size_bytes,
   TR_KEY_size_units,
   TR_KEY_sizeWhenDone,
@@ -393,6 +403,8 @@ enum
   TR_KEY_ut_recommend,
   TR_KEY_utp_enabled,
   TR_KEY_v,
+  TR_KEY_verify_io_limit_mb,
+  TR_KEY_verify_threads,
   TR_KEY_version,
   TR_KEY_wanted,
   TR_KEY_warning_message,
@@ -422,6 +434,12 @@ const char * tr_quark_get_string (tr_quark quark, size_t * len);
  */
 tr_quark tr_quark_new (const void * str, size_t len);
 
+/**
+ * Set up the lock that guards the quarks created at runtime.
+ * This must be called before more than one thread can create quarks.
+ */
+void tr_quark_init_lock (void);
+
 /***
 ****
 ***/
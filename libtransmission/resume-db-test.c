@@ -0,0 +1,250 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memset () */
+
+#include "transmission.h"
+#include "file.h"
+#include "resume-db.h"
+#include "utils.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+static void
+makeState (tr_variant * top, int64_t uploaded, const char * dir)
+{
+  int i;
+  tr_variant * list;
+
+  tr_variantInitDict (top, 4);
+  tr_variantDictAddInt (top, TR_KEY_uploaded, uploaded);
+  tr_variantDictAddStr (top, TR_KEY_destination, dir);
+  tr_variantDictAddBool (top, TR_KEY_paused, false);
+  list = tr_variantDictAddList (top, TR_KEY_priority, 100);
+  for (i=0; i<100; ++i)
+    tr_variantListAddInt (list, i % 3);
+}
+
+static int
+checkState (tr_resume_db * db, const uint8_t * hash, int64_t uploaded, const char * dir)
+{
+  int64_t i;
+  const char * str;
+  tr_variant top;
+  tr_variant * list;
+
+  check (tr_resumeDbRead (db, hash, &top));
+  check (tr_variantDictFindInt (&top, TR_KEY_uploaded, &i));
+  check_int_eq (uploaded, i);
+  check (tr_variantDictFindStr (&top, TR_KEY_destination, &str, NULL));
+  check_streq (dir, str);
+  check (tr_variantDictFindList (&top, TR_KEY_priority, &list));
+  check_uint_eq (100, tr_variantListSize (list));
+  tr_variantFree (&top);
+  return 0;
+}
+
+static int
+test_write_read (void)
+{
+  tr_variant top;
+  tr_resume_db * db;
+  uint64_t before;
+  uint64_t snapshotSize;
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  struct tr_resume_db_stats stats;
+  char * sandbox = libtest_sandbox_create ();
+  char * filename = tr_buildPath (sandbox, "resume.db", NULL);
+
+  memset (hash, 'a', sizeof (hash));
+  db = tr_resumeDbOpen (filename);
+  check (db != NULL);
+  check (!tr_resumeDbRead (db, hash, &top));
+
+  /* the first save writes everything */
+  tr_resumeDbGetStats (db, &stats);
+  before = stats.file_size;
+  makeState (&top, 1, "/one");
+  check_int_eq (0, tr_resumeDbWrite (db, hash, &top));
+  tr_variantFree (&top);
+  tr_resumeDbGetStats (db, &stats);
+  check_int_eq (1, stats.torrent_count);
+  snapshotSize = stats.file_size - before;
+  check (snapshotSize > 0);
+  if (checkState (db, hash, 1, "/one"))
+    return 1;
+
+  /* saving it again unchanged writes nothing */
+  before = stats.file_size;
+  makeState (&top, 1, "/one");
+  check_int_eq (0, tr_resumeDbWrite (db, hash, &top));
+  tr_variantFree (&top);
+  tr_resumeDbGetStats (db, &stats);
+  check_uint_eq (before, stats.file_size);
+
+  /* changing one field writes just that field */
+  makeState (&top, 2, "/one");
+  check_int_eq (0, tr_resumeDbWrite (db, hash, &top));
+  tr_variantFree (&top);
+  tr_resumeDbGetStats (db, &stats);
+  check (stats.file_size > before);
+  check (stats.file_size - before < snapshotSize / 2);
+  if (checkState (db, hash, 2, "/one"))
+    return 1;
+
+  /* it's all still there after reopening */
+  makeState (&top, 3, "/two");
+  check_int_eq (0, tr_resumeDbWrite (db, hash, &top));
+  tr_variantFree (&top);
+  tr_resumeDbClose (db);
+  db = tr_resumeDbOpen (filename);
+  check (db != NULL);
+  if (checkState (db, hash, 3, "/two"))
+    return 1;
+
+  /* and so are removals */
+  tr_resumeDbRemove (db, hash);
+  check (!tr_resumeDbRead (db, hash, &top));
+  tr_resumeDbClose (db);
+  db = tr_resumeDbOpen (filename);
+  check (db != NULL);
+  check (!tr_resumeDbRead (db, hash, &top));
+  tr_resumeDbGetStats (db, &stats);
+  check_int_eq (0, stats.torrent_count);
+
+  tr_resumeDbClose (db);
+  tr_free (filename);
+  libtest_sandbox_destroy (sandbox);
+  tr_free (sandbox);
+  return 0;
+}
+
+static int
+test_unfinished_write (void)
+{
+  tr_variant top;
+  tr_resume_db * db;
+  tr_sys_file_t fd;
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  struct tr_resume_db_stats stats;
+  struct tr_resume_db_stats good;
+  char * sandbox = libtest_sandbox_create ();
+  char * filename = tr_buildPath (sandbox, "resume.db", NULL);
+
+  memset (hash, 'b', sizeof (hash));
+  db = tr_resumeDbOpen (filename);
+  check (db != NULL);
+  makeState (&top, 1, "/one");
+  check_int_eq (0, tr_resumeDbWrite (db, hash, &top));
+  tr_variantFree (&top);
+  tr_resumeDbGetStats (db, &good);
+  tr_resumeDbClose (db);
+
+  /* pretend we crashed partway through writing another record */
+  fd = tr_sys_file_open (filename, TR_SYS_FILE_WRITE | TR_SYS_FILE_APPEND, 0600, NULL);
+  check (fd != TR_BAD_SYS_FILE);
+  check (tr_sys_file_write (fd, "\0\0\0\100garbage", 11, NULL, NULL));
+  tr_sys_file_close (fd, NULL);
+
+  /* the good record survives and the rest is cut off */
+  db = tr_resumeDbOpen (filename);
+  check (db != NULL);
+  tr_resumeDbGetStats (db, &stats);
+  check_int_eq (1, stats.torrent_count);
+  check_uint_eq (good.file_size, stats.file_size);
+  if (checkState (db, hash, 1, "/one"))
+    return 1;
+
+  /* and new records go after it */
+  makeState (&top, 2, "/one");
+  check_int_eq (0, tr_resumeDbWrite (db, hash, &top));
+  tr_variantFree (&top);
+  tr_resumeDbClose (db);
+  db = tr_resumeDbOpen (filename);
+  check (db != NULL);
+  if (checkState (db, hash, 2, "/one"))
+    return 1;
+
+  tr_resumeDbClose (db);
+  tr_free (filename);
+  libtest_sandbox_destroy (sandbox);
+  tr_free (sandbox);
+  return 0;
+}
+
+static int
+test_compact (void)
+{
+  int i;
+  int j;
+  tr_variant top;
+  tr_resume_db * db;
+  uint8_t hashes[3][SHA_DIGEST_LENGTH];
+  struct tr_resume_db_stats stats;
+  char * sandbox = libtest_sandbox_create ();
+  char * filename = tr_buildPath (sandbox, "resume.db", NULL);
+
+  db = tr_resumeDbOpen (filename);
+  check (db != NULL);
+
+  /* lots of saves, including some snapshots and a removal */
+  for (i=0; i<3; ++i)
+    {
+      memset (hashes[i], 'c' + i, SHA_DIGEST_LENGTH);
+
+      for (j=0; j<100; ++j)
+        {
+          makeState (&top, j, (j % 10) ? "/one" : "/two");
+          check_int_eq (0, tr_resumeDbWrite (db, hashes[i], &top));
+          tr_variantFree (&top);
+        }
+    }
+  tr_resumeDbRemove (db, hashes[1]);
+  tr_resumeDbGetStats (db, &stats);
+  check_int_eq (2, stats.torrent_count);
+  check (stats.file_size > stats.live_size);
+
+  check (tr_resumeDbCompact (db));
+  tr_resumeDbGetStats (db, &stats);
+  check_int_eq (2, stats.torrent_count);
+  check_uint_eq (stats.live_size, stats.file_size);
+  if (checkState (db, hashes[0], 99, "/one"))
+    return 1;
+
+  /* it can still be written to and reopened */
+  makeState (&top, 100, "/two");
+  check_int_eq (0, tr_resumeDbWrite (db, hashes[2], &top));
+  tr_variantFree (&top);
+  tr_resumeDbClose (db);
+  db = tr_resumeDbOpen (filename);
+  check (db != NULL);
+  tr_resumeDbGetStats (db, &stats);
+  check_int_eq (2, stats.torrent_count);
+  check (!tr_resumeDbRead (db, hashes[1], &top));
+  if (checkState (db, hashes[0], 99, "/one"))
+    return 1;
+  if (checkState (db, hashes[2], 100, "/two"))
+    return 1;
+
+  tr_resumeDbClose (db);
+  tr_free (filename);
+  libtest_sandbox_destroy (sandbox);
+  tr_free (sandbox);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_write_read,
+                             test_unfinished_write,
+                             test_compact };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
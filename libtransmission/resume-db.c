@@ -0,0 +1,917 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h> /* qsort () */
+#include <string.h> /* memcmp (), memcpy (), memset (), strcmp () */
+
+#include <zlib.h> /* crc32 () */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "error.h"
+#include "file.h"
+#include "log.h"
+#include "platform.h" /* tr_lock */
+#include "ptrarray.h"
+#include "resume-db.h"
+#include "utils.h"
+#include "variant.h"
+
+#define MY_NAME "Resume Database"
+
+static const uint8_t file_magic[8] = { 'T', 'R', 'R', 'E', 'S', 'U', 'M', 'E' };
+
+enum
+{
+  FILE_VERSION = 1,
+
+  /* magic, version, and four reserved bytes */
+  FILE_HEADER_SIZE = 16,
+
+  /* payload length, checksum, kind, three reserved bytes, and info hash.
+   * The checksum covers everything after itself, including the payload. */
+  RECORD_HEADER_SIZE = 32,
+
+  /* after this many deltas, write a snapshot instead so that
+   * reading a torrent's state never has to merge too many records */
+  MAX_DELTAS = 32,
+
+  /* don't bother compacting until there's at least this much to reclaim */
+  COMPACT_MIN_WASTE = 1024 * 1024
+};
+
+enum
+{
+  RECORD_SNAPSHOT = 1, /* all of a torrent's fields */
+  RECORD_DELTA    = 2, /* the fields that changed since the previous record */
+  RECORD_REMOVED  = 3  /* the torrent was removed. This has no payload. */
+};
+
+struct record_ref
+{
+  uint64_t offset; /* of the record's header */
+  uint32_t length; /* of its payload */
+};
+
+struct field_sum
+{
+  tr_quark key;
+  uint32_t sum;
+};
+
+struct db_entry
+{
+  uint8_t hash[SHA_DIGEST_LENGTH];
+
+  /* the torrent's last snapshot, followed by any deltas */
+  struct record_ref * records;
+  int record_count;
+  int record_alloc;
+
+  /* checksums of the fields as they were last written,
+   * or NULL if they haven't been read or written yet */
+  struct field_sum * sums;
+  int sum_count;
+};
+
+struct tr_resume_db
+{
+  tr_lock * lock;
+  char * filename;
+  tr_sys_file_t fd;
+  uint64_t end; /* where the next record goes */
+  uint64_t live_size;
+
+  /* the file as it was when it was opened or last compacted.
+   * Only the first map_valid bytes are ever read from it. */
+  const uint8_t * map;
+  uint64_t map_len;
+  uint64_t map_valid;
+
+  tr_ptrArray entries; /* struct db_entry, sorted by hash */
+};
+
+/***
+****
+***/
+
+static void
+putUint32 (uint8_t * buf, uint32_t val)
+{
+  buf[0] = (val >> 24) & 0xff;
+  buf[1] = (val >> 16) & 0xff;
+  buf[2] = (val >> 8) & 0xff;
+  buf[3] = val & 0xff;
+}
+
+static uint32_t
+getUint32 (const uint8_t * buf)
+{
+  return ((uint32_t)buf[0] << 24)
+       | ((uint32_t)buf[1] << 16)
+       | ((uint32_t)buf[2] << 8)
+       | (uint32_t)buf[3];
+}
+
+static uint32_t
+recordChecksum (const uint8_t * header, const uint8_t * payload, uint32_t length)
+{
+  uLong crc = crc32 (0L, Z_NULL, 0);
+  crc = crc32 (crc, header + 8, RECORD_HEADER_SIZE - 8);
+  if (length > 0) /* crc32 () starts over when given a NULL buffer */
+    crc = crc32 (crc, payload, length);
+  return (uint32_t) crc;
+}
+
+/***
+****  The index of torrents
+***/
+
+static int
+compareEntryToHash (const void * ventry, const void * vhash)
+{
+  const struct db_entry * entry = ventry;
+
+  return memcmp (entry->hash, vhash, SHA_DIGEST_LENGTH);
+}
+
+static uint64_t
+entrySize (const struct db_entry * entry)
+{
+  int i;
+  uint64_t size = 0;
+
+  for (i=0; i<entry->record_count; ++i)
+    size += RECORD_HEADER_SIZE + entry->records[i].length;
+
+  return size;
+}
+
+static void
+entryFree (void * ventry)
+{
+  struct db_entry * entry = ventry;
+
+  tr_free (entry->sums);
+  tr_free (entry->records);
+  tr_free (entry);
+}
+
+static struct db_entry *
+getEntry (tr_resume_db * db, const uint8_t * hash, bool create)
+{
+  bool exact;
+  struct db_entry * entry;
+  const int pos = tr_ptrArrayLowerBound (&db->entries, hash, compareEntryToHash, &exact);
+
+  if (exact)
+    return tr_ptrArrayNth (&db->entries, pos);
+
+  if (!create)
+    return NULL;
+
+  entry = tr_new0 (struct db_entry, 1);
+  memcpy (entry->hash, hash, SHA_DIGEST_LENGTH);
+  tr_ptrArrayInsert (&db->entries, entry, pos);
+  return entry;
+}
+
+static void
+entryDrop (tr_resume_db * db, struct db_entry * entry)
+{
+  bool exact;
+  const int pos = tr_ptrArrayLowerBound (&db->entries, entry->hash, compareEntryToHash, &exact);
+
+  assert (exact);
+
+  db->live_size -= entrySize (entry);
+  tr_ptrArrayRemove (&db->entries, pos);
+  entryFree (entry);
+}
+
+static void
+entryAddRecord (tr_resume_db * db, struct db_entry * entry, int kind, uint64_t offset, uint32_t length)
+{
+  /* a snapshot supersedes everything before it */
+  if (kind == RECORD_SNAPSHOT)
+    {
+      db->live_size -= entrySize (entry);
+      entry->record_count = 0;
+    }
+
+  if (entry->record_count == entry->record_alloc)
+    {
+      entry->record_alloc = entry->record_alloc ? entry->record_alloc * 2 : 2;
+      entry->records = tr_renew (struct record_ref, entry->records, entry->record_alloc);
+    }
+
+  entry->records[entry->record_count].offset = offset;
+  entry->records[entry->record_count].length = length;
+  ++entry->record_count;
+
+  db->live_size += RECORD_HEADER_SIZE + length;
+}
+
+/***
+****  Fields
+***/
+
+struct field
+{
+  tr_quark key;
+  const char * name;
+  size_t name_len;
+  struct evbuffer * value; /* benc */
+  uint32_t sum;
+};
+
+static int
+compareFieldsByName (const void * va, const void * vb)
+{
+  const struct field * a = va;
+  const struct field * b = vb;
+
+  return strcmp (a->name, b->name);
+}
+
+/* benc each of the dict's values separately, so that they can be compared
+ * to what was written last time and so that any of them can be written */
+static struct field *
+getFields (const tr_variant * dict, int * setme_count)
+{
+  size_t n;
+  tr_quark key;
+  tr_variant * val;
+  struct field * fields;
+
+  for (n=0; tr_variantDictChild ((tr_variant*)dict, n, &key, &val); )
+    ++n;
+
+  fields = tr_new0 (struct field, n);
+
+  for (n=0; tr_variantDictChild ((tr_variant*)dict, n, &key, &val); ++n)
+    {
+      struct field * f = &fields[n];
+
+      f->key = key;
+      f->name = tr_quark_get_string (f->key, &f->name_len);
+      f->value = tr_variantToBuf (val, TR_VARIANT_FMT_BENC);
+      f->sum = (uint32_t) crc32 (crc32 (0L, Z_NULL, 0),
+                                 evbuffer_pullup (f->value, -1),
+                                 evbuffer_get_length (f->value));
+    }
+
+  /* benc wants dict keys in order */
+  qsort (fields, n, sizeof (struct field), compareFieldsByName);
+
+  *setme_count = n;
+  return fields;
+}
+
+static void
+freeFields (struct field * fields, int count)
+{
+  int i;
+
+  for (i=0; i<count; ++i)
+    evbuffer_free (fields[i].value);
+
+  tr_free (fields);
+}
+
+static void
+entrySetSums (struct db_entry * entry, const struct field * fields, int count)
+{
+  int i;
+
+  entry->sums = tr_renew (struct field_sum, entry->sums, count);
+  entry->sum_count = count;
+
+  for (i=0; i<count; ++i)
+    {
+      entry->sums[i].key = fields[i].key;
+      entry->sums[i].sum = fields[i].sum;
+    }
+}
+
+static const struct field_sum *
+entryFindSum (const struct db_entry * entry, tr_quark key)
+{
+  int i;
+
+  for (i=0; i<entry->sum_count; ++i)
+    if (entry->sums[i].key == key)
+      return &entry->sums[i];
+
+  return NULL;
+}
+
+static bool
+hasField (const struct field * fields, int count, tr_quark key)
+{
+  int i;
+
+  for (i=0; i<count; ++i)
+    if (fields[i].key == key)
+      return true;
+
+  return false;
+}
+
+/***
+****  Records
+***/
+
+/* Write a record with the fields flagged in `include' at `offset' in `fd'.
+ * Their values are drained in the process. */
+static int
+writeRecord (tr_sys_file_t    fd,
+             uint64_t         offset,
+             int              kind,
+             const uint8_t  * hash,
+             struct field   * fields,
+             const bool     * include,
+             int              count,
+             uint32_t       * setme_length)
+{
+  int i;
+  int err = 0;
+  size_t length;
+  uint8_t header[RECORD_HEADER_SIZE];
+  tr_error * error = NULL;
+  struct evbuffer * out = evbuffer_new ();
+
+  if (kind != RECORD_REMOVED)
+    {
+      evbuffer_add (out, "d", 1);
+      for (i=0; i<count; ++i)
+        {
+          if (include[i])
+            {
+              evbuffer_add_printf (out, "%zu:", fields[i].name_len);
+              evbuffer_add (out, fields[i].name, fields[i].name_len);
+              evbuffer_add_buffer (out, fields[i].value);
+            }
+        }
+      evbuffer_add (out, "e", 1);
+    }
+
+  length = evbuffer_get_length (out);
+  memset (header, 0, sizeof (header));
+  putUint32 (header, length);
+  header[8] = kind;
+  memcpy (header + 12, hash, SHA_DIGEST_LENGTH);
+  putUint32 (header + 4, recordChecksum (header, evbuffer_pullup (out, -1), length));
+  evbuffer_prepend (out, header, sizeof (header));
+
+  if (!tr_sys_file_write_at (fd, evbuffer_pullup (out, -1), evbuffer_get_length (out), offset, NULL, &error))
+    {
+      err = error->code;
+      tr_error_free (error);
+    }
+
+  evbuffer_free (out);
+  *setme_length = length;
+  return err;
+}
+
+static int
+appendRecord (tr_resume_db   * db,
+              int              kind,
+              const uint8_t  * hash,
+              struct field   * fields,
+              const bool     * include,
+              int              count,
+              uint64_t       * setme_offset,
+              uint32_t       * setme_length)
+{
+  const int err = writeRecord (db->fd, db->end, kind, hash, fields, include, count, setme_length);
+
+  if (err)
+    {
+      /* don't leave half a record for the next one to be written after */
+      tr_sys_file_truncate (db->fd, db->end, NULL);
+    }
+  else
+    {
+      *setme_offset = db->end;
+      db->end += RECORD_HEADER_SIZE + *setme_length;
+    }
+
+  return err;
+}
+
+/* @return a pointer to the record's payload, which may need freeing with `setme_free' */
+static const uint8_t *
+getPayload (tr_resume_db * db, const struct record_ref * ref, uint8_t ** setme_free)
+{
+  uint64_t bytes_read;
+  const uint64_t offset = ref->offset + RECORD_HEADER_SIZE;
+
+  *setme_free = NULL;
+
+  if (offset + ref->length <= db->map_valid)
+    return db->map + offset;
+
+  /* it was written after the file was mapped */
+  *setme_free = tr_new (uint8_t, MAX (ref->length, 1));
+  if (!tr_sys_file_read_at (db->fd, *setme_free, ref->length, offset, &bytes_read, NULL)
+      || bytes_read != ref->length)
+    {
+      tr_free (*setme_free);
+      *setme_free = NULL;
+      return NULL;
+    }
+
+  return *setme_free;
+}
+
+static bool
+parseRecord (tr_resume_db * db, const struct record_ref * ref, tr_variant * setme)
+{
+  int err = EINVAL;
+  uint8_t * buf;
+  const uint8_t * payload = getPayload (db, ref, &buf);
+
+  if (payload != NULL)
+    err = tr_variantFromBenc (setme, payload, ref->length);
+
+  tr_free (buf);
+  return !err && tr_variantIsDict (setme);
+}
+
+/* merge the entry's snapshot and deltas */
+static bool
+readEntry (tr_resume_db * db, const struct db_entry * entry, tr_variant * setme)
+{
+  int i;
+
+  if (entry->record_count < 1 || !parseRecord (db, &entry->records[0], setme))
+    return false;
+
+  for (i=1; i<entry->record_count; ++i)
+    {
+      size_t j;
+      tr_quark key;
+      tr_variant * val;
+      tr_variant delta;
+
+      if (!parseRecord (db, &entry->records[i], &delta))
+        {
+          tr_variantFree (setme);
+          return false;
+        }
+
+      for (j=0; tr_variantDictChild (&delta, j, &key, &val); ++j)
+        {
+          tr_variantDictRemove (setme, key);
+          tr_variantDictSteal (setme, key, val);
+        }
+
+      tr_variantFree (&delta);
+    }
+
+  return true;
+}
+
+/***
+****  Opening the database
+***/
+
+static void
+scanRecords (tr_resume_db * db)
+{
+  uint64_t pos = FILE_HEADER_SIZE;
+
+  while (pos + RECORD_HEADER_SIZE <= db->map_valid)
+    {
+      struct db_entry * entry;
+      const uint8_t * header = db->map + pos;
+      const uint32_t length = getUint32 (header);
+      const int kind = header[8];
+      const uint8_t * hash = header + 12;
+
+      if (length > db->map_valid - pos - RECORD_HEADER_SIZE)
+        break;
+
+      if (getUint32 (header + 4) != recordChecksum (header, header + RECORD_HEADER_SIZE, length))
+        break;
+
+      switch (kind)
+        {
+          case RECORD_SNAPSHOT:
+            entryAddRecord (db, getEntry (db, hash, true), kind, pos, length);
+            break;
+
+          case RECORD_DELTA:
+            if ((entry = getEntry (db, hash, false)) != NULL)
+              entryAddRecord (db, entry, kind, pos, length);
+            break;
+
+          case RECORD_REMOVED:
+            if ((entry = getEntry (db, hash, false)) != NULL)
+              entryDrop (db, entry);
+            break;
+
+          default:
+            break;
+        }
+
+      pos += RECORD_HEADER_SIZE + length;
+    }
+
+  if (pos < db->map_valid)
+    {
+      tr_logAddNamedError (MY_NAME, "Discarding the last %"PRIu64" bytes of \"%s\", which weren't completely written",
+                           db->map_valid - pos, db->filename);
+      tr_sys_file_truncate (db->fd, pos, NULL);
+      db->map_valid = pos;
+    }
+
+  db->end = pos;
+}
+
+static bool
+writeFileHeader (tr_sys_file_t fd, tr_error ** error)
+{
+  uint8_t header[FILE_HEADER_SIZE];
+
+  memset (header, 0, sizeof (header));
+  memcpy (header, file_magic, sizeof (file_magic));
+  putUint32 (header + 8, FILE_VERSION);
+
+  return tr_sys_file_write_at (fd, header, sizeof (header), 0, NULL, error);
+}
+
+static bool
+mapFile (tr_resume_db * db, tr_error ** error)
+{
+  tr_sys_path_info info;
+
+  if (!tr_sys_file_get_info (db->fd, &info, error))
+    return false;
+
+  if (info.size < FILE_HEADER_SIZE)
+    {
+      tr_error_set_literal (error, EINVAL, "too short");
+      return false;
+    }
+
+  db->map = tr_sys_file_map_for_reading (db->fd, 0, info.size, error);
+  if (db->map == NULL)
+    return false;
+
+  db->map_len = info.size;
+  db->map_valid = info.size;
+  return true;
+}
+
+static void
+unmapFile (tr_resume_db * db)
+{
+  if (db->map != NULL)
+    tr_sys_file_unmap (db->map, db->map_len, NULL);
+
+  db->map = NULL;
+  db->map_len = 0;
+  db->map_valid = 0;
+}
+
+tr_resume_db *
+tr_resumeDbOpen (const char * filename)
+{
+  tr_sys_path_info info;
+  tr_error * error = NULL;
+  tr_resume_db * db = tr_new0 (tr_resume_db, 1);
+
+  db->filename = tr_strdup (filename);
+  db->fd = tr_sys_file_open (filename, TR_SYS_FILE_READ | TR_SYS_FILE_WRITE | TR_SYS_FILE_CREATE, 0600, &error);
+
+  if ((db->fd != TR_BAD_SYS_FILE)
+      && tr_sys_file_get_info (db->fd, &info, &error)
+      && (info.size > 0 || writeFileHeader (db->fd, &error))
+      && mapFile (db, &error))
+    {
+      if (memcmp (db->map, file_magic, sizeof (file_magic)) != 0
+          || getUint32 (db->map + 8) != FILE_VERSION)
+        tr_error_set_literal (&error, EINVAL, "not a resume database, or a newer version of one");
+    }
+
+  if (error != NULL)
+    {
+      tr_logAddNamedError (MY_NAME, "Couldn't open \"%s\": %s", filename, error->message);
+      tr_error_free (error);
+      unmapFile (db);
+      if (db->fd != TR_BAD_SYS_FILE)
+        tr_sys_file_close (db->fd, NULL);
+      tr_free (db->filename);
+      tr_free (db);
+      return NULL;
+    }
+
+  db->lock = tr_lockNew ();
+  db->live_size = FILE_HEADER_SIZE;
+  scanRecords (db);
+
+  tr_logAddNamedDbg (MY_NAME, "Opened \"%s\": %d torrents, %"PRIu64" of %"PRIu64" bytes in use",
+                     filename, tr_ptrArraySize (&db->entries), db->live_size, db->end);
+  return db;
+}
+
+void
+tr_resumeDbClose (tr_resume_db * db)
+{
+  if (db == NULL)
+    return;
+
+  unmapFile (db);
+  tr_sys_file_close (db->fd, NULL);
+  tr_ptrArrayDestruct (&db->entries, entryFree);
+  tr_lockFree (db->lock);
+  tr_free (db->filename);
+  tr_free (db);
+}
+
+/***
+****  Reading and writing
+***/
+
+bool
+tr_resumeDbRead (tr_resume_db * db, const uint8_t * hash, tr_variant * setme)
+{
+  bool ok = false;
+  struct db_entry * entry;
+
+  tr_lockLock (db->lock);
+
+  if ((entry = getEntry (db, hash, false)) != NULL)
+    {
+      ok = readEntry (db, entry, setme);
+
+      /* so that the next save can tell what changed */
+      if (ok && entry->sums == NULL)
+        {
+          int count;
+          struct field * fields = getFields (setme, &count);
+          entrySetSums (entry, fields, count);
+          freeFields (fields, count);
+        }
+    }
+
+  tr_lockUnlock (db->lock);
+  return ok;
+}
+
+int
+tr_resumeDbWrite (tr_resume_db * db, const uint8_t * hash, const tr_variant * dict)
+{
+  int i;
+  int err = 0;
+  int count;
+  int changed = 0;
+  bool * include;
+  bool snapshot;
+  struct db_entry * entry;
+  struct field * fields;
+
+  assert (tr_variantIsDict (dict));
+
+  tr_lockLock (db->lock);
+
+  fields = getFields (dict, &count);
+  include = tr_new0 (bool, count);
+  entry = getEntry (db, hash, true);
+
+  /* a delta can't say that a field went away */
+  snapshot = entry->sums == NULL
+          || entry->record_count == 0
+          || entry->record_count > MAX_DELTAS;
+  for (i=0; !snapshot && i<entry->sum_count; ++i)
+    if (!hasField (fields, count, entry->sums[i].key))
+      snapshot = true;
+
+  for (i=0; i<count; ++i)
+    {
+      const struct field_sum * old = snapshot ? NULL : entryFindSum (entry, fields[i].key);
+      include[i] = old == NULL || old->sum != fields[i].sum;
+      if (include[i])
+        ++changed;
+    }
+
+  if (changed > 0)
+    {
+      uint64_t offset;
+      uint32_t length;
+      const int kind = snapshot ? RECORD_SNAPSHOT : RECORD_DELTA;
+
+      err = appendRecord (db, kind, hash, fields, include, count, &offset, &length);
+      if (!err)
+        {
+          entryAddRecord (db, entry, kind, offset, length);
+          entrySetSums (entry, fields, count);
+        }
+      else if (entry->record_count == 0)
+        {
+          entryDrop (db, entry);
+        }
+    }
+
+  tr_free (include);
+  freeFields (fields, count);
+  tr_lockUnlock (db->lock);
+  return err;
+}
+
+void
+tr_resumeDbRemove (tr_resume_db * db, const uint8_t * hash)
+{
+  struct db_entry * entry;
+
+  tr_lockLock (db->lock);
+
+  if ((entry = getEntry (db, hash, false)) != NULL)
+    {
+      int err;
+      uint64_t offset;
+      uint32_t length;
+
+      if ((err = appendRecord (db, RECORD_REMOVED, hash, NULL, NULL, 0, &offset, &length)))
+        tr_logAddNamedError (MY_NAME, "Couldn't write to \"%s\": %s", db->filename, tr_strerror (err));
+
+      entryDrop (db, entry);
+    }
+
+  tr_lockUnlock (db->lock);
+}
+
+/***
+****  Compaction
+***/
+
+static bool
+compactImpl (tr_resume_db * db)
+{
+  int i;
+  int n;
+  bool ok;
+  uint64_t pos;
+  tr_sys_file_t fd;
+  tr_error * error = NULL;
+  struct record_ref * refs;
+  char * tmp = tr_strdup_printf ("%s.tmp", db->filename);
+
+  fd = tr_sys_file_open (tmp, TR_SYS_FILE_READ | TR_SYS_FILE_WRITE | TR_SYS_FILE_CREATE | TR_SYS_FILE_TRUNCATE, 0600, &error);
+  if (fd == TR_BAD_SYS_FILE)
+    {
+      tr_logAddNamedError (MY_NAME, "Couldn't compact \"%s\": %s", db->filename, error->message);
+      tr_error_free (error);
+      tr_free (tmp);
+      return false;
+    }
+
+  n = tr_ptrArraySize (&db->entries);
+  refs = tr_new0 (struct record_ref, n);
+  pos = FILE_HEADER_SIZE;
+  ok = writeFileHeader (fd, &error);
+
+  for (i=0; ok && i<n; ++i)
+    {
+      tr_variant top;
+      struct db_entry * entry = tr_ptrArrayNth (&db->entries, i);
+
+      if (readEntry (db, entry, &top))
+        {
+          int j;
+          int err;
+          int count;
+          bool * include;
+          struct field * fields = getFields (&top, &count);
+
+          include = tr_new (bool, count);
+          for (j=0; j<count; ++j)
+            include[j] = true;
+
+          err = writeRecord (fd, pos, RECORD_SNAPSHOT, entry->hash, fields, include, count, &refs[i].length);
+          if (err)
+            {
+              tr_error_set_literal (&error, err, tr_strerror (err));
+              ok = false;
+            }
+
+          refs[i].offset = pos;
+          pos += RECORD_HEADER_SIZE + refs[i].length;
+
+          tr_free (include);
+          freeFields (fields, count);
+          tr_variantFree (&top);
+        }
+      else
+        {
+          /* it was checksummed, so this shouldn't happen */
+          refs[i].length = 0;
+          refs[i].offset = 0;
+        }
+    }
+
+  ok = ok
+    && tr_sys_file_flush (fd, &error)
+    && tr_sys_path_rename (tmp, db->filename, &error);
+
+  if (!ok)
+    {
+      tr_logAddNamedError (MY_NAME, "Couldn't compact \"%s\": %s", db->filename, error->message);
+      tr_error_free (error);
+      tr_sys_file_close (fd, NULL);
+      tr_sys_path_remove (tmp, NULL);
+      tr_free (refs);
+      tr_free (tmp);
+      return false;
+    }
+
+  /* switch over to the new file */
+  unmapFile (db);
+  tr_sys_file_close (db->fd, NULL);
+  db->fd = fd;
+  db->end = pos;
+  db->live_size = FILE_HEADER_SIZE;
+  if (!mapFile (db, &error))
+    {
+      /* everything will be read with tr_sys_file_read_at () instead */
+      tr_logAddNamedError (MY_NAME, "Couldn't map \"%s\": %s", db->filename, error->message);
+      tr_error_free (error);
+    }
+
+  for (i=n-1; i>=0; --i)
+    {
+      struct db_entry * entry = tr_ptrArrayNth (&db->entries, i);
+
+      if (refs[i].offset == 0)
+        {
+          entry->record_count = 0;
+          entryDrop (db, entry);
+        }
+      else
+        {
+          entry->record_count = 0;
+          entryAddRecord (db, entry, RECORD_SNAPSHOT, refs[i].offset, refs[i].length);
+        }
+    }
+
+  tr_free (refs);
+  tr_free (tmp);
+  return true;
+}
+
+bool
+tr_resumeDbCompact (tr_resume_db * db)
+{
+  bool ok;
+  uint64_t old_size;
+
+  tr_lockLock (db->lock);
+
+  old_size = db->end;
+  ok = compactImpl (db);
+
+  if (ok)
+    tr_logAddNamedDbg (MY_NAME, "Compacted \"%s\" from %"PRIu64" to %"PRIu64" bytes",
+                       db->filename, old_size, db->end);
+
+  tr_lockUnlock (db->lock);
+  return ok;
+}
+
+void
+tr_resumeDbMaybeCompact (tr_resume_db * db)
+{
+  bool compact;
+  uint64_t waste;
+
+  tr_lockLock (db->lock);
+  waste = db->end - db->live_size;
+  compact = waste >= COMPACT_MIN_WASTE && waste > db->live_size;
+  tr_lockUnlock (db->lock);
+
+  if (compact)
+    tr_resumeDbCompact (db);
+}
+
+void
+tr_resumeDbGetStats (tr_resume_db * db, struct tr_resume_db_stats * setme)
+{
+  tr_lockLock (db->lock);
+
+  setme->torrent_count = tr_ptrArraySize (&db->entries);
+  setme->file_size = db->end;
+  setme->live_size = db->live_size;
+
+  tr_lockUnlock (db->lock);
+}
@@ -0,0 +1,71 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#pragma once
+
+struct tr_variant;
+
+/**
+ * A single-file, append-only store for the torrents' resume state,
+ * which can be used instead of one .resume file per torrent.
+ *
+ * Each record is a fixed-size header (length, checksum, kind, info hash)
+ * followed by a benc dict of the same fields a .resume file holds.
+ * A torrent's state is its last snapshot record plus any delta records
+ * after it, which hold only the fields that changed. Opening the database
+ * maps it and checks the records' checksums without parsing them, and
+ * tr_resumeDbCompact () rewrites it once most of it is superseded records.
+ *
+ * All of these functions are thread-safe.
+ */
+
+typedef struct tr_resume_db tr_resume_db;
+
+struct tr_resume_db_stats
+{
+  int torrent_count;
+  uint64_t file_size;   /* bytes */
+  uint64_t live_size;   /* bytes of records that are still in use */
+};
+
+/** @return the database, or NULL if it couldn't be opened or created */
+tr_resume_db * tr_resumeDbOpen     (const char              * filename);
+
+void           tr_resumeDbClose    (tr_resume_db            * db);
+
+/**
+ * @brief get a torrent's state, merged from its snapshot and deltas
+ * @return true if the database had a record for the torrent
+ */
+bool           tr_resumeDbRead     (tr_resume_db            * db,
+                                    const uint8_t           * hash,
+                                    struct tr_variant       * setme);
+
+/**
+ * @brief save a torrent's state, writing only the fields that changed
+ * @return 0 on success, or an errno value
+ */
+int            tr_resumeDbWrite    (tr_resume_db            * db,
+                                    const uint8_t           * hash,
+                                    const struct tr_variant * dict);
+
+void           tr_resumeDbRemove   (tr_resume_db            * db,
+                                    const uint8_t           * hash);
+
+/** @brief rewrite the database if most of it is superseded records */
+void           tr_resumeDbMaybeCompact (tr_resume_db        * db);
+
+/** @brief rewrite the database with one snapshot record per torrent */
+bool           tr_resumeDbCompact  (tr_resume_db            * db);
+
+void           tr_resumeDbGetStats (tr_resume_db              * db,
+                                    struct tr_resume_db_stats * setme);
@@ -17,6 +17,7 @@
 #include "peer-mgr.h" /* pex */
 #include "platform.h" /* tr_getResumeDir () */
 #include "resume.h"
+#include "resume-db.h"
 #include "session.h"
 #include "torrent.h"
 #include "utils.h" /* tr_buildPath */
@@ -28,15 +29,21 @@ enum
 };
 
 static char*
-getResumeFilename (const tr_torrent * tor)
+getResumeFilenameFromInfo (const tr_session * session, const tr_info * info)
 {
-  char * base = tr_metainfoGetBasename (tr_torrentInfo (tor));
+  char * base = tr_metainfoGetBasename (info);
   char * filename = tr_strdup_printf ("%s" TR_PATH_DELIMITER_STR "%s.resume",
-                                      tr_getResumeDir (tor->session), base);
+                                      tr_getResumeDir (session), base);
   tr_free (base);
   return filename;
 }
 
+static char*
+getResumeFilename (const tr_torrent * tor)
+{
+  return getResumeFilenameFromInfo (tor->session, tr_torrentInfo (tor));
+}
+
 /***
 ****
 ***/
@@ -654,7 +661,6 @@ tr_torrentSaveResume (tr_torrent * tor)
 {
   int err;
   tr_variant top;
-  char * filename;
 
   if (!tr_isTorrent (tor))
     return;
@@ -687,22 +693,31 @@ tr_torrentSaveResume (tr_torrent * tor)
   saveFilenames (&top, tor);
   saveName (&top, tor);
 
-  filename = getResumeFilename (tor);
-  if ((err = tr_variantToFile (&top, TR_VARIANT_FMT_BENC, filename)))
-    tr_torrentSetLocalError (tor, "Unable to save resume file: %s", tr_strerror (err));
-  tr_free (filename);
+  if (tor->session->resumeDb != NULL)
+    {
+      if ((err = tr_resumeDbWrite (tor->session->resumeDb, tor->info.hash, &top)))
+        tr_torrentSetLocalError (tor, "Unable to save resume state: %s", tr_strerror (err));
+    }
+  else
+    {
+      char * filename = getResumeFilename (tor);
+      if ((err = tr_variantToFile (&top, TR_VARIANT_FMT_BENC, filename)))
+        tr_torrentSetLocalError (tor, "Unable to save resume file: %s", tr_strerror (err));
+      tr_free (filename);
+    }
 
   tr_variantFree (&top);
 }
 
 static uint64_t
-loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
+loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad, const tr_ctor * ctor)
 {
   size_t len;
   int64_t  i;
   const char * str;
   char * filename;
-  tr_variant top;
+  tr_variant fromFile;
+  tr_variant * top;
   bool boolVal;
   uint64_t fieldsLoaded = 0;
   const bool wasDirty = tor->isDirty;
@@ -712,7 +727,23 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
 
   filename = getResumeFilename (tor);
 
-  if (!tr_variantFromFile (&top, TR_VARIANT_FMT_BENC, filename, &error))
+  /* it may have already been read for us on a worker thread */
+  if (tr_ctorGetResume (ctor, &top))
+    {
+      tr_logAddTorDbg (tor, "Using preloaded resume file \"%s\"", filename);
+    }
+  else if ((tor->session->resumeDb != NULL)
+           && tr_resumeDbRead (tor->session->resumeDb, tor->info.hash, &fromFile))
+    {
+      top = &fromFile;
+      tr_logAddTorDbg (tor, "%s", "Read resume state from the database");
+    }
+  else if (tr_variantFromFile (&fromFile, TR_VARIANT_FMT_BENC, filename, &error))
+    {
+      top = &fromFile;
+      tr_logAddTorDbg (tor, "Read resume file \"%s\"", filename);
+    }
+  else
     {
       tr_logAddTorDbg (tor, "Couldn't read \"%s\": %s", filename, error->message);
       tr_error_free (error);
@@ -721,17 +752,15 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
       return fieldsLoaded;
     }
 
-  tr_logAddTorDbg (tor, "Read resume file \"%s\"", filename);
-
   if ((fieldsToLoad & TR_FR_CORRUPT)
-      && tr_variantDictFindInt (&top, TR_KEY_corrupt, &i))
+      && tr_variantDictFindInt (top, TR_KEY_corrupt, &i))
     {
       tor->corruptPrev = i;
       fieldsLoaded |= TR_FR_CORRUPT;
     }
 
   if ((fieldsToLoad & (TR_FR_PROGRESS | TR_FR_DOWNLOAD_DIR))
-      && (tr_variantDictFindStr (&top, TR_KEY_destination, &str, &len))
+      && (tr_variantDictFindStr (top, TR_KEY_destination, &str, &len))
       && (str && *str))
     {
       const bool is_current_dir = tor->currentDir == tor->downloadDir;
@@ -743,7 +772,7 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
     }
 
   if ((fieldsToLoad & (TR_FR_PROGRESS | TR_FR_INCOMPLETE_DIR))
-      && (tr_variantDictFindStr (&top, TR_KEY_incomplete_dir, &str, &len))
+      && (tr_variantDictFindStr (top, TR_KEY_incomplete_dir, &str, &len))
       && (str && *str))
     {
       const bool is_current_dir = tor->currentDir == tor->incompleteDir;
@@ -755,70 +784,70 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
     }
 
   if ((fieldsToLoad & TR_FR_DOWNLOADED)
-      && tr_variantDictFindInt (&top, TR_KEY_downloaded, &i))
+      && tr_variantDictFindInt (top, TR_KEY_downloaded, &i))
     {
       tor->downloadedPrev = i;
       fieldsLoaded |= TR_FR_DOWNLOADED;
     }
 
   if ((fieldsToLoad & TR_FR_UPLOADED)
-      && tr_variantDictFindInt (&top, TR_KEY_uploaded, &i))
+      && tr_variantDictFindInt (top, TR_KEY_uploaded, &i))
     {
       tor->uploadedPrev = i;
       fieldsLoaded |= TR_FR_UPLOADED;
     }
 
   if ((fieldsToLoad & TR_FR_MAX_PEERS)
-      && tr_variantDictFindInt (&top, TR_KEY_max_peers, &i))
+      && tr_variantDictFindInt (top, TR_KEY_max_peers, &i))
     {
       tor->maxConnectedPeers = i;
       fieldsLoaded |= TR_FR_MAX_PEERS;
     }
 
   if ((fieldsToLoad & TR_FR_RUN)
-      && tr_variantDictFindBool (&top, TR_KEY_paused, &boolVal))
+      && tr_variantDictFindBool (top, TR_KEY_paused, &boolVal))
     {
       tor->isRunning = !boolVal;
       fieldsLoaded |= TR_FR_RUN;
     }
 
   if ((fieldsToLoad & TR_FR_ADDED_DATE)
-      && tr_variantDictFindInt (&top, TR_KEY_added_date, &i))
+      && tr_variantDictFindInt (top, TR_KEY_added_date, &i))
     {
       tor->addedDate = i;
       fieldsLoaded |= TR_FR_ADDED_DATE;
     }
 
   if ((fieldsToLoad & TR_FR_DONE_DATE)
-      && tr_variantDictFindInt (&top, TR_KEY_done_date, &i))
+      && tr_variantDictFindInt (top, TR_KEY_done_date, &i))
     {
       tor->doneDate = i;
       fieldsLoaded |= TR_FR_DONE_DATE;
     }
 
   if ((fieldsToLoad & TR_FR_ACTIVITY_DATE)
-      && tr_variantDictFindInt (&top, TR_KEY_activity_date, &i))
+      && tr_variantDictFindInt (top, TR_KEY_activity_date, &i))
     {
       tr_torrentSetActivityDate (tor, i);
       fieldsLoaded |= TR_FR_ACTIVITY_DATE;
     }
 
   if ((fieldsToLoad & TR_FR_TIME_SEEDING)
-      && tr_variantDictFindInt (&top, TR_KEY_seeding_time_seconds, &i))
+      && tr_variantDictFindInt (top, TR_KEY_seeding_time_seconds, &i))
     {
       tor->secondsSeeding = i;
       fieldsLoaded |= TR_FR_TIME_SEEDING;
     }
 
   if ((fieldsToLoad & TR_FR_TIME_DOWNLOADING)
-      && tr_variantDictFindInt (&top, TR_KEY_downloading_time_seconds, &i))
+      && tr_variantDictFindInt (top, TR_KEY_downloading_time_seconds, &i))
     {
       tor->secondsDownloading = i;
       fieldsLoaded |= TR_FR_TIME_DOWNLOADING;
     }
 
   if ((fieldsToLoad & TR_FR_BANDWIDTH_PRIORITY)
-      && tr_variantDictFindInt (&top, TR_KEY_bandwidth_priority, &i)
+      && tr_variantDictFindInt (top, TR_KEY_bandwidth_priority, &i)
       && tr_isPriority (i))
     {
       tr_torrentSetPriority (tor, i);
@@ -826,38 +855,39 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
     }
 
   if (fieldsToLoad & TR_FR_PEERS)
-    fieldsLoaded |= loadPeers (&top, tor);
+    fieldsLoaded |= loadPeers (top, tor);
 
   if (fieldsToLoad & TR_FR_FILE_PRIORITIES)
-    fieldsLoaded |= loadFilePriorities (&top, tor);
+    fieldsLoaded |= loadFilePriorities (top, tor);
 
   if (fieldsToLoad & TR_FR_PROGRESS)
-    fieldsLoaded |= loadProgress (&top, tor);
+    fieldsLoaded |= loadProgress (top, tor);
 
   if (fieldsToLoad & TR_FR_DND)
-    fieldsLoaded |= loadDND (&top, tor);
+    fieldsLoaded |= loadDND (top, tor);
 
   if (fieldsToLoad & TR_FR_SPEEDLIMIT)
-    fieldsLoaded |= loadSpeedLimits (&top, tor);
+    fieldsLoaded |= loadSpeedLimits (top, tor);
 
   if (fieldsToLoad & TR_FR_RATIOLIMIT)
-    fieldsLoaded |= loadRatioLimits (&top, tor);
+    fieldsLoaded |= loadRatioLimits (top, tor);
 
   if (fieldsToLoad & TR_FR_IDLELIMIT)
-    fieldsLoaded |= loadIdleLimits (&top, tor);
+    fieldsLoaded |= loadIdleLimits (top, tor);
 
   if (fieldsToLoad & TR_FR_FILENAMES)
-    fieldsLoaded |= loadFilenames (&top, tor);
+    fieldsLoaded |= loadFilenames (top, tor);
 
   if (fieldsToLoad & TR_FR_NAME)
-    fieldsLoaded |= loadName (&top, tor);
+    fieldsLoaded |= loadName (top, tor);
 
   /* loading the resume file triggers of a lot of changes,
    * but none of them needs to trigger a re-saving of the
    * same resume information... */
   tor->isDirty = wasDirty;
 
-  tr_variantFree (&top);
+  if (top == &fromFile)
+    tr_variantFree (&fromFile);
   tr_free (filename);
   return fieldsLoaded;
 }
@@ -920,17 +950,40 @@ tr_torrentLoadResume (tr_torrent *    tor,
 
   ret |= useManditoryFields (tor, fieldsToLoad, ctor);
   fieldsToLoad &= ~ret;
-  ret |= loadFromFile (tor, fieldsToLoad);
+  ret |= loadFromFile (tor, fieldsToLoad, ctor);
   fieldsToLoad &= ~ret;
   ret |= useFallbackFields (tor, fieldsToLoad, ctor);
 
   return ret;
 }
 
+bool
+tr_torrentReadResume (const tr_session * session,
+                      const tr_info    * info,
+                      tr_variant       * setme)
+{
+  bool ok;
+  char * filename;
+
+  /* a torrent that isn't in the database yet may still have a .resume file */
+  if ((session->resumeDb != NULL) && tr_resumeDbRead (session->resumeDb, info->hash, setme))
+    return true;
+
+  filename = getResumeFilenameFromInfo (session, info);
+  ok = tr_variantFromFile (setme, TR_VARIANT_FMT_BENC, filename, NULL);
+  tr_free (filename);
+  return ok;
+}
+
 void
 tr_torrentRemoveResume (const tr_torrent * tor)
 {
-  char * filename = getResumeFilename (tor);
+  char * filename;
+
+  if (tor->session->resumeDb != NULL)
+    tr_resumeDbRemove (tor->session->resumeDb, tor->info.hash);
+
+  filename = getResumeFilename (tor);
   tr_sys_path_remove (filename, NULL);
   tr_free (filename);
 }
@@ -47,6 +47,15 @@ uint64_t tr_torrentLoadResume   (tr_torrent        * tor,
 
 void     tr_torrentSaveResume   (tr_torrent        * tor);
 
+/**
+ * Read the resume state of the torrent described by @a info without
+ * needing the torrent itself, so that it can be done on a worker thread.
+ * The result can be handed to tr_torrentLoadResume () with tr_ctorSetResume ().
+ */
+bool     tr_torrentReadResume   (const tr_session  * session,
+                                 const tr_info     * info,
+                                 struct tr_variant * setme);
+
 void     tr_torrentRemoveResume (const tr_torrent  * tor);
 
 int      tr_torrentRenameResume (const tr_torrent  * tor,
@@ -0,0 +1,320 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+/* Compares torrent-get's field plan against the per-field switch that
+ * addInfo () used to run, which looked up each field's group and writer
+ * for every torrent and built the file stats once per file field.
+ *
+ * Usage: rpc-bench [torrentCount [fileCount [rounds]]] */
+
+#include <stdio.h>
+#include <stdlib.h> /* atoi () */
+#include <string.h> /* memset () */
+
+#include "transmission.h"
+#include "rpcimpl.h"
+#include "session.h"
+#include "torrent.h"
+#include "utils.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+#define TR_N_ELEMENTS(ary) (sizeof (ary) / sizeof (*ary))
+
+/* roughly what the web client asks for when a torrent's details are open */
+static const char * const field_names[] =
+{
+  "id", "name", "status", "error", "errorString", "eta", "isFinished",
+  "isStalled", "leftUntilDone", "percentDone", "peersConnected",
+  "queuePosition", "rateDownload", "rateUpload", "sizeWhenDone",
+  "uploadRatio", "files", "fileStats", "priorities", "wanted"
+};
+
+static tr_torrent *
+createTorrent (tr_session * session, int i, int fileCount)
+{
+  int j;
+  int err;
+  char name[32];
+  size_t len;
+  char * benc;
+  tr_variant top;
+  tr_variant * info;
+  tr_variant * files;
+  tr_ctor * ctor;
+  tr_torrent * tor;
+  uint8_t pieces[SHA_DIGEST_LENGTH];
+
+  /* one-byte files, so that everything fits in a single piece */
+  tr_snprintf (name, sizeof (name), "torrent-%d", i);
+  memset (pieces, 0, sizeof (pieces));
+  tr_variantInitDict (&top, 1);
+  info = tr_variantDictAddDict (&top, TR_KEY_info, 4);
+  files = tr_variantDictAddList (info, TR_KEY_files, fileCount);
+  for (j=0; j<fileCount; ++j)
+    {
+      char filename[32];
+      tr_variant * file = tr_variantListAddDict (files, 2);
+      tr_snprintf (filename, sizeof (filename), "file-%d", j);
+      tr_variantDictAddInt (file, TR_KEY_length, 1);
+      tr_variantListAddStr (tr_variantDictAddList (file, TR_KEY_path, 1), filename);
+    }
+  tr_variantDictAddStr (info, TR_KEY_name, name);
+  tr_variantDictAddInt (info, TR_KEY_piece_length, 16384);
+  tr_variantDictAddRaw (info, TR_KEY_pieces, pieces, sizeof (pieces));
+  benc = tr_variantToStr (&top, TR_VARIANT_FMT_BENC, &len);
+
+  ctor = tr_ctorNew (session);
+  tr_ctorSetMetainfo (ctor, (uint8_t*)benc, len);
+  tr_ctorSetPaused (ctor, TR_FORCE, true);
+  err = 0;
+  tor = tr_torrentNew (ctor, &err, NULL);
+
+  tr_ctorFree (ctor);
+  tr_free (benc);
+  tr_variantFree (&top);
+  return tor;
+}
+
+/***
+****  The old way
+***/
+
+static bool
+needsStat (tr_quark key)
+{
+  switch (key)
+    {
+      case TR_KEY_id:
+      case TR_KEY_name:
+      case TR_KEY_files:
+      case TR_KEY_fileStats:
+      case TR_KEY_priorities:
+      case TR_KEY_wanted:
+        return false;
+
+      default:
+        return true;
+    }
+}
+
+static void
+addFileList (const tr_torrent * tor, tr_variant * list, bool stats)
+{
+  tr_file_index_t i;
+  tr_file_index_t n;
+  const tr_info * inf = tr_torrentInfo (tor);
+  tr_file_stat * files = tr_torrentFiles (tor, &n);
+
+  for (i=0; i<inf->fileCount; ++i)
+    {
+      const tr_file * file = &inf->files[i];
+      tr_variant * d = tr_variantListAddDict (list, 3);
+      tr_variantDictAddInt (d, TR_KEY_bytesCompleted, files[i].bytesCompleted);
+      if (stats)
+        {
+          tr_variantDictAddInt (d, TR_KEY_priority, file->priority);
+          tr_variantDictAddBool (d, TR_KEY_wanted, !file->dnd);
+        }
+      else
+        {
+          tr_variantDictAddInt (d, TR_KEY_length, file->length);
+          tr_variantDictAddStr (d, TR_KEY_name, file->name);
+        }
+    }
+
+  tr_torrentFilesFree (files, n);
+}
+
+static void
+addField (tr_torrent * tor, const tr_info * inf, const tr_stat * st, tr_variant * d, tr_quark key)
+{
+  tr_file_index_t i;
+  tr_variant * l;
+
+  switch (key)
+    {
+      case TR_KEY_id: tr_variantDictAddInt (d, key, st ? st->id : tr_torrentId (tor)); break;
+      case TR_KEY_name: tr_variantDictAddStr (d, key, tr_torrentName (tor)); break;
+      case TR_KEY_status: tr_variantDictAddInt (d, key, st->activity); break;
+      case TR_KEY_error: tr_variantDictAddInt (d, key, st->error); break;
+      case TR_KEY_errorString: tr_variantDictAddStr (d, key, st->errorString); break;
+      case TR_KEY_eta: tr_variantDictAddInt (d, key, st->eta); break;
+      case TR_KEY_isFinished: tr_variantDictAddBool (d, key, st->finished); break;
+      case TR_KEY_isStalled: tr_variantDictAddBool (d, key, st->isStalled); break;
+      case TR_KEY_leftUntilDone: tr_variantDictAddInt (d, key, st->leftUntilDone); break;
+      case TR_KEY_percentDone: tr_variantDictAddReal (d, key, st->percentDone); break;
+      case TR_KEY_peersConnected: tr_variantDictAddInt (d, key, st->peersConnected); break;
+      case TR_KEY_queuePosition: tr_variantDictAddInt (d, key, st->queuePosition); break;
+      case TR_KEY_rateDownload: tr_variantDictAddInt (d, key, st->pieceDownloadSpeed_KBps); break;
+      case TR_KEY_rateUpload: tr_variantDictAddInt (d, key, st->pieceUploadSpeed_KBps); break;
+      case TR_KEY_sizeWhenDone: tr_variantDictAddInt (d, key, st->sizeWhenDone); break;
+      case TR_KEY_uploadRatio: tr_variantDictAddReal (d, key, st->ratio); break;
+      case TR_KEY_files: addFileList (tor, tr_variantDictAddList (d, key, inf->fileCount), false); break;
+      case TR_KEY_fileStats: addFileList (tor, tr_variantDictAddList (d, key, inf->fileCount), true); break;
+
+      case TR_KEY_priorities:
+        l = tr_variantDictAddList (d, key, inf->fileCount);
+        for (i=0; i<inf->fileCount; ++i)
+          tr_variantListAddInt (l, inf->files[i].priority);
+        break;
+
+      case TR_KEY_wanted:
+        l = tr_variantDictAddList (d, key, inf->fileCount);
+        for (i=0; i<inf->fileCount; ++i)
+          tr_variantListAddInt (l, inf->files[i].dnd ? 0 : 1);
+        break;
+
+      default:
+        break;
+    }
+}
+
+static void
+oldTorrentGet (tr_session * session, tr_variant * response)
+{
+  int i;
+  int n;
+  tr_variant * list;
+  tr_quark keys[TR_N_ELEMENTS (field_names)];
+  tr_torrent ** torrents = tr_sessionGetTorrents (session, &n);
+
+  tr_variantInitDict (response, 1);
+  list = tr_variantDictAddList (tr_variantDictAddDict (response, TR_KEY_arguments, 1), TR_KEY_torrents, n);
+
+  for (i=0; i<(int)TR_N_ELEMENTS (field_names); ++i)
+    keys[i] = tr_quark_new (field_names[i], TR_BAD_SIZE);
+
+  for (i=0; i<n; ++i)
+    {
+      int j;
+      const tr_stat * st = NULL;
+      tr_variant * d = tr_variantListAddDict (list, TR_N_ELEMENTS (keys));
+
+      for (j=0; j<(int)TR_N_ELEMENTS (keys); ++j)
+        {
+          if (needsStat (keys[j]) && (st == NULL))
+            st = tr_torrentStat (torrents[i]);
+
+          addField (torrents[i], tr_torrentInfo (torrents[i]), st, d, keys[j]);
+        }
+    }
+
+  tr_free (torrents);
+}
+
+/***
+****  The new way
+***/
+
+static void
+onResponse (tr_session * session UNUSED, tr_variant * response, void * vresponse)
+{
+  *(tr_variant *) vresponse = *response;
+  tr_variantInitBool (response, false);
+}
+
+static void
+newTorrentGet (tr_session * session, tr_variant * response)
+{
+  size_t i;
+  tr_variant request;
+  tr_variant * args;
+  tr_variant * fields;
+
+  tr_variantInitDict (&request, 2);
+  tr_variantDictAddStr (&request, TR_KEY_method, "torrent-get");
+  args = tr_variantDictAddDict (&request, TR_KEY_arguments, 1);
+  fields = tr_variantDictAddList (args, TR_KEY_fields, TR_N_ELEMENTS (field_names));
+  for (i=0; i<TR_N_ELEMENTS (field_names); ++i)
+    tr_variantListAddStr (fields, field_names[i]);
+
+  tr_rpc_request_exec_json (session, &request, onResponse, response);
+  tr_variantFree (&request);
+}
+
+/***
+****
+***/
+
+static uint64_t
+timeRounds (tr_session * session, void (*torrentGet) (tr_session *, tr_variant *), int rounds, size_t * setmeLen)
+{
+  int i;
+  const uint64_t begin = tr_time_msec ();
+
+  for (i=0; i<rounds; ++i)
+    {
+      tr_variant response;
+
+      torrentGet (session, &response);
+
+      if (i == 0)
+        {
+          tr_variant * args;
+          tr_variant * torrents;
+
+          *setmeLen = 0;
+          if (tr_variantDictFindDict (&response, TR_KEY_arguments, &args)
+              && tr_variantDictFindList (args, TR_KEY_torrents, &torrents))
+            tr_free (tr_variantToStr (torrents, TR_VARIANT_FMT_JSON_LEAN, setmeLen));
+        }
+
+      tr_variantFree (&response);
+    }
+
+  return tr_time_msec () - begin;
+}
+
+int
+main (int argc, char ** argv)
+{
+  int i;
+  size_t oldLen;
+  size_t newLen;
+  uint64_t oldMsec;
+  uint64_t newMsec;
+  tr_session * session;
+  const int torrentCount = argc > 1 ? atoi (argv[1]) : 10000;
+  const int fileCount = argc > 2 ? atoi (argv[2]) : 8;
+  const int rounds = argc > 3 ? atoi (argv[3]) : 10;
+
+  if (torrentCount < 1 || fileCount < 1 || rounds < 1)
+    {
+      fprintf (stderr, "Usage: %s [torrentCount [fileCount [rounds]]]\n", argv[0]);
+      return 1;
+    }
+
+  session = libttest_session_init (NULL);
+
+  for (i=0; i<torrentCount; ++i)
+    {
+      if (createTorrent (session, i, fileCount) == NULL)
+        {
+          fprintf (stderr, "couldn't create torrent %d\n", i);
+          return 1;
+        }
+    }
+
+  oldMsec = timeRounds (session, oldTorrentGet, rounds, &oldLen);
+  newMsec = timeRounds (session, newTorrentGet, rounds, &newLen);
+
+  printf ("%d torrents x %d files, %d fields, %d rounds:  per-field %5"PRIu64" msec  plan %5"PRIu64" msec\n",
+          torrentCount, fileCount, (int) TR_N_ELEMENTS (field_names), rounds, oldMsec, newMsec);
+
+  /* sanity check: both should build the same amount of JSON */
+  if (oldLen != newLen)
+    {
+      fprintf (stderr, "response size mismatch: %zu vs %zu\n", oldLen, newLen);
+      return 1;
+    }
+
+  libttest_session_close (session);
+  return 0;
+}
@@ -68,6 +68,9 @@ struct tr_rpc_server
 
     bool               isStreamInitialized;
     z_stream           stream;
+
+    tr_ptrArray        fileCache; /* struct cached_file, sorted by filename */
+    size_t             fileCacheBytes;
 };
 
 #define dbgmsg(...) \
@@ -266,7 +269,7 @@ handle_upload (struct evhttp_request * req,
             }
 
           if (have_source)
-            tr_rpc_request_exec_json (server->session, &top, NULL, NULL);
+            tr_rpc_request_exec_json_scoped (server->session, &top, NULL, NULL);
 
           tr_variantFree (&top);
         }
@@ -315,17 +318,37 @@ mimetype_guess (const char * path)
   return "application/octet-stream";
 }
 
+static bool
+accepts_gzip (struct evhttp_request * req)
+{
+  const char * encoding = evhttp_find_header (req->input_headers, "Accept-Encoding");
+
+  return encoding != NULL && strstr (encoding, "gzip") != NULL;
+}
+
+static void
+deflate_init_gzip (z_stream * stream)
+{
+  int compressionLevel;
+
+#ifdef TR_LIGHTWEIGHT
+  compressionLevel = Z_DEFAULT_COMPRESSION;
+#else
+  compressionLevel = Z_BEST_COMPRESSION;
+#endif
+
+  /* zlib's manual says: "Add 16 to windowBits to write a simple gzip header
+   * and trailer around the compressed data instead of a zlib wrapper." */
+  deflateInit2 (stream, compressionLevel, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+}
+
 static void
 add_response (struct evhttp_request * req,
               struct tr_rpc_server  * server,
               struct evbuffer       * out,
               struct evbuffer       * content)
 {
-  const char * key = "Accept-Encoding";
-  const char * encoding = evhttp_find_header (req->input_headers, key);
-  const int do_compress = encoding && strstr (encoding, "gzip");
-
-  if (!do_compress)
+  if (!accepts_gzip (req))
     {
       evbuffer_add_buffer (out, content);
     }
@@ -338,21 +361,11 @@ add_response (struct evhttp_request * req,
 
       if (!server->isStreamInitialized)
         {
-          int compressionLevel;
-
           server->isStreamInitialized = true;
           server->stream.zalloc = (alloc_func) Z_NULL;
           server->stream.zfree = (free_func) Z_NULL;
           server->stream.opaque = (voidpf) Z_NULL;
-
-          /* zlib's manual says: "Add 16 to windowBits to write a simple gzip header
-           * and trailer around the compressed data instead of a zlib wrapper." */
-#ifdef TR_LIGHTWEIGHT
-          compressionLevel = Z_DEFAULT_COMPRESSION;
-#else
-          compressionLevel = Z_BEST_COMPRESSION;
-#endif
-          deflateInit2 (&server->stream, compressionLevel, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+          deflate_init_gzip (&server->stream);
         }
 
       server->stream.next_in = content_ptr;
@@ -402,12 +415,171 @@ add_time_header (struct evkeyvalq  * headers,
   evhttp_add_header (headers, key, buf);
 }
 
+/***
+****  The web client's files.
+****
+****  These rarely change, so keep them in memory along with their
+****  gzipped form rather than reading and compressing them on every
+****  request. An entry is reloaded when the file's mtime or size changes.
+***/
+
+enum
+{
+  /* don't use more than this much memory on cached files */
+  FILE_CACHE_MAX_BYTES = 16 * 1024 * 1024
+};
+
+struct cached_file
+{
+  char * filename;
+  time_t mtime;
+  uint64_t size;
+  bool is_cached;
+
+  uint8_t * raw;
+  size_t raw_len;
+  char etag[32];
+
+  uint8_t * gzipped; /* NULL if gzip doesn't make it smaller */
+  size_t gzipped_len;
+  char gzipped_etag[32];
+};
+
+static int
+compare_cached_files (const void * va, const void * vb)
+{
+  const struct cached_file * a = va;
+  const struct cached_file * b = vb;
+
+  return strcmp (a->filename, b->filename);
+}
+
+static void
+cached_file_free (void * vfile)
+{
+  struct cached_file * file = vfile;
+
+  tr_free (file->gzipped);
+  tr_free (file->raw);
+  tr_free (file->filename);
+  tr_free (file);
+}
+
+static size_t
+cached_file_bytes (const struct cached_file * file)
+{
+  return file->raw_len + file->gzipped_len;
+}
+
 static void
-evbuffer_ref_cleanup_tr_free (const void  * data UNUSED,
-                              size_t        datalen UNUSED,
-                              void        * extra)
+cached_file_compress (struct cached_file * file)
+{
+  z_stream stream;
+  size_t max_len;
+
+  memset (&stream, 0, sizeof (stream));
+
+  /* this only happens once per file, so take the time to compress it well */
+  if (deflateInit2 (&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15+16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    return;
+
+  max_len = deflateBound (&stream, file->raw_len);
+  file->gzipped = tr_new (uint8_t, max_len);
+  stream.next_in = file->raw;
+  stream.avail_in = file->raw_len;
+  stream.next_out = file->gzipped;
+  stream.avail_out = max_len;
+
+  if ((deflate (&stream, Z_FINISH) == Z_STREAM_END) && (stream.total_out < file->raw_len))
+    {
+      file->gzipped_len = stream.total_out;
+      file->gzipped = tr_renew (uint8_t, file->gzipped, file->gzipped_len);
+    }
+  else
+    {
+      tr_free (file->gzipped);
+      file->gzipped = NULL;
+    }
+
+  deflateEnd (&stream);
+}
+
+static struct cached_file *
+cached_file_load (const char * filename, const tr_sys_path_info * info, tr_error ** error)
+{
+  uint8_t sha1[SHA_DIGEST_LENGTH];
+  char hex[SHA_DIGEST_LENGTH*2 + 1];
+  struct cached_file * file = tr_new0 (struct cached_file, 1);
+
+  if ((file->raw = tr_loadFile (filename, &file->raw_len, error)) == NULL)
+    {
+      tr_free (file);
+      return NULL;
+    }
+
+  file->filename = tr_strdup (filename);
+  file->mtime = info->last_modified_at;
+  file->size = info->size;
+
+  tr_sha1 (sha1, file->raw, (int) file->raw_len, NULL);
+  tr_sha1_to_hex (hex, sha1);
+  hex[16] = '\0';
+  tr_snprintf (file->etag, sizeof (file->etag), "\"%s\"", hex);
+  tr_snprintf (file->gzipped_etag, sizeof (file->gzipped_etag), "\"%s-gzip\"", hex);
+
+  cached_file_compress (file);
+
+  return file;
+}
+
+/**
+ * @return the file's contents, from the cache if possible.
+ *         If the result's is_cached field is false, the caller must free it.
+ */
+static struct cached_file *
+get_cached_file (struct tr_rpc_server * server, const char * filename, tr_error ** error)
+{
+  tr_sys_path_info info;
+  struct cached_file key;
+  struct cached_file * file;
+
+  if (!tr_sys_path_get_info (filename, 0, &info, error))
+    return NULL;
+
+  key.filename = (char *) filename;
+  file = tr_ptrArrayFindSorted (&server->fileCache, &key, compare_cached_files);
+
+  if (file != NULL)
+    {
+      if ((file->mtime == info.last_modified_at) && (file->size == info.size))
+        return file;
+
+      /* it's changed since we cached it */
+      tr_ptrArrayRemoveSortedPointer (&server->fileCache, file, compare_cached_files);
+      server->fileCacheBytes -= cached_file_bytes (file);
+      cached_file_free (file);
+    }
+
+  if ((file = cached_file_load (filename, &info, error)) == NULL)
+    return NULL;
+
+  if (server->fileCacheBytes + cached_file_bytes (file) <= FILE_CACHE_MAX_BYTES)
+    {
+      file->is_cached = true;
+      tr_ptrArrayInsertSorted (&server->fileCache, file, compare_cached_files);
+      server->fileCacheBytes += cached_file_bytes (file);
+    }
+
+  return file;
+}
+
+static bool
+etag_matches (struct evhttp_request * req, const char * etag)
 {
-  tr_free (extra);
+  const char * if_none_match = evhttp_find_header (req->input_headers, "If-None-Match");
+
+  return (if_none_match != NULL)
+      && ((strcmp (if_none_match, "*") == 0) || (strstr (if_none_match, etag) != NULL));
 }
 
 static void
@@ -422,12 +594,8 @@ serve_file (struct evhttp_request  * req,
     }
   else
     {
-      void * file;
-      size_t file_len;
       tr_error * error = NULL;
-
-      file_len = 0;
-      file = tr_loadFile (filename, &file_len, &error);
+      struct cached_file * file = get_cached_file (server, filename, &error);
 
       if (file == NULL)
         {
@@ -438,22 +606,40 @@ serve_file (struct evhttp_request  * req,
         }
       else
         {
-          struct evbuffer * content;
-          struct evbuffer * out;
           const time_t now = tr_time ();
+          const bool do_compress = (file->gzipped != NULL) && accepts_gzip (req);
+          const char * etag = do_compress ? file->gzipped_etag : file->etag;
 
-          content = evbuffer_new ();
-          evbuffer_add_reference (content, file, file_len, evbuffer_ref_cleanup_tr_free, file);
-
-          out = evbuffer_new ();
           evhttp_add_header (req->output_headers, "Content-Type", mimetype_guess (filename));
+          evhttp_add_header (req->output_headers, "ETag", etag);
+          evhttp_add_header (req->output_headers, "Vary", "Accept-Encoding");
           add_time_header (req->output_headers, "Date", now);
           add_time_header (req->output_headers, "Expires", now+ (24*60*60));
-          add_response (req, server, out, content);
-          evhttp_send_reply (req, HTTP_OK, "OK", out);
 
-          evbuffer_free (out);
-          evbuffer_free (content);
+          if (etag_matches (req, etag))
+            {
+              evhttp_send_reply (req, HTTP_NOTMODIFIED, "Not Modified", NULL);
+            }
+          else
+            {
+              struct evbuffer * out = evbuffer_new ();
+
+              if (do_compress)
+                {
+                  evhttp_add_header (req->output_headers, "Content-Encoding", "gzip");
+                  evbuffer_add (out, file->gzipped, file->gzipped_len);
+                }
+              else
+                {
+                  evbuffer_add (out, file->raw, file->raw_len);
+                }
+
+              evhttp_send_reply (req, HTTP_OK, "OK", out);
+              evbuffer_free (out);
+            }
+
+          if (!file->is_cached)
+            cached_file_free (file);
         }
     }
 }
@@ -528,6 +714,140 @@ rpc_response_func (tr_session * session UNUSED,
   tr_free (data);
 }
 
+/***
+****  Streamed responses.
+****
+****  These are sent with chunked encoding, and each chunk is only
+****  generated once the previous one has been written to the socket,
+****  so memory use stays bounded no matter how large the response is.
+***/
+
+struct rpc_stream_data
+{
+  struct evhttp_request * req;
+  tr_rpc_stream * stream;
+  struct evbuffer * json;
+  struct evbuffer * out;
+  bool do_compress;
+  z_stream zstream;
+};
+
+static void
+rpc_stream_data_free (struct rpc_stream_data * data)
+{
+  if (data->do_compress)
+    deflateEnd (&data->zstream);
+
+  tr_rpc_stream_free (data->stream);
+  evbuffer_free (data->json);
+  evbuffer_free (data->out);
+  tr_free (data);
+}
+
+static void
+rpc_stream_on_close (struct evhttp_connection * con UNUSED, void * vdata)
+{
+  /* the client went away before the response was finished */
+  rpc_stream_data_free (vdata);
+}
+
+/* move data->json into data->out, compressing it along the way */
+static void
+rpc_stream_deflate (struct rpc_stream_data * data, bool finish)
+{
+  const size_t len = evbuffer_get_length (data->json);
+
+  data->zstream.next_in = evbuffer_pullup (data->json, -1);
+  data->zstream.avail_in = len;
+
+  for (;;)
+    {
+      int state;
+      struct evbuffer_iovec iovec[1];
+
+      evbuffer_reserve_space (data->out, 16384, iovec, 1);
+      data->zstream.next_out = iovec[0].iov_base;
+      data->zstream.avail_out = iovec[0].iov_len;
+      state = deflate (&data->zstream, finish ? Z_FINISH : Z_NO_FLUSH);
+      iovec[0].iov_len -= data->zstream.avail_out;
+      evbuffer_commit_space (data->out, iovec, 1);
+
+      if (state == Z_STREAM_ERROR)
+        break;
+      if (finish ? (state == Z_STREAM_END) : (data->zstream.avail_out > 0))
+        break;
+    }
+
+  evbuffer_drain (data->json, len);
+}
+
+static void
+rpc_stream_send_next (struct evhttp_connection * con UNUSED, void * vdata)
+{
+  bool done = false;
+  struct rpc_stream_data * data = vdata;
+
+  for (;;)
+    {
+      /* zlib may hold on to the input for a while, so keep going
+         until there's something to send. An empty chunk would end the reply */
+      while (!done && (evbuffer_get_length (data->out) == 0))
+        {
+          done = tr_rpc_stream_next (data->stream, data->json);
+
+          if (data->do_compress)
+            rpc_stream_deflate (data, done);
+          else
+            evbuffer_add_buffer (data->out, data->json);
+        }
+
+      if (done)
+        break;
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+      evhttp_send_reply_chunk_with_cb (data->req, data->out, rpc_stream_send_next, data);
+      return;
+#else
+      /* no way to wait for the chunk to be written, so send everything now */
+      evhttp_send_reply_chunk (data->req, data->out);
+#endif
+    }
+
+  evhttp_connection_set_closecb (evhttp_request_get_connection (data->req), NULL, NULL);
+  evhttp_send_reply_chunk (data->req, data->out);
+  evhttp_send_reply_end (data->req);
+  rpc_stream_data_free (data);
+}
+
+static void
+send_streamed_response (struct evhttp_request * req,
+                        tr_rpc_stream         * stream)
+{
+  struct rpc_stream_data * data = tr_new0 (struct rpc_stream_data, 1);
+
+  data->req = req;
+  data->stream = stream;
+  data->json = evbuffer_new ();
+  data->out = evbuffer_new ();
+  data->do_compress = accepts_gzip (req);
+
+  if (data->do_compress)
+    {
+      deflate_init_gzip (&data->zstream);
+      evhttp_add_header (req->output_headers, "Content-Encoding", "gzip");
+    }
+
+  evhttp_add_header (req->output_headers,
+                     "Content-Type", "application/json; charset=UTF-8");
+  evhttp_connection_set_closecb (evhttp_request_get_connection (req), rpc_stream_on_close, data);
+  evhttp_send_reply_start (req, HTTP_OK, "OK");
+  rpc_stream_send_next (NULL, data);
+}
+
+/***
+****
+***/
+
 static void
 handle_rpc_from_json (struct evhttp_request * req,
                       struct tr_rpc_server  * server,
@@ -535,17 +855,26 @@ handle_rpc_from_json (struct evhttp_request * req,
                       size_t                  json_len)
 {
   tr_variant top;
-  bool have_content = tr_variantFromJson (&top, json, json_len) == 0;
+  tr_rpc_stream * stream;
   struct rpc_response_data * data;
+  tr_variant_arena * arena = tr_variantArenaNew ();
+  const bool have_content = tr_variantFromJsonArena (&top, json, json_len, arena) == 0;
+
+  if (have_content && ((stream = tr_rpc_stream_new (server->session, &top))))
+    {
+      send_streamed_response (req, stream);
+      tr_variantArenaFree (arena);
+      return;
+    }
 
   data = tr_new0 (struct rpc_response_data, 1);
   data->req = req;
   data->server = server;
 
-  tr_rpc_request_exec_json (server->session, have_content ? &top : NULL, rpc_response_func, data);
+  /* rpc_response_func () is done with the response when it returns */
+  tr_rpc_request_exec_json_scoped (server->session, have_content ? &top : NULL, rpc_response_func, data);
 
-  if (have_content)
-    tr_variantFree (&top);
+  tr_variantArenaFree (arena);
 }
 
 static void
@@ -1003,6 +1332,7 @@ closeServer (void * vserver)
     tr_free (tmp);
   if (s->isStreamInitialized)
     deflateEnd (&s->stream);
+  tr_ptrArrayDestruct (&s->fileCache, cached_file_free);
   tr_free (s->url);
   tr_free (s->sessionId);
   tr_free (s->whitelistStr);
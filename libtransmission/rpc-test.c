@@ -6,8 +6,13 @@
  *
  */
 
+#include <string.h> /* strlen (), strstr () */
+
+#include <event2/buffer.h>
+
 #include "transmission.h"
 #include "rpcimpl.h"
+#include "session.h" /* tr_sessionCountTorrents () */
 #include "utils.h"
 #include "variant.h"
 
@@ -159,11 +164,282 @@ test_session_get_and_set (void)
 ****
 ***/
 
+static void
+torrentGet (tr_session * session, int64_t since, tr_variant * response)
+{
+  tr_variant request;
+  tr_variant * args;
+  tr_variant * fields;
+
+  tr_variantInitDict (&request, 2);
+  tr_variantDictAddStr (&request, TR_KEY_method, "torrent-get");
+  args = tr_variantDictAddDict (&request, TR_KEY_arguments, 2);
+  fields = tr_variantDictAddList (args, TR_KEY_fields, 3);
+  tr_variantListAddStr (fields, "name");
+  tr_variantListAddStr (fields, "percentDone");
+  tr_variantListAddStr (fields, "uploadLimit");
+  if (since >= 0)
+    tr_variantDictAddInt (args, TR_KEY_since, since);
+  tr_rpc_request_exec_json (session, &request, rpc_response_func, response);
+  tr_variantFree (&request);
+}
+
+static int64_t
+getRevision (tr_variant * response)
+{
+  tr_variant * args;
+  int64_t revision = -1;
+
+  if (tr_variantDictFindDict (response, TR_KEY_arguments, &args))
+    tr_variantDictFindInt (args, TR_KEY_revision, &revision);
+
+  return revision;
+}
+
+static int
+test_torrent_get_since (void)
+{
+  int i;
+  int64_t id;
+  int64_t revision;
+  int64_t prev;
+  int64_t removed_id;
+  tr_variant response;
+  tr_variant * args;
+  tr_variant * torrents;
+  tr_variant * t;
+  tr_session * session = libttest_session_init (NULL);
+  tr_torrent * tor = libttest_zero_torrent_init (session);
+
+  check (tor != NULL);
+
+  /* a full get lists every field */
+  torrentGet (session, -1, &response);
+  check (tr_variantDictFindDict (&response, TR_KEY_arguments, &args));
+  check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+  check_int_eq (1, tr_variantListSize (torrents));
+  t = tr_variantListChild (torrents, 0);
+  check (tr_variantDictFind (t, TR_KEY_name) != NULL);
+  check (tr_variantDictFind (t, TR_KEY_percentDone) != NULL);
+  check (tr_variantDictFind (t, TR_KEY_uploadLimit) != NULL);
+  check (tr_variantDictFind (args, TR_KEY_removed) == NULL);
+  revision = getRevision (&response);
+  check (revision > 0);
+  tr_variantFree (&response);
+
+  /* once a second, the session notices the new torrent's state change.
+     after that the stopped torrent stops changing */
+  for (i=0; i<10; ++i)
+    {
+      tr_wait_msec (1100);
+      prev = revision;
+      torrentGet (session, -1, &response);
+      revision = getRevision (&response);
+      tr_variantFree (&response);
+      if (revision == prev)
+        break;
+    }
+  check_int_eq (prev, revision);
+
+  /* nothing changed since then */
+  torrentGet (session, revision, &response);
+  check (tr_variantDictFindDict (&response, TR_KEY_arguments, &args));
+  check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+  check_int_eq (0, tr_variantListSize (torrents));
+  check (tr_variantDictFindList (args, TR_KEY_removed, &t));
+  check_int_eq (0, tr_variantListSize (t));
+  check_int_eq (revision, getRevision (&response));
+  tr_variantFree (&response);
+
+  /* change a setting. only that group's fields are returned, plus the id */
+  tr_torrentSetSpeedLimit_KBps (tor, TR_UP, 42);
+  torrentGet (session, revision, &response);
+  check (tr_variantDictFindDict (&response, TR_KEY_arguments, &args));
+  check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+  check_int_eq (1, tr_variantListSize (torrents));
+  t = tr_variantListChild (torrents, 0);
+  check (tr_variantDictFindInt (t, TR_KEY_id, &id));
+  check_int_eq (tr_torrentId (tor), id);
+  check (tr_variantDictFind (t, TR_KEY_uploadLimit) != NULL);
+  check (tr_variantDictFind (t, TR_KEY_name) == NULL);
+  check (tr_variantDictFind (t, TR_KEY_percentDone) == NULL);
+  check (getRevision (&response) > revision);
+  revision = getRevision (&response);
+  tr_variantFree (&response);
+
+  /* removed torrents are listed */
+  removed_id = tr_torrentId (tor);
+  tr_torrentRemove (tor, false, NULL);
+  while (tr_sessionCountTorrents (session) > 0)
+    tr_wait_msec (10);
+  torrentGet (session, revision, &response);
+  check (tr_variantDictFindDict (&response, TR_KEY_arguments, &args));
+  check (tr_variantDictFindList (args, TR_KEY_removed, &t));
+  check_int_eq (1, tr_variantListSize (t));
+  check (tr_variantGetInt (tr_variantListChild (t, 0), &id));
+  check_int_eq (removed_id, id);
+  tr_variantFree (&response);
+
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+static void
+buildTorrentGet (tr_variant * request, const char * method)
+{
+  tr_variant * args;
+  tr_variant * fields;
+
+  tr_variantInitDict (request, 3);
+  tr_variantDictAddStr (request, TR_KEY_method, method);
+  tr_variantDictAddInt (request, TR_KEY_tag, 7);
+  args = tr_variantDictAddDict (request, TR_KEY_arguments, 1);
+  fields = tr_variantDictAddList (args, TR_KEY_fields, 5);
+  tr_variantListAddStr (fields, "id");
+  tr_variantListAddStr (fields, "name");
+  tr_variantListAddStr (fields, "files");
+  tr_variantListAddStr (fields, "totalSize");
+  tr_variantListAddStr (fields, "wanted");
+}
+
+/* serialize the response, minus its "revision", which may tick between calls */
+static char *
+responseToStr (tr_variant * response)
+{
+  tr_variant * args;
+
+  if (tr_variantDictFindDict (response, TR_KEY_arguments, &args))
+    tr_variantDictRemove (args, TR_KEY_revision);
+
+  return tr_variantToStr (response, TR_VARIANT_FMT_JSON_LEAN, NULL);
+}
+
+static int
+test_torrent_get_stream (void)
+{
+  int chunks;
+  char * expected;
+  char * actual;
+  tr_variant request;
+  tr_variant response;
+  tr_variant streamed;
+  tr_rpc_stream * stream;
+  struct evbuffer * buf;
+  tr_session * session = libttest_session_init (NULL);
+  tr_torrent * tor = libttest_zero_torrent_init (session);
+
+  check (tor != NULL);
+
+  /* only torrent-get requests with fields can be streamed */
+  buildTorrentGet (&request, "session-get");
+  check_ptr_eq (NULL, tr_rpc_stream_new (session, &request));
+  tr_variantFree (&request);
+  tr_variantInitDict (&request, 1);
+  tr_variantDictAddStr (&request, TR_KEY_method, "torrent-get");
+  check_ptr_eq (NULL, tr_rpc_stream_new (session, &request));
+  tr_variantFree (&request);
+
+  /* a streamed response says the same thing as a regular one */
+  buildTorrentGet (&request, "torrent-get");
+  tr_rpc_request_exec_json (session, &request, rpc_response_func, &response);
+  stream = tr_rpc_stream_new (session, &request);
+  check (stream != NULL);
+  buf = evbuffer_new ();
+  for (chunks=1; !tr_rpc_stream_next (stream, buf); ++chunks)
+    check (chunks < 100);
+  tr_rpc_stream_free (stream);
+
+  check_int_eq (0, tr_variantFromJson (&streamed,
+                                       evbuffer_pullup (buf, -1),
+                                       evbuffer_get_length (buf)));
+  expected = responseToStr (&response);
+  actual = responseToStr (&streamed);
+  check_streq (expected, actual);
+
+  tr_free (actual);
+  tr_free (expected);
+  tr_variantFree (&streamed);
+  tr_variantFree (&response);
+  tr_variantFree (&request);
+  evbuffer_free (buf);
+  tr_torrentRemove (tor, false, NULL);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+static void
+rpc_response_to_str_func (tr_session * session UNUSED,
+                          tr_variant * response,
+                          void       * setme)
+{
+  *(char **) setme = responseToStr (response);
+}
+
+static int
+test_scoped_response (void)
+{
+  char * expected;
+  char * actual;
+  tr_variant request;
+  tr_variant response;
+  tr_variant_arena * arena;
+  tr_session * session = libttest_session_init (NULL);
+  tr_torrent * tor = libttest_zero_torrent_init (session);
+  const char * json = "{ \"method\": \"torrent-get\", \"tag\": 7, \"arguments\": { \"fields\":"
+                      " [ \"id\", \"name\", \"downloadDir\", \"files\", \"peers\", \"wanted\" ] } }";
+
+  check (tor != NULL);
+
+  /* an arena request and response say the same thing as regular ones */
+  check_int_eq (0, tr_variantFromJson (&request, json, strlen (json)));
+  tr_rpc_request_exec_json (session, &request, rpc_response_func, &response);
+  expected = responseToStr (&response);
+  tr_variantFree (&response);
+  tr_variantFree (&request);
+
+  arena = tr_variantArenaNew ();
+  check_int_eq (0, tr_variantFromJsonArena (&request, json, strlen (json), arena));
+  actual = NULL;
+  tr_rpc_request_exec_json_scoped (session, &request, rpc_response_to_str_func, &actual);
+  check (actual != NULL);
+  check_streq (expected, actual);
+  tr_free (actual);
+
+  /* and so do errors */
+  tr_variantDictAddStr (&request, TR_KEY_method, "no-such-method");
+  actual = NULL;
+  tr_rpc_request_exec_json_scoped (session, &request, rpc_response_to_str_func, &actual);
+  check (actual != NULL);
+  check (strstr (actual, "method name not recognized") != NULL);
+  tr_free (actual);
+  tr_variantArenaFree (arena);
+
+  tr_free (expected);
+  tr_torrentRemove (tor, false, NULL);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
 int
 main (void)
 {
   const testFunc tests[] = { test_list,
-                             test_session_get_and_set };
+                             test_session_get_and_set,
+                             test_torrent_get_since,
+                             test_torrent_get_stream,
+                             test_scoped_response };
 
   return runTests (tests, NUM_TESTS (tests));
 }
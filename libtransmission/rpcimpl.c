@@ -32,7 +32,7 @@
 #include "version.h"
 #include "web.h"
 
-#define RPC_VERSION     15
+#define RPC_VERSION     16
 #define RPC_VERSION_MIN 1
 
 #define RECENTLY_ACTIVE_SECONDS 60
@@ -88,6 +88,7 @@ struct tr_rpc_idle_data
   tr_variant            * args_out;
   tr_rpc_response_func    callback;
   void                  * callback_user_data;
+  tr_variant_arena      * arena; /* if set, it holds the response */
 };
 
 static void
@@ -100,6 +101,7 @@ tr_idle_function_done (struct tr_rpc_idle_data * data, const char * result)
   (*data->callback)(data->session, data->response, data->callback_user_data);
 
   tr_variantFree (data->response);
+  tr_variantArenaFree (data->arena);
   tr_free (data->response);
   tr_free (data);
 }
@@ -430,12 +432,9 @@ torrentVerify (tr_session               * session,
 ***/
 
 static void
-addFileStats (const tr_torrent * tor, tr_variant * list)
+addFileStats (const tr_info * info, const tr_file_stat * files, tr_variant * list)
 {
   tr_file_index_t i;
-  tr_file_index_t n;
-  const tr_info * info = tr_torrentInfo (tor);
-  tr_file_stat * files = tr_torrentFiles (tor, &n);
 
   for (i=0; i<info->fileCount; ++i)
     {
@@ -445,17 +444,12 @@ addFileStats (const tr_torrent * tor, tr_variant * list)
       tr_variantDictAddInt (d, TR_KEY_priority, file->priority);
       tr_variantDictAddBool (d, TR_KEY_wanted, !file->dnd);
     }
-
-  tr_torrentFilesFree (files, n);
 }
 
 static void
-addFiles (const tr_torrent * tor, tr_variant * list)
+addFiles (const tr_info * info, const tr_file_stat * files, tr_variant * list)
 {
   tr_file_index_t i;
-  tr_file_index_t n;
-  const tr_info * info = tr_torrentInfo (tor);
-  tr_file_stat *  files = tr_torrentFiles (tor, &n);
 
   for (i=0; i<info->fileCount; ++i)
     {
@@ -465,8 +459,6 @@ addFiles (const tr_torrent * tor, tr_variant * list)
       tr_variantDictAddInt (d, TR_KEY_length, file->length);
       tr_variantDictAddStr (d, TR_KEY_name, file->name);
     }
-
-  tr_torrentFilesFree (files, n);
 }
 
 static void
@@ -541,7 +533,7 @@ addPeers (tr_torrent * tor, tr_variant * list)
   int peerCount;
   tr_peer_stat * peers = tr_torrentPeers (tor, &peerCount);
 
-  tr_variantInitList (list, peerCount);
+  tr_variantListReserve (list, peerCount);
 
   for (i=0; i<peerCount; ++i)
     {
@@ -568,354 +560,485 @@ addPeers (tr_torrent * tor, tr_variant * list)
   tr_torrentPeersFree (peers, peerCount);
 }
 
-static void
-addField (tr_torrent       * const tor,
-          const tr_info    * const inf,
-          const tr_stat    * const st,
-          tr_variant       * const d,
-          const tr_quark           key)
-{
-  char * str;
-
-  switch (key)
-    {
-      case TR_KEY_activityDate:
-        tr_variantDictAddInt (d, key, st->activityDate);
-        break;
-
-      case TR_KEY_addedDate:
-        tr_variantDictAddInt (d, key, st->addedDate);
-        break;
-
-      case TR_KEY_bandwidthPriority:
-        tr_variantDictAddInt (d, key, tr_torrentGetPriority (tor));
-        break;
-
-      case TR_KEY_comment:
-        tr_variantDictAddStr (d, key, inf->comment ? inf->comment : "");
-        break;
 
-      case TR_KEY_corruptEver:
-        tr_variantDictAddInt (d, key, st->corruptEver);
-        break;
-
-      case TR_KEY_creator:
-        tr_variantDictAddStr (d, key, inf->creator ? inf->creator : "");
-        break;
-
-      case TR_KEY_dateCreated:
-        tr_variantDictAddInt (d, key, inf->dateCreated);
-        break;
-
-      case TR_KEY_desiredAvailable:
-        tr_variantDictAddInt (d, key, st->desiredAvailable);
-        break;
-
-      case TR_KEY_doneDate:
-        tr_variantDictAddInt (d, key, st->doneDate);
-        break;
-
-      case TR_KEY_downloadDir:
-        tr_variantDictAddStr (d, key, tr_torrentGetDownloadDir (tor));
-        break;
+/***
+****  torrent-get's fields.
+****
+****  Each field has a writer and a list of the sources it reads from.
+****  A request's fields are looked up once to build a field_plan, and
+****  then for each torrent the sources that the plan needs are computed
+****  once and shared by all of its writers.
+***/
 
-      case TR_KEY_downloadedEver:
-        tr_variantDictAddInt (d, key, st->downloadedEver);
-        break;
+enum
+{
+  FIELD_NEEDS_STAT  = (1<<0), /* tr_torrentStat () */
+  FIELD_NEEDS_FILES = (1<<1)  /* tr_torrentFiles () */
+};
 
-      case TR_KEY_downloadLimit:
-        tr_variantDictAddInt (d, key, tr_torrentGetSpeedLimit_KBps (tor, TR_DOWN));
-        break;
+struct field_sources
+{
+  tr_torrent * tor;
+  const tr_info * inf;
+  const tr_stat * st;
+  tr_file_stat * files;
+};
 
-      case TR_KEY_downloadLimited:
-        tr_variantDictAddBool (d, key, tr_torrentUsesSpeedLimit (tor, TR_DOWN));
-        break;
+typedef void (*field_writer) (const struct field_sources * src, tr_variant * d, tr_quark key);
+
+/* a plan's keys are unique, so skip tr_variantDictAdd*()'s search for an existing key */
+#define FIELD_WRITER(name, init, value) \
+  static void \
+  name (const struct field_sources * src, tr_variant * d, tr_quark key) \
+  { \
+    init (tr_variantDictAdd (d, key), value); \
+  }
+
+/* strings need `d', so that they're copied into its arena if it has one */
+#define STR_FIELD_WRITER(name, value) \
+  static void \
+  name (const struct field_sources * src, tr_variant * d, tr_quark key) \
+  { \
+    tr_variantInitChildStr (d, tr_variantDictAdd (d, key), value, TR_BAD_SIZE); \
+  }
+
+FIELD_WRITER (writeActivityDate,          tr_variantInitInt,     src->st->activityDate)
+FIELD_WRITER (writeAddedDate,             tr_variantInitInt,     src->st->addedDate)
+FIELD_WRITER (writeBandwidthPriority,     tr_variantInitInt,     tr_torrentGetPriority (src->tor))
+STR_FIELD_WRITER (writeComment,                                  src->inf->comment ? src->inf->comment : "")
+FIELD_WRITER (writeCorruptEver,           tr_variantInitInt,     src->st->corruptEver)
+STR_FIELD_WRITER (writeCreator,                                  src->inf->creator ? src->inf->creator : "")
+FIELD_WRITER (writeDateCreated,           tr_variantInitInt,     src->inf->dateCreated)
+FIELD_WRITER (writeDesiredAvailable,      tr_variantInitInt,     src->st->desiredAvailable)
+FIELD_WRITER (writeDoneDate,              tr_variantInitInt,     src->st->doneDate)
+STR_FIELD_WRITER (writeDownloadDir,                              tr_torrentGetDownloadDir (src->tor))
+FIELD_WRITER (writeDownloadedEver,        tr_variantInitInt,     src->st->downloadedEver)
+FIELD_WRITER (writeDownloadLimit,         tr_variantInitInt,     tr_torrentGetSpeedLimit_KBps (src->tor, TR_DOWN))
+FIELD_WRITER (writeDownloadLimited,       tr_variantInitBool,    tr_torrentUsesSpeedLimit (src->tor, TR_DOWN))
+FIELD_WRITER (writeError,                 tr_variantInitInt,     src->st->error)
+STR_FIELD_WRITER (writeErrorString,                              src->st->errorString)
+FIELD_WRITER (writeEta,                   tr_variantInitInt,     src->st->eta)
+FIELD_WRITER (writeEtaIdle,               tr_variantInitInt,     src->st->etaIdle)
+STR_FIELD_WRITER (writeHashString,                               src->inf->hashString)
+FIELD_WRITER (writeHaveUnchecked,         tr_variantInitInt,     src->st->haveUnchecked)
+FIELD_WRITER (writeHaveValid,             tr_variantInitInt,     src->st->haveValid)
+FIELD_WRITER (writeHonorsSessionLimits,   tr_variantInitBool,    tr_torrentUsesSessionLimits (src->tor))
+FIELD_WRITER (writeId,                    tr_variantInitInt,     tr_torrentId (src->tor))
+FIELD_WRITER (writeIsFinished,            tr_variantInitBool,    src->st->finished)
+FIELD_WRITER (writeIsPrivate,             tr_variantInitBool,    tr_torrentIsPrivate (src->tor))
+FIELD_WRITER (writeIsStalled,             tr_variantInitBool,    src->st->isStalled)
+FIELD_WRITER (writeLeftUntilDone,         tr_variantInitInt,     src->st->leftUntilDone)
+FIELD_WRITER (writeManualAnnounceTime,    tr_variantInitInt,     src->st->manualAnnounceTime)
+FIELD_WRITER (writePeerLimit,             tr_variantInitInt,     tr_torrentGetPeerLimit (src->tor))
+FIELD_WRITER (writeMetadataPercentComplete, tr_variantInitReal,    src->st->metadataPercentComplete)
+STR_FIELD_WRITER (writeName,                                     tr_torrentName (src->tor))
+FIELD_WRITER (writePercentDone,           tr_variantInitReal,    src->st->percentDone)
+FIELD_WRITER (writePeersConnected,        tr_variantInitInt,     src->st->peersConnected)
+FIELD_WRITER (writePeersGettingFromUs,    tr_variantInitInt,     src->st->peersGettingFromUs)
+FIELD_WRITER (writePeersSendingToUs,      tr_variantInitInt,     src->st->peersSendingToUs)
+FIELD_WRITER (writePieceCount,            tr_variantInitInt,     src->inf->pieceCount)
+FIELD_WRITER (writePieceSize,             tr_variantInitInt,     src->inf->pieceSize)
+FIELD_WRITER (writeQueuePosition,         tr_variantInitInt,     src->st->queuePosition)
+FIELD_WRITER (writeRateDownload,          tr_variantInitInt,     toSpeedBytes (src->st->pieceDownloadSpeed_KBps))
+FIELD_WRITER (writeRateUpload,            tr_variantInitInt,     toSpeedBytes (src->st->pieceUploadSpeed_KBps))
+FIELD_WRITER (writeRecheckProgress,       tr_variantInitReal,    src->st->recheckProgress)
+FIELD_WRITER (writeSecondsDownloading,    tr_variantInitInt,     src->st->secondsDownloading)
+FIELD_WRITER (writeSecondsSeeding,        tr_variantInitInt,     src->st->secondsSeeding)
+FIELD_WRITER (writeSeedIdleLimit,         tr_variantInitInt,     tr_torrentGetIdleLimit (src->tor))
+FIELD_WRITER (writeSeedIdleMode,          tr_variantInitInt,     tr_torrentGetIdleMode (src->tor))
+FIELD_WRITER (writeSeedRatioLimit,        tr_variantInitReal,    tr_torrentGetRatioLimit (src->tor))
+FIELD_WRITER (writeSeedRatioMode,         tr_variantInitInt,     tr_torrentGetRatioMode (src->tor))
+FIELD_WRITER (writeSizeWhenDone,          tr_variantInitInt,     src->st->sizeWhenDone)
+FIELD_WRITER (writeStartDate,             tr_variantInitInt,     src->st->startDate)
+FIELD_WRITER (writeStatus,                tr_variantInitInt,     src->st->activity)
+STR_FIELD_WRITER (writeTorrentFile,                              src->inf->torrent)
+FIELD_WRITER (writeTotalSize,             tr_variantInitInt,     src->inf->totalSize)
+FIELD_WRITER (writeUploadedEver,          tr_variantInitInt,     src->st->uploadedEver)
+FIELD_WRITER (writeUploadLimit,           tr_variantInitInt,     tr_torrentGetSpeedLimit_KBps (src->tor, TR_UP))
+FIELD_WRITER (writeUploadLimited,         tr_variantInitBool,    tr_torrentUsesSpeedLimit (src->tor, TR_UP))
+FIELD_WRITER (writeUploadRatio,           tr_variantInitReal,    src->st->ratio)
+FIELD_WRITER (writeWebseedsSendingToUs,   tr_variantInitInt,     src->st->webseedsSendingToUs)
+
+#undef STR_FIELD_WRITER
+#undef FIELD_WRITER
 
-      case TR_KEY_error:
-        tr_variantDictAddInt (d, key, st->error);
-        break;
+static void
+writeFiles (const struct field_sources * src, tr_variant * d, tr_quark key)
+{
+  addFiles (src->inf, src->files, tr_variantDictAddList (d, key, src->inf->fileCount));
+}
 
-      case TR_KEY_errorString:
-        tr_variantDictAddStr (d, key, st->errorString);
-        break;
+static void
+writeFileStats (const struct field_sources * src, tr_variant * d, tr_quark key)
+{
+  addFileStats (src->inf, src->files, tr_variantDictAddList (d, key, src->inf->fileCount));
+}
 
-      case TR_KEY_eta:
-        tr_variantDictAddInt (d, key, st->eta);
-        break;
+static void
+writeMagnetLink (const struct field_sources * src, tr_variant * d, tr_quark key)
+{
+  char * str = tr_torrentGetMagnetLink (src->tor);
+  tr_variantDictAddStr (d, key, str);
+  tr_free (str);
+}
 
-      case TR_KEY_files:
-        addFiles (tor, tr_variantDictAddList (d, key, inf->fileCount));
-        break;
+static void
+writePeers (const struct field_sources * src, tr_variant * d, tr_quark key)
+{
+  addPeers (src->tor, tr_variantDictAddList (d, key, 0));
+}
 
-      case TR_KEY_fileStats:
-        addFileStats (tor, tr_variantDictAddList (d, key, inf->fileCount));
-        break;
+static void
+writePeersFrom (const struct field_sources * src, tr_variant * d, tr_quark key)
+{
+  tr_variant * tmp = tr_variantDictAddDict (d, key, 7);
+  const int * f = src->st->peersFrom;
+
+  tr_variantDictAddInt (tmp, TR_KEY_fromCache,    f[TR_PEER_FROM_RESUME]);
+  tr_variantDictAddInt (tmp, TR_KEY_fromDht,      f[TR_PEER_FROM_DHT]);
+  tr_variantDictAddInt (tmp, TR_KEY_fromIncoming, f[TR_PEER_FROM_INCOMING]);
+  tr_variantDictAddInt (tmp, TR_KEY_fromLpd,      f[TR_PEER_FROM_LPD]);
+  tr_variantDictAddInt (tmp, TR_KEY_fromLtep,     f[TR_PEER_FROM_LTEP]);
+  tr_variantDictAddInt (tmp, TR_KEY_fromPex,      f[TR_PEER_FROM_PEX]);
+  tr_variantDictAddInt (tmp, TR_KEY_fromTracker,  f[TR_PEER_FROM_TRACKER]);
+}
 
-      case TR_KEY_hashString:
-        tr_variantDictAddStr (d, key, tor->info.hashString);
-        break;
+static void
+writePieces (const struct field_sources * src, tr_variant * d, tr_quark key)
+{
+  if (tr_torrentHasMetadata (src->tor))
+    {
+      size_t byte_count = 0;
+      void * bytes = tr_torrentCreatePieceBitfield (src->tor, &byte_count);
+      char * str = tr_base64_encode (bytes, byte_count, NULL);
+      tr_variantDictAddStr (d, key, str!=NULL ? str : "");
+      tr_free (str);
+      tr_free (bytes);
+    }
+  else
+    {
+      tr_variantDictAddStr (d, key, "");
+    }
+}
 
-      case TR_KEY_haveUnchecked:
-        tr_variantDictAddInt (d, key, st->haveUnchecked);
-        break;
+static void
+writePriorities (const struct field_sources * src, tr_variant * d, tr_quark key)
+{
+  tr_file_index_t i;
+  const tr_info * inf = src->inf;
+  tr_variant * p = tr_variantDictAddList (d, key, inf->fileCount);
 
-      case TR_KEY_haveValid:
-        tr_variantDictAddInt (d, key, st->haveValid);
-        break;
+  for (i=0; i<inf->fileCount; ++i)
+    tr_variantListAddInt (p, inf->files[i].priority);
+}
 
-      case TR_KEY_honorsSessionLimits:
-        tr_variantDictAddBool (d, key, tr_torrentUsesSessionLimits (tor));
-        break;
+static void
+writeTrackers (const struct field_sources * src, tr_variant * d, tr_quark key)
+{
+  addTrackers (src->inf, tr_variantDictAddList (d, key, src->inf->trackerCount));
+}
 
-      case TR_KEY_id:
-        tr_variantDictAddInt (d, key, st->id);
-        break;
+static void
+writeTrackerStats (const struct field_sources * src, tr_variant * d, tr_quark key)
+{
+  int n;
+  tr_tracker_stat * s = tr_torrentTrackers (src->tor, &n);
 
-      case TR_KEY_isFinished:
-        tr_variantDictAddBool (d, key, st->finished);
-        break;
+  addTrackerStats (s, n, tr_variantDictAddList (d, key, n));
+  tr_torrentTrackersFree (s, n);
+}
 
-      case TR_KEY_isPrivate:
-        tr_variantDictAddBool (d, key, tr_torrentIsPrivate (tor));
-        break;
+static void
+writeWanted (const struct field_sources * src, tr_variant * d, tr_quark key)
+{
+  tr_file_index_t i;
+  const tr_info * inf = src->inf;
+  tr_variant * w = tr_variantDictAddList (d, key, inf->fileCount);
 
-      case TR_KEY_isStalled:
-        tr_variantDictAddBool (d, key, st->isStalled);
-        break;
+  for (i=0; i<inf->fileCount; ++i)
+    tr_variantListAddInt (w, inf->files[i].dnd ? 0 : 1);
+}
 
-      case TR_KEY_leftUntilDone:
-        tr_variantDictAddInt (d, key, st->leftUntilDone);
-        break;
+static void
+writeWebseeds (const struct field_sources * src, tr_variant * d, tr_quark key)
+{
+  addWebseeds (src->inf, tr_variantDictAddList (d, key, src->inf->webseedCount));
+}
 
-      case TR_KEY_manualAnnounceTime:
-        tr_variantDictAddInt (d, key, st->manualAnnounceTime);
-        break;
+struct field_info
+{
+  field_writer write;
+  tr_torrent_field_group group;
+  int sources;
+};
 
-      case TR_KEY_maxConnectedPeers:
-        tr_variantDictAddInt (d, key,  tr_torrentGetPeerLimit (tor));
-        break;
+#define INFO        TR_TORRENT_INFO, 0
+#define SETTINGS    TR_TORRENT_SETTINGS, 0
+#define STATS       TR_TORRENT_STATS, 0
+#define STAT_STATS  TR_TORRENT_STATS, FIELD_NEEDS_STAT
+#define FILE_STATS  TR_TORRENT_STATS, FIELD_NEEDS_FILES
 
-      case TR_KEY_magnetLink:
-        str = tr_torrentGetMagnetLink (tor);
-        tr_variantDictAddStr (d, key, str);
-        tr_free (str);
-        break;
+/* indexed by quark. Quarks that aren't torrent fields have a NULL writer */
+static const struct field_info field_infos[TR_N_KEYS] =
+{
+  [TR_KEY_activityDate]            = { writeActivityDate,            STAT_STATS },
+  [TR_KEY_addedDate]               = { writeAddedDate,               STAT_STATS },
+  [TR_KEY_bandwidthPriority]       = { writeBandwidthPriority,       SETTINGS },
+  [TR_KEY_comment]                 = { writeComment,                 INFO },
+  [TR_KEY_corruptEver]             = { writeCorruptEver,             STAT_STATS },
+  [TR_KEY_creator]                 = { writeCreator,                 INFO },
+  [TR_KEY_dateCreated]             = { writeDateCreated,             INFO },
+  [TR_KEY_desiredAvailable]        = { writeDesiredAvailable,        STAT_STATS },
+  [TR_KEY_doneDate]                = { writeDoneDate,                STAT_STATS },
+  [TR_KEY_downloadDir]             = { writeDownloadDir,             SETTINGS },
+  [TR_KEY_downloadedEver]          = { writeDownloadedEver,          STAT_STATS },
+  [TR_KEY_downloadLimit]           = { writeDownloadLimit,           SETTINGS },
+  [TR_KEY_downloadLimited]         = { writeDownloadLimited,         SETTINGS },
+  [TR_KEY_error]                   = { writeError,                   STAT_STATS },
+  [TR_KEY_errorString]             = { writeErrorString,             STAT_STATS },
+  [TR_KEY_eta]                     = { writeEta,                     STAT_STATS },
+  [TR_KEY_etaIdle]                 = { writeEtaIdle,                 STAT_STATS },
+  [TR_KEY_files]                   = { writeFiles,                   FILE_STATS },
+  [TR_KEY_fileStats]               = { writeFileStats,               FILE_STATS },
+  [TR_KEY_hashString]              = { writeHashString,              INFO },
+  [TR_KEY_haveUnchecked]           = { writeHaveUnchecked,           STAT_STATS },
+  [TR_KEY_haveValid]               = { writeHaveValid,               STAT_STATS },
+  [TR_KEY_honorsSessionLimits]     = { writeHonorsSessionLimits,     SETTINGS },
+  [TR_KEY_id]                      = { writeId,                      STATS },
+  [TR_KEY_isFinished]              = { writeIsFinished,              STAT_STATS },
+  [TR_KEY_isPrivate]               = { writeIsPrivate,               INFO },
+  [TR_KEY_isStalled]               = { writeIsStalled,               STAT_STATS },
+  [TR_KEY_leftUntilDone]           = { writeLeftUntilDone,           STAT_STATS },
+  [TR_KEY_magnetLink]              = { writeMagnetLink,              INFO },
+  [TR_KEY_manualAnnounceTime]      = { writeManualAnnounceTime,      STAT_STATS },
+  [TR_KEY_maxConnectedPeers]       = { writePeerLimit,               SETTINGS },
+  [TR_KEY_metadataPercentComplete] = { writeMetadataPercentComplete, STAT_STATS },
+  [TR_KEY_name]                    = { writeName,                    INFO },
+  [TR_KEY_peer_limit]              = { writePeerLimit,               SETTINGS },
+  [TR_KEY_peers]                   = { writePeers,                   STATS },
+  [TR_KEY_peersConnected]          = { writePeersConnected,          STAT_STATS },
+  [TR_KEY_peersFrom]               = { writePeersFrom,               STAT_STATS },
+  [TR_KEY_peersGettingFromUs]      = { writePeersGettingFromUs,      STAT_STATS },
+  [TR_KEY_peersSendingToUs]        = { writePeersSendingToUs,        STAT_STATS },
+  [TR_KEY_percentDone]             = { writePercentDone,             STAT_STATS },
+  [TR_KEY_pieces]                  = { writePieces,                  STATS },
+  [TR_KEY_pieceCount]              = { writePieceCount,              INFO },
+  [TR_KEY_pieceSize]               = { writePieceSize,               INFO },
+  [TR_KEY_priorities]              = { writePriorities,              SETTINGS },
+  [TR_KEY_queuePosition]           = { writeQueuePosition,           STAT_STATS },
+  [TR_KEY_rateDownload]            = { writeRateDownload,            STAT_STATS },
+  [TR_KEY_rateUpload]              = { writeRateUpload,              STAT_STATS },
+  [TR_KEY_recheckProgress]         = { writeRecheckProgress,         STAT_STATS },
+  [TR_KEY_secondsDownloading]      = { writeSecondsDownloading,      STAT_STATS },
+  [TR_KEY_secondsSeeding]          = { writeSecondsSeeding,          STAT_STATS },
+  [TR_KEY_seedIdleLimit]           = { writeSeedIdleLimit,           SETTINGS },
+  [TR_KEY_seedIdleMode]            = { writeSeedIdleMode,            SETTINGS },
+  [TR_KEY_seedRatioLimit]          = { writeSeedRatioLimit,          SETTINGS },
+  [TR_KEY_seedRatioMode]           = { writeSeedRatioMode,           SETTINGS },
+  [TR_KEY_sizeWhenDone]            = { writeSizeWhenDone,            STAT_STATS },
+  [TR_KEY_startDate]               = { writeStartDate,               STAT_STATS },
+  [TR_KEY_status]                  = { writeStatus,                  STAT_STATS },
+  [TR_KEY_torrentFile]             = { writeTorrentFile,             INFO },
+  [TR_KEY_totalSize]               = { writeTotalSize,               INFO },
+  [TR_KEY_trackers]                = { writeTrackers,                INFO },
+  [TR_KEY_trackerStats]            = { writeTrackerStats,            STATS },
+  [TR_KEY_uploadedEver]            = { writeUploadedEver,            STAT_STATS },
+  [TR_KEY_uploadLimit]             = { writeUploadLimit,             SETTINGS },
+  [TR_KEY_uploadLimited]           = { writeUploadLimited,           SETTINGS },
+  [TR_KEY_uploadRatio]             = { writeUploadRatio,             STAT_STATS },
+  [TR_KEY_wanted]                  = { writeWanted,                  SETTINGS },
+  [TR_KEY_webseeds]                = { writeWebseeds,                INFO },
+  [TR_KEY_webseedsSendingToUs]     = { writeWebseedsSendingToUs,     STAT_STATS }
+};
 
-      case TR_KEY_metadataPercentComplete:
-        tr_variantDictAddReal (d, key, st->metadataPercentComplete);
-        break;
+#undef INFO
+#undef SETTINGS
+#undef STATS
+#undef STAT_STATS
+#undef FILE_STATS
 
-      case TR_KEY_name:
-        tr_variantDictAddStr (d, key, tr_torrentName (tor));
-        break;
+struct field_plan_entry
+{
+  tr_quark key;
+  const struct field_info * info;
+};
 
-      case TR_KEY_percentDone:
-        tr_variantDictAddReal (d, key, st->percentDone);
-        break;
+struct field_plan
+{
+  struct field_plan_entry * entries;
+  int count;
+};
 
-      case TR_KEY_peer_limit:
-        tr_variantDictAddInt (d, key, tr_torrentGetPeerLimit (tor));
-        break;
+static void
+fieldPlanInit (struct field_plan * plan, const tr_quark * keys, int keyCount)
+{
+  int i;
 
-      case TR_KEY_peers:
-        addPeers (tor, tr_variantDictAdd (d, key));
-        break;
+  plan->entries = tr_new (struct field_plan_entry, keyCount);
+  plan->count = 0;
 
-      case TR_KEY_peersConnected:
-        tr_variantDictAddInt (d, key, st->peersConnected);
-        break;
+  /* unknown and repeated fields are dropped here rather than for every torrent */
+  for (i=0; i<keyCount; ++i)
+    {
+      int j;
+      const tr_quark key = keys[i];
 
-      case TR_KEY_peersFrom:
-        {
-          tr_variant * tmp = tr_variantDictAddDict (d, key, 7);
-          const int * f = st->peersFrom;
-          tr_variantDictAddInt (tmp, TR_KEY_fromCache,    f[TR_PEER_FROM_RESUME]);
-          tr_variantDictAddInt (tmp, TR_KEY_fromDht,      f[TR_PEER_FROM_DHT]);
-          tr_variantDictAddInt (tmp, TR_KEY_fromIncoming, f[TR_PEER_FROM_INCOMING]);
-          tr_variantDictAddInt (tmp, TR_KEY_fromLpd,      f[TR_PEER_FROM_LPD]);
-          tr_variantDictAddInt (tmp, TR_KEY_fromLtep,     f[TR_PEER_FROM_LTEP]);
-          tr_variantDictAddInt (tmp, TR_KEY_fromPex,      f[TR_PEER_FROM_PEX]);
-          tr_variantDictAddInt (tmp, TR_KEY_fromTracker,  f[TR_PEER_FROM_TRACKER]);
+      for (j=0; j<plan->count; ++j)
+        if (plan->entries[j].key == key)
           break;
-        }
-
-      case TR_KEY_peersGettingFromUs:
-        tr_variantDictAddInt (d, key, st->peersGettingFromUs);
-        break;
-
-      case TR_KEY_peersSendingToUs:
-        tr_variantDictAddInt (d, key, st->peersSendingToUs);
-        break;
 
-      case TR_KEY_pieces:
-        if (tr_torrentHasMetadata (tor))
-          {
-            size_t byte_count = 0;
-            void * bytes = tr_torrentCreatePieceBitfield (tor, &byte_count);
-            char * str = tr_base64_encode (bytes, byte_count, NULL);
-            tr_variantDictAddStr (d, key, str!=NULL ? str : "");
-            tr_free (str);
-            tr_free (bytes);
-          }
-        else
-          {
-            tr_variantDictAddStr (d, key, "");
-          }
-        break;
-
-      case TR_KEY_pieceCount:
-        tr_variantDictAddInt (d, key, inf->pieceCount);
-        break;
-
-      case TR_KEY_pieceSize:
-        tr_variantDictAddInt (d, key, inf->pieceSize);
-        break;
-
-      case TR_KEY_priorities:
+      if ((j == plan->count) && (field_infos[key].write != NULL))
         {
-          tr_file_index_t i;
-          tr_variant * p = tr_variantDictAddList (d, key, inf->fileCount);
-          for (i=0; i<inf->fileCount; ++i)
-            tr_variantListAddInt (p, inf->files[i].priority);
-          break;
+          struct field_plan_entry * e = &plan->entries[plan->count++];
+          e->key = key;
+          e->info = &field_infos[key];
         }
+    }
+}
 
-      case TR_KEY_queuePosition:
-        tr_variantDictAddInt (d, key, st->queuePosition);
-        break;
-
-      case TR_KEY_etaIdle:
-        tr_variantDictAddInt (d, key, st->etaIdle);
-        break;
-
-      case TR_KEY_rateDownload:
-        tr_variantDictAddInt (d, key, toSpeedBytes (st->pieceDownloadSpeed_KBps));
-        break;
-
-      case TR_KEY_rateUpload:
-        tr_variantDictAddInt (d, key, toSpeedBytes (st->pieceUploadSpeed_KBps));
-        break;
-
-      case TR_KEY_recheckProgress:
-        tr_variantDictAddReal (d, key, st->recheckProgress);
-        break;
-
-      case TR_KEY_seedIdleLimit:
-        tr_variantDictAddInt (d, key, tr_torrentGetIdleLimit (tor));
-        break;
-
-      case TR_KEY_seedIdleMode:
-        tr_variantDictAddInt (d, key, tr_torrentGetIdleMode (tor));
-        break;
-
-      case TR_KEY_seedRatioLimit:
-        tr_variantDictAddReal (d, key, tr_torrentGetRatioLimit (tor));
-        break;
+/* build a plan from torrent-get's "fields" argument */
+static void
+fieldPlanInitFromList (struct field_plan * plan, tr_variant * fields)
+{
+  int i;
+  int n = 0;
+  const int fieldCount = tr_variantListSize (fields);
+  tr_quark * keys = tr_new (tr_quark, fieldCount);
 
-      case TR_KEY_seedRatioMode:
-        tr_variantDictAddInt (d, key, tr_torrentGetRatioMode (tor));
-        break;
+  for (i=0; i<fieldCount; ++i)
+    {
+      size_t len;
+      const char * str;
+      tr_quark key;
 
-      case TR_KEY_sizeWhenDone:
-        tr_variantDictAddInt (d, key, st->sizeWhenDone);
-        break;
+      if (tr_variantGetStr (tr_variantListChild (fields, i), &str, &len) && tr_quark_lookup (str, len, &key))
+        keys[n++] = key;
+    }
 
-      case TR_KEY_startDate:
-        tr_variantDictAddInt (d, key, st->startDate);
-        break;
+  fieldPlanInit (plan, keys, n);
+  tr_free (keys);
+}
 
-      case TR_KEY_status:
-        tr_variantDictAddInt (d, key, st->activity);
-        break;
+static void
+fieldPlanDestruct (struct field_plan * plan)
+{
+  tr_free (plan->entries);
+}
 
-      case TR_KEY_secondsDownloading:
-        tr_variantDictAddInt (d, key, st->secondsDownloading);
-        break;
+static bool
+fieldIsWanted (const tr_torrent * tor, const struct field_plan_entry * e, int64_t since)
+{
+  if (since < 0)
+    return true;
 
-      case TR_KEY_secondsSeeding:
-        tr_variantDictAddInt (d, key, st->secondsSeeding);
-        break;
+  /* "id" is always added first when `since' is used */
+  return (e->key != TR_KEY_id) && (tr_torrentGetRevision (tor, e->info->group) > (uint64_t) since);
+}
 
-      case TR_KEY_trackers:
-        addTrackers (inf, tr_variantDictAddList (d, key, inf->trackerCount));
-        break;
+/* add the fields to the empty dict `d'.
+   if `since' is nonnegative, only add the fields changed after that revision */
+static void
+addInfo (tr_torrent * tor, tr_variant * d, const struct field_plan * plan, int64_t since)
+{
+  int i;
+  int n = 0;
+  int sources = 0;
+  struct field_sources src;
 
-      case TR_KEY_trackerStats:
+  /* find what the wanted fields need, so each source is built only once */
+  for (i=0; i<plan->count; ++i)
+    {
+      if (fieldIsWanted (tor, &plan->entries[i], since))
         {
-          int n;
-          tr_tracker_stat * s = tr_torrentTrackers (tor, &n);
-          addTrackerStats (s, n, tr_variantDictAddList (d, key, n));
-          tr_torrentTrackersFree (s, n);
-          break;
+          sources |= plan->entries[i].info->sources;
+          ++n;
         }
+    }
 
-      case TR_KEY_torrentFile:
-        tr_variantDictAddStr (d, key, inf->torrent);
-        break;
-
-      case TR_KEY_totalSize:
-        tr_variantDictAddInt (d, key, inf->totalSize);
-        break;
-
-      case TR_KEY_uploadedEver:
-        tr_variantDictAddInt (d, key, st->uploadedEver);
-        break;
-
-      case TR_KEY_uploadLimit:
-        tr_variantDictAddInt (d, key, tr_torrentGetSpeedLimit_KBps (tor, TR_UP));
-        break;
+  src.tor = tor;
+  src.inf = tr_torrentInfo (tor);
+  src.st = (sources & FIELD_NEEDS_STAT) ? tr_torrentStat (tor) : NULL;
+  src.files = (sources & FIELD_NEEDS_FILES) ? tr_torrentFiles (tor, NULL) : NULL;
 
-      case TR_KEY_uploadLimited:
-        tr_variantDictAddBool (d, key, tr_torrentUsesSpeedLimit (tor, TR_UP));
-        break;
+  tr_variantDictReserve (d, n + 1);
 
-      case TR_KEY_uploadRatio:
-        tr_variantDictAddReal (d, key, st->ratio);
-        break;
+  if (since >= 0)
+    tr_variantDictAddInt (d, TR_KEY_id, tr_torrentId (tor));
 
-      case TR_KEY_wanted:
-        {
-          tr_file_index_t i;
-          tr_variant * w = tr_variantDictAddList (d, key, inf->fileCount);
-          for (i=0; i<inf->fileCount; ++i)
-            tr_variantListAddInt (w, inf->files[i].dnd ? 0 : 1);
-          break;
-        }
+  for (i=0; i<plan->count; ++i)
+    {
+      const struct field_plan_entry * e = &plan->entries[i];
 
-      case TR_KEY_webseeds:
-        addWebseeds (inf, tr_variantDictAddList (d, key, inf->webseedCount));
-        break;
+      if (fieldIsWanted (tor, e, since))
+        e->info->write (&src, d, e->key);
+    }
 
-      case TR_KEY_webseedsSendingToUs:
-        tr_variantDictAddInt (d, key, st->webseedsSendingToUs);
-        break;
+  if (src.files != NULL)
+    tr_torrentFilesFree (src.files, src.inf->fileCount);
+}
 
-      default:
-        break;
-    }
+static bool
+torrentChangedSince (const tr_torrent * tor, int64_t since)
+{
+  return (since < 0) || (tr_torrentGetLatestRevision (tor) > (uint64_t) since);
 }
 
-static void
-addInfo (tr_torrent * tor, tr_variant * d, tr_variant * fields)
+/**
+ * Adds torrent-get's "removed" and "revision" response arguments.
+ * @return the request's "since" argument, or -1 if it didn't have one
+ */
+static int64_t
+addTorrentGetExtras (tr_session * session,
+                     tr_variant * args_in,
+                     tr_variant * args_out)
 {
-  const int n = tr_variantListSize (fields);
+  int64_t since;
+  const char * strVal;
 
-  tr_variantInitDict (d, n);
+  if (tr_variantDictFindInt (args_in, TR_KEY_since, &since))
+    {
+      int n = 0;
+      tr_variant * d;
+      tr_variant * removed_out = tr_variantDictAddList (args_out, TR_KEY_removed, 0);
+
+      since = MAX (0, since);
 
-  if (n > 0)
+      while ((d = tr_variantListChild (&session->removedTorrents, n++)))
+        {
+          int64_t intVal;
+          if (tr_variantDictFindInt (d, TR_KEY_revision, &intVal) && (intVal > since))
+            {
+              tr_variantDictFindInt (d, TR_KEY_id, &intVal);
+              tr_variantListAddInt (removed_out, intVal);
+            }
+        }
+    }
+  else
     {
-      int i;
-      const tr_info * const inf = tr_torrentInfo (tor);
-      const tr_stat * const st = tr_torrentStat ((tr_torrent*)tor);
+      since = -1;
 
-      for (i=0; i<n; ++i)
+      if (tr_variantDictFindStr (args_in, TR_KEY_ids, &strVal, NULL) && strcmp (strVal, "recently-active") == 0)
         {
-          size_t len;
-          const char * str;
-          if (tr_variantGetStr (tr_variantListChild (fields, i), &str, &len))
-            addField (tor, inf, st, d, tr_quark_new (str, len));
+          int n = 0;
+          tr_variant * d;
+          const time_t now = tr_time ();
+          const int interval = RECENTLY_ACTIVE_SECONDS;
+          tr_variant * removed_out = tr_variantDictAddList (args_out, TR_KEY_removed, 0);
+          while ((d = tr_variantListChild (&session->removedTorrents, n++)))
+            {
+              int64_t intVal;
+              if (tr_variantDictFindInt (d, TR_KEY_date, &intVal) && (intVal >= now - interval))
+                {
+                  tr_variantDictFindInt (d, TR_KEY_id, &intVal);
+                  tr_variantListAddInt (removed_out, intVal);
+                }
+            }
         }
     }
+
+  tr_variantDictAddInt (args_out, TR_KEY_revision, session->revision);
+
+  return since;
 }
 
 static const char*
@@ -929,33 +1052,27 @@ torrentGet (tr_session               * session,
   tr_torrent ** torrents = getTorrents (session, args_in, &torrentCount);
   tr_variant * list = tr_variantDictAddList (args_out, TR_KEY_torrents, torrentCount);
   tr_variant * fields;
-  const char * strVal;
+  const int64_t since = addTorrentGetExtras (session, args_in, args_out);
   const char * errmsg = NULL;
 
   assert (idle_data == NULL);
 
-  if (tr_variantDictFindStr (args_in, TR_KEY_ids, &strVal, NULL) && strcmp (strVal, "recently-active") == 0)
+  if (!tr_variantDictFindList (args_in, TR_KEY_fields, &fields))
     {
-      int n = 0;
-      tr_variant * d;
-      const time_t now = tr_time ();
-      const int interval = RECENTLY_ACTIVE_SECONDS;
-      tr_variant * removed_out = tr_variantDictAddList (args_out, TR_KEY_removed, 0);
-      while ((d = tr_variantListChild (&session->removedTorrents, n++)))
-        {
-          int64_t intVal;
-          if (tr_variantDictFindInt (d, TR_KEY_date, &intVal) && (intVal >= now - interval))
-            {
-              tr_variantDictFindInt (d, TR_KEY_id, &intVal);
-              tr_variantListAddInt (removed_out, intVal);
-            }
-        }
+      errmsg = "no fields specified";
     }
+  else
+    {
+      struct field_plan plan;
 
-  if (!tr_variantDictFindList (args_in, TR_KEY_fields, &fields))
-    errmsg = "no fields specified";
-  else for (i=0; i<torrentCount; ++i)
-    addInfo (torrents[i], tr_variantListAdd (list), fields);
+      fieldPlanInitFromList (&plan, fields);
+
+      for (i=0; i<torrentCount; ++i)
+        if (torrentChangedSince (torrents[i], since))
+          addInfo (torrents[i], tr_variantListAddDict (list, 0), &plan, since);
+
+      fieldPlanDestruct (&plan);
+    }
 
   tr_free (torrents);
   return errmsg;
@@ -1615,15 +1732,13 @@ addTorrentImpl (struct tr_rpc_idle_data * data, tr_ctor * ctor)
 
   if (tor && key)
     {
-      tr_variant fields;
-      tr_variantInitList (&fields, 3);
-      tr_variantListAddStr (&fields, "id");
-      tr_variantListAddStr (&fields, "name");
-      tr_variantListAddStr (&fields, "hashString");
-      addInfo (tor, tr_variantDictAdd (data->args_out, key), &fields);
+      struct field_plan plan;
+      const tr_quark fields[] = { TR_KEY_id, TR_KEY_name, TR_KEY_hashString };
+      fieldPlanInit (&plan, fields, TR_N_ELEMENTS (fields));
+      addInfo (tor, tr_variantDictAddDict (data->args_out, key, 0), &plan, -1);
+      fieldPlanDestruct (&plan);
       if (result == NULL)
         notify (data->session, TR_RPC_TORRENT_ADDED, tor);
-      tr_variantFree (&fields);
       result = NULL;
     }
 
@@ -2001,6 +2116,7 @@ sessionStats (tr_session               * session,
   tr_variant * d;
   tr_session_stats currentStats = { 0.0f, 0, 0, 0, 0, 0 };
   tr_session_stats cumulativeStats = { 0.0f, 0, 0, 0, 0, 0 };
+  struct tr_fd_stats fileStats;
   tr_torrent * tor = NULL;
 
   assert (idle_data == NULL);
@@ -2036,6 +2152,14 @@ sessionStats (tr_session               * session,
   tr_variantDictAddInt (d, TR_KEY_sessionCount, currentStats.sessionCount);
   tr_variantDictAddInt (d, TR_KEY_uploadedBytes, currentStats.uploadedBytes);
 
+  tr_fdGetFileStats (session, &fileStats);
+  d = tr_variantDictAddDict (args_out, TR_KEY_file_cache_stats, 5);
+  tr_variantDictAddInt (d, TR_KEY_evictions, fileStats.evictions);
+  tr_variantDictAddInt (d, TR_KEY_hits, fileStats.hits);
+  tr_variantDictAddInt (d, TR_KEY_maxOpenFiles, fileStats.max_open);
+  tr_variantDictAddInt (d, TR_KEY_misses, fileStats.misses);
+  tr_variantDictAddInt (d, TR_KEY_openFiles, fileStats.open_count);
+
   return NULL;
 }
 
@@ -2199,11 +2323,22 @@ noop_response_callback (tr_session * session UNUSED,
 {
 }
 
-void
-tr_rpc_request_exec_json (tr_session            * session,
-                          const tr_variant      * request,
-                          tr_rpc_response_func    callback,
-                          void                  * callback_user_data)
+static void
+initResponse (tr_variant * response, tr_variant_arena * arena)
+{
+  if (arena != NULL)
+    tr_variantInitArenaDict (response, arena, 3);
+  else
+    tr_variantInitDict (response, 3);
+}
+
+/* if `use_arena' is true, the response is freed once `callback' returns */
+static void
+rpcRequestExec (tr_session            * session,
+                const tr_variant      * request,
+                tr_rpc_response_func    callback,
+                void                  * callback_user_data,
+                bool                    use_arena)
 {
   int i;
   const char * str;
@@ -2236,8 +2371,9 @@ tr_rpc_request_exec_json (tr_session            * session,
     {
       int64_t tag;
       tr_variant response;
+      tr_variant_arena * arena = use_arena ? tr_variantArenaNew () : NULL;
 
-      tr_variantInitDict (&response, 3);
+      initResponse (&response, arena);
       tr_variantDictAddDict (&response, TR_KEY_arguments, 0);
       tr_variantDictAddStr (&response, TR_KEY_result, result);
       if (tr_variantDictFindInt (mutable_request, TR_KEY_tag, &tag))
@@ -2246,14 +2382,16 @@ tr_rpc_request_exec_json (tr_session            * session,
       (*callback)(session, &response, callback_user_data);
 
       tr_variantFree (&response);
+      tr_variantArenaFree (arena);
     }
   else if (methods[i].immediate)
     {
       int64_t tag;
       tr_variant response;
       tr_variant * args_out;
+      tr_variant_arena * arena = use_arena ? tr_variantArenaNew () : NULL;
 
-      tr_variantInitDict (&response, 3);
+      initResponse (&response, arena);
       args_out = tr_variantDictAddDict (&response, TR_KEY_arguments, 0);
       result = (*methods[i].func)(session, args_in, args_out, NULL);
       if (result == NULL)
@@ -2265,6 +2403,7 @@ tr_rpc_request_exec_json (tr_session            * session,
       (*callback)(session, &response, callback_user_data);
 
       tr_variantFree (&response);
+      tr_variantArenaFree (arena);
     }
   else
     {
@@ -2272,7 +2411,8 @@ tr_rpc_request_exec_json (tr_session            * session,
       struct tr_rpc_idle_data * data = tr_new0 (struct tr_rpc_idle_data, 1);
       data->session = session;
       data->response = tr_new0 (tr_variant, 1);
-      tr_variantInitDict (data->response, 3);
+      data->arena = use_arena ? tr_variantArenaNew () : NULL;
+      initResponse (data->response, data->arena);
       if (tr_variantDictFindInt (mutable_request, TR_KEY_tag, &tag))
         tr_variantDictAddInt (data->response, TR_KEY_tag, tag);
       data->args_out = tr_variantDictAddDict (data->response, TR_KEY_arguments, 0);
@@ -2286,6 +2426,175 @@ tr_rpc_request_exec_json (tr_session            * session,
     }
 }
 
+void
+tr_rpc_request_exec_json (tr_session            * session,
+                          const tr_variant      * request,
+                          tr_rpc_response_func    callback,
+                          void                  * callback_user_data)
+{
+  rpcRequestExec (session, request, callback, callback_user_data, false);
+}
+
+void
+tr_rpc_request_exec_json_scoped (tr_session            * session,
+                                 const tr_variant      * request,
+                                 tr_rpc_response_func    callback,
+                                 void                  * callback_user_data)
+{
+  rpcRequestExec (session, request, callback, callback_user_data, true);
+}
+
+/***
+****
+***/
+
+enum
+{
+  /* how much JSON tr_rpc_stream_next () writes at a time */
+  STREAM_CHUNK_SIZE = 64 * 1024
+};
+
+struct tr_rpc_stream
+{
+  tr_session * session;
+  struct evbuffer * buf;
+  tr_json_writer * writer;
+
+  /* the torrents to list. Keep their ids, not pointers,
+     since they may be removed before we get to them */
+  int * ids;
+  int idCount;
+  int idIndex;
+
+  struct field_plan plan;
+  int64_t since;
+
+  tr_variant extras; /* arguments that follow the "torrents" list */
+  int64_t tag;
+  bool hasTag;
+  bool done;
+};
+
+tr_rpc_stream *
+tr_rpc_stream_new (tr_session * session, const tr_variant * request)
+{
+  int i;
+  int torrentCount;
+  const char * str;
+  tr_variant * args_in;
+  tr_variant * fields;
+  tr_torrent ** torrents;
+  tr_rpc_stream * stream;
+  tr_variant * const mutable_request = (tr_variant *) request;
+
+  if (!tr_variantDictFindStr (mutable_request, TR_KEY_method, &str, NULL)
+      || (strcmp (str, "torrent-get") != 0)
+      || !tr_variantDictFindDict (mutable_request, TR_KEY_arguments, &args_in)
+      || !tr_variantDictFindList (args_in, TR_KEY_fields, &fields))
+    return NULL;
+
+  stream = tr_new0 (tr_rpc_stream, 1);
+  stream->session = session;
+  stream->buf = evbuffer_new ();
+  stream->writer = tr_jsonWriterNew (stream->buf);
+  fieldPlanInitFromList (&stream->plan, fields);
+  stream->hasTag = tr_variantDictFindInt (mutable_request, TR_KEY_tag, &stream->tag);
+
+  torrents = getTorrents (session, args_in, &torrentCount);
+  stream->ids = tr_new (int, torrentCount);
+  for (i=0; i<torrentCount; ++i)
+    stream->ids[i] = tr_torrentId (torrents[i]);
+  stream->idCount = torrentCount;
+  tr_free (torrents);
+
+  /* build these now, so that "revision" isn't newer than the torrents we list */
+  tr_variantInitDict (&stream->extras, 2);
+  stream->since = addTorrentGetExtras (session, args_in, &stream->extras);
+
+  tr_jsonWriterDictBegin (stream->writer);
+  tr_jsonWriterKey (stream->writer, TR_KEY_arguments);
+  tr_jsonWriterDictBegin (stream->writer);
+  tr_jsonWriterKey (stream->writer, TR_KEY_torrents);
+  tr_jsonWriterListBegin (stream->writer);
+
+  return stream;
+}
+
+static void
+streamFinish (tr_rpc_stream * stream)
+{
+  size_t i;
+  tr_quark key;
+  tr_variant * val;
+  tr_json_writer * w = stream->writer;
+
+  tr_jsonWriterEnd (w); /* torrents */
+
+  for (i=0; tr_variantDictChild (&stream->extras, i, &key, &val); ++i)
+    {
+      tr_jsonWriterKey (w, key);
+      tr_jsonWriterVariant (w, val);
+    }
+
+  tr_jsonWriterEnd (w); /* arguments */
+
+  tr_jsonWriterKey (w, TR_KEY_result);
+  tr_jsonWriterStr (w, "success");
+
+  if (stream->hasTag)
+    {
+      tr_jsonWriterKey (w, TR_KEY_tag);
+      tr_jsonWriterInt (w, stream->tag);
+    }
+
+  tr_jsonWriterEnd (w);
+
+  stream->done = true;
+}
+
+bool
+tr_rpc_stream_next (tr_rpc_stream * stream, struct evbuffer * out)
+{
+  while (!stream->done && (evbuffer_get_length (stream->buf) < STREAM_CHUNK_SIZE))
+    {
+      if (stream->idIndex < stream->idCount)
+        {
+          tr_torrent * tor = tr_torrentFindFromId (stream->session, stream->ids[stream->idIndex++]);
+
+          /* only one torrent's tr_variant exists at a time */
+          if ((tor != NULL) && torrentChangedSince (tor, stream->since))
+            {
+              tr_variant d;
+              tr_variantInitDict (&d, 0);
+              addInfo (tor, &d, &stream->plan, stream->since);
+              tr_jsonWriterVariant (stream->writer, &d);
+              tr_variantFree (&d);
+            }
+        }
+      else
+        {
+          streamFinish (stream);
+        }
+    }
+
+  evbuffer_add_buffer (out, stream->buf);
+  return stream->done;
+}
+
+void
+tr_rpc_stream_free (tr_rpc_stream * stream)
+{
+  if (stream == NULL)
+    return;
+
+  tr_variantFree (&stream->extras);
+  fieldPlanDestruct (&stream->plan);
+  tr_free (stream->ids);
+  tr_jsonWriterFree (stream->writer);
+  evbuffer_free (stream->buf);
+  tr_free (stream);
+}
+
 /**
  * Munge the URI into a usable form.
  *
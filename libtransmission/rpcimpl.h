@@ -29,6 +29,19 @@ void tr_rpc_request_exec_json (tr_session            * session,
                                tr_rpc_response_func    callback,
                                void                  * callback_user_data);
 
+/**
+ * @brief like tr_rpc_request_exec_json (), but the response only lives
+ *        until `callback' returns.
+ *
+ * The response is built in an arena that's freed in one go afterwards,
+ * instead of node by node, so `callback' must not keep or take ownership
+ * of it. `request' may be an arena tree, e.g. from tr_variantFromJsonArena ().
+ */
+void tr_rpc_request_exec_json_scoped (tr_session            * session,
+                                      const tr_variant      * request,
+                                      tr_rpc_response_func    callback,
+                                      void                  * callback_user_data);
+
 /* see the RPC spec's "Request URI Notation" section */
 void tr_rpc_request_exec_uri (tr_session           * session,
                               const void           * request_uri,
@@ -36,6 +49,36 @@ void tr_rpc_request_exec_uri (tr_session           * session,
                               tr_rpc_response_func   callback,
                               void                 * callback_user_data);
 
+/***
+****  Streamed responses
+****
+****  Some responses, e.g. a torrent-get of every field of every torrent,
+****  can be very large. These can be written out as JSON a piece at a time
+****  instead of being built as one big tr_variant first.
+***/
+
+struct evbuffer;
+
+typedef struct tr_rpc_stream tr_rpc_stream;
+
+/**
+ * @brief start a response that's written a piece at a time.
+ * @return NULL if `request' can't be streamed. Currently only well-formed
+ *         "torrent-get" requests can be. Use tr_rpc_request_exec_json () for
+ *         the others.
+ */
+tr_rpc_stream * tr_rpc_stream_new (tr_session       * session,
+                                   const tr_variant * request);
+
+/**
+ * @brief append the next piece of the JSON response to `out'
+ * @return true if that was the last piece
+ */
+bool tr_rpc_stream_next (tr_rpc_stream   * stream,
+                         struct evbuffer * out);
+
+void tr_rpc_stream_free (tr_rpc_stream * stream);
+
 void tr_rpc_parse_list_str (tr_variant  * setme,
                             const char  * list_str,
                             size_t        list_str_len);
@@ -6,12 +6,19 @@
  *
  */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "transmission.h"
+#include "crypto-utils.h" /* tr_sha1_to_hex () */
+#include "file.h"
+#include "platform.h" /* tr_getResumeDir () */
+#include "resume-db.h"
 #include "session.h"
+#include "torrent.h"
 #include "utils.h"
+#include "variant.h"
 #include "version.h"
 
 #undef VERBOSE
@@ -45,4 +52,281 @@ testPeerId (void)
     return 0;
 }
 
-MAIN_SINGLE_TEST (testPeerId)
+static tr_torrent *
+createTorrent (tr_session * session, int i)
+{
+    int err;
+    char name[32];
+    size_t len;
+    char * benc;
+    tr_variant top;
+    tr_variant * info;
+    tr_ctor * ctor;
+    tr_torrent * tor;
+    uint8_t pieces[SHA_DIGEST_LENGTH];
+
+    /* a one-byte torrent whose info dict, and so its hash, depends on i */
+    tr_snprintf (name, sizeof (name), "torrent-%d", i);
+    memset (pieces, 0, sizeof (pieces));
+    tr_variantInitDict (&top, 1);
+    info = tr_variantDictAddDict (&top, TR_KEY_info, 4);
+    tr_variantDictAddInt (info, TR_KEY_length, 1);
+    tr_variantDictAddStr (info, TR_KEY_name, name);
+    tr_variantDictAddInt (info, TR_KEY_piece_length, 16384);
+    tr_variantDictAddRaw (info, TR_KEY_pieces, pieces, sizeof (pieces));
+    benc = tr_variantToStr (&top, TR_VARIANT_FMT_BENC, &len);
+
+    ctor = tr_ctorNew (session);
+    tr_ctorSetMetainfo (ctor, (uint8_t*)benc, len);
+    tr_ctorSetPaused (ctor, TR_FORCE, true);
+    tr_ctorSetDeleteSource (ctor, false);
+    err = 0;
+    tor = tr_torrentNew (ctor, &err, NULL);
+
+    tr_ctorFree (ctor);
+    tr_free (benc);
+    tr_variantFree (&top);
+    return tor;
+}
+
+static int
+testTorrentLookup (void)
+{
+    int i;
+    int j;
+    char hashString[SHA_DIGEST_LENGTH*2 + 1];
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    enum { N = 100 };
+    tr_torrent * torrents[N];
+    int ids[N];
+    uint8_t hashes[N][SHA_DIGEST_LENGTH];
+    uint8_t obfuscatedHashes[N][SHA_DIGEST_LENGTH];
+    tr_session * session = libttest_session_init (NULL);
+
+    /* enough torrents to make the lookup tables grow */
+    for (i = 0; i < N; ++i)
+    {
+        torrents[i] = createTorrent (session, i);
+        check (torrents[i] != NULL);
+    }
+
+    for (i = 0; i < N; ++i)
+    {
+        tr_torrent * tor = torrents[i];
+
+        check_ptr_eq (tor, tr_torrentFindFromId (session, tr_torrentId (tor)));
+        check_ptr_eq (tor, tr_torrentFindFromHash (session, tor->info.hash));
+        check_ptr_eq (tor, tr_torrentFindFromObfuscatedHash (session, tor->obfuscatedHash));
+        check_ptr_eq (tor, tr_torrentFindFromHashString (session, tor->info.hashString));
+
+        /* hash strings are case-insensitive */
+        for (j = 0; j < SHA_DIGEST_LENGTH*2 + 1; ++j)
+            hashString[j] = toupper (tor->info.hashString[j]);
+        check_ptr_eq (tor, tr_torrentFindFromHashString (session, hashString));
+    }
+
+    /* unknown keys */
+    memset (hash, 0, sizeof (hash));
+    check_ptr_eq (NULL, tr_torrentFindFromId (session, -1));
+    check_ptr_eq (NULL, tr_torrentFindFromHash (session, hash));
+    check_ptr_eq (NULL, tr_torrentFindFromObfuscatedHash (session, hash));
+    tr_sha1_to_hex (hashString, hash);
+    check_ptr_eq (NULL, tr_torrentFindFromHashString (session, hashString));
+    check_ptr_eq (NULL, tr_torrentFindFromHashString (session, "not a hash"));
+    hashString[SHA_DIGEST_LENGTH] = '\0';
+    check_ptr_eq (NULL, tr_torrentFindFromHashString (session, hashString));
+
+    /* removed torrents can't be found, and the others still can */
+    for (i = 0; i < N; ++i)
+    {
+        ids[i] = tr_torrentId (torrents[i]);
+        memcpy (hashes[i], torrents[i]->info.hash, SHA_DIGEST_LENGTH);
+        memcpy (obfuscatedHashes[i], torrents[i]->obfuscatedHash, SHA_DIGEST_LENGTH);
+    }
+    for (i = 0; i < N; i += 2)
+        tr_torrentRemove (torrents[i], false, NULL);
+    while (tr_sessionCountTorrents (session) > N / 2)
+        tr_wait_msec (10);
+    for (i = 0; i < N; ++i)
+    {
+        const tr_torrent * expected = (i % 2) ? torrents[i] : NULL;
+
+        check_ptr_eq (expected, tr_torrentFindFromId (session, ids[i]));
+        check_ptr_eq (expected, tr_torrentFindFromHash (session, hashes[i]));
+        check_ptr_eq (expected, tr_torrentFindFromObfuscatedHash (session, obfuscatedHashes[i]));
+    }
+
+    libttest_session_close (session);
+    return 0;
+}
+
+static tr_session *
+restartSession (tr_session * session)
+{
+    char * configDir = tr_strdup (tr_sessionGetConfigDir (session));
+    tr_variant settings;
+
+    tr_variantInitDict (&settings, 0);
+    tr_sessionGetSettings (session, &settings);
+    tr_sessionClose (session);
+    session = tr_sessionInit (configDir, true, &settings);
+
+    tr_variantFree (&settings);
+    tr_free (configDir);
+    return session;
+}
+
+/* @return how many .resume files there were */
+static int
+removeResumeFiles (const tr_session * session)
+{
+    int n = 0;
+    const char * name;
+    const char * dir = tr_getResumeDir (session);
+    tr_sys_dir_t odir = tr_sys_dir_open (dir, NULL);
+
+    if (odir == TR_BAD_SYS_DIR)
+        return 0;
+
+    while ((name = tr_sys_dir_read_name (odir, NULL)) != NULL)
+    {
+        if (tr_str_has_suffix (name, ".resume"))
+        {
+            char * path = tr_buildPath (dir, name, NULL);
+            tr_sys_path_remove (path, NULL);
+            tr_free (path);
+            ++n;
+        }
+    }
+
+    tr_sys_dir_close (odir, NULL);
+    return n;
+}
+
+static int
+testLoadTorrents (void)
+{
+    int i;
+    int n;
+    tr_ctor * ctor;
+    tr_torrent ** torrents;
+    enum { N = 300 }; /* enough for several worker threads and batches */
+    uint8_t hashes[N][SHA_DIGEST_LENGTH];
+    tr_session * session = libttest_session_init (NULL);
+
+    for (i = 0; i < N; ++i)
+    {
+        tr_torrent * tor = createTorrent (session, i);
+        check (tor != NULL);
+        memcpy (hashes[i], tor->info.hash, SHA_DIGEST_LENGTH);
+
+        /* something that's kept in the .resume file */
+        tr_torrentSetRatioMode (tor, TR_RATIOLIMIT_SINGLE);
+        tr_torrentSetRatioLimit (tor, i);
+    }
+
+    /* restart the session and load them back */
+    session = restartSession (session);
+
+    ctor = tr_ctorNew (session);
+    torrents = tr_sessionLoadTorrents (session, ctor, &n);
+    check_int_eq (N, n);
+    check_int_eq (N, tr_sessionCountTorrents (session));
+
+    for (i = 0; i < N; ++i)
+    {
+        tr_torrent * tor = tr_torrentFindFromHash (session, hashes[i]);
+        check (tor != NULL);
+        check_int_eq (TR_RATIOLIMIT_SINGLE, tr_torrentGetRatioMode (tor));
+        check_int_eq (i, (int) tr_torrentGetRatioLimit (tor));
+    }
+
+    tr_free (torrents);
+    tr_ctorFree (ctor);
+    libttest_session_close (session);
+    return 0;
+}
+
+static int
+checkRatioLimits (tr_session * session, const uint8_t hashes[][SHA_DIGEST_LENGTH], int count, int bump)
+{
+    int i;
+    int n;
+    tr_ctor * ctor = tr_ctorNew (session);
+    tr_torrent ** torrents = tr_sessionLoadTorrents (session, ctor, &n);
+
+    check_int_eq (count, n);
+
+    for (i = 0; i < count; ++i)
+    {
+        tr_torrent * tor = tr_torrentFindFromHash (session, hashes[i]);
+        check (tor != NULL);
+        check_int_eq (i + bump, (int) tr_torrentGetRatioLimit (tor));
+    }
+
+    tr_free (torrents);
+    tr_ctorFree (ctor);
+    return 0;
+}
+
+static int
+testResumeDatabase (void)
+{
+    int i;
+    char * dbFilename;
+    struct tr_resume_db_stats stats;
+    enum { N = 20 };
+    uint8_t hashes[N][SHA_DIGEST_LENGTH];
+    tr_session * session = libttest_session_init (NULL);
+
+    for (i = 0; i < N; ++i)
+    {
+        tr_torrent * tor = createTorrent (session, i);
+        check (tor != NULL);
+        memcpy (hashes[i], tor->info.hash, SHA_DIGEST_LENGTH);
+        tr_torrentSetRatioMode (tor, TR_RATIOLIMIT_SINGLE);
+        tr_torrentSetRatioLimit (tor, i);
+    }
+
+    /* turning it on moves everything into the database */
+    dbFilename = tr_buildPath (tr_sessionGetConfigDir (session), "resume.db", NULL);
+    check (!tr_sys_path_exists (dbFilename, NULL));
+    tr_sessionSetResumeDatabaseEnabled (session, true);
+    check (tr_sessionIsResumeDatabaseEnabled (session));
+    check (tr_sys_path_exists (dbFilename, NULL));
+    tr_resumeDbGetStats (session->resumeDb, &stats);
+    check_int_eq (N, stats.torrent_count);
+    removeResumeFiles (session);
+
+    /* changes are saved there */
+    for (i = 0; i < N; ++i)
+        tr_torrentSetRatioLimit (tr_torrentFindFromHash (session, hashes[i]), i + 1);
+    session = restartSession (session);
+    check (tr_sessionIsResumeDatabaseEnabled (session));
+    check_int_eq (0, removeResumeFiles (session));
+    if (checkRatioLimits (session, hashes, N, 1))
+        return 1;
+
+    /* turning it off moves everything back out again */
+    tr_sessionSetResumeDatabaseEnabled (session, false);
+    check (!tr_sys_path_exists (dbFilename, NULL));
+    session = restartSession (session);
+    check (!tr_sessionIsResumeDatabaseEnabled (session));
+    if (checkRatioLimits (session, hashes, N, 1))
+        return 1;
+
+    tr_free (dbFilename);
+    libttest_session_close (session);
+    return 0;
+}
+
+int
+main (void)
+{
+    const testFunc tests[] = { testPeerId,
+                               testTorrentLookup,
+                               testLoadTorrents,
+                               testResumeDatabase };
+
+    return runTests (tests, NUM_TESTS (tests));
+}
@@ -35,14 +35,19 @@
 #include "error-types.h"
 #include "fdlimit.h"
 #include "file.h"
+#include "io-queue.h"
 #include "list.h"
 #include "log.h"
+#include "metainfo.h" /* tr_metainfoParse () */
 #include "net.h"
 #include "peer-io.h"
+#include "peer-io-loops.h"
 #include "peer-mgr.h"
 #include "platform.h" /* tr_lock, tr_getTorrentDir () */
 #include "platform-quota.h" /* tr_device_info_free() */
 #include "port-forwarding.h"
+#include "resume.h" /* tr_torrentReadResume () */
+#include "resume-db.h"
 #include "rpc-server.h"
 #include "session.h"
 #include "stats.h"
@@ -63,9 +68,11 @@ enum
 #ifdef TR_LIGHTWEIGHT
   DEFAULT_CACHE_SIZE_MB = 2,
   DEFAULT_PREFETCH_ENABLED = false,
+  DEFAULT_VERIFY_THREADS = 1,
 #else
   DEFAULT_CACHE_SIZE_MB = 4,
   DEFAULT_PREFETCH_ENABLED = true,
+  DEFAULT_VERIFY_THREADS = 2,
 #endif
   SAVE_INTERVAL_SECS = 360
 };
@@ -316,7 +323,7 @@ tr_sessionGetDefaultSettings (tr_variant * d)
 {
   assert (tr_variantIsDict (d));
 
-  tr_variantDictReserve (d, 63);
+  tr_variantDictReserve (d, 65);
   tr_variantDictAddBool (d, TR_KEY_blocklist_enabled,               false);
   tr_variantDictAddStr  (d, TR_KEY_blocklist_url,                   "http://www.example.com/blocklist");
   tr_variantDictAddInt  (d, TR_KEY_cache_size_mb,                   DEFAULT_CACHE_SIZE_MB);
@@ -376,6 +383,10 @@ tr_sessionGetDefaultSettings (tr_variant * d)
   tr_variantDictAddBool (d, TR_KEY_speed_limit_up_enabled,          false);
   tr_variantDictAddInt  (d, TR_KEY_umask,                           022);
   tr_variantDictAddInt  (d, TR_KEY_upload_slots_per_torrent,        14);
+  tr_variantDictAddInt  (d, TR_KEY_verify_threads,                  DEFAULT_VERIFY_THREADS);
+  tr_variantDictAddInt  (d, TR_KEY_verify_io_limit_mb,              0);
+  tr_variantDictAddInt  (d, TR_KEY_peer_io_threads,                 0);
+  tr_variantDictAddBool (d, TR_KEY_resume_database_enabled,         false);
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv4,               TR_DEFAULT_BIND_ADDRESS_IPV4);
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv6,               TR_DEFAULT_BIND_ADDRESS_IPV6);
   tr_variantDictAddBool (d, TR_KEY_start_added_torrents,            true);
@@ -387,7 +398,7 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
 {
   assert (tr_variantIsDict (d));
 
-  tr_variantDictReserve (d, 63);
+  tr_variantDictReserve (d, 65);
   tr_variantDictAddBool (d, TR_KEY_blocklist_enabled,            tr_blocklistIsEnabled (s));
   tr_variantDictAddStr  (d, TR_KEY_blocklist_url,                tr_blocklistGetURL (s));
   tr_variantDictAddInt  (d, TR_KEY_cache_size_mb,                tr_sessionGetCacheLimit_MB (s));
@@ -448,6 +459,10 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
   tr_variantDictAddBool (d, TR_KEY_speed_limit_up_enabled,       tr_sessionIsSpeedLimited (s, TR_UP));
   tr_variantDictAddInt  (d, TR_KEY_umask,                        s->umask);
   tr_variantDictAddInt  (d, TR_KEY_upload_slots_per_torrent,     s->uploadSlotsPerTorrent);
+  tr_variantDictAddInt  (d, TR_KEY_verify_threads,               tr_sessionGetVerifyThreads (s));
+  tr_variantDictAddInt  (d, TR_KEY_verify_io_limit_mb,           tr_sessionGetVerifyIOLimit_MB (s));
+  tr_variantDictAddInt  (d, TR_KEY_peer_io_threads,              s->peerIoThreads);
+  tr_variantDictAddBool (d, TR_KEY_resume_database_enabled,      tr_sessionIsResumeDatabaseEnabled (s));
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv4,            tr_address_to_string (&s->public_ipv4->addr));
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv6,            tr_address_to_string (&s->public_ipv6->addr));
   tr_variantDictAddBool (d, TR_KEY_start_added_torrents,         !tr_sessionGetPaused (s));
@@ -559,6 +574,9 @@ onSaveTimer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vsession)
   while ((tor = tr_torrentNext (session, tor)))
     tr_torrentSave (tor);
 
+  if (session->resumeDb != NULL)
+    tr_resumeDbMaybeCompact (session->resumeDb);
+
   tr_statsSaveDirty (session);
 
   tr_timerAdd (session->saveTimer, SAVE_INTERVAL_SECS, 0);
@@ -592,12 +610,15 @@ tr_sessionInit (const char * configDir,
 
   tr_timeUpdate (time (NULL));
 
+  /* before any of the session's threads can create quarks */
+  tr_quark_init_lock ();
+
   /* initialize the bare skeleton of the session object */
   session = tr_new0 (tr_session, 1);
   session->udp_socket = TR_BAD_SOCKET;
   session->udp6_socket = TR_BAD_SOCKET;
   session->lock = tr_lockNew ();
-  session->cache = tr_cacheNew (1024*1024*2);
+  session->cache = tr_cacheNew (session, 1024*1024*2);
   session->magicNumber = SESSION_MAGIC_NUMBER;
   tr_bandwidthConstruct (&session->bandwidth, session, NULL);
   tr_variantInitList (&session->removedTorrents, 0);
@@ -633,6 +654,7 @@ onNowTimer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vsession)
   const int min = 100;
   const int max = 999999;
   struct timeval tv;
+  uint64_t now_msec;
   tr_torrent * tor = NULL;
   tr_session * session = vsession;
   const time_t now = time (NULL);
@@ -651,6 +673,7 @@ onNowTimer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vsession)
   if (session->turtle.isClockEnabled)
     turtleCheckClock (session, &session->turtle);
 
+  now_msec = tr_time_msec ();
   while ((tor = tr_torrentNext (session, tor)))
     {
       if (tor->isRunning)
@@ -660,6 +683,8 @@ onNowTimer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vsession)
           else
             ++tor->secondsDownloading;
         }
+
+      tr_torrentCheckStatsChanged (tor, now, now_msec);
     }
 
   /**
@@ -682,6 +707,7 @@ static void loadBlocklists (tr_session * session);
 static void
 tr_sessionInitImpl (void * vdata)
 {
+  int64_t i;
   tr_variant settings;
   struct init_data * data = vdata;
   tr_variant * clientSettings = data->clientSettings;
@@ -712,6 +738,17 @@ tr_sessionInitImpl (void * vdata)
 
   session->peerMgr = tr_peerMgrNew (session);
 
+  session->ioQueue = tr_ioQueueNew (session->event_base);
+
+  /* these have to be ready before any peers connect, and they can't
+     come and go while peers are connected, so this is only read here */
+  if (tr_variantDictFindInt (&settings, TR_KEY_peer_io_threads, &i) && (i > 0))
+    {
+      session->ioLoops = tr_ioLoopsNew (session, i);
+      if (session->ioLoops != NULL)
+        session->peerIoThreads = i;
+    }
+
   session->shared = tr_sharedInit (session);
 
   /**
@@ -812,6 +849,12 @@ sessionSetImpl (void * vdata)
     tr_sessionSetDeleteSource (session, boolVal);
   if (tr_variantDictFindInt (settings, TR_KEY_peer_id_ttl_hours, &i))
     session->peer_id_ttl_hours = i;
+  if (tr_variantDictFindInt (settings, TR_KEY_verify_threads, &i))
+    tr_sessionSetVerifyThreads (session, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_verify_io_limit_mb, &i))
+    tr_sessionSetVerifyIOLimit_MB (session, i);
+  if (tr_variantDictFindBool (settings, TR_KEY_resume_database_enabled, &boolVal))
+    tr_sessionSetResumeDatabaseEnabled (session, boolVal);
 
   /* torrent queues */
   if (tr_variantDictFindInt (settings, TR_KEY_queue_stalled_minutes, &i))
@@ -1819,6 +1862,13 @@ sessionCloseImplStart (tr_session * session)
     tr_torrentFree (torrents[i]);
   tr_free (torrents);
 
+  if (session->resumeDb != NULL)
+    {
+      tr_resumeDbMaybeCompact (session->resumeDb);
+      tr_resumeDbClose (session->resumeDb);
+      session->resumeDb = NULL;
+    }
+
   /* Close the announcer *after* closing the torrents
      so that all the &event=stopped messages will be
      queued to be sent by tr_announcerClose () */
@@ -1828,6 +1878,10 @@ sessionCloseImplStart (tr_session * session)
      it won't be idle until the announce events are sent... */
   tr_webClose (session, TR_WEB_CLOSE_WHEN_IDLE);
 
+  /* the reads in flight are holding cache blocks */
+  tr_ioQueueFree (session->ioQueue);
+  session->ioQueue = NULL;
+
   tr_cacheFree (session->cache);
   session->cache = NULL;
 
@@ -1873,6 +1927,10 @@ sessionCloseImplFinish (tr_session * session)
   tr_statsClose (session);
   tr_peerMgrFree (session->peerMgr);
 
+  /* this goes *after* freeing the peers, whose sockets the loops hold */
+  tr_ioLoopsFree (session->ioLoops);
+  session->ioLoops = NULL;
+
   closeBlocklists (session);
 
   tr_fdClose (session);
@@ -1962,6 +2020,9 @@ tr_sessionClose (tr_session * session)
       tr_free (session->metainfoLookup);
     }
   tr_device_info_free (session->downloadDir);
+  tr_free (session->torrentsById);
+  tr_free (session->torrentsByHash);
+  tr_free (session->torrentsByObfuscatedHash);
   tr_free (session->torrentDoneScript);
   tr_free (session->configDir);
   tr_free (session->resumeDir);
@@ -1972,30 +2033,201 @@ tr_sessionClose (tr_session * session)
   tr_free (session);
 }
 
-struct sessionLoadTorrentsData
+/***
+****  Loading the torrents at startup.
+****
+****  Reading and parsing the .torrent and .resume files is most of the
+****  work and doesn't touch the session, so it's spread over worker
+****  threads. The parsed torrents are handed to the event thread in
+****  batches, where they're created and added to the session.
+***/
+
+enum
+{
+#ifdef TR_LIGHTWEIGHT
+  LOAD_TORRENTS_THREADS = 1,
+#else
+  LOAD_TORRENTS_THREADS = 4,
+#endif
+
+  /* how many parsed torrents to hand to the event thread at a time */
+  LOAD_TORRENTS_BATCH_SIZE = 64
+};
+
+struct parsed_torrent
+{
+  tr_ctor * ctor; /* holds the metainfo */
+  tr_info info;
+  bool hasInfo;
+  size_t infoDictLength;
+  tr_variant resume;
+  bool hasResume;
+};
+
+struct load_torrents_job
 {
   tr_session * session;
   tr_ctor * ctor;
-  int * setmeCount;
-  tr_torrent ** torrents;
-  bool done;
+
+  char ** paths;
+  int pathCount;
+
+  tr_lock * lock;
+  int nextPath;          /* guarded by lock */
+  int workersRunning;    /* guarded by lock */
+  int batchesPending;    /* guarded by lock */
+  uint64_t parseMsec;    /* guarded by lock; summed over the workers */
+
+  /* only touched in the event thread */
+  tr_list * torrents;
+  int torrentCount;
+  uint64_t attachMsec;
+};
+
+struct load_torrents_batch
+{
+  struct load_torrents_job * job;
+  struct parsed_torrent items[LOAD_TORRENTS_BATCH_SIZE];
+  int count;
 };
 
+static bool
+parseTorrent (const tr_session * session, const char * path, struct parsed_torrent * setme)
+{
+  const tr_variant * metainfo;
+
+  memset (setme, 0, sizeof (struct parsed_torrent));
+  setme->ctor = tr_ctorNew (NULL);
+
+  if ((tr_ctorSetMetainfoFromFile (setme->ctor, path) != 0)
+      || !tr_ctorGetMetainfo (setme->ctor, &metainfo))
+    {
+      tr_ctorFree (setme->ctor);
+      return false;
+    }
+
+  if (!tr_metainfoParse (session, metainfo, &setme->info, &setme->hasInfo, &setme->infoDictLength))
+    {
+      tr_ctorFree (setme->ctor);
+      return false;
+    }
+
+  if (setme->hasInfo && !tr_getBlockSize (setme->info.pieceSize))
+    {
+      tr_metainfoFree (&setme->info);
+      tr_ctorFree (setme->ctor);
+      return false;
+    }
+
+  setme->hasResume = tr_torrentReadResume (session, &setme->info, &setme->resume);
+  return true;
+}
+
+/* runs in the event thread */
 static void
-sessionLoadTorrents (void * vdata)
+attachTorrents (void * vbatch)
 {
   int i;
+  struct load_torrents_batch * batch = vbatch;
+  struct load_torrents_job * job = batch->job;
+  const uint64_t begin = tr_time_msec ();
+
+  for (i=0; i<batch->count; ++i)
+    {
+      tr_torrent * tor;
+      struct parsed_torrent * parsed = &batch->items[i];
+
+      tr_ctorTakeMetainfo (job->ctor, parsed->ctor);
+      tr_ctorSetResume (job->ctor, parsed->hasResume ? &parsed->resume : NULL);
+
+      tor = tr_torrentNewFromInfo (job->ctor, &parsed->info, parsed->hasInfo, parsed->infoDictLength, NULL);
+      if (tor != NULL)
+        {
+          tr_list_prepend (&job->torrents, tor);
+          ++job->torrentCount;
+        }
+
+      tr_ctorSetResume (job->ctor, NULL);
+      tr_ctorFree (parsed->ctor);
+    }
+
+  job->attachMsec += tr_time_msec () - begin;
+  tr_free (batch);
+
+  tr_lockLock (job->lock);
+  --job->batchesPending;
+  tr_lockUnlock (job->lock);
+}
+
+static void
+sendBatch (struct load_torrents_job * job, struct load_torrents_batch * batch)
+{
+  tr_lockLock (job->lock);
+  ++job->batchesPending;
+  tr_lockUnlock (job->lock);
+
+  tr_runInEventThread (job->session, attachTorrents, batch);
+}
+
+static void
+loadTorrentsWorker (void * vjob)
+{
+  struct load_torrents_job * job = vjob;
+  struct load_torrents_batch * batch = NULL;
+  uint64_t msec = 0;
+
+  for (;;)
+    {
+      int i;
+      uint64_t begin;
+
+      tr_lockLock (job->lock);
+      i = job->nextPath++;
+      tr_lockUnlock (job->lock);
+
+      if (i >= job->pathCount)
+        break;
+
+      if (batch == NULL)
+        {
+          batch = tr_new (struct load_torrents_batch, 1);
+          batch->job = job;
+          batch->count = 0;
+        }
+
+      begin = tr_time_msec ();
+      if (parseTorrent (job->session, job->paths[i], &batch->items[batch->count]))
+        ++batch->count;
+      msec += tr_time_msec () - begin;
+
+      if (batch->count == LOAD_TORRENTS_BATCH_SIZE)
+        {
+          sendBatch (job, batch);
+          batch = NULL;
+        }
+    }
+
+  if (batch != NULL && batch->count > 0)
+    sendBatch (job, batch);
+  else
+    tr_free (batch);
+
+  tr_lockLock (job->lock);
+  job->parseMsec += msec;
+  --job->workersRunning;
+  tr_lockUnlock (job->lock);
+}
+
+static char **
+getTorrentPaths (const tr_session * session, int * setmeCount)
+{
   int n = 0;
+  tr_list * l;
+  tr_list * list = NULL;
   tr_sys_path_info info;
   tr_sys_dir_t odir = NULL;
-  tr_list * l = NULL;
-  tr_list * list = NULL;
-  struct sessionLoadTorrentsData * data = vdata;
-  const char * dirname = tr_getTorrentDir (data->session);
-
-  assert (tr_isSession (data->session));
-
-  tr_ctorSetSave (data->ctor, false); /* since we already have them */
+  const char * dirname = tr_getTorrentDir (session);
+  char ** paths;
 
   if (tr_sys_path_get_info (dirname, 0, &info, NULL) &&
       info.type == TR_SYS_PATH_IS_DIRECTORY &&
@@ -2006,34 +2238,20 @@ sessionLoadTorrents (void * vdata)
         {
           if (tr_str_has_suffix (name, ".torrent"))
             {
-              tr_torrent * tor;
-              char * path = tr_buildPath (dirname, name, NULL);
-              tr_ctorSetMetainfoFromFile (data->ctor, path);
-              if ((tor = tr_torrentNew (data->ctor, NULL, NULL)))
-                {
-                  tr_list_prepend (&list, tor);
-                  ++n;
-                }
-              tr_free (path);
+              tr_list_prepend (&list, tr_buildPath (dirname, name, NULL));
+              ++n;
             }
         }
       tr_sys_dir_close (odir, NULL);
     }
 
-  data->torrents = tr_new (tr_torrent *, n);
-  for (i=0, l=list; l!=NULL; l=l->next)
-    data->torrents[i++] = (tr_torrent*) l->data;
-  assert (i == n);
-
-    tr_list_free (&list, NULL);
-
-  if (n)
-    tr_logAddInfo (_("Loaded %d torrents"), n);
+  paths = tr_new (char *, n);
+  for (n=0, l=list; l!=NULL; l=l->next)
+    paths[n++] = l->data;
+  tr_list_free (&list, NULL);
 
-  if (data->setmeCount)
-    *data->setmeCount = n;
-
-  data->done = true;
+  *setmeCount = n;
+  return paths;
 }
 
 tr_torrent **
@@ -2041,19 +2259,72 @@ tr_sessionLoadTorrents (tr_session * session,
                         tr_ctor    * ctor,
                         int        * setmeCount)
 {
-  struct sessionLoadTorrentsData data;
+  int i;
+  int n;
+  int threadCount;
+  tr_list * l;
+  uint64_t scanMsec;
+  tr_torrent ** torrents;
+  struct load_torrents_job job;
+  const uint64_t begin = tr_time_msec ();
 
-  data.session = session;
-  data.ctor = ctor;
-  data.setmeCount = setmeCount;
-  data.torrents = NULL;
-  data.done = false;
+  assert (tr_isSession (session));
+  assert (!tr_amInEventThread (session));
 
-  tr_runInEventThread (session, sessionLoadTorrents, &data);
-  while (!data.done)
-    tr_wait_msec (100);
+  tr_ctorSetSave (ctor, false); /* since we already have them */
 
-  return data.torrents;
+  memset (&job, 0, sizeof (job));
+  job.session = session;
+  job.ctor = ctor;
+  job.lock = tr_lockNew ();
+  job.paths = getTorrentPaths (session, &job.pathCount);
+  scanMsec = tr_time_msec () - begin;
+
+  /* this thread would be waiting anyway, so it's one of the workers too */
+  threadCount = 1 + MIN (LOAD_TORRENTS_THREADS, job.pathCount / LOAD_TORRENTS_BATCH_SIZE);
+  job.workersRunning = threadCount;
+  for (i=1; i<threadCount; ++i)
+    tr_threadNew (loadTorrentsWorker, &job);
+  loadTorrentsWorker (&job);
+
+  for (;;)
+    {
+      bool done;
+
+      tr_lockLock (job.lock);
+      done = job.workersRunning == 0 && job.batchesPending == 0;
+      tr_lockUnlock (job.lock);
+
+      if (done)
+        break;
+
+      tr_wait_msec (10);
+    }
+
+  n = job.torrentCount;
+  torrents = tr_new (tr_torrent *, n);
+  for (i=0, l=job.torrents; l!=NULL; l=l->next)
+    torrents[i++] = l->data;
+  assert (i == n);
+  tr_list_free (&job.torrents, NULL);
+
+  if (n)
+    tr_logAddInfo (_("Loaded %d torrents"), n);
+
+  tr_logAddDebug ("Loaded %d of %d torrent files in %"PRIu64" msec with %d threads"
+                  " (scan %"PRIu64" msec, parse %"PRIu64" msec total, attach %"PRIu64" msec)",
+                  n, job.pathCount, tr_time_msec () - begin, threadCount,
+                  scanMsec, job.parseMsec, job.attachMsec);
+
+  for (i=0; i<job.pathCount; ++i)
+    tr_free (job.paths[i]);
+  tr_free (job.paths);
+  tr_lockFree (job.lock);
+
+  if (setmeCount)
+    *setmeCount = n;
+
+  return torrents;
 }
 
 /***
@@ -2220,6 +2491,95 @@ tr_sessionGetCacheLimit_MB (const tr_session * session)
 ****
 ***/
 
+void
+tr_sessionSetVerifyThreads (tr_session * session, int count)
+{
+  assert (tr_isSession (session));
+
+  session->verifyThreads = MAX (1, count);
+}
+
+int
+tr_sessionGetVerifyThreads (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->verifyThreads;
+}
+
+void
+tr_sessionSetVerifyIOLimit_MB (tr_session * session, int mb)
+{
+  assert (tr_isSession (session));
+
+  session->verifyIOLimitMB = MAX (0, mb);
+}
+
+int
+tr_sessionGetVerifyIOLimit_MB (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->verifyIOLimitMB;
+}
+
+/***
+****
+***/
+
+void
+tr_sessionSetResumeDatabaseEnabled (tr_session * session, bool enabled)
+{
+  char * filename;
+  tr_torrent * tor = NULL;
+
+  assert (tr_isSession (session));
+
+  if (enabled == (session->resumeDb != NULL))
+    return;
+
+  tr_sessionLock (session);
+
+  filename = tr_buildPath (session->configDir, "resume.db", NULL);
+
+  if (enabled)
+    {
+      session->resumeDb = tr_resumeDbOpen (filename);
+
+      /* if it can't be opened, keep using the .resume files */
+      if (session->resumeDb != NULL)
+        while ((tor = tr_torrentNext (session, tor)))
+          tr_torrentSaveResume (tor);
+    }
+  else
+    {
+      tr_resume_db * db = session->resumeDb;
+
+      /* write the .resume files before the database goes away */
+      session->resumeDb = NULL;
+      while ((tor = tr_torrentNext (session, tor)))
+        tr_torrentSaveResume (tor);
+
+      tr_resumeDbClose (db);
+      tr_sys_path_remove (filename, NULL);
+    }
+
+  tr_free (filename);
+  tr_sessionUnlock (session);
+}
+
+bool
+tr_sessionIsResumeDatabaseEnabled (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->resumeDb != NULL;
+}
+
+/***
+****
+***/
+
 struct port_forwarding_data
 {
   bool enabled;
@@ -52,6 +52,8 @@ struct tr_announcer_udp;
 struct tr_bindsockets;
 struct tr_cache;
 struct tr_fdInfo;
+struct tr_io_queue;
+struct tr_resume_db;
 struct tr_device_info;
 
 struct tr_turtle_info
@@ -147,6 +149,17 @@ struct tr_session
 
     int                          uploadSlotsPerTorrent;
 
+    int                          verifyThreads;
+    int                          verifyIOLimitMB;
+
+    /* if non-NULL, TCP peers' sockets are read and written on these threads.
+       their number comes from the settings and can't change while running. */
+    int                          peerIoThreads;
+    struct tr_io_loops         * ioLoops;
+
+    /* if non-NULL, resume state is kept here instead of in .resume files */
+    struct tr_resume_db        * resumeDb;
+
     /* The UDP sockets used for the DHT and uTP. */
     tr_port                      udp_port;
     tr_socket_t                  udp_socket;
@@ -154,6 +167,7 @@ struct tr_session
     unsigned char *              udp6_bound;
     struct event                 *udp_event;
     struct event                 *udp6_event;
+    struct tr_udp_batch          *udp_batch;
 
     /* The open port on the local machine for incoming peer requests */
     tr_port                      private_peer_port;
@@ -175,6 +189,16 @@ struct tr_session
     int                          torrentCount;
     tr_torrent *                 torrentList;
 
+    /* hash tables over torrentList for the tr_torrentFindFrom* () functions.
+       torrentBucketCount is a power of two, or zero while there are no torrents */
+    size_t                       torrentBucketCount;
+    tr_torrent **                torrentsById;
+    tr_torrent **                torrentsByHash;
+    tr_torrent **                torrentsByObfuscatedHash;
+
+    /* incremented whenever a torrent changes. See tr_torrentMarkChanged () */
+    uint64_t                     revision;
+
     char *                       torrentDoneScript;
 
     char *                       configDir;
@@ -192,6 +216,9 @@ struct tr_session
 
     struct tr_cache *            cache;
 
+    /* asynchronous disk reads, or NULL to use blocking ones */
+    struct tr_io_queue *         ioQueue;
+
     struct tr_lock *             lock;
 
     struct tr_web *              web;
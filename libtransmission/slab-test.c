@@ -0,0 +1,127 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memset () */
+
+#include "transmission.h"
+#include "crypto-utils.h" /* tr_rand_int_weak () */
+#include "slab.h"
+#include "utils.h" /* tr_new0 () */
+
+#include "libtransmission-test.h"
+
+static int
+test_basic (void)
+{
+  int i;
+  uint8_t * slots[10];
+  tr_slab * slab = tr_slabNew (100, 4);
+
+  check_int_eq (0, tr_slabGetUsed (slab));
+  check_int_eq (0, tr_slabGetCapacity (slab));
+
+  /* slots are distinct and don't overlap */
+  for (i=0; i<10; ++i)
+    {
+      slots[i] = tr_slabAlloc (slab);
+      memset (slots[i], i, 100);
+    }
+  for (i=0; i<10; ++i)
+    {
+      check_int_eq (i, slots[i][0]);
+      check_int_eq (i, slots[i][99]);
+    }
+  check_int_eq (10, tr_slabGetUsed (slab));
+  check_int_eq (12, tr_slabGetCapacity (slab));
+
+  /* a released slot gets reused */
+  tr_slabRelease (slab, slots[5]);
+  check_int_eq (9, tr_slabGetUsed (slab));
+  check_ptr_eq (slots[5], tr_slabAlloc (slab));
+
+  /* a slot with two references survives the first release */
+  tr_slabRef (slab, slots[0]);
+  tr_slabRelease (slab, slots[0]);
+  check_int_eq (10, tr_slabGetUsed (slab));
+  tr_slabRelease (slab, slots[0]);
+  check_int_eq (9, tr_slabGetUsed (slab));
+
+  /* with no limit, empty chunks are given back right away */
+  for (i=1; i<4; ++i)
+    tr_slabRelease (slab, slots[i]);
+  check_int_eq (8, tr_slabGetCapacity (slab));
+
+  /* but chunks within the limit are kept */
+  tr_slabSetLimit (slab, 8);
+  for (i=4; i<8; ++i)
+    tr_slabRelease (slab, slots[i]);
+  check_int_eq (8, tr_slabGetCapacity (slab));
+
+  /* ...until the limit shrinks */
+  tr_slabSetLimit (slab, 0);
+  check_int_eq (4, tr_slabGetCapacity (slab));
+
+  for (i=8; i<10; ++i)
+    tr_slabRelease (slab, slots[i]);
+  check_int_eq (0, tr_slabGetUsed (slab));
+  check_int_eq (0, tr_slabGetCapacity (slab));
+
+  tr_slabFree (slab);
+  return 0;
+}
+
+static int
+test_random (void)
+{
+  int i;
+  const int n = 500;
+  int * owner = tr_new0 (int, n);
+  uint8_t ** slots = tr_new0 (uint8_t *, n);
+  tr_slab * slab = tr_slabNew (sizeof (int), 16);
+
+  tr_slabSetLimit (slab, 64);
+
+  for (i=0; i<20000; ++i)
+    {
+      const int j = tr_rand_int_weak (n);
+
+      if (slots[j] == NULL)
+        {
+          slots[j] = tr_slabAlloc (slab);
+          owner[j] = tr_rand_int_weak (1000000);
+          memcpy (slots[j], &owner[j], sizeof (int));
+        }
+      else
+        {
+          int val;
+          memcpy (&val, slots[j], sizeof (int));
+          check_int_eq (owner[j], val);
+          tr_slabRelease (slab, slots[j]);
+          slots[j] = NULL;
+        }
+    }
+
+  for (i=0; i<n; ++i)
+    tr_slabRelease (slab, slots[i]);
+  check_int_eq (0, tr_slabGetUsed (slab));
+  check (tr_slabGetCapacity (slab) <= 64);
+
+  tr_slabFree (slab);
+  tr_free (slots);
+  tr_free (owner);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_basic,
+                             test_random };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -0,0 +1,256 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <assert.h>
+
+#include "transmission.h"
+#include "ptrarray.h"
+#include "slab.h"
+#include "utils.h"
+
+struct slab_chunk
+{
+  uint8_t * base;
+
+  /* a stack of the indices of this chunk's free slots */
+  uint16_t * freeSlots;
+  int freeCount;
+
+  uint16_t * refCounts;
+};
+
+struct tr_slab
+{
+  size_t slotSize;
+  int slotsPerChunk;
+
+  tr_ptrArray chunks;    /* struct slab_chunk, sorted by base */
+  tr_ptrArray available; /* struct slab_chunk with free slots */
+
+  int used;
+  int capacity;
+  int maxSlots;
+};
+
+/***
+****
+***/
+
+static int
+compareChunks (const void * va, const void * vb)
+{
+  const struct slab_chunk * a = va;
+  const struct slab_chunk * b = vb;
+
+  if (a->base != b->base)
+    return a->base < b->base ? -1 : 1;
+
+  return 0;
+}
+
+static struct slab_chunk *
+chunkNew (tr_slab * slab)
+{
+  int i;
+  struct slab_chunk * chunk = tr_new (struct slab_chunk, 1);
+
+  chunk->base = tr_valloc (slab->slotSize * slab->slotsPerChunk);
+  chunk->freeSlots = tr_new (uint16_t, slab->slotsPerChunk);
+  chunk->refCounts = tr_new0 (uint16_t, slab->slotsPerChunk);
+  chunk->freeCount = slab->slotsPerChunk;
+
+  /* hand out the lower slots first */
+  for (i=0; i<slab->slotsPerChunk; ++i)
+    chunk->freeSlots[i] = slab->slotsPerChunk - 1 - i;
+
+  tr_ptrArrayInsertSorted (&slab->chunks, chunk, compareChunks);
+  tr_ptrArrayAppend (&slab->available, chunk);
+  slab->capacity += slab->slotsPerChunk;
+
+  return chunk;
+}
+
+static void
+chunkFree (tr_slab * slab, struct slab_chunk * chunk)
+{
+  int i;
+  const int n = tr_ptrArraySize (&slab->available);
+  void ** available = tr_ptrArrayBase (&slab->available);
+
+  assert (chunk->freeCount == slab->slotsPerChunk);
+
+  for (i=0; i<n; ++i)
+    if (available[i] == chunk)
+      break;
+  assert (i < n);
+  tr_ptrArrayRemove (&slab->available, i);
+  tr_ptrArrayRemoveSortedPointer (&slab->chunks, chunk, compareChunks);
+  slab->capacity -= slab->slotsPerChunk;
+
+  tr_free (chunk->refCounts);
+  tr_free (chunk->freeSlots);
+  tr_free (chunk->base);
+  tr_free (chunk);
+}
+
+/* find the chunk that a slot was carved from */
+static struct slab_chunk *
+findChunk (const tr_slab * slab, const uint8_t * slot)
+{
+  int lo = 0;
+  int hi = tr_ptrArraySize (&slab->chunks);
+  struct slab_chunk * const * chunks = (struct slab_chunk * const *) tr_ptrArrayBase (&slab->chunks);
+  const size_t chunkSize = slab->slotSize * slab->slotsPerChunk;
+
+  while (lo < hi)
+    {
+      const int mid = lo + (hi - lo) / 2;
+      struct slab_chunk * chunk = chunks[mid];
+
+      if (slot < chunk->base)
+        hi = mid;
+      else if (slot >= chunk->base + chunkSize)
+        lo = mid + 1;
+      else
+        return chunk;
+    }
+
+  return NULL;
+}
+
+/***
+****
+***/
+
+tr_slab *
+tr_slabNew (size_t slotSize, int slotsPerChunk)
+{
+  tr_slab * slab;
+
+  assert (slotSize > 0);
+  assert (0 < slotsPerChunk && slotsPerChunk <= UINT16_MAX);
+
+  slab = tr_new0 (tr_slab, 1);
+  slab->slotSize = slotSize;
+  slab->slotsPerChunk = slotsPerChunk;
+  slab->chunks = TR_PTR_ARRAY_INIT;
+  slab->available = TR_PTR_ARRAY_INIT;
+  return slab;
+}
+
+void
+tr_slabFree (tr_slab * slab)
+{
+  assert (slab->used == 0);
+
+  while (!tr_ptrArrayEmpty (&slab->chunks))
+    chunkFree (slab, tr_ptrArrayBack (&slab->chunks));
+
+  tr_ptrArrayDestruct (&slab->chunks, NULL);
+  tr_ptrArrayDestruct (&slab->available, NULL);
+  tr_free (slab);
+}
+
+void *
+tr_slabAlloc (tr_slab * slab)
+{
+  struct slab_chunk * chunk;
+  int index;
+
+  if (tr_ptrArrayEmpty (&slab->available))
+    chunkNew (slab);
+
+  chunk = tr_ptrArrayBack (&slab->available);
+  index = chunk->freeSlots[--chunk->freeCount];
+  if (chunk->freeCount == 0)
+    tr_ptrArrayPop (&slab->available);
+
+  assert (chunk->refCounts[index] == 0);
+  chunk->refCounts[index] = 1;
+  ++slab->used;
+  return chunk->base + index * slab->slotSize;
+}
+
+void
+tr_slabRef (tr_slab * slab, void * vslot)
+{
+  uint8_t * slot = vslot;
+  struct slab_chunk * chunk = findChunk (slab, slot);
+  int index;
+
+  assert (chunk != NULL);
+  assert ((slot - chunk->base) % slab->slotSize == 0);
+
+  index = (slot - chunk->base) / slab->slotSize;
+  assert (0 < chunk->refCounts[index] && chunk->refCounts[index] < UINT16_MAX);
+  ++chunk->refCounts[index];
+}
+
+void
+tr_slabRelease (tr_slab * slab, void * vslot)
+{
+  uint8_t * slot = vslot;
+  struct slab_chunk * chunk;
+  int index;
+
+  if (slot == NULL)
+    return;
+
+  chunk = findChunk (slab, slot);
+  assert (chunk != NULL);
+  assert ((slot - chunk->base) % slab->slotSize == 0);
+
+  index = (slot - chunk->base) / slab->slotSize;
+  assert (chunk->refCounts[index] > 0);
+  if (--chunk->refCounts[index] > 0)
+    return;
+
+  chunk->freeSlots[chunk->freeCount++] = index;
+  if (chunk->freeCount == 1)
+    tr_ptrArrayAppend (&slab->available, chunk);
+
+  --slab->used;
+
+  if ((chunk->freeCount == slab->slotsPerChunk) && (slab->capacity > slab->maxSlots))
+    chunkFree (slab, chunk);
+}
+
+void
+tr_slabSetLimit (tr_slab * slab, int maxSlots)
+{
+  int i;
+
+  slab->maxSlots = maxSlots;
+
+  /* give back any empty chunks that we no longer want */
+  for (i=tr_ptrArraySize (&slab->available)-1; i>=0 && slab->capacity>slab->maxSlots; --i)
+    {
+      struct slab_chunk * chunk = tr_ptrArrayNth (&slab->available, i);
+
+      if (chunk->freeCount == slab->slotsPerChunk)
+        chunkFree (slab, chunk);
+    }
+}
+
+size_t
+tr_slabGetSlotSize (const tr_slab * slab)
+{
+  return slab->slotSize;
+}
+
+int
+tr_slabGetUsed (const tr_slab * slab)
+{
+  return slab->used;
+}
+
+int
+tr_slabGetCapacity (const tr_slab * slab)
+{
+  return slab->capacity;
+}
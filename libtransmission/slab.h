@@ -0,0 +1,63 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#pragma once
+
+/**
+ * A fixed-size slab allocator.
+ *
+ * Slots are carved out of page-aligned chunks, so a steady stream of
+ * same-sized allocations (such as 16 KiB piece blocks) reuses the same
+ * memory instead of churning through malloc () and fragmenting the heap.
+ *
+ * Slots are reference-counted so that they can be shared, e.g. with an
+ * evbuffer via evbuffer_add_reference ().
+ *
+ * This isn't thread-safe. Other threads may use a slot's contents,
+ * but only one thread may allocate, ref, and release.
+ */
+
+typedef struct tr_slab tr_slab;
+
+/**
+ * @param slotSize the size of each slot, in bytes
+ * @param slotsPerChunk how many slots to allocate from the system at a time
+ */
+tr_slab * tr_slabNew (size_t slotSize, int slotsPerChunk);
+
+/** @brief free the slab. All of its slots must have been released. */
+void tr_slabFree (tr_slab * slab);
+
+/** @brief get a slot. This never fails. */
+void * tr_slabAlloc (tr_slab * slab);
+
+/** @brief add a reference to a slot. Slots start out with one. */
+void tr_slabRef (tr_slab * slab, void * slot);
+
+/** @brief drop a reference to a slot, returning it to the slab if it was the last one */
+void tr_slabRelease (tr_slab * slab, void * slot);
+
+/**
+ * @brief set how many slots' worth of chunks to keep around.
+ *
+ * The slab still grows past this as needed, but once it's bigger than
+ * this, chunks that become empty are given back to the system.
+ */
+void tr_slabSetLimit (tr_slab * slab, int maxSlots);
+
+size_t tr_slabGetSlotSize (const tr_slab * slab);
+
+/** @brief how many slots are currently handed out */
+int tr_slabGetUsed (const tr_slab * slab);
+
+/** @brief how many slots the slab has allocated from the system */
+int tr_slabGetCapacity (const tr_slab * slab);
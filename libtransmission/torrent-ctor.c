@@ -39,8 +39,13 @@ struct tr_ctor
     bool                    isSet_metainfo;
     bool                    isSet_delete;
     tr_variant              metainfo;
+    uint8_t *               metainfoBytes; /* metainfo's strings point here */
+    tr_variant_arena *      metainfoArena; /* which holds metainfo's tree */
     char *                  sourceFile;
 
+    bool                    isSet_resume;
+    tr_variant              resume;
+
     struct optional_args    optionalArgs[2];
 
     char                  * cookies;
@@ -76,23 +81,66 @@ clearMetainfo (tr_ctor * ctor)
     if (ctor->isSet_metainfo)
     {
         ctor->isSet_metainfo = false;
-        tr_variantFree (&ctor->metainfo);
+        tr_variantArenaFree (ctor->metainfoArena);
+        tr_free (ctor->metainfoBytes);
+        ctor->metainfoArena = NULL;
+        ctor->metainfoBytes = NULL;
     }
 
     setSourceFile (ctor, NULL);
 }
 
+/* parse `metainfo' in place, without copying its strings. Takes ownership */
+static int
+setMetainfoBuffer (tr_ctor * ctor,
+                   uint8_t * metainfo,
+                   size_t    len)
+{
+    int err;
+    tr_variant_arena * arena = tr_variantArenaNew ();
+
+    clearMetainfo (ctor);
+    err = tr_variantFromBencBorrowed (&ctor->metainfo, metainfo, len, arena);
+    if (err)
+    {
+        tr_variantArenaFree (arena);
+        tr_free (metainfo);
+    }
+    else
+    {
+        ctor->metainfoArena = arena;
+        ctor->metainfoBytes = metainfo;
+        ctor->isSet_metainfo = true;
+    }
+
+    return err;
+}
+
 int
 tr_ctorSetMetainfo (tr_ctor *       ctor,
                     const uint8_t * metainfo,
                     size_t          len)
 {
-    int err;
+    return setMetainfoBuffer (ctor, tr_memdup (metainfo, len), len);
+}
 
+void
+tr_ctorTakeMetainfo (tr_ctor * ctor, tr_ctor * from)
+{
     clearMetainfo (ctor);
-    err = tr_variantFromBenc (&ctor->metainfo, metainfo, len);
-    ctor->isSet_metainfo = !err;
-    return err;
+
+    if (from->isSet_metainfo)
+    {
+        ctor->metainfo = from->metainfo;
+        ctor->metainfoBytes = from->metainfoBytes;
+        ctor->metainfoArena = from->metainfoArena;
+        ctor->isSet_metainfo = true;
+        from->isSet_metainfo = false;
+        from->metainfoBytes = NULL;
+        from->metainfoArena = NULL;
+    }
+
+    setSourceFile (ctor, from->sourceFile);
 }
 
 const char*
@@ -116,9 +164,8 @@ tr_ctorSetMetainfoFromMagnetLink (tr_ctor * ctor, const char * magnet_link)
 
         tr_magnetCreateMetainfo (magnet_info, &tmp);
         str = tr_variantToStr (&tmp, TR_VARIANT_FMT_BENC, &len);
-        err = tr_ctorSetMetainfo (ctor, (const uint8_t*)str, len);
+        err = setMetainfoBuffer (ctor, (uint8_t*)str, len);
 
-        tr_free (str);
         tr_variantFree (&tmp);
         tr_magnetFree (magnet_info);
     }
@@ -136,9 +183,12 @@ tr_ctorSetMetainfoFromFile (tr_ctor *    ctor,
 
     metainfo = tr_loadFile (filename, &len, NULL);
     if (metainfo && len)
-        err = tr_ctorSetMetainfo (ctor, metainfo, len);
+    {
+        err = setMetainfoBuffer (ctor, metainfo, len);
+    }
     else
     {
+        tr_free (metainfo);
         clearMetainfo (ctor);
         err = 1;
     }
@@ -167,7 +217,6 @@ tr_ctorSetMetainfoFromFile (tr_ctor *    ctor,
         }
     }
 
-    tr_free (metainfo);
     return err;
 }
 
@@ -291,6 +340,31 @@ tr_ctorGetSave (const tr_ctor * ctor)
     return ctor && ctor->saveInOurTorrentsDir;
 }
 
+void
+tr_ctorSetResume (tr_ctor * ctor, tr_variant * resume)
+{
+    if (ctor->isSet_resume)
+        tr_variantFree (&ctor->resume);
+
+    ctor->isSet_resume = resume != NULL;
+
+    if (resume != NULL)
+    {
+        ctor->resume = *resume;
+        tr_variantInitBool (resume, false);
+    }
+}
+
+bool
+tr_ctorGetResume (const tr_ctor * ctor, tr_variant ** setme)
+{
+    if (ctor == NULL || !ctor->isSet_resume)
+        return false;
+
+    *setme = (tr_variant *) &ctor->resume;
+    return true;
+}
+
 void
 tr_ctorSetPaused (tr_ctor *   ctor,
                   tr_ctorMode mode,
@@ -480,6 +554,7 @@ void
 tr_ctorFree (tr_ctor * ctor)
 {
     clearMetainfo (ctor);
+    tr_ctorSetResume (ctor, NULL);
     tr_free (ctor->optionalArgs[1].downloadDir);
     tr_free (ctor->optionalArgs[0].downloadDir);
     tr_free (ctor->incompleteDir);
@@ -121,8 +121,10 @@ findInfoDictOffset (const tr_torrent * tor)
   if ((fileContents = tr_loadFile (tor->info.torrent, &fileLen, NULL)))
     {
       tr_variant top;
+      tr_variant_arena * arena = tr_variantArenaNew ();
 
-      if (!tr_variantFromBenc (&top, fileContents, fileLen))
+      /* the tree is thrown away at once, so don't copy the file's strings */
+      if (!tr_variantFromBencBorrowed (&top, fileContents, fileLen, arena))
         {
           tr_variant * infoDict;
 
@@ -134,10 +136,9 @@ findInfoDictOffset (const tr_torrent * tor)
               offset = i != NULL ? i - fileContents : 0;
               tr_free (infoContents);
             }
-
-          tr_variantFree (&top);
         }
 
+      tr_variantArenaFree (arena);
       tr_free (fileContents);
     }
 
@@ -17,6 +17,7 @@
 #endif
 
 #include <assert.h>
+#include <ctype.h> /* isxdigit () */
 #include <math.h>
 #include <stdarg.h>
 #include <string.h> /* memcmp */
@@ -80,12 +81,121 @@ tr_torrentId (const tr_torrent * tor)
   return tor ? tor->uniqueId : -1;
 }
 
-tr_torrent*
-tr_torrentFindFromId (tr_session * session, int id)
+/***
+****  Lookup tables
+***/
+
+enum
+{
+  MIN_TORRENT_BUCKETS = 64
+};
+
+static inline size_t
+idBucket (const tr_session * session, int id)
+{
+  /* ids are handed out sequentially, so the low bits are evenly spread */
+  return (size_t) id & (session->torrentBucketCount - 1);
+}
+
+static inline size_t
+hashBucket (const tr_session * session, const uint8_t * hash)
+{
+  uint32_t val;
+
+  /* SHA1 output is already uniformly distributed */
+  memcpy (&val, hash, sizeof (val));
+  return val & (session->torrentBucketCount - 1);
+}
+
+static void
+torrentIndexInsert (tr_session * session, tr_torrent * tor)
+{
+  size_t i;
+
+  i = idBucket (session, tor->uniqueId);
+  tor->nextById = session->torrentsById[i];
+  session->torrentsById[i] = tor;
+
+  i = hashBucket (session, tor->info.hash);
+  tor->nextByHash = session->torrentsByHash[i];
+  session->torrentsByHash[i] = tor;
+
+  i = hashBucket (session, tor->obfuscatedHash);
+  tor->nextByObfuscatedHash = session->torrentsByObfuscatedHash[i];
+  session->torrentsByObfuscatedHash[i] = tor;
+}
+
+static void
+torrentIndexRebuild (tr_session * session, size_t bucketCount)
 {
   tr_torrent * tor = NULL;
 
+  tr_free (session->torrentsById);
+  tr_free (session->torrentsByHash);
+  tr_free (session->torrentsByObfuscatedHash);
+
+  session->torrentBucketCount = bucketCount;
+  session->torrentsById = tr_new0 (tr_torrent *, bucketCount);
+  session->torrentsByHash = tr_new0 (tr_torrent *, bucketCount);
+  session->torrentsByObfuscatedHash = tr_new0 (tr_torrent *, bucketCount);
+
   while ((tor = tr_torrentNext (session, tor)))
+    torrentIndexInsert (session, tor);
+}
+
+/* call this after `tor' has been added to session->torrentList */
+static void
+torrentIndexAdd (tr_session * session, tr_torrent * tor)
+{
+  if ((size_t) session->torrentCount > session->torrentBucketCount)
+    torrentIndexRebuild (session, MAX (MIN_TORRENT_BUCKETS, session->torrentBucketCount * 2));
+  else
+    torrentIndexInsert (session, tor);
+}
+
+/* call this after `tor' has been removed from session->torrentList */
+static void
+torrentIndexRemove (tr_session * session, tr_torrent * tor)
+{
+  tr_torrent ** it;
+
+  if (session->torrentCount == 0)
+    {
+      tr_free (session->torrentsById);
+      tr_free (session->torrentsByHash);
+      tr_free (session->torrentsByObfuscatedHash);
+      session->torrentsById = NULL;
+      session->torrentsByHash = NULL;
+      session->torrentsByObfuscatedHash = NULL;
+      session->torrentBucketCount = 0;
+      return;
+    }
+
+  it = &session->torrentsById[idBucket (session, tor->uniqueId)];
+  while (*it != tor)
+    it = &(*it)->nextById;
+  *it = tor->nextById;
+
+  it = &session->torrentsByHash[hashBucket (session, tor->info.hash)];
+  while (*it != tor)
+    it = &(*it)->nextByHash;
+  *it = tor->nextByHash;
+
+  it = &session->torrentsByObfuscatedHash[hashBucket (session, tor->obfuscatedHash)];
+  while (*it != tor)
+    it = &(*it)->nextByObfuscatedHash;
+  *it = tor->nextByObfuscatedHash;
+}
+
+tr_torrent*
+tr_torrentFindFromId (tr_session * session, int id)
+{
+  tr_torrent * tor;
+
+  if (session->torrentBucketCount == 0)
+    return NULL;
+
+  for (tor = session->torrentsById[idBucket (session, id)]; tor != NULL; tor = tor->nextById)
     if (tor->uniqueId == id)
       return tor;
 
@@ -95,24 +205,30 @@ tr_torrentFindFromId (tr_session * session, int id)
 tr_torrent*
 tr_torrentFindFromHashString (tr_session *  session, const char * str)
 {
-  tr_torrent * tor = NULL;
+  size_t i;
+  uint8_t hash[SHA_DIGEST_LENGTH];
 
-  while ((tor = tr_torrentNext (session, tor)))
-    if (!evutil_ascii_strcasecmp (str, tor->info.hashString))
-      return tor;
+  for (i=0; i<SHA_DIGEST_LENGTH*2; ++i)
+    if (!isxdigit ((unsigned char) str[i]))
+      return NULL;
+  if (str[i] != '\0')
+    return NULL;
 
-  return NULL;
+  tr_hex_to_sha1 (hash, str);
+  return tr_torrentFindFromHash (session, hash);
 }
 
 tr_torrent*
 tr_torrentFindFromHash (tr_session * session, const uint8_t * torrentHash)
 {
-  tr_torrent * tor = NULL;
+  tr_torrent * tor;
 
-  while ((tor = tr_torrentNext (session, tor)))
-    if (*tor->info.hash == *torrentHash)
-      if (memcmp (tor->info.hash, torrentHash, SHA_DIGEST_LENGTH) == 0)
-        return tor;
+  if (session->torrentBucketCount == 0)
+    return NULL;
+
+  for (tor = session->torrentsByHash[hashBucket (session, torrentHash)]; tor != NULL; tor = tor->nextByHash)
+    if (memcmp (tor->info.hash, torrentHash, SHA_DIGEST_LENGTH) == 0)
+      return tor;
 
   return NULL;
 }
@@ -136,9 +252,14 @@ tr_torrent*
 tr_torrentFindFromObfuscatedHash (tr_session * session,
                                   const uint8_t * obfuscatedTorrentHash)
 {
-  tr_torrent * tor = NULL;
+  tr_torrent * tor;
 
-  while ((tor = tr_torrentNext (session, tor)))
+  if (session->torrentBucketCount == 0)
+    return NULL;
+
+  for (tor = session->torrentsByObfuscatedHash[hashBucket (session, obfuscatedTorrentHash)];
+       tor != NULL;
+       tor = tor->nextByObfuscatedHash)
     if (memcmp (tor->obfuscatedHash, obfuscatedTorrentHash, SHA_DIGEST_LENGTH) == 0)
       return tor;
 
@@ -223,7 +344,10 @@ tr_torrentSetSpeedLimit_Bps (tr_torrent * tor, tr_direction dir, unsigned int Bp
   assert (tr_isDirection (dir));
 
   if (tr_bandwidthSetDesiredSpeed_Bps (&tor->bandwidth, dir, Bps))
-    tr_torrentSetDirty (tor);
+    {
+      tr_torrentSetDirty (tor);
+      tr_torrentMarkChanged (tor, TR_TORRENT_SETTINGS);
+    }
 }
 void
 tr_torrentSetSpeedLimit_KBps (tr_torrent * tor, tr_direction dir, unsigned int KBps)
@@ -255,7 +379,10 @@ tr_torrentUseSpeedLimit (tr_torrent * tor, tr_direction dir, bool do_use)
   assert (tr_isDirection (dir));
 
   if (tr_bandwidthSetLimited (&tor->bandwidth, dir, do_use))
-    tr_torrentSetDirty (tor);
+    {
+      tr_torrentSetDirty (tor);
+      tr_torrentMarkChanged (tor, TR_TORRENT_SETTINGS);
+    }
 }
 
 bool
@@ -277,7 +404,10 @@ tr_torrentUseSessionLimits (tr_torrent * tor, bool doUse)
   changed |= tr_bandwidthHonorParentLimits (&tor->bandwidth, TR_DOWN, doUse);
 
   if (changed)
-    tr_torrentSetDirty (tor);
+    {
+      tr_torrentSetDirty (tor);
+      tr_torrentMarkChanged (tor, TR_TORRENT_SETTINGS);
+    }
 }
 
 bool
@@ -303,6 +433,7 @@ tr_torrentSetRatioMode (tr_torrent *  tor, tr_ratiolimit mode)
       tor->ratioLimitMode = mode;
 
       tr_torrentSetDirty (tor);
+      tr_torrentMarkChanged (tor, TR_TORRENT_SETTINGS);
     }
 }
 
@@ -324,6 +455,7 @@ tr_torrentSetRatioLimit (tr_torrent * tor, double desiredRatio)
       tor->desiredRatio = desiredRatio;
 
       tr_torrentSetDirty (tor);
+      tr_torrentMarkChanged (tor, TR_TORRENT_SETTINGS);
     }
 }
 
@@ -412,6 +544,7 @@ tr_torrentSetIdleMode (tr_torrent *  tor, tr_idlelimit mode)
       tor->idleLimitMode = mode;
 
       tr_torrentSetDirty (tor);
+      tr_torrentMarkChanged (tor, TR_TORRENT_SETTINGS);
     }
 }
 
@@ -433,6 +566,7 @@ tr_torrentSetIdleLimit (tr_torrent * tor, uint16_t idleMinutes)
       tor->idleLimitMinutes = idleMinutes;
 
       tr_torrentSetDirty (tor);
+      tr_torrentMarkChanged (tor, TR_TORRENT_SETTINGS);
     }
 }
 
@@ -534,6 +668,7 @@ tr_torrentSetLocalError (tr_torrent * tor, const char * fmt, ...)
   va_end (ap);
 
   tr_logAddTorErr (tor, "%s", tor->errorString);
+  tr_torrentMarkChanged (tor, TR_TORRENT_STATS);
 
   if (tor->isRunning)
     tor->isStopping = true;
@@ -545,6 +680,7 @@ tr_torrentClearError (tr_torrent * tor)
   tor->error = TR_STAT_OK;
   tor->errorString[0] = '\0';
   tor->errorTracker[0] = '\0';
+  tr_torrentMarkChanged (tor, TR_TORRENT_STATS);
 }
 
 static void
@@ -574,6 +710,7 @@ onTrackerResponse (tr_torrent * tor, const tr_tracker_event * event, void * unus
         tor->error = TR_STAT_TRACKER_WARNING;
         tr_strlcpy (tor->errorTracker, event->tracker, sizeof (tor->errorTracker));
         tr_strlcpy (tor->errorString, event->text, sizeof (tor->errorString));
+        tr_torrentMarkChanged (tor, TR_TORRENT_STATS);
         break;
 
       case TR_TRACKER_ERROR:
@@ -581,6 +718,7 @@ onTrackerResponse (tr_torrent * tor, const tr_tracker_event * event, void * unus
         tor->error = TR_STAT_TRACKER_ERROR;
         tr_strlcpy (tor->errorTracker, event->tracker, sizeof (tor->errorTracker));
         tr_strlcpy (tor->errorString, event->text, sizeof (tor->errorString));
+        tr_torrentMarkChanged (tor, TR_TORRENT_STATS);
         break;
 
       case TR_TRACKER_ERROR_CLEAR:
@@ -815,6 +953,7 @@ void
 tr_torrentGotNewInfoDict (tr_torrent * tor)
 {
   torrentInitFromInfo (tor);
+  tr_torrentMarkChanged (tor, TR_TORRENT_INFO);
 
   tr_peerMgrOnTorrentGotMetainfo (tor);
 
@@ -850,6 +989,7 @@ setLocalErrorIfFilesDisappeared (tr_torrent * tor)
 static void
 torrentInit (tr_torrent * tor, const tr_ctor * ctor)
 {
+  int i;
   bool doStart;
   uint64_t loaded;
   const char * dir;
@@ -929,6 +1069,9 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
       tr_torrentSetIdleLimit (tor, tr_sessionGetIdleLimit (tor->session));
     }
 
+  for (i=0; i<TR_TORRENT_FIELD_GROUP_COUNT; ++i)
+    tr_torrentMarkChanged (tor, i);
+
   /* add the torrent to tr_session.torrentList */
   session->torrentCount++;
   if (session->torrentList == NULL)
@@ -942,6 +1085,7 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
         it = it->next;
       it->next = tor;
     }
+  torrentIndexAdd (session, tor);
 
   /* if we don't have a local .torrent file already, assume the torrent is new */
   isNewTorrent = !tr_sys_path_exists (tor->info.torrent, NULL);
@@ -1035,6 +1179,21 @@ tr_torrentParse (const tr_ctor * ctor, tr_info * setmeInfo)
   return torrentParseImpl (ctor, setmeInfo, NULL, NULL, NULL);
 }
 
+static tr_torrent *
+torrentCreate (const tr_ctor * ctor, const tr_info * info, bool hasInfo, size_t infoDictLength)
+{
+  tr_torrent * tor = tr_new0 (tr_torrent, 1);
+
+  tor->info = *info;
+
+  if (hasInfo)
+    tor->infoDictLength = infoDictLength;
+
+  torrentInit (tor, ctor);
+
+  return tor;
+}
+
 tr_torrent *
 tr_torrentNew (const tr_ctor * ctor, int * setme_error, int * setme_duplicate_id)
 {
@@ -1050,13 +1209,7 @@ tr_torrentNew (const tr_ctor * ctor, int * setme_error, int * setme_duplicate_id
   r = torrentParseImpl (ctor, &tmpInfo, &hasInfo, &len, setme_duplicate_id);
   if (r == TR_PARSE_OK)
     {
-      tor = tr_new0 (tr_torrent, 1);
-      tor->info = tmpInfo;
-
-      if (hasInfo)
-        tor->infoDictLength = len;
-
-      torrentInit (tor, ctor);
+      tor = torrentCreate (ctor, &tmpInfo, hasInfo, len);
     }
   else
     {
@@ -1070,6 +1223,30 @@ tr_torrentNew (const tr_ctor * ctor, int * setme_error, int * setme_duplicate_id
   return tor;
 }
 
+tr_torrent *
+tr_torrentNewFromInfo (const tr_ctor * ctor,
+                       tr_info       * info,
+                       bool            hasInfo,
+                       size_t          infoDictLength,
+                       int           * setme_duplicate_id)
+{
+  const tr_torrent * dupe;
+  tr_session * session = tr_ctorGetSession (ctor);
+
+  assert (tr_isSession (session));
+
+  if ((dupe = tr_torrentFindFromHash (session, info->hash)) != NULL)
+    {
+      if (setme_duplicate_id != NULL)
+        *setme_duplicate_id = tr_torrentId (dupe);
+
+      tr_metainfoFree (info);
+      return NULL;
+    }
+
+  return torrentCreate (ctor, info, hasInfo, infoDictLength);
+}
+
 /**
 ***
 **/
@@ -1084,6 +1261,7 @@ tr_torrentSetDownloadDir (tr_torrent * tor, const char * path)
       tr_free (tor->downloadDir);
       tor->downloadDir = tr_strdup (path);
       tr_torrentSetDirty (tor);
+      tr_torrentMarkChanged (tor, TR_TORRENT_SETTINGS);
     }
 
   refreshCurrentDir (tor);
@@ -1158,6 +1336,36 @@ tr_torrentStatCached (tr_torrent * tor)
        : tr_torrentStat (tor);
 }
 
+uint64_t
+tr_torrentGetLatestRevision (const tr_torrent * tor)
+{
+  int i;
+  uint64_t ret = 0;
+
+  for (i=0; i<TR_TORRENT_FIELD_GROUP_COUNT; ++i)
+    ret = MAX (ret, tor->revisions[i]);
+
+  return ret;
+}
+
+void
+tr_torrentCheckStatsChanged (tr_torrent * tor, time_t now, uint64_t now_msec)
+{
+  /* state changes mark the stats where they happen, so this only
+     covers the counters that tick on their own: the speeds (including
+     their last drop back to zero) and verify progress. Idle running
+     torrents have counters like secondsSeeding that tick too, but
+     those are only refreshed once a minute, staggered by id */
+  const bool active = (tor->verifyState != TR_VERIFY_NONE)
+                   || (tr_bandwidthGetRawSpeed_Bps (&tor->bandwidth, now_msec, TR_UP) > 0)
+                   || (tr_bandwidthGetRawSpeed_Bps (&tor->bandwidth, now_msec, TR_DOWN) > 0);
+
+  if (active || tor->wasActive || (tor->isRunning && ((now + tor->uniqueId) % 60) == 0))
+    tr_torrentMarkChanged (tor, TR_TORRENT_STATS);
+
+  tor->wasActive = active;
+}
+
 void
 tr_torrentSetVerifyState (tr_torrent * tor, tr_verify_state state)
 {
@@ -1166,6 +1374,7 @@ tr_torrentSetVerifyState (tr_torrent * tor, tr_verify_state state)
 
   tor->verifyState = state;
   tor->anyDate = tr_time ();
+  tr_torrentMarkChanged (tor, TR_TORRENT_STATS);
 }
 
 tr_torrent_activity
@@ -1598,6 +1807,7 @@ freeTorrent (tr_torrent * tor)
   /* decrement the torrent count */
   assert (session->torrentCount >= 1);
   session->torrentCount--;
+  torrentIndexRemove (session, tor);
 
   /* resequence the queue positions */
   t = NULL;
@@ -1607,6 +1817,7 @@ freeTorrent (tr_torrent * tor)
         {
           t->queuePosition--;
           t->anyDate = now;
+          tr_torrentMarkChanged (t, TR_TORRENT_STATS);
         }
     }
   assert (queueIsSequenced (session));
@@ -1643,7 +1854,7 @@ torrentStartImpl (void * vtor)
   tor->isRunning = true;
   tor->completeness = tr_cpGetStatus (&tor->completion);
   tor->startDate = tor->anyDate = now;
-  tr_torrentClearError (tor);
+  tr_torrentClearError (tor); /* also marks the stats as changed */
   tor->finishedSeedingByIdle = false;
 
   tr_torrentResetTransferStats (tor);
@@ -1763,16 +1974,31 @@ struct verify_data
 {
   bool aborted;
   tr_torrent * tor;
+  tr_session * session;
+  int torrent_id;
   tr_verify_done_func callback_func;
   void * callback_data;
 };
 
+/* the torrent may have been freed while this was queued for the event thread */
+static bool
+verifyTorrentExists (const struct verify_data * data)
+{
+  return tr_torrentFindFromId (data->session, data->torrent_id) == data->tor;
+}
+
 static void
 onVerifyDoneThreadFunc (void * vdata)
 {
   struct verify_data * data = vdata;
   tr_torrent * tor = data->tor;
 
+  if (!verifyTorrentExists (data))
+    {
+      tr_free (data);
+      return;
+    }
+
   if (!data->aborted)
     tr_torrentRecheckCompleteness (tor);
 
@@ -1803,6 +2029,13 @@ verifyTorrent (void * vdata)
   bool startAfter;
   struct verify_data * data = vdata;
   tr_torrent * tor = data->tor;
+
+  if (!verifyTorrentExists (data))
+    {
+      tr_free (data);
+      return;
+    }
+
   tr_sessionLock (tor->session);
 
   /* if the torrent's already being verified, stop it */
@@ -1830,6 +2063,8 @@ tr_torrentVerify (tr_torrent           * tor,
 
   data = tr_new (struct verify_data, 1);
   data->tor = tor;
+  data->session = tor->session;
+  data->torrent_id = tor->uniqueId;
   data->aborted = false;
   data->callback_func = callback_func;
   data->callback_data = callback_data;
@@ -1893,6 +2128,7 @@ tr_torrentStop (tr_torrent * tor)
       tor->isRunning = false;
       tor->isStopping = false;
       tr_torrentSetDirty (tor);
+      tr_torrentMarkChanged (tor, TR_TORRENT_STATS);
       tr_runInEventThread (tor->session, stopTorrent, tor);
 
       tr_sessionUnlock (tor->session);
@@ -1907,9 +2143,10 @@ closeTorrent (void * vtor)
 
   assert (tr_isTorrent (tor));
 
-  d = tr_variantListAddDict (&tor->session->removedTorrents, 2);
+  d = tr_variantListAddDict (&tor->session->removedTorrents, 3);
   tr_variantDictAddInt (d, TR_KEY_id, tor->uniqueId);
   tr_variantDictAddInt (d, TR_KEY_date, tr_time ());
+  tr_variantDictAddInt (d, TR_KEY_revision, ++tor->session->revision);
 
   tr_logAddTorInfo (tor, "%s", _("Removing torrent"));
 
@@ -2217,6 +2454,7 @@ tr_torrentRecheckCompleteness (tr_torrent * tor)
                           getCompletionString (completeness));
 
       tor->completeness = completeness;
+      tr_torrentMarkChanged (tor, TR_TORRENT_STATS);
       tr_fdTorrentClose (tor->session, tor->uniqueId);
 
       if (tr_torrentIsSeed (tor))
@@ -2318,6 +2556,7 @@ tr_torrentSetFilePriorities (tr_torrent             * tor,
     if (files[i] < tor->info.fileCount)
       tr_torrentInitFilePriority (tor, files[i], priority);
   tr_torrentSetDirty (tor);
+  tr_torrentMarkChanged (tor, TR_TORRENT_SETTINGS);
   tr_peerMgrRebuildRequests (tor);
 
   tr_torrentUnlock (tor);
@@ -2430,6 +2669,8 @@ tr_torrentSetFileDLs (tr_torrent             * tor,
 
   tr_torrentInitFileDLs (tor, files, fileCount, doDownload);
   tr_torrentSetDirty (tor);
+  tr_torrentMarkChanged (tor, TR_TORRENT_SETTINGS);
+  tr_torrentMarkChanged (tor, TR_TORRENT_STATS); /* e.g. sizeWhenDone */
   tr_torrentRecheckCompleteness (tor);
   tr_peerMgrRebuildRequests (tor);
 
@@ -2459,9 +2700,31 @@ tr_torrentSetPriority (tr_torrent * tor, tr_priority_t priority)
       tor->bandwidth.priority = priority;
 
       tr_torrentSetDirty (tor);
+      tr_torrentMarkChanged (tor, TR_TORRENT_SETTINGS);
     }
 }
 
+unsigned int
+tr_torrentGetBandwidthWeight (const tr_torrent * tor)
+{
+  assert (tr_isTorrent (tor));
+
+  return MAX (tr_bandwidthGetWeight (&tor->bandwidth), 1u);
+}
+
+void
+tr_torrentSetBandwidthWeight (tr_torrent * tor, unsigned int weight)
+{
+  assert (tr_isTorrent (tor));
+  assert (weight > 0);
+
+  /* keep the peers' round robin quanta well inside their range */
+  weight = MAX (weight, 1u);
+  weight = MIN (weight, (unsigned int) TR_MAX_BANDWIDTH_WEIGHT);
+
+  tr_bandwidthSetWeight (&tor->bandwidth, weight);
+}
+
 /***
 ****
 ***/
@@ -2477,6 +2740,7 @@ tr_torrentSetPeerLimit (tr_torrent * tor,
       tor->maxConnectedPeers = maxConnectedPeers;
 
       tr_torrentSetDirty (tor);
+      tr_torrentMarkChanged (tor, TR_TORRENT_SETTINGS);
     }
 }
 
@@ -2640,6 +2904,7 @@ tr_torrentCheckPiece (tr_torrent * tor, tr_piece_index_t pieceIndex)
   tr_torrentSetPieceChecked (tor, pieceIndex);
   tor->anyDate = tr_time ();
   tr_torrentSetDirty (tor);
+  tr_torrentMarkChanged (tor, TR_TORRENT_STATS);
 
   return pass;
 }
@@ -2770,6 +3035,7 @@ tr_torrentSetAnnounceList (tr_torrent             * tor,
 
           tr_metainfoFree (&tmpInfo);
           tr_variantToFile (&metainfo, TR_VARIANT_FMT_BENC, tor->info.torrent);
+          tr_torrentMarkChanged (tor, TR_TORRENT_INFO);
         }
 
       /* cleanup */
@@ -3537,6 +3803,7 @@ tr_torrentSetQueuePosition (tr_torrent * tor, int pos)
             {
               walk->queuePosition--;
               walk->anyDate = now;
+              tr_torrentMarkChanged (walk, TR_TORRENT_STATS);
             }
         }
 
@@ -3546,6 +3813,7 @@ tr_torrentSetQueuePosition (tr_torrent * tor, int pos)
             {
               walk->queuePosition++;
               walk->anyDate = now;
+              tr_torrentMarkChanged (walk, TR_TORRENT_STATS);
             }
         }
 
@@ -3557,6 +3825,7 @@ tr_torrentSetQueuePosition (tr_torrent * tor, int pos)
 
   tor->queuePosition = MIN (pos, (back+1));
   tor->anyDate = now;
+  tr_torrentMarkChanged (tor, TR_TORRENT_STATS);
 
   assert (queueIsSequenced (tor->session));
 }
@@ -3625,6 +3894,7 @@ torrentSetQueued (tr_torrent * tor, bool queued)
       tor->isQueued = queued;
       tor->anyDate = tr_time ();
       tr_torrentSetDirty (tor);
+      tr_torrentMarkChanged (tor, TR_TORRENT_STATS);
     }
 }
 
@@ -3837,6 +4107,8 @@ torrentRenamePath (void * vdata)
                 }
 
               tr_torrentSetDirty (tor);
+              tr_torrentMarkChanged (tor, TR_TORRENT_INFO);
+              tr_torrentMarkChanged (tor, TR_TORRENT_STATS); /* "files" has the names too */
             }
         }
 
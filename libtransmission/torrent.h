@@ -31,10 +31,34 @@ void        tr_ctorSetSave (tr_ctor * ctor,
 
 bool        tr_ctorGetSave (const tr_ctor * ctor);
 
+/** @brief move the metainfo and source file out of @a from and into @a ctor */
+void        tr_ctorTakeMetainfo (tr_ctor * ctor, tr_ctor * from);
+
+/**
+ * @brief give the ctor an already-read .resume file to use instead of
+ *        reading it from disk. The ctor takes ownership; NULL clears it.
+ */
+void        tr_ctorSetResume (tr_ctor * ctor, tr_variant * resume);
+
+bool        tr_ctorGetResume (const tr_ctor * ctor, tr_variant ** setme);
+
 void        tr_ctorInitTorrentPriorities (const tr_ctor * ctor, tr_torrent * tor);
 
 void        tr_ctorInitTorrentWanted (const tr_ctor * ctor, tr_torrent * tor);
 
+/**
+ * @brief like tr_torrentNew (), but with metainfo that's already been parsed,
+ *        such as by tr_sessionLoadTorrents ()'s worker threads.
+ *
+ * The torrent takes ownership of @a info. If it can't be created because
+ * it's a duplicate, @a info is freed.
+ */
+tr_torrent * tr_torrentNewFromInfo (const tr_ctor * ctor,
+                                    tr_info       * info,
+                                    bool            hasInfo,
+                                    size_t          infoDictLength,
+                                    int           * setme_duplicate_id);
+
 /**
 ***
 **/
@@ -128,6 +152,20 @@ tr_torrent_activity tr_torrentGetActivity (const tr_torrent * tor);
 
 struct tr_incomplete_metadata;
 
+/**
+ * The torrent's RPC fields are split into groups whose changes are
+ * tracked separately, so that clients can ask for only what changed.
+ */
+typedef enum
+{
+    TR_TORRENT_INFO,     /* from the metainfo: name, trackers, piece size, ... */
+    TR_TORRENT_SETTINGS, /* set by the user: speed limits, priorities, location, ... */
+    TR_TORRENT_STATS,    /* everything else: progress, speeds, peers, ... */
+
+    TR_TORRENT_FIELD_GROUP_COUNT
+}
+tr_torrent_field_group;
+
 /** @brief Torrent object */
 struct tr_torrent
 {
@@ -218,6 +256,10 @@ struct tr_torrent
     time_t                     startDate;
     time_t                     anyDate;
 
+    /* the session revision at which each tr_torrent_field_group last changed */
+    uint64_t                   revisions[TR_TORRENT_FIELD_GROUP_COUNT];
+    bool                       wasActive;
+
     int                        secondsDownloading;
     int                        secondsSeeding;
 
@@ -258,6 +300,11 @@ struct tr_torrent
 
     tr_torrent *               next;
 
+    /* chains in the session's lookup tables */
+    tr_torrent *               nextById;
+    tr_torrent *               nextByHash;
+    tr_torrent *               nextByObfuscatedHash;
+
     int                        uniqueId;
 
     struct tr_bandwidth        bandwidth;
@@ -384,6 +431,28 @@ void tr_torrentSetDirty (tr_torrent * tor)
     tor->isDirty = true;
 }
 
+/* note that fields in `group' have changed, for tr_torrentGetRevision () */
+static inline
+void tr_torrentMarkChanged (tr_torrent * tor, tr_torrent_field_group group)
+{
+    assert (tr_isTorrent (tor));
+
+    tor->revisions[group] = ++tor->session->revision;
+}
+
+/** @brief the session revision at which fields in `group' last changed */
+static inline
+uint64_t tr_torrentGetRevision (const tr_torrent * tor, tr_torrent_field_group group)
+{
+    return tor->revisions[group];
+}
+
+/** @brief the session revision at which any of the torrent's fields last changed */
+uint64_t tr_torrentGetLatestRevision (const tr_torrent * tor);
+
+/* called once a second to mark the stats whose counters are ticking */
+void tr_torrentCheckStatsChanged (tr_torrent * tor, time_t now, uint64_t now_msec);
+
 uint32_t tr_getBlockSize (uint32_t pieceSize);
 
 /**
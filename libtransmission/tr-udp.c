@@ -21,7 +21,12 @@ THE SOFTWARE.
 
 */
 
+#if (defined (HAVE_RECVMMSG) || defined (HAVE_SENDMMSG)) && !defined (_GNU_SOURCE)
+ #define _GNU_SOURCE /* for recvmmsg () and sendmmsg () */
+#endif
+
 #include <assert.h>
+#include <errno.h>
 #include <string.h> /* memcmp (), memcpy (), memset () */
 #include <stdlib.h> /* malloc (), free () */
 
@@ -42,6 +47,8 @@ THE SOFTWARE.
 #include "tr-dht.h"
 #include "tr-utp.h"
 #include "tr-udp.h"
+#include "trevent.h" /* tr_amInEventThread () */
+#include "utils.h"
 
 /* Since we use a single UDP socket in order to implement multiple
    uTP sockets, try to set up huge buffers. */
@@ -114,7 +121,202 @@ tr_udpSetSocketBuffers (tr_session *session)
 }
 
 
+/***
+****  Batched I/O
+***/
+
+/* How many datagrams to read per wakeup, or to send per syscall. */
+#define UDP_BATCH_SIZE 32
+
+/* Larger than any datagram we expect to receive. */
+#define UDP_RECV_SIZE 4096
+
+/* uTP keeps its packets below the path MTU, and so do the UDP trackers.
+   Anything bigger than this is sent right away instead of being queued. */
+#define UDP_SEND_SIZE 1536
+
+struct tr_udp_packet
+{
+    tr_socket_t fd;
+    socklen_t tolen;
+    size_t len;
+    struct sockaddr_storage to;
+    unsigned char buf[UDP_SEND_SIZE];
+};
+
+struct tr_udp_batch
+{
+    struct event * flush_event;
+
+    int out_count;
+    struct tr_udp_packet out[UDP_BATCH_SIZE];
+
+    /* +1 so that the DHT code can have its NUL terminator */
+    unsigned char in[UDP_BATCH_SIZE][UDP_RECV_SIZE + 1];
+    struct sockaddr_storage from[UDP_BATCH_SIZE];
+
+    struct tr_udp_stats stats;
+    struct tr_udp_stats prev;
+    uint64_t prev_msec;
+};
+
+static void
+count_sent (struct tr_udp_batch * b, int packets)
+{
+    b->stats.packets_out += packets;
+    ++b->stats.send_calls;
+}
+
+static void
+send_one (struct tr_udp_batch * b, const struct tr_udp_packet * p)
+{
+    sendto (p->fd, (const void *) p->buf, p->len, 0,
+            (const struct sockaddr *) &p->to, p->tolen);
+    count_sent (b, 1);
+}
+
+/* Sends out[first..last), which all go out on the same socket.
+   UDP is unreliable anyway, so packets that fail are dropped. */
+static void
+send_run (struct tr_udp_batch * b, int first, int last)
+{
+#ifdef HAVE_SENDMMSG
+    int i;
+    struct iovec iov[UDP_BATCH_SIZE];
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+
+    memset (msgs, 0, sizeof (struct mmsghdr) * (last - first));
+    for (i = first; i < last; ++i) {
+        struct msghdr *h = &msgs[i - first].msg_hdr;
+        iov[i - first].iov_base = b->out[i].buf;
+        iov[i - first].iov_len = b->out[i].len;
+        h->msg_name = &b->out[i].to;
+        h->msg_namelen = b->out[i].tolen;
+        h->msg_iov = &iov[i - first];
+        h->msg_iovlen = 1;
+    }
+
+    i = first;
+    while (i < last) {
+        const int rc = sendmmsg (b->out[i].fd, &msgs[i - first], last - i, 0);
+        if (rc > 0) {
+            count_sent (b, rc);
+            i += rc;
+        } else if (rc < 0 && errno == ENOSYS) {
+            /* built with sendmmsg () but running on a kernel without it */
+            for (; i < last; ++i)
+                send_one (b, &b->out[i]);
+        } else {
+            /* skip the packet that failed */
+            count_sent (b, 0);
+            ++i;
+        }
+    }
+#else
+    int i;
+
+    for (i = first; i < last; ++i)
+        send_one (b, &b->out[i]);
+#endif
+}
+
+void
+tr_udpFlush (tr_session * ss)
+{
+    int i;
+    int first;
+    struct tr_udp_batch * b = ss->udp_batch;
+
+    if (b == NULL || b->out_count == 0)
+        return;
+
+    for (first = 0, i = 1; i <= b->out_count; ++i) {
+        if (i == b->out_count || b->out[i].fd != b->out[first].fd) {
+            send_run (b, first, i);
+            first = i;
+        }
+    }
+
+    b->out_count = 0;
+}
+
+static void
+flush_callback (evutil_socket_t foo UNUSED, short bar UNUSED, void * vsession)
+{
+    tr_udpFlush (vsession);
+}
+
+void
+tr_udpSendTo (tr_session * ss, const void * buf, size_t buflen,
+              const struct sockaddr * to, socklen_t tolen)
+{
+    tr_socket_t fd;
+    struct tr_udp_packet * p;
+    struct tr_udp_batch * b = ss->udp_batch;
+
+    assert (tr_amInEventThread (ss));
+
+    if (to->sa_family == AF_INET)
+        fd = ss->udp_socket;
+    else if (to->sa_family == AF_INET6)
+        fd = ss->udp6_socket;
+    else
+        fd = TR_BAD_SOCKET;
+
+    if (fd == TR_BAD_SOCKET)
+        return;
+
+    if (b == NULL || buflen > UDP_SEND_SIZE || tolen > sizeof (p->to)) {
+        tr_udpFlush (ss); /* keep the packets in order */
+        sendto (fd, buf, buflen, 0, to, tolen);
+        if (b != NULL)
+            count_sent (b, 1);
+        return;
+    }
+
+    if (b->out_count == UDP_BATCH_SIZE)
+        tr_udpFlush (ss);
+
+    /* send the queue once the callbacks that are ready have run */
+    if (b->out_count == 0)
+        event_active (b->flush_event, EV_TIMEOUT, 1);
+
+    p = &b->out[b->out_count++];
+    p->fd = fd;
+    p->len = buflen;
+    p->tolen = tolen;
+    memcpy (p->buf, buf, buflen);
+    memcpy (&p->to, to, tolen);
+}
+
+void
+tr_udpGetStats (tr_session * ss, struct tr_udp_stats * setme)
+{
+    uint64_t now;
+    double sec;
+    struct tr_udp_batch * b = ss->udp_batch;
+
+    memset (setme, 0, sizeof (struct tr_udp_stats));
+    if (b == NULL)
+        return;
+
+    now = tr_time_msec ();
+    if (now - b->prev_msec >= 1000) {
+        sec = (now - b->prev_msec) / 1000.0;
+        b->stats.packets_in_per_sec = (b->stats.packets_in - b->prev.packets_in) / sec;
+        b->stats.packets_out_per_sec = (b->stats.packets_out - b->prev.packets_out) / sec;
+        b->stats.recv_calls_per_sec = (b->stats.recv_calls - b->prev.recv_calls) / sec;
+        b->stats.send_calls_per_sec = (b->stats.send_calls - b->prev.send_calls) / sec;
+        b->prev = b->stats;
+        b->prev_msec = now;
+    }
+
+    *setme = b->stats;
+}
 
+/***
+****
+***/
 
 /* BEP-32 has a rather nice explanation of why we need to bind to one
    IPv6 address, if I may say so myself. */
@@ -195,48 +397,94 @@ rebind_ipv6 (tr_session *ss, bool force)
     }
 }
 
+/* Since most packets we receive here are ÂµTP, make quick inline
+   checks for the other protocols.  The logic is as follows:
+   - all DHT packets start with 'd';
+   - all UDP tracker packets start with a 32-bit (!) "action", which
+     is between 0 and 3;
+   - the above cannot be ÂµTP packets, since these start with a 4-bit
+     version number (1).
+   buf must have room for one more byte after the packet. */
+static void
+dispatch_packet (tr_session *ss, unsigned char *buf, int rc,
+                 struct sockaddr *from, socklen_t fromlen)
+{
+    if (buf[0] == 'd') {
+        if (tr_sessionAllowsDHT (ss)) {
+            buf[rc] = '\0'; /* required by the DHT code */
+            tr_dhtCallback (buf, rc, from, fromlen, ss);
+        }
+    } else if (rc >= 8 &&
+               buf[0] == 0 && buf[1] == 0 && buf[2] == 0 && buf[3] <= 3) {
+        rc = tau_handle_message (ss, buf, rc);
+        if (!rc)
+            tr_logAddNamedDbg ("UDP", "Couldn't parse UDP tracker packet.");
+    } else {
+        if (tr_sessionIsUTPEnabled (ss)) {
+            rc = tr_utpPacket (buf, rc, from, fromlen, ss);
+            if (!rc)
+                tr_logAddNamedDbg ("UDP", "Unexpected UDP packet");
+        }
+    }
+}
+
 static void
 event_callback (evutil_socket_t s, short type UNUSED, void *sv)
 {
-    int rc;
-    socklen_t fromlen;
-    unsigned char buf[4096];
-    struct sockaddr_storage from;
+    int i;
+    int n;
     tr_session *ss = sv;
+    struct tr_udp_batch *b = ss->udp_batch;
 
     assert (tr_isSession (sv));
     assert (type == EV_READ);
 
-    fromlen = sizeof (from);
-    rc = recvfrom (s, (void *) buf, 4096 - 1, 0,
-                (struct sockaddr*)&from, &fromlen);
-
-    /* Since most packets we receive here are ÂµTP, make quick inline
-       checks for the other protocols.  The logic is as follows:
-       - all DHT packets start with 'd';
-       - all UDP tracker packets start with a 32-bit (!) "action", which
-         is between 0 and 3;
-       - the above cannot be ÂµTP packets, since these start with a 4-bit
-         version number (1). */
-    if (rc > 0) {
-        if (buf[0] == 'd') {
-            if (tr_sessionAllowsDHT (ss)) {
-                buf[rc] = '\0'; /* required by the DHT code */
-                tr_dhtCallback (buf, rc, (struct sockaddr*)&from, fromlen, sv);
-            }
-        } else if (rc >= 8 &&
-                   buf[0] == 0 && buf[1] == 0 && buf[2] == 0 && buf[3] <= 3) {
-            rc = tau_handle_message (ss, buf, rc);
-            if (!rc)
-                tr_logAddNamedDbg ("UDP", "Couldn't parse UDP tracker packet.");
-        } else {
-            if (tr_sessionIsUTPEnabled (ss)) {
-                rc = tr_utpPacket (buf, rc, (struct sockaddr*)&from, fromlen, ss);
-                if (!rc)
-                    tr_logAddNamedDbg ("UDP", "Unexpected UDP packet");
-            }
+#ifdef HAVE_RECVMMSG
+    {
+        struct iovec iov[UDP_BATCH_SIZE];
+        struct mmsghdr msgs[UDP_BATCH_SIZE];
+
+        memset (msgs, 0, sizeof (msgs));
+        for (i = 0; i < UDP_BATCH_SIZE; ++i) {
+            iov[i].iov_base = b->in[i];
+            iov[i].iov_len = UDP_RECV_SIZE;
+            msgs[i].msg_hdr.msg_name = &b->from[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof (b->from[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        n = recvmmsg (s, msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+        ++b->stats.recv_calls;
+
+        for (i = 0; i < n; ++i) {
+            if (msgs[i].msg_len > 0)
+                dispatch_packet (ss, b->in[i], msgs[i].msg_len,
+                                 (struct sockaddr*)&b->from[i],
+                                 msgs[i].msg_hdr.msg_namelen);
         }
     }
+#else
+    {
+        socklen_t fromlen = sizeof (b->from[0]);
+
+        n = recvfrom (s, (void *) b->in[0], UDP_RECV_SIZE, 0,
+                      (struct sockaddr*)&b->from[0], &fromlen);
+        ++b->stats.recv_calls;
+
+        if (n > 0) {
+            dispatch_packet (ss, b->in[0], n,
+                             (struct sockaddr*)&b->from[0], fromlen);
+            n = 1;
+        }
+    }
+#endif
+
+    if (n > 0)
+        b->stats.packets_in += n;
+
+    /* send the replies to everything we just read in as few calls as possible */
+    tr_udpFlush (ss);
 }
 
 void
@@ -254,6 +502,10 @@ tr_udpInit (tr_session *ss)
     if (ss->udp_port <= 0)
         return;
 
+    ss->udp_batch = tr_new0 (struct tr_udp_batch, 1);
+    ss->udp_batch->prev_msec = tr_time_msec ();
+    ss->udp_batch->flush_event = event_new (ss->event_base, -1, 0, flush_callback, ss);
+
     ss->udp_socket = socket (PF_INET, SOCK_DGRAM, 0);
     if (ss->udp_socket == TR_BAD_SOCKET) {
         tr_logAddNamedError ("UDP", "Couldn't create IPv4 socket");
@@ -306,6 +558,13 @@ tr_udpUninit (tr_session *ss)
 {
     tr_dhtUninit (ss);
 
+    tr_udpFlush (ss);
+    if (ss->udp_batch) {
+        event_free (ss->udp_batch->flush_event);
+        tr_free (ss->udp_batch);
+        ss->udp_batch = NULL;
+    }
+
     if (ss->udp_socket != TR_BAD_SOCKET) {
         tr_netCloseSocket (ss->udp_socket);
         ss->udp_socket = TR_BAD_SOCKET;
@@ -31,6 +31,33 @@ void tr_udpInit (tr_session *);
 void tr_udpUninit (tr_session *);
 void tr_udpSetSocketBuffers (tr_session *);
 
+/* Outgoing datagrams are queued and sent in batches, with sendmmsg ()
+   where it's available, once the event loop has run the callbacks that
+   are ready. Incoming ones are read in batches too, with recvmmsg (). */
+void tr_udpSendTo (tr_session * session,
+                   const void * buf, size_t buflen,
+                   const struct sockaddr * to, socklen_t tolen);
+
+/* Send everything that's queued now. */
+void tr_udpFlush (tr_session * session);
+
+struct tr_udp_stats
+{
+    uint64_t packets_in;
+    uint64_t packets_out;
+    uint64_t recv_calls;    /* receive syscalls */
+    uint64_t send_calls;    /* send syscalls */
+
+    /* the same counters, per second, since the previous call
+       that was at least a second earlier */
+    double packets_in_per_sec;
+    double packets_out_per_sec;
+    double recv_calls_per_sec;
+    double send_calls_per_sec;
+};
+
+void tr_udpGetStats (tr_session * session, struct tr_udp_stats * setme);
+
 bool tau_handle_message (tr_session * session,
                          const uint8_t  * msg, size_t msglen);
 
@@ -33,6 +33,7 @@ THE SOFTWARE.
 #include "session.h"
 #include "crypto-utils.h" /* tr_rand_int_weak () */
 #include "peer-mgr.h"
+#include "tr-udp.h"
 #include "tr-utp.h"
 #include "utils.h"
 
@@ -128,12 +129,7 @@ void
 tr_utpSendTo (void *closure, const unsigned char *buf, size_t buflen,
              const struct sockaddr *to, socklen_t tolen)
 {
-    tr_session *ss = closure;
-
-    if (to->sa_family == AF_INET && ss->udp_socket != TR_BAD_SOCKET)
-        sendto (ss->udp_socket, (const void *) buf, buflen, 0, to, tolen);
-    else if (to->sa_family == AF_INET6 && ss->udp6_socket != TR_BAD_SOCKET)
-        sendto (ss->udp6_socket, (const void *) buf, buflen, 0, to, tolen);
+    tr_udpSendTo (closure, buf, buflen, to, tolen);
 }
 
 static void
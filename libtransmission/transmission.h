@@ -515,6 +515,23 @@ void  tr_sessionSetLPDEnabled (tr_session * session, bool enabled);
 void  tr_sessionSetCacheLimit_MB (tr_session * session, int mb);
 int   tr_sessionGetCacheLimit_MB (const tr_session * session);
 
+/** @brief Set how many threads hash pieces when verifying local data */
+void  tr_sessionSetVerifyThreads (tr_session * session, int count);
+int   tr_sessionGetVerifyThreads (const tr_session * session);
+
+/** @brief Limit how many MB per second verification may read, or 0 for no limit */
+void  tr_sessionSetVerifyIOLimit_MB (tr_session * session, int mb);
+int   tr_sessionGetVerifyIOLimit_MB (const tr_session * session);
+
+/**
+ * @brief Keep the torrents' resume state in a single database file in the
+ *        config dir instead of one .resume file per torrent.
+ *
+ * Turning this on or off moves every torrent's state over right away.
+ */
+void  tr_sessionSetResumeDatabaseEnabled (tr_session * session, bool enabled);
+bool  tr_sessionIsResumeDatabaseEnabled  (const tr_session * session);
+
 tr_encryption_mode tr_sessionGetEncryption (tr_session * session);
 void               tr_sessionSetEncryption (tr_session * session,
                                             tr_encryption_mode    mode);
@@ -658,6 +675,18 @@ bool       tr_sessionGetDeleteSource (const tr_session *);
 tr_priority_t   tr_torrentGetPriority (const tr_torrent *);
 void            tr_torrentSetPriority (tr_torrent *, tr_priority_t);
 
+#define TR_MAX_BANDWIDTH_WEIGHT 255
+
+/**
+ * @brief Set the torrent's share of bandwidth, relative to the other
+ *        torrents of the same bandwidth priority. Each of its peers gets
+ *        this many times the bytes of a peer in a torrent of weight 1.
+ *        The default is 1, and it's clamped to 1..TR_MAX_BANDWIDTH_WEIGHT.
+ *        It isn't saved between sessions.
+ */
+unsigned int    tr_torrentGetBandwidthWeight (const tr_torrent *);
+void            tr_torrentSetBandwidthWeight (tr_torrent *, unsigned int weight);
+
 /***
 ****
 ****  Torrent Queueing
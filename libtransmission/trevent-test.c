@@ -0,0 +1,198 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memset () */
+
+#include "transmission.h"
+#include "platform.h" /* tr_threadNew () */
+#include "session.h"
+#include "trevent.h"
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+#define PRODUCER_COUNT 4
+#define CALLS_PER_PRODUCER 5000
+#define BATCH_CALLS 100
+
+struct call
+{
+  struct producer * producer;
+  int seq;
+};
+
+struct producer
+{
+  tr_session * session;
+  struct call calls[CALLS_PER_PRODUCER];
+  int next_seq;   /* only used by the libevent thread */
+  bool in_order;  /* only used by the libevent thread */
+  volatile bool done;
+};
+
+struct trevent_test_data
+{
+  tr_session * session;
+  struct tr_event_stats stats;
+  volatile bool blocking;
+  volatile bool release;
+  volatile bool done;
+  int count;      /* only used by the libevent thread */
+};
+
+static void
+callFunc (void * vcall)
+{
+  struct call * call = vcall;
+  struct producer * producer = call->producer;
+
+  if (call->seq != producer->next_seq)
+    producer->in_order = false;
+  producer->next_seq = call->seq + 1;
+
+  if (producer->next_seq == CALLS_PER_PRODUCER)
+    producer->done = true;
+}
+
+static void
+producerThreadFunc (void * vproducer)
+{
+  int i;
+  struct producer * producer = vproducer;
+
+  for (i=0; i<CALLS_PER_PRODUCER; ++i)
+    tr_runInEventThread (producer->session, callFunc, &producer->calls[i]);
+}
+
+static void
+getStatsFunc (void * vdata)
+{
+  struct trevent_test_data * data = vdata;
+
+  tr_eventGetStats (data->session, &data->stats);
+  data->done = true;
+}
+
+static void
+runAndWait (struct trevent_test_data * data, void (*func) (void *))
+{
+  data->done = false;
+  tr_runInEventThread (data->session, func, data);
+  while (!data->done)
+    tr_wait_msec (10);
+}
+
+static int
+test_many_producers (void)
+{
+  int i;
+  int j;
+  struct trevent_test_data data;
+  struct producer * producers = tr_new0 (struct producer, PRODUCER_COUNT);
+
+  memset (&data, 0, sizeof (data));
+  data.session = libttest_session_init (NULL);
+
+  for (i=0; i<PRODUCER_COUNT; ++i)
+    {
+      producers[i].session = data.session;
+      producers[i].in_order = true;
+      for (j=0; j<CALLS_PER_PRODUCER; ++j)
+        {
+          producers[i].calls[j].producer = &producers[i];
+          producers[i].calls[j].seq = j;
+        }
+    }
+
+  for (i=0; i<PRODUCER_COUNT; ++i)
+    tr_threadNew (producerThreadFunc, &producers[i]);
+
+  /* every call gets run, and each thread's calls are run in order */
+  for (i=0; i<PRODUCER_COUNT; ++i)
+    {
+      while (!producers[i].done)
+        tr_wait_msec (10);
+      check (producers[i].in_order);
+      check_int_eq (CALLS_PER_PRODUCER, producers[i].next_seq);
+    }
+
+  runAndWait (&data, getStatsFunc);
+  check (data.stats.calls >= PRODUCER_COUNT * CALLS_PER_PRODUCER);
+  check (data.stats.batches <= data.stats.calls);
+  check (data.stats.wakeups <= data.stats.calls);
+  check (data.stats.max_queue_depth >= 1);
+
+  libttest_session_close (data.session);
+  tr_free (producers);
+  return 0;
+}
+
+static void
+blockFunc (void * vdata)
+{
+  struct trevent_test_data * data = vdata;
+
+  data->blocking = true;
+  while (!data->release)
+    tr_wait_msec (10);
+}
+
+static void
+countFunc (void * vdata)
+{
+  struct trevent_test_data * data = vdata;
+
+  ++data->count;
+}
+
+static int
+test_batching (void)
+{
+  int i;
+  uint64_t calls;
+  uint64_t batches;
+  uint64_t wakeups;
+  struct trevent_test_data data;
+
+  memset (&data, 0, sizeof (data));
+  data.session = libttest_session_init (NULL);
+
+  runAndWait (&data, getStatsFunc);
+  calls = data.stats.calls;
+  batches = data.stats.batches;
+  wakeups = data.stats.wakeups;
+
+  /* queue up calls while the libevent thread is busy */
+  tr_runInEventThread (data.session, blockFunc, &data);
+  while (!data.blocking)
+    tr_wait_msec (10);
+  for (i=0; i<BATCH_CALLS; ++i)
+    tr_runInEventThread (data.session, countFunc, &data);
+  data.release = true;
+
+  /* they take one wakeup and run in one batch */
+  runAndWait (&data, getStatsFunc);
+  check_int_eq (BATCH_CALLS, data.count);
+  check_int_eq (BATCH_CALLS + 2, data.stats.calls - calls);
+  check (data.stats.wakeups - wakeups <= 3);
+  check (data.stats.batches - batches <= 3);
+  check (data.stats.max_queue_depth >= BATCH_CALLS);
+  check (data.stats.max_latency_usec > 0);
+
+  libttest_session_close (data.session);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_many_producers,
+                             test_batching };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -27,7 +27,7 @@
 #include "session.h"
 
 #include "transmission.h"
-#include "platform.h" /* tr_lockLock () */
+#include "platform.h" /* tr_amInThread () */
 #include "trevent.h"
 #include "utils.h"
 
@@ -138,80 +138,209 @@ typedef int tr_pipe_end_t;
 ****
 ***/
 
+/***
+****  Atomics for the run queue
+***/
+
+#ifdef _MSC_VER
+ #define atomic_exchange_ptr(p,v) InterlockedExchangePointer ((PVOID volatile *)(p), (v))
+ #define atomic_exchange_int(p,v) InterlockedExchange ((LONG volatile *)(p), (v))
+ #define atomic_add_int(p,v) InterlockedExchangeAdd ((LONG volatile *)(p), (v))
+ #define atomic_load_int(p) (*(p))
+ #define atomic_load_ptr(p) (*(p)) /* volatile reads have acquire semantics */
+ #define atomic_store_ptr(p,v) (*(p) = (v)) /* volatile writes have release semantics */
+#else
+ #define atomic_exchange_ptr(p,v) __atomic_exchange_n ((p), (v), __ATOMIC_ACQ_REL)
+ #define atomic_exchange_int(p,v) __atomic_exchange_n ((p), (v), __ATOMIC_ACQ_REL)
+ #define atomic_add_int(p,v) __atomic_fetch_add ((p), (v), __ATOMIC_RELAXED)
+ #define atomic_load_int(p) __atomic_load_n ((p), __ATOMIC_RELAXED)
+ #define atomic_load_ptr(p) __atomic_load_n ((p), __ATOMIC_ACQUIRE)
+ #define atomic_store_ptr(p,v) __atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+#endif
+
+/***
+****
+***/
+
+struct tr_run_data
+{
+    struct tr_run_data * volatile next;
+    void  (*func)(void *);
+    void *  user_data;
+    uint64_t queued_at; /* usec */
+};
+
+enum
+{
+    /* the most queued calls to run before letting other events have a turn */
+    MAX_BATCH_SIZE = 1024
+};
+
 typedef struct tr_event_handle
 {
     uint8_t      die;
     tr_pipe_end_t fds[2];
-    tr_lock *    lock;
     tr_session *  session;
     tr_thread *  thread;
     struct event_base * base;
     struct event * pipeEvent;
+
+    /* The calls waiting to be run, in an intrusive multi-producer
+       single-consumer queue: producers push onto 'tail' with one atomic
+       exchange, and the libevent thread pops from 'head'. 'stub' keeps
+       the queue from ever being empty, so 'head' never needs a lock. */
+    struct tr_run_data * volatile tail;
+    struct tr_run_data * head;
+    struct tr_run_data stub;
+
+    /* nonzero if a wakeup byte has been written to the pipe and the
+       libevent thread hasn't started draining the queue yet */
+    volatile int wakeup_pending;
+
+    /* stats */
+    volatile int depth;
+    int max_depth;
+    uint64_t calls;
+    uint64_t batches;
+    uint64_t wakeups;
+    uint64_t total_latency;
+    uint64_t max_latency;
 }
 tr_event_handle;
 
-struct tr_run_data
-{
-    void  (*func)(void *);
-    void *  user_data;
-};
-
 #define dbgmsg(...) \
     do { \
         if (tr_logGetDeepEnabled ()) \
             tr_logAddDeep (__FILE__, __LINE__, "event", __VA_ARGS__); \
     } while (0)
 
+static uint64_t
+tr_time_usec (void)
+{
+    struct timeval tv;
+
+    tr_gettimeofday (&tv);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 static void
-readFromPipe (evutil_socket_t   fd,
-              short             eventType,
-              void            * veh)
+queuePush (tr_event_handle * eh, struct tr_run_data * data)
 {
-    char              ch;
-    int               ret;
-    tr_event_handle * eh = veh;
+    struct tr_run_data * prev;
 
-    dbgmsg ("readFromPipe: eventType is %hd", eventType);
+    data->next = NULL;
+    prev = atomic_exchange_ptr (&eh->tail, data);
+    atomic_store_ptr (&prev->next, data);
+}
+
+/* Returns NULL if the queue is empty, or if a producer is halfway through
+   queuePush (). That producer will write its own wakeup, since it hasn't
+   set wakeup_pending yet. */
+static struct tr_run_data *
+queuePop (tr_event_handle * eh)
+{
+    struct tr_run_data * head = eh->head;
+    struct tr_run_data * next = atomic_load_ptr (&head->next);
+
+    if (head == &eh->stub)
+    {
+        if (next == NULL)
+            return NULL;
+
+        eh->head = next;
+        head = next;
+        next = atomic_load_ptr (&head->next);
+    }
 
-    /* read the command type */
-    ch = '\0';
-    do
+    if (next != NULL)
     {
-        ret = piperead (fd, &ch, 1);
+        eh->head = next;
+        return head;
     }
-    while (!eh->die && ret < 0 && errno == EAGAIN);
 
-    dbgmsg ("command is [%c], ret is %d, errno is %d", ch, ret, (int)errno);
+    if (head != atomic_load_ptr (&eh->tail))
+        return NULL;
 
-    switch (ch)
+    /* 'head' is the last node, so put the stub behind it before taking it */
+    queuePush (eh, &eh->stub);
+    next = atomic_load_ptr (&head->next);
+    if (next == NULL)
+        return NULL;
+
+    eh->head = next;
+    return head;
+}
+
+static void
+runQueue (tr_event_handle * eh)
+{
+    int n;
+    struct tr_run_data * data;
+
+    /* Clear this before draining, so that a call queued after the drain
+       has begun either gets run by it or writes another wakeup. */
+    atomic_exchange_int (&eh->wakeup_pending, 0);
+
+    for (n=0; n<MAX_BATCH_SIZE && (data = queuePop (eh)) != NULL; ++n)
     {
-        case 'r': /* run in libevent thread */
-        {
-            struct tr_run_data data;
-            const size_t       nwant = sizeof (data);
-            const ev_ssize_t   ngot = piperead (fd, &data, nwant);
-            if (!eh->die && (ngot == (ev_ssize_t) nwant))
-            {
-                dbgmsg ("invoking function in libevent thread");
-              (data.func)(data.user_data);
-            }
-            break;
-        }
+        const int depth = atomic_add_int (&eh->depth, -1);
 
-        case '\0': /* eof */
-        {
-            dbgmsg ("pipe eof reached... removing event listener");
-            event_free (eh->pipeEvent);
-            tr_netCloseSocket (eh->fds[0]);
-            event_base_loopexit (eh->base, NULL);
-            break;
-        }
+        if (eh->max_depth < depth)
+            eh->max_depth = depth;
 
-        default:
+        if (!eh->die)
         {
-            assert (0 && "unhandled command type!");
-            break;
+            const uint64_t latency = tr_time_usec () - data->queued_at;
+
+            eh->total_latency += latency;
+            if (eh->max_latency < latency)
+                eh->max_latency = latency;
+            ++eh->calls;
+
+            dbgmsg ("invoking function in libevent thread");
+            (data->func)(data->user_data);
         }
+
+        tr_free (data);
+    }
+
+    if (n > 0)
+        ++eh->batches;
+
+    /* if there's more, come back after the other events have had a turn */
+    if (n == MAX_BATCH_SIZE)
+        event_active (eh->pipeEvent, EV_READ, 0);
+}
+
+static void
+readFromPipe (evutil_socket_t   fd,
+              short             eventType,
+              void            * veh)
+{
+    char              buf[64];
+    ev_ssize_t        ret;
+    tr_event_handle * eh = veh;
+
+    dbgmsg ("readFromPipe: eventType is %hd", eventType);
+
+    /* drain the wakeup bytes */
+    while ((ret = piperead (fd, buf, sizeof (buf))) > 0)
+        eh->wakeups += ret;
+
+    dbgmsg ("ret is %d, errno is %d", (int)ret, (int)errno);
+
+    runQueue (eh);
+
+    if (ret == 0) /* eof */
+    {
+        struct tr_run_data * data;
+
+        dbgmsg ("pipe eof reached... removing event listener");
+        while ((data = queuePop (eh)) != NULL)
+            tr_free (data);
+        event_free (eh->pipeEvent);
+        tr_netCloseSocket (eh->fds[0]);
+        event_base_loopexit (eh->base, NULL);
     }
 }
 
@@ -254,7 +383,6 @@ libeventThreadFunc (void * veh)
         event_base_dispatch (base);
 
     /* shut down the thread */
-    tr_lockFree (eh->lock);
     event_base_free (base);
     eh->session->events = NULL;
     tr_free (eh);
@@ -269,9 +397,11 @@ tr_eventInit (tr_session * session)
     session->events = NULL;
 
     eh = tr_new0 (tr_event_handle, 1);
-    eh->lock = tr_lockNew ();
+    eh->head = eh->tail = &eh->stub;
     if (pipe (eh->fds) == -1)
       tr_logAddError ("Unable to write to pipe() in libtransmission: %s", tr_strerror(errno));
+    else
+      evutil_make_socket_nonblocking (eh->fds[0]);
     eh->session = session;
     eh->thread = tr_threadNew (libeventThreadFunc, eh);
 
@@ -323,26 +453,41 @@ tr_runInEventThread (tr_session * session,
     }
   else
     {
-      tr_pipe_end_t fd;
-      char ch;
-      ev_ssize_t res_1;
-      ev_ssize_t res_2;
       tr_event_handle * e = session->events;
-      struct tr_run_data data;
+      struct tr_run_data * data = tr_new (struct tr_run_data, 1);
 
-      tr_lockLock (e->lock);
+      data->func = func;
+      data->user_data = user_data;
+      data->queued_at = tr_time_usec ();
+      atomic_add_int (&e->depth, 1);
+      queuePush (e, data);
 
-      fd = e->fds[1];
-      ch = 'r';
-      res_1 = pipewrite (fd, &ch, 1);
+      /* only the first call since the last drain needs to wake it up */
+      if (atomic_exchange_int (&e->wakeup_pending, 1) == 0)
+        {
+          const char ch = 'r';
 
-      data.func = func;
-      data.user_data = user_data;
-      res_2 = pipewrite (fd, &data, sizeof (data));
+          if (pipewrite (e->fds[1], &ch, 1) == -1)
+            tr_logAddError ("Unable to write to libtransmisison event queue: %s", tr_strerror(errno));
+        }
+    }
+}
 
-      tr_lockUnlock (e->lock);
+void
+tr_eventGetStats (const tr_session * session, struct tr_event_stats * setme)
+{
+  const tr_event_handle * e;
 
-      if ((res_1 == -1) || (res_2 == -1))
-        tr_logAddError ("Unable to write to libtransmisison event queue: %s", tr_strerror(errno));
-    }
+  assert (tr_isSession (session));
+  assert (tr_amInEventThread (session));
+  assert (setme != NULL);
+
+  e = session->events;
+  setme->queue_depth = atomic_load_int (&e->depth);
+  setme->max_queue_depth = e->max_depth;
+  setme->calls = e->calls;
+  setme->batches = e->batches;
+  setme->wakeups = e->wakeups;
+  setme->avg_latency_usec = e->calls ? (double)e->total_latency / e->calls : 0.0;
+  setme->max_latency_usec = e->max_latency;
 }
@@ -23,3 +23,17 @@ bool   tr_amInEventThread (const tr_session *);
 
 void   tr_runInEventThread (tr_session *, void func (void*), void * user_data);
 
+
+struct tr_event_stats
+{
+    int queue_depth;         /* calls waiting to be run */
+    int max_queue_depth;     /* the most that have been waiting at once */
+    uint64_t calls;          /* calls from other threads that have been run */
+    uint64_t batches;        /* how many times the queue was drained */
+    uint64_t wakeups;        /* how many wakeups were written to the pipe */
+    double avg_latency_usec; /* time from being queued to being run */
+    uint64_t max_latency_usec;
+};
+
+/** @brief must be called from the libevent thread */
+void   tr_eventGetStats (const tr_session *, struct tr_event_stats * setme);
@@ -0,0 +1,119 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memset () */
+#include <time.h> /* time () */
+
+#include "transmission.h"
+#include "net.h"
+#include "session.h"
+#include "trevent.h"
+#include "tr-udp.h"
+#include "utils.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+#define PACKET_COUNT 20
+
+struct udp_test_data
+{
+  tr_session * session;
+  struct tr_udp_stats stats;
+  volatile bool done;
+};
+
+static void
+sendPacketsFunc (void * vdata)
+{
+  int i;
+  struct sockaddr_in sin;
+  unsigned char buf[32];
+  struct udp_test_data * data = vdata;
+
+  /* not DHT, tracker or uTP, so the session reads them and drops them */
+  memset (buf, 0xff, sizeof (buf));
+
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  sin.sin_port = htons (data->session->udp_port);
+
+  for (i=0; i<PACKET_COUNT; ++i)
+    tr_udpSendTo (data->session, buf, sizeof (buf), (struct sockaddr*)&sin, sizeof (sin));
+
+  data->done = true;
+}
+
+static void
+getStatsFunc (void * vdata)
+{
+  struct udp_test_data * data = vdata;
+
+  tr_udpGetStats (data->session, &data->stats);
+  data->done = true;
+}
+
+static void
+runAndWait (struct udp_test_data * data, void (*func) (void *))
+{
+  data->done = false;
+  tr_runInEventThread (data->session, func, data);
+  while (!data->done)
+    tr_wait_msec (10);
+}
+
+static int
+test_batching (void)
+{
+  tr_variant settings;
+  struct udp_test_data data;
+  const time_t deadline = time (NULL) + 5;
+
+  /* a random port, so that tests running alongside us don't take it */
+  tr_variantInitDict (&settings, 3);
+  tr_variantDictAddBool (&settings, TR_KEY_peer_port_random_on_start, true);
+  tr_variantDictAddBool (&settings, TR_KEY_dht_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_utp_enabled, false);
+  data.session = libttest_session_init (&settings);
+  check (data.session->udp_socket != TR_BAD_SOCKET);
+
+  runAndWait (&data, sendPacketsFunc);
+
+  do
+    {
+      tr_wait_msec (10);
+      runAndWait (&data, getStatsFunc);
+    }
+  while (data.stats.packets_in < PACKET_COUNT && time (NULL) <= deadline);
+
+  check_uint_eq (PACKET_COUNT, data.stats.packets_out);
+  check_uint_eq (PACKET_COUNT, data.stats.packets_in);
+
+#ifdef HAVE_SENDMMSG
+  check (data.stats.send_calls < PACKET_COUNT);
+#else
+  check_uint_eq (PACKET_COUNT, data.stats.send_calls);
+#endif
+
+#ifdef HAVE_RECVMMSG
+  check (data.stats.recv_calls < PACKET_COUNT);
+#endif
+
+  libttest_session_close (data.session);
+  tr_variantFree (&settings);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_batching };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -158,10 +158,11 @@ get_node (tr_ptrArray * stack, tr_quark * key, tr_variant * top, int * err)
  * attack via maliciously-crafted bencoded data. (#667)
  */
 int
-tr_variantParseBenc (const void    * buf_in,
-                     const void    * bufend_in,
-                     tr_variant    * top,
-                     const char   ** setme_end)
+tr_variantParseBenc (const void        * buf_in,
+                     const void        * bufend_in,
+                     tr_variant        * top,
+                     const char       ** setme_end,
+                     tr_variant_arena  * arena)
 {
   int err = 0;
   const uint8_t * buf = buf_in;
@@ -201,6 +202,7 @@ tr_variantParseBenc (const void    * buf_in,
           if ((v = get_node (&stack, &key, top, &err)))
             {
               tr_variantInitList (v, 0);
+              v->val.l.arena = arena;
               tr_ptrArrayAppend (&stack, v);
             }
         }
@@ -213,6 +215,7 @@ tr_variantParseBenc (const void    * buf_in,
           if ((v = get_node (&stack, &key, top, &err)))
             {
               tr_variantInitDict (v, 0);
+              v->val.l.arena = arena;
               tr_ptrArrayAppend (&stack, v);
             }
         }
@@ -246,7 +249,12 @@ tr_variantParseBenc (const void    * buf_in,
           if (!key && !tr_ptrArrayEmpty(&stack) && tr_variantIsDict(tr_ptrArrayBack(&stack)))
             key = tr_quark_new (str, str_len);
           else if ((v = get_node (&stack, &key, top, &err)))
-            tr_variantInitStr (v, str, str_len);
+            {
+              if (arena != NULL)
+                tr_variantInitStrView (v, str, str_len);
+              else
+                tr_variantInitStr (v, str, str_len);
+            }
         }
       else /* invalid bencoded text... march past it */
         {
@@ -37,11 +37,13 @@ void tr_variantToBufBenc (const tr_variant * top, struct evbuffer * buf);
 
 void tr_variantInit (tr_variant * v, char type);
 
-int tr_jsonParse (const char    * source, /* Such as a filename. Only when logging an error */
-                  const void    * vbuf,
-                  size_t          len,
-                  tr_variant    * setme_benc,
-                  const char   ** setme_end);
+/* if `arena' is set, the tree and copies of its strings are allocated from it */
+int tr_jsonParse (const char       * source, /* Such as a filename. Only when logging an error */
+                  const void       * vbuf,
+                  size_t             len,
+                  tr_variant       * setme_benc,
+                  const char      ** setme_end,
+                  tr_variant_arena * arena);
 
 /** @brief Private function that's exposed here only for unit tests */
 int tr_bencParseInt (const uint8_t *  buf,
@@ -56,9 +58,19 @@ int tr_bencParseStr (const uint8_t *  buf,
                      const uint8_t ** setme_str,
                      size_t *         setme_strlen);
 
-int tr_variantParseBenc (const void     * buf,
-                         const void     * end,
-                         tr_variant     * top,
-                         const char ** setme_end);
+/* if `arena' is set, the tree is allocated from it and borrows its strings from `buf' */
+int tr_variantParseBenc (const void       * buf,
+                         const void       * end,
+                         tr_variant       * top,
+                         const char      ** setme_end,
+                         tr_variant_arena * arena);
+
+void * tr_variantArenaAlloc (tr_variant_arena * arena, size_t size);
+
+/* like tr_variantInitStr (), but copy `str' into `arena' */
+void tr_variantInitArenaStr (tr_variant * v, tr_variant_arena * arena, const void * str, size_t len);
+
+/* like tr_variantInitStr (), but point at `str' instead of copying it */
+void tr_variantInitStrView (tr_variant * v, const void * str, size_t len);
 
 
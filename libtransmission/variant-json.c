@@ -44,6 +44,7 @@ struct json_wrapper_data
   struct evbuffer * strbuf;
   const char * source;
   tr_ptrArray stack;
+  tr_variant_arena * arena;
 };
 
 static tr_variant*
@@ -129,6 +130,7 @@ action_callback_PUSH (jsonsl_t                  jsn,
         data->has_content = true;
         node = get_node (jsn);
         tr_variantInitList (node, 0);
+        node->val.l.arena = data->arena;
         tr_ptrArrayAppend (&data->stack, node);
         break;
 
@@ -136,6 +138,7 @@ action_callback_PUSH (jsonsl_t                  jsn,
         data->has_content = true;
         node = get_node (jsn);
         tr_variantInitDict (node, 0);
+        node->val.l.arena = data->arena;
         tr_ptrArrayAppend (&data->stack, node);
         break;
 
@@ -286,7 +289,10 @@ action_callback_POP (jsonsl_t                  jsn,
     {
       size_t len;
       const char * str = extract_string (jsn, state, &len, data->strbuf);
-      tr_variantInitStr (get_node (jsn), str, len);
+      if (data->arena != NULL)
+        tr_variantInitArenaStr (get_node (jsn), data->arena, str, len);
+      else
+        tr_variantInitStr (get_node (jsn), str, len);
       data->has_content = true;
     }
   else if (state->type == JSONSL_T_HKEY)
@@ -327,11 +333,12 @@ action_callback_POP (jsonsl_t                  jsn,
 }
 
 int
-tr_jsonParse (const char     * source,
-              const void     * vbuf,
-              size_t           len,
-              tr_variant     * setme_variant,
-              const char    ** setme_end)
+tr_jsonParse (const char       * source,
+              const void       * vbuf,
+              size_t             len,
+              tr_variant       * setme_variant,
+              const char      ** setme_end,
+              tr_variant_arena * arena)
 {
   int error;
   jsonsl_t jsn;
@@ -350,6 +357,7 @@ tr_jsonParse (const char     * source,
   data.top = setme_variant;
   data.stack = TR_PTR_ARRAY_INIT;
   data.source = source;
+  data.arena = arena;
   data.keybuf = evbuffer_new ();
   data.strbuf = evbuffer_new ();
 
@@ -509,28 +517,21 @@ jsonRealFunc (const tr_variant * val,
 }
 
 static void
-jsonStringFunc (const tr_variant * val,
-                void             * vdata)
+jsonAppendString (struct evbuffer * out, const char * str, size_t len)
 {
-  char * out;
+  char * outbuf;
   char * outwalk;
   char * outend;
   struct evbuffer_iovec vec[1];
-  struct jsonWalk * data = vdata;
-  const char * str;
-  size_t len;
-  const unsigned char * it;
-  const unsigned char * end;
+  const unsigned char * it = (const unsigned char *) str;
+  const unsigned char * end = it + len;
 
-  tr_variantGetStr (val, &str, &len);
-  it = (const unsigned char *) str;
-  end = it + len;
-
-  evbuffer_reserve_space (data->out, len * 4, vec, 1);
-  out = vec[0].iov_base;
-  outend = out + vec[0].iov_len;
+  /* worst case: every byte becomes a \u00XX escape, plus the quotes */
+  evbuffer_reserve_space (out, len * 6 + 2, vec, 1);
+  outbuf = vec[0].iov_base;
+  outend = outbuf + vec[0].iov_len;
 
-  outwalk = out;
+  outwalk = outbuf;
   *outwalk++ = '"';
 
   for (; it!=end; ++it)
@@ -567,8 +568,20 @@ jsonStringFunc (const tr_variant * val,
     }
 
   *outwalk++ = '"';
-  vec[0].iov_len = outwalk - out;
-  evbuffer_commit_space (data->out, vec, 1);
+  vec[0].iov_len = outwalk - outbuf;
+  evbuffer_commit_space (out, vec, 1);
+}
+
+static void
+jsonStringFunc (const tr_variant * val,
+                void             * vdata)
+{
+  size_t len;
+  const char * str;
+  struct jsonWalk * data = vdata;
+
+  tr_variantGetStr (val, &str, &len);
+  jsonAppendString (data->out, str, len);
 
   jsonChildFunc (data);
 }
@@ -625,8 +638,8 @@ static const struct VariantWalkFuncs walk_funcs = { jsonIntFunc,
                                                     jsonListBeginFunc,
                                                     jsonContainerEndFunc };
 
-void
-tr_variantToBufJson (const tr_variant * top, struct evbuffer * buf, bool lean)
+static void
+jsonWalk (const tr_variant * top, struct evbuffer * buf, bool lean)
 {
   struct jsonWalk data;
 
@@ -635,7 +648,129 @@ tr_variantToBufJson (const tr_variant * top, struct evbuffer * buf, bool lean)
   data.parents = NULL;
 
   tr_variantWalk (top, &walk_funcs, &data, true);
+}
+
+void
+tr_variantToBufJson (const tr_variant * top, struct evbuffer * buf, bool lean)
+{
+  jsonWalk (top, buf, lean);
 
   if (evbuffer_get_length (buf))
     evbuffer_add_printf (buf, "\n");
 }
+
+/****
+*****  Streaming
+****/
+
+struct tr_json_writer
+{
+  struct evbuffer * out;
+  int depth;
+  bool keyWritten; /* if true, the next value belongs to that key */
+  bool isDict[MAX_DEPTH];
+  int childCount[MAX_DEPTH];
+};
+
+tr_json_writer *
+tr_jsonWriterNew (struct evbuffer * out)
+{
+  tr_json_writer * w = tr_new0 (tr_json_writer, 1);
+  w->out = out;
+  return w;
+}
+
+void
+tr_jsonWriterFree (tr_json_writer * w)
+{
+  tr_free (w);
+}
+
+static void
+jsonWriterBeforeValue (tr_json_writer * w)
+{
+  if (w->depth == 0)
+    return;
+
+  if (w->isDict[w->depth-1])
+    {
+      assert (w->keyWritten);
+      w->keyWritten = false;
+    }
+  else if (w->childCount[w->depth-1]++ > 0)
+    {
+      evbuffer_add (w->out, ",", 1);
+    }
+}
+
+static void
+jsonWriterPush (tr_json_writer * w, bool isDict)
+{
+  assert (w->depth < MAX_DEPTH);
+
+  jsonWriterBeforeValue (w);
+  evbuffer_add (w->out, isDict ? "{" : "[", 1);
+  w->isDict[w->depth] = isDict;
+  w->childCount[w->depth] = 0;
+  ++w->depth;
+}
+
+void
+tr_jsonWriterDictBegin (tr_json_writer * w)
+{
+  jsonWriterPush (w, true);
+}
+
+void
+tr_jsonWriterListBegin (tr_json_writer * w)
+{
+  jsonWriterPush (w, false);
+}
+
+void
+tr_jsonWriterEnd (tr_json_writer * w)
+{
+  assert (w->depth > 0);
+  assert (!w->keyWritten);
+
+  --w->depth;
+  evbuffer_add (w->out, w->isDict[w->depth] ? "}" : "]", 1);
+}
+
+void
+tr_jsonWriterKey (tr_json_writer * w, const tr_quark key)
+{
+  size_t len;
+  const char * str = tr_quark_get_string (key, &len);
+
+  assert (w->depth > 0);
+  assert (w->isDict[w->depth-1]);
+  assert (!w->keyWritten);
+
+  if (w->childCount[w->depth-1]++ > 0)
+    evbuffer_add (w->out, ",", 1);
+  jsonAppendString (w->out, str, len);
+  evbuffer_add (w->out, ":", 1);
+  w->keyWritten = true;
+}
+
+void
+tr_jsonWriterInt (tr_json_writer * w, int64_t value)
+{
+  jsonWriterBeforeValue (w);
+  evbuffer_add_printf (w->out, "%" PRId64, value);
+}
+
+void
+tr_jsonWriterStr (tr_json_writer * w, const char * value)
+{
+  jsonWriterBeforeValue (w);
+  jsonAppendString (w->out, value, strlen (value));
+}
+
+void
+tr_jsonWriterVariant (tr_json_writer * w, const tr_variant * value)
+{
+  jsonWriterBeforeValue (w);
+  jsonWalk (value, w->out, true);
+}
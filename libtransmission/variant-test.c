@@ -545,6 +545,122 @@ testParse2 (void)
   return 0;
 }
 
+static int
+testBorrowed (void)
+{
+  int i;
+  size_t len;
+  char * benc;
+  const char * str;
+  tr_variant top;
+  tr_variant * list;
+  tr_variant * child;
+  tr_variant_arena * arena;
+  const char * in = "d5:filesl3:one40:a string that's too long to fit inline..i3ee4:infod1:xi7eee";
+  const char * longStr = strstr (in, "a string");
+
+  /* long strings point into the input instead of being copied */
+  arena = tr_variantArenaNew ();
+  check_int_eq (0, tr_variantFromBencBorrowed (&top, in, strlen (in), arena));
+  check (tr_variantDictFindList (&top, TR_KEY_files, &list));
+  check_uint_eq (3, tr_variantListSize (list));
+  check (tr_variantGetStr (tr_variantListChild (list, 0), &str, &len));
+  check_uint_eq (3, len);
+  check_streq ("one", str);
+  check (tr_variantGetStr (tr_variantListChild (list, 1), &str, &len));
+  check_uint_eq (40, len);
+  check_ptr_eq (longStr, str);
+
+  /* it serializes back to what it came from */
+  benc = tr_variantToStr (&top, TR_VARIANT_FMT_BENC, &len);
+  check_streq (in, benc);
+  tr_free (benc);
+
+  /* things added to it are allocated from the arena too */
+  child = tr_variantDictAddDict (&top, TR_KEY_peers, 0);
+  for (i=0; i<1000; ++i)
+    tr_variantListAddStr (tr_variantDictAddList (child, i + 1, 1), "another string that's too long to fit inline");
+  check (tr_variantDictFindList (child, 1000, &list));
+  check (tr_variantGetStr (tr_variantListChild (list, 0), &str, &len));
+  check_streq ("another string that's too long to fit inline", str);
+
+  /* freeing the tree is a no-op; the arena frees it all */
+  tr_variantFree (&top);
+  tr_variantArenaFree (arena);
+
+  /* bad input still fails */
+  arena = tr_variantArenaNew ();
+  check (tr_variantFromBencBorrowed (&top, "d3:key", 6, arena) != 0);
+  tr_variantArenaFree (arena);
+
+  return 0;
+}
+
+static int
+testDictIndex (void)
+{
+  int i;
+  int64_t val;
+  tr_variant top;
+  tr_quark keys[1000];
+  const int n = sizeof (keys) / sizeof (keys[0]);
+
+  for (i=0; i<n; ++i)
+    {
+      char buf[32];
+      tr_snprintf (buf, sizeof (buf), "test-dict-index-%d", i);
+      keys[i] = tr_quark_new (buf, TR_BAD_SIZE);
+    }
+
+  /* big dicts are indexed, but find the same things as small ones */
+  tr_variantInitDict (&top, 0);
+  for (i=0; i<n; ++i)
+    {
+      tr_variantDictAddInt (&top, keys[i], i);
+      check (tr_variantDictFindInt (&top, keys[i], &val));
+      check_int_eq (i, val);
+      if (i + 1 < n)
+        check (tr_variantDictFind (&top, keys[i + 1]) == NULL);
+    }
+
+  /* removing moves the last child into the hole, and the index follows it */
+  for (i=0; i<n; i+=3)
+    check (tr_variantDictRemove (&top, keys[i]));
+  check (!tr_variantDictRemove (&top, keys[0]));
+  for (i=0; i<n; ++i)
+    {
+      if (i % 3 == 0)
+        {
+          check (tr_variantDictFind (&top, keys[i]) == NULL);
+        }
+      else
+        {
+          check (tr_variantDictFindInt (&top, keys[i], &val));
+          check_int_eq (i, val);
+        }
+    }
+
+  /* adding them back reuses the emptied slots */
+  for (i=0; i<n; i+=3)
+    tr_variantDictAddInt (&top, keys[i], -i);
+  for (i=0; i<n; ++i)
+    {
+      check (tr_variantDictFindInt (&top, keys[i], &val));
+      check_int_eq (i % 3 ? i : -i, val);
+    }
+
+  /* like the linear search, a duplicate key finds the first one added */
+  tr_variantInitInt (tr_variantDictAdd (&top, keys[1]), 12345);
+  check (tr_variantDictFindInt (&top, keys[1], &val));
+  check_int_eq (1, val);
+  check (tr_variantDictRemove (&top, keys[1]));
+  check (tr_variantDictFindInt (&top, keys[1], &val));
+  check_int_eq (12345, val);
+
+  tr_variantFree (&top);
+  return 0;
+}
+
 int
 main (void)
 {
@@ -555,6 +671,8 @@ main (void)
                                     testMerge,
                                     testBool,
                                     testParse2,
+                                    testBorrowed,
+                                    testDictIndex,
                                     testStackSmash };
   return runTests (tests, NUM_TESTS (tests));
 }
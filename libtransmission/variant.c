@@ -134,6 +134,98 @@ tr_variantInit (tr_variant * v, char type)
   memset (&v->val, 0, sizeof(v->val));
 }
 
+/***
+****  Arenas
+***/
+
+enum
+{
+  ARENA_BLOCK_SIZE = 64 * 1024,
+
+  /* bigger than this gets a block of its own, so as not to waste the rest */
+  ARENA_BIG_ALLOC = ARENA_BLOCK_SIZE / 4
+};
+
+struct arena_block
+{
+  struct arena_block * next;
+  size_t size;
+  size_t used;
+  union { double d; int64_t i; void * p; } data[]; /* aligned for tr_variant */
+};
+
+struct tr_variant_arena
+{
+  struct arena_block * blocks; /* the newest, which is being filled, first */
+};
+
+tr_variant_arena *
+tr_variantArenaNew (void)
+{
+  return tr_new0 (tr_variant_arena, 1);
+}
+
+void
+tr_variantArenaFree (tr_variant_arena * arena)
+{
+  if (arena != NULL)
+    {
+      struct arena_block * next;
+      struct arena_block * block;
+
+      for (block=arena->blocks; block!=NULL; block=next)
+        {
+          next = block->next;
+          tr_free (block);
+        }
+
+      tr_free (arena);
+    }
+}
+
+void *
+tr_variantArenaAlloc (tr_variant_arena * arena, size_t size)
+{
+  void * ret;
+  struct arena_block * block = arena->blocks;
+
+  /* keep everything aligned */
+  size = (size + sizeof (block->data[0]) - 1) & ~(sizeof (block->data[0]) - 1);
+
+  if (size > ARENA_BIG_ALLOC)
+    {
+      block = tr_malloc (sizeof (struct arena_block) + size);
+      block->size = block->used = size;
+
+      /* put it behind the block being filled */
+      if (arena->blocks != NULL)
+        {
+          block->next = arena->blocks->next;
+          arena->blocks->next = block;
+        }
+      else
+        {
+          block->next = NULL;
+          arena->blocks = block;
+        }
+
+      return block->data;
+    }
+
+  if (block == NULL || block->used + size > block->size)
+    {
+      block = tr_malloc (sizeof (struct arena_block) + ARENA_BLOCK_SIZE);
+      block->size = ARENA_BLOCK_SIZE;
+      block->used = 0;
+      block->next = arena->blocks;
+      arena->blocks = block;
+    }
+
+  ret = (char*)block->data + block->used;
+  block->used += size;
+  return ret;
+}
+
 /***
 ****
 ***/
@@ -166,6 +258,7 @@ tr_variant_string_get_string (const struct tr_variant_string * str)
       case TR_STRING_TYPE_BUF: ret = str->str.buf; break;
       case TR_STRING_TYPE_HEAP: ret = str->str.str; break;
       case TR_STRING_TYPE_QUARK: ret = str->str.str; break;
+      case TR_STRING_TYPE_VIEW: ret = str->str.str; break;
       default: ret = NULL;
     }
 
@@ -213,6 +306,43 @@ tr_variant_string_set_string (struct tr_variant_string  * str,
     }
 }
 
+/* point at bytes that someone else owns */
+static void
+tr_variant_string_set_view (struct tr_variant_string  * str,
+                            const char                * bytes,
+                            size_t                      len)
+{
+  tr_variant_string_clear (str);
+
+  str->type = TR_STRING_TYPE_VIEW;
+  str->str.str = bytes;
+  str->len = len;
+}
+
+/* like tr_variant_string_set_string (), but copy into `arena' */
+static void
+tr_variant_string_set_arena_string (struct tr_variant_string  * str,
+                                    tr_variant_arena          * arena,
+                                    const char                * bytes,
+                                    size_t                      len)
+{
+  if (bytes == NULL)
+    len = 0;
+  else if (len == TR_BAD_SIZE)
+    len = strlen (bytes);
+
+  if (len < sizeof (str->str.buf))
+    {
+      tr_variant_string_set_string (str, bytes, len);
+    }
+  else
+    {
+      char * tmp = tr_variantArenaAlloc (arena, len+1);
+      memcpy (tmp, bytes, len);
+      tmp[len] = '\0';
+      tr_variant_string_set_view (str, tmp, len);
+    }
+}
 
 /***
 ****
@@ -226,18 +356,158 @@ getStr (const tr_variant * v)
   return tr_variant_string_get_string (&v->val.s);
 }
 
+/***
+****  Dict indices
+****
+****  Small dicts are searched linearly. Once a dict with DICT_INDEX_MIN
+****  children is searched, it gets a hash table of its keys, which
+****  tr_variantDictAdd () and tr_variantDictRemove () keep up to date.
+****  It's an open-addressed table with linear probing, whose slots hold
+****  a child's position + 1, or 0 if they're empty. Since the table is
+****  built by a lookup, even lookups in big dicts aren't thread-safe.
+***/
+
+enum
+{
+  DICT_INDEX_MIN = 16
+};
+
+struct tr_variant_dict_index
+{
+  uint32_t mask; /* the slot count - 1 */
+  uint32_t slots[];
+};
+
+static inline uint32_t
+dictIndexHome (const struct tr_variant_dict_index * index, tr_quark key)
+{
+  uint32_t h = (uint32_t) key * 2654435761u;
+  h ^= h >> 16;
+  return h & index->mask;
+}
+
+static void
+dictIndexInsert (tr_variant * dict, uint32_t pos)
+{
+  struct tr_variant_dict_index * index = dict->val.l.index;
+  uint32_t i = dictIndexHome (index, dict->val.l.vals[pos].key);
+
+  /* duplicate keys go after the existing ones, so lookups still find the first */
+  while (index->slots[i] != 0)
+    i = (i + 1) & index->mask;
+
+  index->slots[i] = pos + 1;
+}
+
+static void
+dictIndexBuild (tr_variant * dict)
+{
+  uint32_t i;
+  uint32_t slot_count = 32;
+  size_t size;
+
+  /* keep it no more than half full */
+  while (slot_count < dict->val.l.count * 2u)
+    slot_count *= 2u;
+
+  size = sizeof (struct tr_variant_dict_index) + slot_count * sizeof (uint32_t);
+
+  if (dict->val.l.arena != NULL)
+    {
+      dict->val.l.index = tr_variantArenaAlloc (dict->val.l.arena, size);
+    }
+  else
+    {
+      tr_free (dict->val.l.index);
+      dict->val.l.index = tr_malloc (size);
+    }
+
+  memset (dict->val.l.index->slots, 0, slot_count * sizeof (uint32_t));
+  dict->val.l.index->mask = slot_count - 1;
+
+  for (i=0; i<dict->val.l.count; ++i)
+    dictIndexInsert (dict, i);
+}
+
+/* find the slot that points at `pos' */
+static uint32_t
+dictIndexFindSlot (const tr_variant * dict, uint32_t pos)
+{
+  const struct tr_variant_dict_index * index = dict->val.l.index;
+  uint32_t i = dictIndexHome (index, dict->val.l.vals[pos].key);
+
+  while (index->slots[i] != pos + 1)
+    {
+      assert (index->slots[i] != 0);
+      i = (i + 1) & index->mask;
+    }
+
+  return i;
+}
+
+/* called before the child at `pos' is removed and replaced by the one at `last' */
+static void
+dictIndexRemove (tr_variant * dict, uint32_t pos, uint32_t last)
+{
+  struct tr_variant_dict_index * index = dict->val.l.index;
+  uint32_t hole = dictIndexFindSlot (dict, pos);
+  uint32_t i = hole;
+
+  /* empty the slot, then shift the rest of its run back so that no
+     entry is left on the far side of an empty slot from its home */
+  index->slots[hole] = 0;
+
+  for (;;)
+    {
+      uint32_t home;
+
+      i = (i + 1) & index->mask;
+      if (index->slots[i] == 0)
+        break;
+
+      home = dictIndexHome (index, dict->val.l.vals[index->slots[i] - 1].key);
+
+      /* can it move back to the hole without passing its home? */
+      if (((i - home) & index->mask) >= ((i - hole) & index->mask))
+        {
+          index->slots[hole] = index->slots[i];
+          index->slots[i] = 0;
+          hole = i;
+        }
+    }
+
+  if (pos != last)
+    index->slots[dictIndexFindSlot (dict, last)] = pos + 1;
+}
+
 static int
 dictIndexOf (const tr_variant * dict, const tr_quark key)
 {
   if (tr_variantIsDict (dict))
     {
-      const tr_variant * walk;
-      const tr_variant * const begin = dict->val.l.vals;
-      const tr_variant * const end = begin + dict->val.l.count;
+      const struct tr_variant_dict_index * index;
 
-      for (walk=begin; walk!=end; ++walk)
-        if (walk->key == key)
-          return walk - begin;
+      if (dict->val.l.index == NULL && dict->val.l.count >= DICT_INDEX_MIN)
+        dictIndexBuild ((tr_variant *) dict);
+
+      if ((index = dict->val.l.index) != NULL)
+        {
+          uint32_t i;
+
+          for (i=dictIndexHome (index, key); index->slots[i]!=0; i=(i+1)&index->mask)
+            if (dict->val.l.vals[index->slots[i] - 1].key == key)
+              return index->slots[i] - 1;
+        }
+      else
+        {
+          const tr_variant * walk;
+          const tr_variant * const begin = dict->val.l.vals;
+          const tr_variant * const end = begin + dict->val.l.count;
+
+          for (walk=begin; walk!=end; ++walk)
+            if (walk->key == key)
+              return walk - begin;
+        }
     }
 
   return -1;
@@ -481,6 +751,47 @@ tr_variantInitStr (tr_variant * v, const void * str, size_t len)
   tr_variant_string_set_string (&v->val.s, str, len);
 }
 
+void
+tr_variantInitStrView (tr_variant * v, const void * str, size_t len)
+{
+  tr_variantInit (v, TR_VARIANT_TYPE_STR);
+
+  /* short ones fit inside the variant anyway */
+  if (len < sizeof (v->val.s.str.buf))
+    tr_variant_string_set_string (&v->val.s, str, len);
+  else
+    tr_variant_string_set_view (&v->val.s, str, len);
+}
+
+void
+tr_variantInitArenaStr (tr_variant * v, tr_variant_arena * arena, const void * str, size_t len)
+{
+  tr_variantInit (v, TR_VARIANT_TYPE_STR);
+  tr_variant_string_set_arena_string (&v->val.s, arena, str, len);
+}
+
+void
+tr_variantInitChildStr (const tr_variant * container, tr_variant * child, const void * str, size_t len)
+{
+  assert (tr_variantIsContainer (container));
+
+  if (container->val.l.arena != NULL)
+    tr_variantInitArenaStr (child, container->val.l.arena, str, len);
+  else
+    tr_variantInitStr (child, str, len);
+}
+
+static void containerReserve (tr_variant * v, size_t count);
+
+/* make a child of `container' a new list or dict in the same arena, if any */
+static void
+initChildContainer (const tr_variant * container, tr_variant * child, char type, size_t reserve_count)
+{
+  tr_variantInit (child, type);
+  child->val.l.arena = container->val.l.arena;
+  containerReserve (child, reserve_count);
+}
+
 void
 tr_variantInitBool (tr_variant * v, bool value)
 {
@@ -523,7 +834,18 @@ containerReserve (tr_variant * v, size_t count)
       while (n < needed)
         n *= 2u;
 
-      v->val.l.vals = tr_renew (tr_variant, v->val.l.vals, n);
+      if (v->val.l.arena != NULL)
+        {
+          tr_variant * vals = tr_variantArenaAlloc (v->val.l.arena, n * sizeof (tr_variant));
+          if (v->val.l.count > 0)
+            memcpy (vals, v->val.l.vals, v->val.l.count * sizeof (tr_variant));
+          v->val.l.vals = vals;
+        }
+      else
+        {
+          v->val.l.vals = tr_renew (tr_variant, v->val.l.vals, n);
+        }
+
       v->val.l.alloc = n;
     }
 }
@@ -542,6 +864,16 @@ tr_variantInitDict (tr_variant * v, size_t reserve_count)
   tr_variantDictReserve (v, reserve_count);
 }
 
+void
+tr_variantInitArenaDict (tr_variant * v, tr_variant_arena * arena, size_t reserve_count)
+{
+  assert (arena != NULL);
+
+  tr_variantInit (v, TR_VARIANT_TYPE_DICT);
+  v->val.l.arena = arena;
+  tr_variantDictReserve (v, reserve_count);
+}
+
 void
 tr_variantDictReserve (tr_variant  * dict,
                        size_t        reserve_count)
@@ -597,7 +929,7 @@ tr_variantListAddStr (tr_variant  * list,
                       const char  * val)
 {
   tr_variant * child = tr_variantListAdd (list);
-  tr_variantInitStr (child, val, TR_BAD_SIZE);
+  tr_variantInitChildStr (list, child, val, TR_BAD_SIZE);
   return child;
 }
 
@@ -616,7 +948,7 @@ tr_variantListAddRaw (tr_variant  * list,
                       size_t        len)
 {
   tr_variant * child = tr_variantListAdd (list);
-  tr_variantInitRaw (child, val, len);
+  tr_variantInitChildStr (list, child, val, len);
   return child;
 }
 
@@ -625,7 +957,7 @@ tr_variantListAddList (tr_variant  * list,
                        size_t        reserve_count)
 {
   tr_variant * child = tr_variantListAdd (list);
-  tr_variantInitList (child, reserve_count);
+  initChildContainer (list, child, TR_VARIANT_TYPE_LIST, reserve_count);
   return child;
 }
 
@@ -634,7 +966,7 @@ tr_variantListAddDict (tr_variant  * list,
                        size_t        reserve_count)
 {
   tr_variant * child = tr_variantListAdd (list);
-  tr_variantInitDict (child, reserve_count);
+  initChildContainer (list, child, TR_VARIANT_TYPE_DICT, reserve_count);
   return child;
 }
 
@@ -651,6 +983,15 @@ tr_variantDictAdd (tr_variant      * dict,
   val = dict->val.l.vals + dict->val.l.count++;
   tr_variantInit (val, TR_VARIANT_TYPE_INT);
   val->key = key;
+
+  if (dict->val.l.index != NULL)
+    {
+      if (dict->val.l.count * 2u > dict->val.l.index->mask + 1u)
+        dictIndexBuild (dict);
+      else
+        dictIndexInsert (dict, dict->val.l.count - 1);
+    }
+
   return val;
 }
 
@@ -726,7 +1067,7 @@ tr_variantDictAddStr (tr_variant      * dict,
                       const char      * val)
 {
   tr_variant * child = dictFindOrAdd (dict, key, TR_VARIANT_TYPE_STR);
-  tr_variantInitStr (child, val, TR_BAD_SIZE);
+  tr_variantInitChildStr (dict, child, val, TR_BAD_SIZE);
   return child;
 }
 
@@ -737,7 +1078,7 @@ tr_variantDictAddRaw (tr_variant      * dict,
                       size_t            len)
 {
   tr_variant * child = dictFindOrAdd (dict, key, TR_VARIANT_TYPE_STR);
-  tr_variantInitRaw (child, src, len);
+  tr_variantInitChildStr (dict, child, src, len);
   return child;
 }
 
@@ -747,7 +1088,7 @@ tr_variantDictAddList (tr_variant     * dict,
                        size_t           reserve_count)
 {
   tr_variant * child = tr_variantDictAdd (dict, key);
-  tr_variantInitList (child, reserve_count);
+  initChildContainer (dict, child, TR_VARIANT_TYPE_LIST, reserve_count);
   return child;
 }
 
@@ -757,7 +1098,7 @@ tr_variantDictAddDict (tr_variant     * dict,
                        size_t           reserve_count)
 {
   tr_variant * child = tr_variantDictAdd (dict, key);
-  tr_variantInitDict (child, reserve_count);
+  initChildContainer (dict, child, TR_VARIANT_TYPE_DICT, reserve_count);
   return child;
 }
 
@@ -784,6 +1125,9 @@ tr_variantDictRemove (tr_variant     * dict,
     {
       const int last = dict->val.l.count - 1;
 
+      if (dict->val.l.index != NULL)
+        dictIndexRemove (dict, i, last);
+
       tr_variantFree (&dict->val.l.vals[i]);
 
       if (i != last)
@@ -995,7 +1339,11 @@ freeStringFunc (const tr_variant * v, void * unused UNUSED)
 static void
 freeContainerEndFunc (const tr_variant * v, void * unused UNUSED)
 {
-  tr_free (v->val.l.vals);
+  if (v->val.l.arena == NULL)
+    {
+      tr_free (v->val.l.vals);
+      tr_free (v->val.l.index);
+    }
 }
 
 static const struct VariantWalkFuncs freeWalkFuncs = { freeDummyFunc,
@@ -1009,6 +1357,10 @@ static const struct VariantWalkFuncs freeWalkFuncs = { freeDummyFunc,
 void
 tr_variantFree (tr_variant * v)
 {
+  /* everything in an arena's tree belongs to the arena */
+  if (tr_variantIsContainer (v) && v->val.l.arena != NULL)
+    return;
+
   if (tr_variantIsSomething (v))
     tr_variantWalk (v, &freeWalkFuncs, NULL, false);
 }
@@ -1313,13 +1665,14 @@ tr_variantFromFile (tr_variant      * setme,
   return ret;
 }
 
-int
-tr_variantFromBuf (tr_variant      * setme,
-                   tr_variant_fmt    fmt,
-                   const void      * buf,
-                   size_t            buflen,
-                   const char      * optional_source,
-                   const char     ** setme_end)
+static int
+variantFromBuf (tr_variant        * setme,
+                tr_variant_fmt      fmt,
+                const void        * buf,
+                size_t              buflen,
+                const char        * optional_source,
+                const char       ** setme_end,
+                tr_variant_arena  * arena)
 {
   int err;
   struct locale_context locale_ctx;
@@ -1331,11 +1684,11 @@ tr_variantFromBuf (tr_variant      * setme,
     {
       case TR_VARIANT_FMT_JSON:
       case TR_VARIANT_FMT_JSON_LEAN:
-        err = tr_jsonParse (optional_source, buf, buflen, setme, setme_end);
+        err = tr_jsonParse (optional_source, buf, buflen, setme, setme_end, arena);
         break;
 
       default /* TR_VARIANT_FMT_BENC */:
-        err = tr_variantParseBenc (buf, ((const char*)buf)+buflen, setme, setme_end);
+        err = tr_variantParseBenc (buf, ((const char*)buf)+buflen, setme, setme_end, arena);
         break;
     }
 
@@ -1343,3 +1696,37 @@ tr_variantFromBuf (tr_variant      * setme,
   restore_locale (&locale_ctx);
   return err;
 }
+
+int
+tr_variantFromBuf (tr_variant      * setme,
+                   tr_variant_fmt    fmt,
+                   const void      * buf,
+                   size_t            buflen,
+                   const char      * optional_source,
+                   const char     ** setme_end)
+{
+  return variantFromBuf (setme, fmt, buf, buflen, optional_source, setme_end, NULL);
+}
+
+int
+tr_variantFromJsonArena (tr_variant        * setme,
+                         const void        * buf,
+                         size_t              buflen,
+                         tr_variant_arena  * arena)
+{
+  assert (arena != NULL);
+
+  return variantFromBuf (setme, TR_VARIANT_FMT_JSON, buf, buflen, NULL, NULL, arena);
+}
+
+int
+tr_variantFromBencBorrowed (tr_variant        * setme,
+                            const void        * buf,
+                            size_t              buflen,
+                            tr_variant_arena  * arena)
+{
+  assert (arena != NULL);
+
+  /* benc has no reals, so there's no need for the locale dance */
+  return tr_variantParseBenc (buf, ((const char*)buf)+buflen, setme, NULL, arena);
+}
@@ -18,6 +18,8 @@ extern "C" {
 struct evbuffer;
 
 struct tr_error;
+struct tr_variant_arena;
+struct tr_variant_dict_index;
 
 /**
  * @addtogroup tr_variant Variant
@@ -35,7 +37,8 @@ typedef enum
 {
   TR_STRING_TYPE_QUARK,
   TR_STRING_TYPE_HEAP,
-  TR_STRING_TYPE_BUF
+  TR_STRING_TYPE_BUF,
+  TR_STRING_TYPE_VIEW /* borrowed. Not freed, and maybe not nul-terminated */
 }
 tr_string_type;
 
@@ -85,9 +88,11 @@ typedef struct tr_variant
 
       struct
         {
-          size_t alloc;
-          size_t count;
+          uint32_t alloc;
+          uint32_t count;
           struct tr_variant * vals;
+          struct tr_variant_arena * arena; /* if set, it owns vals */
+          struct tr_variant_dict_index * index; /* only for big dicts */
         } l;
     }
   val;
@@ -96,6 +101,42 @@ tr_variant;
 
 void  tr_variantFree (tr_variant *);
 
+/***
+****  Arenas
+****
+****  A tree whose containers are allocated from an arena has all of its
+****  children, and copies of its strings, bump-allocated from that arena.
+****  tr_variantFree () on it is a no-op; the whole tree is released at once
+****  by tr_variantArenaFree (). Children must only be added through the
+****  container's tr_variantDictAdd* () and tr_variantListAdd* () functions,
+****  not by tr_variantDictSteal () or by calling tr_variantInitStr (),
+****  tr_variantInitList () or tr_variantInitDict () on a bare
+****  tr_variantDictAdd () or tr_variantListAdd () slot, since those would
+****  be leaked. Use tr_variantInitChildStr () for such a slot instead.
+***/
+
+typedef struct tr_variant_arena tr_variant_arena;
+
+tr_variant_arena * tr_variantArenaNew  (void);
+
+void               tr_variantArenaFree (tr_variant_arena * arena);
+
+/** @brief start a tree that's allocated from `arena' */
+void               tr_variantInitArenaDict (tr_variant       * initme,
+                                            tr_variant_arena * arena,
+                                            size_t             reserve_count);
+
+/**
+ * @brief set a slot from tr_variantDictAdd () or tr_variantListAdd () to a string
+ *
+ * Like tr_variantInitStr (), but the copy comes from `container''s arena if
+ * it has one.
+ */
+void               tr_variantInitChildStr  (const tr_variant * container,
+                                            tr_variant       * child,
+                                            const void       * str,
+                                            size_t             str_len);
+
 /***
 ****  Serialization / Deserialization
 ***/
@@ -119,6 +160,42 @@ char* tr_variantToStr (const tr_variant * variant,
 struct evbuffer * tr_variantToBuf (const tr_variant * variant,
                                    tr_variant_fmt     fmt);
 
+/***
+****  Streaming JSON
+****
+****  For building large JSON documents a piece at a time, e.g. to send
+****  them out while they're being written, without building the whole
+****  document as a tr_variant first. The output is TR_VARIANT_FMT_JSON_LEAN.
+***/
+
+typedef struct tr_json_writer tr_json_writer;
+
+/** @brief create a writer that appends to `out' */
+tr_json_writer * tr_jsonWriterNew       (struct evbuffer  * out);
+
+void             tr_jsonWriterFree      (tr_json_writer   * writer);
+
+void             tr_jsonWriterDictBegin (tr_json_writer   * writer);
+
+void             tr_jsonWriterListBegin (tr_json_writer   * writer);
+
+/** @brief close the innermost dict or list */
+void             tr_jsonWriterEnd       (tr_json_writer   * writer);
+
+/** @brief write a dict key. The next thing written is its value. */
+void             tr_jsonWriterKey       (tr_json_writer   * writer,
+                                         const tr_quark     key);
+
+void             tr_jsonWriterInt       (tr_json_writer   * writer,
+                                         int64_t            value);
+
+void             tr_jsonWriterStr       (tr_json_writer   * writer,
+                                         const char       * value);
+
+/** @brief write a tr_variant (and all of its children) as a value */
+void             tr_jsonWriterVariant   (tr_json_writer   * writer,
+                                         const tr_variant * value);
+
 /* TR_VARIANT_FMT_JSON_LEAN and TR_VARIANT_FMT_JSON are equivalent here. */
 bool tr_variantFromFile (tr_variant       * setme,
                          tr_variant_fmt     fmt,
@@ -133,6 +210,19 @@ int tr_variantFromBuf (tr_variant     * setme,
                        const char     * optional_source,
                        const char    ** setme_end);
 
+/**
+ * @brief parse benc into a tree allocated from `arena', without copying strings.
+ *
+ * Strings that don't fit inside a tr_variant point into `buf' instead of
+ * being copied, so `buf' must outlive the tree and those strings aren't
+ * nul-terminated: use the lengths from tr_variantGetStr () and friends.
+ * This is for large, short-lived documents such as .torrent files.
+ */
+int tr_variantFromBencBorrowed (tr_variant        * setme,
+                                const void        * buf,
+                                size_t              buflen,
+                                tr_variant_arena  * arena);
+
 static inline int
 tr_variantFromBenc (tr_variant * setme,
                     const void * buf,
@@ -169,6 +259,18 @@ tr_variantFromJsonFull (tr_variant  * setme,
                             source,
                             setme_end);
 }
+
+/**
+ * @brief parse JSON into a tree allocated from `arena'.
+ *
+ * Unlike tr_variantFromBencBorrowed (), strings are copied into the arena,
+ * since JSON strings may need to be unescaped.
+ */
+int tr_variantFromJsonArena (tr_variant        * setme,
+                             const void        * buf,
+                             size_t              buflen,
+                             tr_variant_arena  * arena);
+
 static inline int
 tr_variantFromJson (tr_variant  * setme,
                     const void  * buf,
@@ -11,6 +11,7 @@
  #define _XOPEN_SOURCE 600
 #endif
 
+#include <assert.h>
 #include <string.h> /* memcmp () */
 #include <stdlib.h> /* free () */
 
@@ -22,9 +23,11 @@
 #include "completion.h"
 #include "crypto-utils.h"
 #include "file.h"
+#include "inout.h" /* tr_ioFindFileLocation () */
 #include "list.h"
 #include "log.h"
 #include "platform.h" /* tr_lock () */
+#include "session.h"
 #include "torrent.h"
 #include "utils.h" /* tr_valloc (), tr_free () */
 #include "verify.h"
@@ -35,206 +38,357 @@
 
 enum
 {
-  MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100
+  /* how much each worker reads from disk at a time */
+  VERIFY_BUFFER_SIZE = 1024 * 1024,
+
+  /* how many bytes' worth of pieces a worker claims at once.
+     large enough to keep reads mostly sequential, small enough
+     that several workers can share a single torrent */
+  VERIFY_BATCH_SIZE = 1024 * 1024 * 8,
+
+  /* how long a worker waits when the I/O budget is spent */
+  VERIFY_BUDGET_WAIT_MSEC = 50
 };
 
-static bool
-verifyTorrent (tr_torrent * tor, bool * stopFlag)
+struct verify_node
+{
+  tr_torrent          * torrent;
+  tr_verify_done_func   callback_func;
+  void                * callback_data;
+  uint64_t              current_size;
+};
+
+/* a torrent whose pieces are being handed out to the workers */
+struct verify_job
+{
+  struct verify_node   node;
+  tr_piece_index_t     next_piece;
+  int                  active_workers;
+  bool                 stop;
+  bool                 done;
+  bool                 changed;
+  time_t               begin;
+};
+
+/* a worker's currently-open file */
+struct verify_file
+{
+  const tr_torrent   * tor;
+  tr_file_index_t      index;
+  tr_sys_file_t        fd;
+};
+
+static tr_list * verifyList = NULL;
+static tr_list * jobList = NULL;
+static int workerCount = 0;
+
+/* the I/O budget shared by all the workers */
+static time_t budgetPeriod = 0;
+static uint64_t budgetUsed = 0;
+
+static tr_lock*
+getVerifyLock (void)
 {
-  time_t end;
-  tr_sha1_ctx_t sha;
-  tr_sys_file_t fd = TR_BAD_SYS_FILE;
-  uint64_t filePos = 0;
-  bool changed = false;
-  bool hadPiece = false;
-  time_t lastSleptAt = 0;
-  uint32_t piecePos = 0;
-  tr_file_index_t fileIndex = 0;
-  tr_file_index_t prevFileIndex = !fileIndex;
-  tr_piece_index_t pieceIndex = 0;
-  const time_t begin = tr_time ();
-  const size_t buflen = 1024 * 128; /* 128 KiB buffer */
-  uint8_t * buffer = tr_valloc (buflen);
-
-  sha = tr_sha1_init ();
-
-  tr_logAddTorDbg (tor, "%s", "verifying torrent...");
-  tr_torrentSetChecked (tor, 0);
-  while (!*stopFlag && (pieceIndex < tor->info.pieceCount))
+  static tr_lock * lock = NULL;
+
+  if (lock == NULL)
+    lock = tr_lockNew ();
+
+  return lock;
+}
+
+/***
+****
+***/
+
+/* sleeping while the I/O budget is spent goes a long
+ * way towards reducing the verify's IO load... */
+static void
+verifyConsumeBudget (const tr_session * session, uint64_t bytes)
+{
+  tr_lock * lock = getVerifyLock ();
+
+  for (;;)
     {
-      uint64_t leftInPiece;
-      uint64_t bytesThisPass;
-      uint64_t leftInFile;
-      const tr_file * file = &tor->info.files[fileIndex];
+      const uint64_t limit = tr_sessionGetVerifyIOLimit_MB (session) * (uint64_t)tr_mem_K * tr_mem_K;
+      const time_t now = tr_time ();
+      bool allowed;
 
-      /* if we're starting a new piece... */
-      if (piecePos == 0)
-        hadPiece = tr_torrentPieceIsComplete (tor, pieceIndex);
+      tr_lockLock (lock);
 
-      /* if we're starting a new file... */
-      if (filePos == 0 && fd == TR_BAD_SYS_FILE && fileIndex != prevFileIndex)
+      if (budgetPeriod != now)
         {
-          char * filename = tr_torrentFindFile (tor, fileIndex);
-          fd = filename == NULL ? TR_BAD_SYS_FILE : tr_sys_file_open (filename,
-               TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, NULL);
-          tr_free (filename);
-          prevFileIndex = fileIndex;
+          budgetPeriod = now;
+          budgetUsed = 0;
         }
 
-      /* figure out how much we can read this pass */
-      leftInPiece = tr_torPieceCountBytes (tor, pieceIndex) - piecePos;
-      leftInFile = file->length - filePos;
-      bytesThisPass = MIN (leftInFile, leftInPiece);
-      bytesThisPass = MIN (bytesThisPass, buflen);
+      allowed = limit == 0 || budgetUsed < limit;
+      if (allowed)
+        budgetUsed += bytes;
 
-      /* read a bit */
-      if (fd != TR_BAD_SYS_FILE)
-        {
-          uint64_t numRead;
-          if (tr_sys_file_read_at (fd, buffer, bytesThisPass, filePos, &numRead, NULL) && numRead > 0)
-            {
-              bytesThisPass = numRead;
-              tr_sha1_update (sha, buffer, bytesThisPass);
-#if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_DONTNEED
-              (void) posix_fadvise (fd, filePos, bytesThisPass, POSIX_FADV_DONTNEED);
-#endif
-            }
-        }
+      tr_lockUnlock (lock);
 
-      /* move our offsets */
-      leftInPiece -= bytesThisPass;
-      leftInFile -= bytesThisPass;
-      piecePos += bytesThisPass;
-      filePos += bytesThisPass;
+      if (allowed)
+        break;
 
-      /* if we're finishing a piece... */
-      if (leftInPiece == 0)
-        {
-          time_t now;
-          bool hasPiece;
-          uint8_t hash[SHA_DIGEST_LENGTH];
+      tr_wait_msec (VERIFY_BUDGET_WAIT_MSEC);
+    }
+}
 
-          tr_sha1_final (sha, hash);
-          hasPiece = memcmp (hash, tor->info.pieces[pieceIndex].hash, SHA_DIGEST_LENGTH) == 0;
+static void
+verifyFileClose (struct verify_file * vf)
+{
+  if (vf->fd != TR_BAD_SYS_FILE)
+    {
+      tr_sys_file_close (vf->fd, NULL);
+      vf->fd = TR_BAD_SYS_FILE;
+    }
 
-          if (hasPiece || hadPiece)
-            {
-              tr_torrentSetHasPiece (tor, pieceIndex, hasPiece);
-              changed |= hasPiece != hadPiece;
-            }
+  vf->tor = NULL;
+}
 
-          tr_torrentSetPieceChecked (tor, pieceIndex);
-          now = tr_time ();
-          tor->anyDate = now;
+static tr_sys_file_t
+verifyFileOpen (struct verify_file * vf, const tr_torrent * tor, tr_file_index_t fileIndex)
+{
+  if (vf->tor != tor || vf->index != fileIndex)
+    {
+      char * filename;
 
-          /* sleeping even just a few msec per second goes a long
-           * way towards reducing IO load... */
-          if (lastSleptAt != now)
-            {
-              lastSleptAt = now;
-              tr_wait_msec (MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY);
-            }
+      verifyFileClose (vf);
 
-          sha = tr_sha1_init ();
-          pieceIndex++;
-          piecePos = 0;
-        }
+      filename = tr_torrentFindFile (tor, fileIndex);
+      vf->fd = filename == NULL ? TR_BAD_SYS_FILE : tr_sys_file_open (filename,
+               TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, NULL);
+      vf->tor = tor;
+      vf->index = fileIndex;
+      tr_free (filename);
+    }
+
+  return vf->fd;
+}
+
+static bool
+verifyPiece (tr_torrent          * tor,
+             tr_piece_index_t      pieceIndex,
+             uint8_t             * buffer,
+             struct verify_file  * vf,
+             const bool          * stopFlag)
+{
+  uint64_t fileOffset;
+  tr_file_index_t fileIndex;
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  uint32_t leftInPiece = tr_torPieceCountBytes (tor, pieceIndex);
+  tr_sha1_ctx_t sha = tr_sha1_init ();
 
-      /* if we're finishing a file... */
-      if (leftInFile == 0)
+  tr_ioFindFileLocation (tor, pieceIndex, 0, &fileIndex, &fileOffset);
+
+  while (leftInPiece > 0 && !*stopFlag)
+    {
+      tr_sys_file_t fd;
+      uint64_t numRead;
+      uint64_t bytesThisPass;
+      const tr_file * file = &tor->info.files[fileIndex];
+
+      /* skip past the end of this file, including empty ones */
+      if (fileOffset >= file->length)
         {
-          if (fd != TR_BAD_SYS_FILE)
-            {
-              tr_sys_file_close (fd, NULL);
-              fd = TR_BAD_SYS_FILE;
-            }
-          fileIndex++;
-          filePos = 0;
+          ++fileIndex;
+          fileOffset = 0;
+          continue;
         }
-    }
 
-  /* cleanup */
-  if (fd != TR_BAD_SYS_FILE)
-    tr_sys_file_close (fd, NULL);
-  tr_sha1_final (sha, NULL);
-  free (buffer);
+      bytesThisPass = MIN (leftInPiece, file->length - fileOffset);
+      bytesThisPass = MIN (bytesThisPass, VERIFY_BUFFER_SIZE);
 
-  /* stopwatch */
-  end = tr_time ();
-  tr_logAddTorDbg (tor, "Verification is done. It took %d seconds to verify %"PRIu64" bytes (%"PRIu64" bytes per second)",
-             (int)(end-begin), tor->info.totalSize,
-             (uint64_t)(tor->info.totalSize/ (1+ (end-begin))));
+      verifyConsumeBudget (tor->session, bytesThisPass);
 
-  return changed;
+      fd = verifyFileOpen (vf, tor, fileIndex);
+      if (fd == TR_BAD_SYS_FILE)
+        break;
+
+      if (!tr_sys_file_read_at (fd, buffer, bytesThisPass, fileOffset, &numRead, NULL) || numRead == 0)
+        break;
+
+      tr_sha1_update (sha, buffer, numRead);
+#if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_DONTNEED
+      (void) posix_fadvise (fd, fileOffset, numRead, POSIX_FADV_DONTNEED);
+#endif
+
+      leftInPiece -= numRead;
+      fileOffset += numRead;
+    }
+
+  tr_sha1_final (sha, hash);
+
+  return leftInPiece == 0
+      && memcmp (hash, tor->info.pieces[pieceIndex].hash, SHA_DIGEST_LENGTH) == 0;
 }
 
 /***
 ****
 ***/
 
-struct verify_node
+static struct verify_job *
+findJob (const tr_torrent * tor)
 {
-  tr_torrent          * torrent;
-  tr_verify_done_func   callback_func;
-  void                * callback_data;
-  uint64_t              current_size;
-};
+  tr_list * l;
 
-static struct verify_node currentNode;
-static tr_list * verifyList = NULL;
-static tr_thread * verifyThread = NULL;
-static bool stopCurrent = false;
+  for (l=jobList; l!=NULL; l=l->next)
+    {
+      struct verify_job * job = l->data;
+      if (job->node.torrent == tor)
+        return job;
+    }
 
-static tr_lock*
-getVerifyLock (void)
+  return NULL;
+}
+
+/* called with the verify lock held. the lock is released while
+   the callback runs, so the job stays listed until it's done */
+static void
+finishJob (struct verify_job * job)
 {
-  static tr_lock * lock = NULL;
+  tr_lock * lock = getVerifyLock ();
+  tr_torrent * tor = job->node.torrent;
+  const time_t end = tr_time ();
 
-  if (lock == NULL)
-    lock = tr_lockNew ();
+  assert (!job->done);
+  assert (job->active_workers == 0);
 
-  return lock;
+  job->done = true;
+  tr_lockUnlock (lock);
+
+  tr_torrentSetVerifyState (tor, TR_VERIFY_NONE);
+  assert (tr_isTorrent (tor));
+
+  if (!job->stop && job->changed)
+    tr_torrentSetDirty (tor);
+
+  tr_logAddTorDbg (tor, "Verification is done. It took %d seconds to verify %"PRIu64" bytes (%"PRIu64" bytes per second)",
+             (int)(end-job->begin), tor->info.totalSize,
+             (uint64_t)(tor->info.totalSize/ (1+ (end-job->begin))));
+
+  if (job->node.callback_func)
+    (*job->node.callback_func)(tor, job->stop, job->node.callback_data);
+
+  tr_lockLock (lock);
+  tr_list_remove_data (&jobList, job);
+  tr_free (job);
 }
 
-static void
-verifyThreadFunc (void * unused UNUSED)
+/* called with the verify lock held.
+   returns a job that still has unclaimed pieces, or NULL if there's no work left */
+static struct verify_job *
+getNextJob (void)
 {
-  for (;;)
+  tr_list * l;
+  struct verify_node * node;
+
+  /* reap stopped jobs that nobody's working on */
+  for (l=jobList; l!=NULL; )
     {
-      int changed = 0;
-      tr_torrent * tor;
-      struct verify_node * node;
-
-      tr_lockLock (getVerifyLock ());
-      stopCurrent = false;
-      node = (struct verify_node*) verifyList ? verifyList->data : NULL;
-      if (node == NULL)
+      struct verify_job * job = l->data;
+      l = l->next;
+
+      if (job->stop && !job->done && job->active_workers == 0)
         {
-          currentNode.torrent = NULL;
-          break;
+          finishJob (job);
+          l = jobList;
         }
+    }
+
+  /* prefer the oldest job so that torrents finish in queue order */
+  for (l=jobList; l!=NULL; l=l->next)
+    {
+      struct verify_job * job = l->data;
+      if (!job->stop && !job->done && job->next_piece < job->node.torrent->info.pieceCount)
+        return job;
+    }
+
+  /* start the next queued torrent */
+  while ((node = tr_list_pop_front (&verifyList)) != NULL)
+    {
+      struct verify_job * job = tr_new0 (struct verify_job, 1);
+      tr_torrent * tor = node->torrent;
 
-      currentNode = *node;
-      tor = currentNode.torrent;
-      tr_list_remove_data (&verifyList, node);
+      job->node = *node;
+      job->begin = tr_time ();
       tr_free (node);
-      tr_lockUnlock (getVerifyLock ());
+      tr_list_append (&jobList, job);
 
       tr_logAddTorInfo (tor, "%s", _("Verifying torrent"));
+      tr_logAddTorDbg (tor, "%s", "verifying torrent...");
       tr_torrentSetVerifyState (tor, TR_VERIFY_NOW);
-      changed = verifyTorrent (tor, &stopCurrent);
-      tr_torrentSetVerifyState (tor, TR_VERIFY_NONE);
-      assert (tr_isTorrent (tor));
+      tr_torrentSetChecked (tor, 0);
 
-      if (!stopCurrent && changed)
-        tr_torrentSetDirty (tor);
+      if (tor->info.pieceCount > 0)
+        return job;
 
-      if (currentNode.callback_func)
-        (*currentNode.callback_func)(tor, stopCurrent, currentNode.callback_data);
+      finishJob (job);
     }
 
-  verifyThread = NULL;
-  tr_lockUnlock (getVerifyLock ());
+  return NULL;
+}
+
+static void
+verifyThreadFunc (void * unused UNUSED)
+{
+  struct verify_job * job;
+  struct verify_file vf = { NULL, 0, TR_BAD_SYS_FILE };
+  uint8_t * buffer = tr_valloc (VERIFY_BUFFER_SIZE);
+  tr_lock * lock = getVerifyLock ();
+
+  tr_lockLock (lock);
+
+  while ((job = getNextJob ()) != NULL)
+    {
+      uint64_t claimed = 0;
+      tr_piece_index_t pieceIndex;
+      tr_torrent * tor = job->node.torrent;
+      const tr_piece_index_t first = job->next_piece;
+      tr_piece_index_t last = first;
+
+      /* claim a batch of pieces */
+      while (last < tor->info.pieceCount && claimed < VERIFY_BATCH_SIZE)
+        claimed += tr_torPieceCountBytes (tor, last++);
+      job->next_piece = last;
+      ++job->active_workers;
+      tr_lockUnlock (lock);
+
+      for (pieceIndex=first; pieceIndex<last && !job->stop; ++pieceIndex)
+        {
+          bool hadPiece;
+          const bool hasPiece = verifyPiece (tor, pieceIndex, buffer, &vf, &job->stop);
+
+          if (job->stop)
+            break;
+
+          /* the completion bitfield isn't threadsafe, so serialize the updates */
+          tr_lockLock (lock);
+          hadPiece = tr_torrentPieceIsComplete (tor, pieceIndex);
+          if (hasPiece || hadPiece)
+            {
+              tr_torrentSetHasPiece (tor, pieceIndex, hasPiece);
+              job->changed |= hasPiece != hadPiece;
+            }
+          tr_torrentSetPieceChecked (tor, pieceIndex);
+          tor->anyDate = tr_time ();
+          tr_lockUnlock (lock);
+        }
+
+      verifyFileClose (&vf);
+
+      tr_lockLock (lock);
+      --job->active_workers;
+      if (!job->done && job->active_workers == 0
+                     && (job->stop || job->next_piece == tor->info.pieceCount))
+        finishJob (job);
+    }
+
+  --workerCount;
+  tr_lockUnlock (lock);
+
+  free (buffer);
 }
 
 static int
@@ -262,6 +416,7 @@ tr_verifyAdd (tr_torrent           * tor,
               tr_verify_done_func    callback_func,
               void                 * callback_data)
 {
+  int maxWorkers;
   struct verify_node * node;
 
   assert (tr_isTorrent (tor));
@@ -273,11 +428,16 @@ tr_verifyAdd (tr_torrent           * tor,
   node->callback_data = callback_data;
   node->current_size = tr_torrentGetCurrentSizeOnDisk (tor);
 
+  maxWorkers = MAX (1, tr_sessionGetVerifyThreads (tor->session));
+
   tr_lockLock (getVerifyLock ());
   tr_torrentSetVerifyState (tor, TR_VERIFY_WAIT);
   tr_list_insert_sorted (&verifyList, node, compareVerifyByPriorityAndSize);
-  if (verifyThread == NULL)
-    verifyThread = tr_threadNew (verifyThreadFunc, NULL);
+  while (workerCount < maxWorkers)
+    {
+      ++workerCount;
+      tr_threadNew (verifyThreadFunc, NULL);
+    }
   tr_lockUnlock (getVerifyLock ());
 }
 
@@ -292,16 +452,18 @@ compareVerifyByTorrent (const void * va, const void * vb)
 void
 tr_verifyRemove (tr_torrent * tor)
 {
+  struct verify_job * job;
   tr_lock * lock = getVerifyLock ();
   tr_lockLock (lock);
 
   assert (tr_isTorrent (tor));
 
-  if (tor == currentNode.torrent)
+  if ((job = findJob (tor)) != NULL)
     {
-      stopCurrent = true;
+      job->stop = true;
 
-      while (stopCurrent)
+      /* wait for the workers to notice and for the callback to run */
+      while (findJob (tor) == job)
         {
           tr_lockUnlock (lock);
           tr_wait_msec (100);
@@ -329,11 +491,13 @@ tr_verifyRemove (tr_torrent * tor)
 void
 tr_verifyClose (tr_session * session UNUSED)
 {
+  tr_list * l;
+
   tr_lockLock (getVerifyLock ());
 
-  stopCurrent = true;
+  for (l=jobList; l!=NULL; l=l->next)
+    ((struct verify_job*)l->data)->stop = true;
   tr_list_free (&verifyList, tr_free);
 
   tr_lockUnlock (getVerifyLock ());
 }
-